@@ -257,9 +257,11 @@ static int get_fx3_prog_handle(void)
 	// Now wait for the flash programmer to enumerate, and get a handle to it.
 	for ( j = 0; j < GETHANDLE_TIMEOUT; j++ ) {
 		sleep (1);
-		for ( i = 0; i < num_devices_detected; i++ ) {
+		for ( i = 0; i < cyusb_getcount(); i++ ) {
+			if ( (cyusb_getdevice(i) == nullptr) || (cyusb_getdevice(i)->vid != FLASHPROG_VID) )
+				continue;
 			handle = cyusb_gethandle(i);
-			if ( cyusb_getvendor(handle) == FLASHPROG_VID ) {
+			if ( handle != nullptr ) {
 				r = check_fx3_flashprog(handle);
 				if ( r == 0 ) {
 					h = handle;
@@ -27,6 +27,7 @@
 #include "usbmethods.h"
 #include "../include/controlcenter.h"
 #include "../include/cyusb.h"
+#include "../include/cyusb_qt.h"
 
 ControlCenter *mainwin = nullptr;
 QProgressBar  *mbar = nullptr;
@@ -61,8 +62,9 @@ static int summ_count = 0;
 static unsigned int cum_data_in;
 static unsigned int cum_data_out;
 static int data_count;
-static struct libusb_transfer *transfer = nullptr;
-static unsigned char *isoc_databuf = nullptr;
+static cyusb_stream *isoc_stream = nullptr;
+static struct libusb_transfer *isoc_transfer = nullptr;
+static bool isoc_in;
 static int totalout, totalin, pkts_success, pkts_failure;
 
 static int fd_outfile, fd_infile;
@@ -120,33 +122,40 @@ static void update_devlist()
 {
 	int i, r, num_interfaces, index = 0;
 	char tbuf[60];
-	struct libusb_config_descriptor *config_desc = nullptr;
-	struct libusb_device_descriptor desc;
+	const struct cyusb_descriptors *descs;
+	struct cydev *cd;
+	libusb_device_handle *th;
 
 	mainwin->listWidget->clear();
 
+	num_devices_detected = cyusb_getcount();
 	for ( i = 0; i < num_devices_detected; ++i ) {
-		h = cyusb_gethandle(i);
-		dev = libusb_get_device(h);
-		libusb_get_device_descriptor(dev, &desc);
+		cd = cyusb_getdevice(i);
+		if ( !cd )	/* Slot freed by a device removal */
+			continue;
 		sprintf(tbuf,"VID=%04x,PID=%04x,BusNum=%02x,Addr=%d",
-				desc.idVendor, desc.idProduct,
-				libusb_get_bus_number(dev), libusb_get_device_address(dev));
-		mainwin->listWidget->addItem(QString(tbuf));
-		r = libusb_get_active_config_descriptor (dev, &config_desc);
-		if ( r ) {
-			libusb_error(r, "Error in 'get_active_config_descriptor' ");
+				cd->vid, cd->pid, cd->busnum, cd->devaddr);
+		QListWidgetItem *item = new QListWidgetItem(QString(tbuf));
+		item->setData(Qt::UserRole, i);	/* Index into the library device table */
+		mainwin->listWidget->addItem(item);
+
+		/* The device is opened here; one that cannot be opened is still listed. */
+		th = cyusb_gethandle(i);
+		if ( !th )
+			continue;
+		descs = cyusb_getdescriptors(i);
+		if ( !descs ) {
+			libusb_error(LIBUSB_ERROR_IO, "Error in 'get_active_config_descriptor' ");
 			return;
 		}
-		num_interfaces = config_desc->bNumInterfaces;
+		num_interfaces = descs->config->bNumInterfaces;
 		while (num_interfaces){
-			if (libusb_kernel_driver_active (h, index)){
-				libusb_detach_kernel_driver (h, index);
+			if (libusb_kernel_driver_active (th, index)){
+				libusb_detach_kernel_driver (th, index);
 			}
 			index++;
 			num_interfaces--;
 		}
-		libusb_free_config_descriptor (config_desc);
 	}
 }
 static void disable_vendor_extensions()
@@ -282,6 +291,18 @@ void ControlCenter::on_streamer_control_start_clicked ()
 	temp = mainwin->streamer_queue_sel->currentText().toStdString().c_str();
 	sscanf (temp, "%d", &queuedepth);
 
+	// "Auto" uses the settings tuned earlier for this endpoint, or tunes them now.
+	if ((mainwin->streamer_size_sel->currentText() == "Auto") ||
+			(mainwin->streamer_queue_sel->currentText() == "Auto")) {
+		reqsize = queuedepth = 0;
+		if ((cyusb_autotune_lookup (current_device_index, ep, &reqsize, &queuedepth) != 0) &&
+				(cyusb_autotune (current_device_index, ep, &reqsize, &queuedepth) < 0)) {
+			reqsize = queuedepth = 16;
+		}
+		mainwin->streamer_size_sel->setCurrentIndex (mainwin->streamer_size_sel->findText (QString::number (reqsize)));
+		mainwin->streamer_queue_sel->setCurrentIndex (mainwin->streamer_queue_sel->findText (QString::number (queuedepth)));
+	}
+
 	streamer_set_params (ep, eptype, pktsize, reqsize, queuedepth);
 	if (streamer_start_xfer () == 0) {
 		// Test started properly. Enable the stop button.
@@ -294,10 +315,8 @@ void ControlCenter::on_streamer_control_start_clicked ()
 
 void ControlCenter::on_streamer_control_stop_clicked ()
 {
-	// Wait until streamer operation is stopped.
+	// Stop the streamer operation; this returns once the transfers are done.
 	streamer_stop_xfer ();
-	while (streamer_is_running ())
-		sleep (1);
 
 	// Now disable the stop button and enable the start button.
 	mainwin->streamer_control_stop->setEnabled (false);
@@ -432,6 +451,8 @@ static void update_endpoints()
 			mainwin->streamer_size_sel->addItem (tbuf);
 			mainwin->streamer_queue_sel->addItem (tbuf);
 		}
+		mainwin->streamer_size_sel->addItem ("Auto");
+		mainwin->streamer_queue_sel->addItem ("Auto");
 
 		// Choose 16 as the default request size and queue depth
 		mainwin->streamer_size_sel->setCurrentIndex (4);
@@ -471,12 +492,14 @@ void ControlCenter::on_pb_setIFace_clicked()
 	char tval[3];
 	int N, M;
 
-	struct libusb_config_descriptor *config_desc = nullptr;
+	const struct cyusb_descriptors *descs = cyusb_getdescriptors(current_device_index);
 
-	r = libusb_get_active_config_descriptor(dev, &config_desc);
-	if ( r ) libusb_error(r, "Error in 'get_active_config_descriptor' ");
+	if ( !descs ) {
+		libusb_error(LIBUSB_ERROR_IO, "Error in 'get_active_config_descriptor' ");
+		return;
+	}
 
-	N = config_desc->interface[mainwin->sb_selectIf->value()].num_altsetting;
+	N = descs->config->interface[mainwin->sb_selectIf->value()].num_altsetting;
 	sprintf(tval,"%d",N);
 	mainwin->le_numAlt->setText(tval);
 	mainwin->sb_selectAIf->setMaximum(N - 1);
@@ -554,20 +577,21 @@ static void update_summary(void)
 
 void get_config_details()
 {
-	int r;
 	int i, j, k;
 	char tbuf[60];
 	char tval[5];
-	struct libusb_config_descriptor *desc = nullptr;
+	const struct cyusb_descriptors *descs;
+	const struct libusb_config_descriptor *desc;
 
 	h = cyusb_gethandle(current_device_index);
 	dev = libusb_get_device(h);
 
-	r = libusb_get_active_config_descriptor(dev, &desc);
-	if ( r ) {
-		libusb_error(r, "Error getting configuration descriptor");
+	descs = cyusb_getdescriptors(current_device_index);
+	if ( !descs ) {
+		libusb_error(LIBUSB_ERROR_IO, "Error getting configuration descriptor");
 		return ;
 	}
+	desc = descs->config;
 	sprintf(tval,"%d",desc->bNumInterfaces);
 	mainwin->le_numIfaces->setReadOnly(true);
 	mainwin->le_numIfaces->setText(tval);
@@ -626,9 +650,6 @@ void get_config_details()
 				sprintf(tbuf,"\t\t<ENDPOINT>");
 				mainwin->lw_desc->addItem(QString(tbuf));
 				const struct libusb_endpoint_descriptor *ep = ifd[j].endpoint;
-				struct libusb_ss_endpoint_companion_descriptor *compd = nullptr;
-
-				libusb_get_ss_endpoint_companion_descriptor (nullptr, ep, &compd);
 
 				sprintf(tbuf,"\t\tbLength             = %0d",  ep[k].bLength);
 				mainwin->lw_desc->addItem(QString(tbuf));
@@ -639,30 +660,6 @@ void get_config_details()
 				sprintf(tbuf,"\t\tbmAttributes        = %d",   ep[k].bmAttributes);
 				mainwin->lw_desc->addItem(QString(tbuf));
 
-				summ[summ_count].ifnum    = ifd[j].bInterfaceNumber;
-				summ[summ_count].altnum   = ifd[j].bAlternateSetting;
-				summ[summ_count].epnum    = ep[k].bEndpointAddress;
-				summ[summ_count].eptype   = ep[k].bmAttributes;
-				summ[summ_count].maxps    = ep[k].wMaxPacketSize & 0x7ff;  /* ignoring bits 11,12 */
-				summ[summ_count].interval = ep[k].bInterval;
-
-				if (compd != nullptr) {
-					// USB 3.0. Multiple max packet size by burst size.
-					if (summ[summ_count].eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-						summ[summ_count].reqsize = (summ[summ_count].maxps * (compd->bMaxBurst + 1) *
-							(compd->bmAttributes + 1));
-					else
-						summ[summ_count].reqsize = (summ[summ_count].maxps * (compd->bMaxBurst + 1));
-				} else {
-					// USB 2.0. Multiply packet size by mult for ISO endpoints
-					if (summ[summ_count].eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-						summ[summ_count].reqsize =
-							libusb_get_max_iso_packet_size (dev, summ[summ_count].epnum);
-					else
-						summ[summ_count].reqsize  = summ[summ_count].maxps;
-				}
-
-				++summ_count;
 				sprintf(tbuf,"\t\twMaxPacketSize      = %04x", (ep[k].wMaxPacketSize));
 				mainwin->lw_desc->addItem(QString(tbuf));
 				sprintf(tbuf,"\t\tbInterval           = %d",   ep[k].bInterval);
@@ -683,7 +680,19 @@ void get_config_details()
 	sprintf(tbuf,"</CONFIGURATION>");
 	mainwin->lw_desc->addItem(QString(tbuf));
 
-	libusb_free_config_descriptor(desc);
+	/* The endpoint summary comes from the endpoint table computed by the library. */
+	for ( i = 0; (i < descs->nendpoints) && (summ_count < 100); ++i ) {
+		const struct cyusb_endpoint *ep = &descs->endpoints[i];
+
+		summ[summ_count].ifnum    = ep->interface;
+		summ[summ_count].altnum   = ep->altsetting;
+		summ[summ_count].epnum    = ep->address;
+		summ[summ_count].eptype   = ep->type;
+		summ[summ_count].maxps    = ep->maxpacket;
+		summ[summ_count].interval = ep->interval;
+		summ[summ_count].reqsize  = ep->pktsize;
+		++summ_count;
+	}
 
 	check_for_kernel_driver();
 	update_summary();
@@ -692,24 +701,25 @@ void get_config_details()
 
 void get_device_details()
 {
-	int r;
 	char tbuf[60];
 	char tval[5];
-	struct libusb_device_descriptor desc;
-	struct libusb_config_descriptor *config_desc = nullptr;
+	const struct cyusb_descriptors *descs;
+	const struct libusb_config_descriptor *config_desc;
 
 	h = cyusb_gethandle(current_device_index);
 	if ( !h ) {
 		printf("Error in getting a handle. curent_device_index = %d\n", current_device_index);
+		return ;
 	}
 	dev = libusb_get_device(h);
 
-	r = libusb_get_device_descriptor(dev, &desc);
-	if ( r ) {
-		libusb_error(r, "Error getting device descriptor");
+	descs = cyusb_getdescriptors(current_device_index);
+	if ( !descs ) {
+		libusb_error(LIBUSB_ERROR_IO, "Error getting device descriptor");
 		return ;
 	}
-	r = libusb_get_active_config_descriptor(dev, &config_desc);
+	const struct libusb_device_descriptor &desc = descs->device;
+	config_desc = descs->config;
 	sprintf(tval,"%d",config_desc->bNumInterfaces);
 	mainwin->le_numIfaces->setText(tval);
 	mainwin->sb_selectIf->setEnabled(true);
@@ -757,7 +767,6 @@ void get_device_details()
 	check_for_kernel_driver();
 	detect_device();
 	mainwin->on_pb_setIFace_clicked();
-	libusb_free_config_descriptor (config_desc);
 }
 
 static void clear_widgets()
@@ -816,9 +825,8 @@ static void set_if_aif()
 
 void ControlCenter::on_listWidget_itemClicked(QListWidgetItem *item)
 {
-	item = item;
 	clear_widgets();
-	current_device_index = mainwin->listWidget->currentRow();
+	current_device_index = item->data(Qt::UserRole).toInt();
 	get_device_details();
 	get_config_details();
 	set_if_aif();
@@ -877,9 +885,39 @@ void ControlCenter::sigusr1_handler()
 		printf ("read returned %d\n", n);
 
 	update_devlist();
+	if ( (current_device_index >= 0) && (cyusb_getdevice(current_device_index) == nullptr) ) {
+		/* The selected device has been removed. */
+		clear_widgets();
+		current_device_index = -1;
+		h = nullptr;
+		dev = nullptr;
+	}
 	mainwin->sn_sigusr1->setEnabled(true);	
 }
 
+static void hotplug_handler(int index, int event, void *user)
+{
+	char a = 1;
+	int N;
+
+	/* Called from the Qt event loop, or on the library event thread if the events could not be
+	   moved there: hand over to the device list refresh through the socket pair. The library
+	   closes the handle of a departed device on return, so it is let go of now; on the Qt thread
+	   the selection goes with it, so no slot runs on the closed handle before the refresh. */
+	printf("Device %s at index %d\n", (event == CYUSB_DEVICE_ARRIVED) ? "added" : "removed", index);
+	if ( (event == CYUSB_DEVICE_LEFT) && (index == current_device_index) ) {
+		h = nullptr;
+		dev = nullptr;
+		if ( QThread::currentThread() == qApp->thread() ) {
+			clear_widgets();
+			current_device_index = -1;
+		}
+	}
+	N = write(sigusr1_fd[0], &a, 1);
+	if (N < 0)
+		printf ("write returned %d\n", N);
+}
+
 static void setup_handler(int signo)
 {
 	char a = 1;
@@ -1503,7 +1541,9 @@ void ControlCenter::on_pb6_rcv_clicked()
 	ep = mainwin->cb6_in->currentText().toInt(&ok, 16);
 
 	if ( mainwin->cb6_loop->isChecked() ) {
-		buf = (unsigned char *)malloc(data_count);
+		buf = cyusb_buffer_get(h, data_count);
+		if ( !buf )
+			return;
 		r = libusb_bulk_transfer(h, ep, buf, 
 				data_count, &transferred, 1000);
 		printf("Bytes read from device = %d\n",transferred);
@@ -1523,7 +1563,9 @@ void ControlCenter::on_pb6_rcv_clicked()
 	}
 	else {
 		r = mainwin->le6_size->text().toInt(&ok, 10);
-		buf = (unsigned char *)malloc(r);
+		buf = cyusb_buffer_get(h, r);
+		if ( !buf )
+			return;
 		r = libusb_bulk_transfer(h, ep, buf, 
 				r, &transferred, 1000);
 		printf("Bytes read from device = %d\n",transferred);
@@ -1537,18 +1579,20 @@ void ControlCenter::on_pb6_rcv_clicked()
 				printf ("write returned %d\n", r);
 		}
 	}
-	free(buf);
+	cyusb_buffer_put(h, buf);
 }
 
 void ControlCenter::pb6_send_file_selected(unsigned char *buf, int sz)
 {
 	int r;
-	int transferred = 0;
+	size_t transferred = 0;
 	bool ok;
 	char tmpbuf[10];
 
-	r = libusb_bulk_transfer(h, mainwin->cb6_out->currentText().toInt(&ok, 16), buf, sz, &transferred, 1000);
-	printf("Bytes sent to device = %d\n",transferred);
+	/* Large blocks are split into chunks that are kept in flight by the library. */
+	r = cyusb_bulk_write(current_device_index, mainwin->cb6_out->currentText().toInt(&ok, 16), buf, sz,
+			&transferred, 1000);
+	printf("Bytes sent to device = %d\n",(int)transferred);
 	if ( r ) {
 		libusb_error(r, "Error in bulk write!");
 		clearhalt_out();
@@ -1557,7 +1601,7 @@ void ControlCenter::pb6_send_file_selected(unsigned char *buf, int sz)
 	cum_data_out += transferred;
 	sprintf(tmpbuf,"%d",cum_data_out);
 	mainwin->label6_out->setText(tmpbuf);
-	dump_data6_out(transferred, buf);
+	dump_data6_out((int)transferred, buf);
 
 	if ( mainwin->cb6_loop->isChecked() ) {
 		data_count = transferred;
@@ -1577,7 +1621,9 @@ void ControlCenter::pb6_send_nofile_selected()
 	unsigned char val;
 
 	sz = mainwin->le6_size->text().toInt(&ok, 10);
-	buf = (unsigned char *)malloc(sz);
+	buf = cyusb_buffer_get(h, sz);
+	if ( !buf )
+		return;
 
 	if ( (mainwin->le6_out_hex->text() == "" ) && (mainwin->le6_out_ascii->text() == "") ) {
 		if ( mainwin->rb6_constant->isChecked() ) {
@@ -1618,7 +1664,7 @@ void ControlCenter::pb6_send_nofile_selected()
 	mainwin->label6_out->setText(tmpbuf);
 
 	dump_data6_out(transferred, buf);
-	free(buf);
+	cyusb_buffer_put(h, buf);
 
 	if ( mainwin->cb6_loop->isChecked() ) {
 		data_count = transferred;
@@ -1725,13 +1771,15 @@ void ControlCenter::on_pb6_send_clicked()
 			}
 		}
 
-		maxps = 4096;	/* If sending a file, then data is sent in 4096 byte packets */
+		/* If sending a file in loopback mode, data is sent in 4096 byte blocks that the device
+		   can echo; otherwise in large blocks written with several chunks in flight. */
+		maxps = mainwin->cb6_loop->isChecked() ? 4096 : (1 << 20);
 
-		buf = (unsigned char *)malloc(maxps);
-		while ( (nbr = read(fd_outfile, buf, maxps)) ) {
+		buf = cyusb_buffer_get(h, maxps);
+		while ( buf && (nbr = read(fd_outfile, buf, maxps)) > 0 ) {
 			pb6_send_file_selected(buf, nbr);
 		}
-		free(buf);
+		cyusb_buffer_put(h, buf);
 		::close(fd_outfile);
 		::close(fd_infile);
 	}
@@ -1856,6 +1904,16 @@ static void dump_data7_out(int num_bytes, unsigned char *dbuf)
 	}
 }
 
+/* Called when the isochronous transfer has finished, from the Qt event loop or the library
+   event thread. The results are shown from the GUI event loop; the transfer stays untouched
+   until the stream is closed there. */
+static int isoc_callback(const struct cyusb_xfer *xfer, void *user)
+{
+	isoc_transfer = xfer->transfer;
+	QMetaObject::invokeMethod(mainwin, "isoc_done", Qt::QueuedConnection);
+	return 0;
+}
+
 static void in_callback( struct libusb_transfer *transfer)
 {
 	bool ok;
@@ -1902,7 +1960,7 @@ static void in_callback( struct libusb_transfer *transfer)
 	sprintf(tbuf,"%6d",pkts_failure);
 	mainwin->label7_dropped_in->setText(tbuf);
 	ep_in = mainwin->cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = libusb_get_max_iso_packet_size(dev, ep_in);
+	pktsize_in = cyusb_getendpoint(current_device_index, ep_in)->pktsize;
 	inrate = ( (((double)totalin * (double)pktsize_in) / (double)elapsed ) * (1000.0 / 1024.0) );
 	sprintf(ttbuf, "%8.1f", inrate);
 	mainwin->label7_ratein->setText(ttbuf);
@@ -1955,22 +2013,34 @@ static void out_callback( struct libusb_transfer *transfer)
 	sprintf(tbuf,"%6d",pkts_failure);
 	mainwin->label7_dropped_out->setText(tbuf);
 	ep_out = mainwin->cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = libusb_get_max_iso_packet_size(dev, ep_out);
+	pktsize_out = cyusb_getendpoint(current_device_index, ep_out)->pktsize;
 	outrate = ( (((double)totalout * (double)pktsize_out) / (double)elapsed ) * (1000.0 / 1024.0) );
 	sprintf(ttbuf, "%8.1f", outrate);
 	mainwin->label7_rateout->setText(ttbuf);
 }	
 
+void ControlCenter::isoc_done()
+{
+	if ( isoc_in )
+		in_callback(isoc_transfer);
+	else
+		out_callback(isoc_transfer);
+
+	cyusb_stream_close(isoc_stream);
+	isoc_stream = nullptr;
+	isoc_transfer = nullptr;
+}
+
 void ControlCenter::on_pb7_rcv_clicked()
 {
 	int numpkts;	
 	bool ok;
+	const struct cyusb_endpoint *epinfo;
 	int pktsize_in;
 	int bufsize_in;
 	unsigned char ep_in;
 	int r;
 	char tbuf[10];
-	struct timeval tv;
 
 	if ( cb7_in->currentText() == "" ) {  /* No ep_in exists */
 		QMessageBox mb;
@@ -1979,42 +2049,37 @@ void ControlCenter::on_pb7_rcv_clicked()
 		return;
 	} 
 
+	if ( isoc_stream )  /* Previous transfer not finished yet */
+		return;
+
 	ep_in = cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = libusb_get_max_iso_packet_size(dev, ep_in);
+	epinfo = cyusb_getendpoint(current_device_index, ep_in);
+	if ( !epinfo ) {
+		libusb_error(LIBUSB_ERROR_NOT_FOUND, "Error looking up the endpoint");
+		return;
+	}
+	pktsize_in = epinfo->pktsize;
 	sprintf(tbuf,"%9d",pktsize_in);
 	mainwin->label7_pktsize_in->setText(tbuf);
 
 	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
 	bufsize_in = pktsize_in * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_in);
 
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
-		QMessageBox mb;
-		mb.setText("Alloc failure");
-		mb.exec();
+	r = cyusb_stream_open(current_device_index, ep_in, numpkts, 1, isoc_callback, nullptr, &isoc_stream);
+	if ( r ) {
+		libusb_error(r, "Error setting up transfer");
 		return;
 	}
-
-	libusb_fill_iso_transfer(transfer, h, ep_in, isoc_databuf, bufsize_in, numpkts, in_callback, nullptr, 10000 );
-
-	libusb_set_iso_packet_lengths(transfer, pktsize_in);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+	isoc_in = true;
 
 	isoc_time = new QElapsedTimer();
 	isoc_time->start();
 
-	r = libusb_submit_transfer(transfer);
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
-
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(nullptr,&tv);
-	}
-
+	r = cyusb_stream_submit(isoc_stream, nullptr, bufsize_in, 0);
 	if ( r ) {
 		printf("Error %d submitting transfer\n", r);
+		cyusb_stream_close(isoc_stream);
+		isoc_stream = nullptr;
 	}
 }
 
@@ -2022,12 +2087,13 @@ void ControlCenter::on_pb7_send_clicked()
 {
 	int numpkts;	
 	bool ok;
+	const struct cyusb_endpoint *epinfo;
 	int pktsize_out;
 	int bufsize_out;
 	unsigned char ep_out;
+	unsigned char *databuf;
 	int r;
 	char tbuf[10];
-	struct timeval tv;
 
 	if ( cb7_out->currentText() == "" ) {  /* No ep_out exists */
 		QMessageBox mb;
@@ -2036,47 +2102,51 @@ void ControlCenter::on_pb7_send_clicked()
 		return;
 	} 
 
+	if ( isoc_stream )  /* Previous transfer not finished yet */
+		return;
+
 	ep_out = cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = libusb_get_max_iso_packet_size(dev, ep_out);
+	epinfo = cyusb_getendpoint(current_device_index, ep_out);
+	if ( !epinfo ) {
+		libusb_error(LIBUSB_ERROR_NOT_FOUND, "Error looking up the endpoint");
+		return;
+	}
+	pktsize_out = epinfo->pktsize;
 	sprintf(tbuf,"%9d",pktsize_out);
 	mainwin->label7_pktsize_out->setText(tbuf);
 
 	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
 	bufsize_out = pktsize_out * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_out);
-
-	for ( int i = 0; i < numpkts; ++i )
-		for ( int j = 0; j < pktsize_out; ++j )
-			isoc_databuf[i*pktsize_out+j] = i + 1;
-
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
+	databuf = (unsigned char *)malloc(bufsize_out);
+	if ( !databuf ) {
 		QMessageBox mb;
 		mb.setText("Alloc failure");
 		mb.exec();
 		return;
 	}
 
-	libusb_fill_iso_transfer(transfer, h, ep_out, isoc_databuf, bufsize_out, numpkts, out_callback, nullptr, 10000 );
+	for ( int i = 0; i < numpkts; ++i )
+		for ( int j = 0; j < pktsize_out; ++j )
+			databuf[i*pktsize_out+j] = i + 1;
 
-	libusb_set_iso_packet_lengths(transfer, pktsize_out);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+	r = cyusb_stream_open(current_device_index, ep_out, numpkts, 1, isoc_callback, nullptr, &isoc_stream);
+	if ( r ) {
+		libusb_error(r, "Error setting up transfer");
+		free(databuf);
+		return;
+	}
+	isoc_in = false;
 
 	isoc_time = new QElapsedTimer();
 	isoc_time->start();
 
-	r = libusb_submit_transfer(transfer);
-
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
-
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(nullptr,&tv);
-	}
-
+	/* The data is copied into the buffer of the stream. */
+	r = cyusb_stream_submit(isoc_stream, databuf, bufsize_out, 0);
+	free(databuf);
 	if ( r ) {
 		printf("Error %d submitting transfer\n", r);
+		cyusb_stream_close(isoc_stream);
+		isoc_stream = nullptr;
 	}
 }
 
@@ -2154,9 +2224,20 @@ int main(int argc, char **argv)
 	}
 	else num_devices_detected = r;
 
-	signal(SIGUSR1, setup_handler);
-
 	mainwin = new ControlCenter;
+
+	/* Use incremental hotplug updates where available; the SIGUSR1 from the udev rule is then
+	   redundant. Otherwise fall back to re-opening the library on every SIGUSR1. As the session
+	   then lives as long as the application, its events are handled in the Qt event loop, and
+	   the library event thread is not needed. */
+	if ( cyusb_hotplug_register(hotplug_handler, nullptr) == 0 ) {
+		signal(SIGUSR1, SIG_IGN);
+		new cyusb::EventNotifier(&app);
+	}
+	else
+		signal(SIGUSR1, setup_handler);
+	cyusb_watch_config();
+
 	QMainWindow *mw = new QMainWindow(nullptr);
 	mw->setCentralWidget(mainwin);
 	QIcon *qic = new QIcon(":/cypress_60x60.png");
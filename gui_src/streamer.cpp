@@ -12,9 +12,8 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -22,7 +21,7 @@
 #include "../include/controlcenter.h"
 
 extern ControlCenter *mainwin;
-extern libusb_device_handle  *h;
+extern int current_device_index;
 
 // Variables storing the user provided application configuration.
 static unsigned int	endpoint   = 0;		// Endpoint to be tested
@@ -31,18 +30,26 @@ static unsigned int	queuedepth = 16;	// Number of requests to queue
 static unsigned char	eptype;			// Type of endpoint (transfer type)
 static unsigned int	pktsize;		// Maximum packet size for the endpoint
 
-static unsigned int	success_count = 0;	// Number of successful transfers
-static unsigned int	failure_count = 0;	// Number of failed transfers
-static unsigned int	transfer_size = 0;	// Size of data transfers performed so far
-static unsigned int	transfer_index = 0;	// Write index into the transfer_size array
-static unsigned int	transfer_perf = 0;	// Performance in KBps
+static struct cyusb_ep_stats base_stats;	// Counters of the endpoint when the test started
+static struct cyusb_ep_stats last_stats;	// Counters of the endpoint at the last refresh
 static volatile bool	stop_transfers = false;	// Request to stop data transfers
-static volatile int	rqts_in_flight = 0;	// Number of transfers that are in progress
 static volatile bool	app_running = false;	// Whether the streamer application is running
-static pthread_t	strm_thread;		// Thread used for the streamer operation
+static QTimer		*strm_timer = nullptr;	// Refreshes the statistics once a second
+static cyusb_stream	*stream = nullptr;	// Queue of transfers on the endpoint
 
-static struct timeval	start_ts;		// Data transfer start time stamp.
-static struct timeval	end_ts;			// Data transfer stop time stamp.
+static unsigned long long last_ns;		// CLOCK_MONOTONIC time of the last refresh, in ns
+
+// Function: now_ns
+// Returns the CLOCK_MONOTONIC time in ns, the clock the library stamps transfers with.
+static unsigned long long
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 // Function: streamer_set_params
 // Sets the streamer test parameters
@@ -62,12 +69,29 @@ streamer_set_params (
 }
 
 // Function: streamer_stop_xfer
-// Requests the streamer operation to be stopped.
+// Stops the streamer operation. Closing the stream waits for the transfers in flight, which
+// complete meanwhile even if the library events are handled in this thread's event loop.
 void
 streamer_stop_xfer (
 		void)
 {
 	stop_transfers = true;
+	if (!app_running)
+		return;
+
+	strm_timer->stop ();
+	printf ("Stopping streamer app\n");
+	printf ("%d requests are pending\n", cyusb_stream_pending (stream));
+	cyusb_stream_stop (stream);
+
+	// Tail latency tells how much buffering the endpoint needs.
+	printf ("Transfer latency:\n");
+	cyusb_stream_latency_dump (stream, stdout);
+	cyusb_stream_close (stream);
+	stream = nullptr;
+	app_running = false;
+
+	printf ("Streamer test completed\n\n");
 }
 
 // Function: streamer_is_running
@@ -80,157 +104,71 @@ streamer_is_running (
 }
 
 // Function: streamer_update_results
-// Gets the streamer test results on an ongoing basis
+// Gets the streamer test results on an ongoing basis, from the performance counters the
+// library keeps for the endpoint. For isochronous endpoints the library adds up the data
+// transferred in each micro-frame.
 static void
 streamer_update_results (
 		void)
 {
+	struct cyusb_ep_stats st;
+	unsigned long long now = now_ns ();
 	char buffer[64];
 
+	cyusb_stats_endpoint (current_device_index, endpoint, &st);
+
 	// Print the transfer statistics into the character strings and update UI.
-	sprintf (buffer, "%d", success_count);
+	sprintf (buffer, "%llu", st.status[LIBUSB_TRANSFER_COMPLETED] - base_stats.status[LIBUSB_TRANSFER_COMPLETED]);
 	mainwin->streamer_out_passcnt->setText (buffer);
 
-	sprintf (buffer, "%d", failure_count);
+	sprintf (buffer, "%llu", st.failed - base_stats.failed);
 	mainwin->streamer_out_failcnt->setText (buffer);
 
-	sprintf (buffer, "%d", transfer_perf);
+	// Calculate the performance in KBps since the last refresh.
+	sprintf (buffer, "%.0f", ((st.bytes - last_stats.bytes) / 1024.0) / ((now - last_ns) / 1e9));
 	mainwin->streamer_out_perf->setText (buffer);
+
+	last_stats = st;
+	last_ns    = now;
 }
 
 // Function: xfer_callback
-// This is the call back function called by libusb upon completion of a queued data transfer.
-static void
+// This is the call back function called upon completion of a queued data transfer, from the
+// Qt event loop or the library event thread. Returning non-zero re-submits the transfer.
+static int
 xfer_callback (
-		struct libusb_transfer *transfer)
-{
-	unsigned int elapsed_time;
-	double       performance;
-	int          size = 0;
-
-	// Check if the transfer has succeeded.
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-
-		failure_count++;
-
-	} else {
-
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-
-			// Loop through all the packets and check the status of each packet transfer
-			for (unsigned int i = 0; i < reqsize; ++i) {
-
-				// Calculate the actual size of data transferred in each micro-frame.
-				if (transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED) {
-					size += transfer->iso_packet_desc[i].actual_length;
-				}
-			}
-
-		} else {
-			size = reqsize * pktsize;
-		}
-
-		success_count++;
-	}
-
-	// Update the actual transfer size for this request.
-	transfer_size += size;
-
-	// Print the transfer statistics when queuedepth transfers are completed.
-	transfer_index++;
-	if (transfer_index == queuedepth) {
-
-		gettimeofday (&end_ts, nullptr);
-		elapsed_time = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000 +
-			(end_ts.tv_usec - start_ts.tv_usec));
-
-		// Calculate the performance in KBps.
-		performance    = (((double)transfer_size / 1024) / ((double)elapsed_time / 1000000));
-		transfer_perf  = (unsigned int)performance;
-
-		transfer_index = 0;
-		transfer_size  = 0;
-		start_ts = end_ts;
-	}
-
-	// Reduce the number of requests in flight.
-	rqts_in_flight--;
-
-	// Prepare and re-submit the read request.
-	if (!stop_transfers) {
-
-		// We do not expect a transfer queue attempt to fail in the general case.
-		// However, if it does fail; we just ignore the error.
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_set_iso_packet_lengths (transfer, pktsize);
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			default:
-				break;
-		}
-	}
-}
-
-// Function to free data buffers and transfer structures
-static void
-free_transfer_buffers (
-		unsigned char          **databuffers,
-		struct libusb_transfer **transfers)
+		const struct cyusb_xfer *xfer,
+		void *user)
 {
-	// Free up any allocated transfer structures
-	if (transfers != nullptr) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (transfers[i] != nullptr) {
-				libusb_free_transfer (transfers[i]);
-			}
-			transfers[i] = nullptr;
-		}
-		free (transfers);
-	}
-
-	// Free up any allocated data buffers
-	if (databuffers != nullptr) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (databuffers[i] != nullptr) {
-				free (databuffers[i]);
-			}
-			databuffers[i] = nullptr;
-		}
-		free (databuffers);
-	}
+	// We do not expect a transfer queue attempt to fail in the general case. However, if it
+	// does fail; the library just drops the request.
+	return (!stop_transfers);
 }
 
-// Function: streamer_thread_func
-// Function that implements the main streamer functionality. This will run on a dedicated thread
-// created for the streamer operation.
-static void *
-streamer_thread_func (
-		void *arg)
+// Function: streamer_start_xfer
+// Function to start the streamer operation. This sets up and queues the transfers, which then
+// run without a thread of their own; a timer refreshes the statistics once a second until
+// the operation is stopped.
+int
+streamer_start_xfer (
+		void)
 {
-	libusb_device_handle *dev_handle = (libusb_device_handle *)arg;
-	struct libusb_transfer **transfers = nullptr;		// List of transfer structures.
-	unsigned char **databuffers = nullptr;			// List of data buffers.
 	int  rStatus;
 
-	// Check for validity of the device handle
-	if (dev_handle == nullptr) {
-		printf ("Failed to get CyUSB device handle\n");
-		pthread_exit (nullptr);
+	if (app_running)
+		return -EBUSY;
+
+	// The stream holds a use of the handle until it is closed, so that it stays open even
+	// if the device list is refreshed from the GUI thread in the meantime.
+	if (cyusb_stream_open (current_device_index, endpoint, reqsize, queuedepth,
+				xfer_callback, nullptr, &stream) != 0) {
+		printf ("Failed to set up transfers on endpoint 0x%x\n", endpoint);
+		return -ENODEV;
 	}
 
+	// Default initialization for variables
+	stop_transfers = false;
+
 	// The endpoint is already found and its properties are known.
 	printf ("Starting test with the following parameters\n");
 	printf ("\tEndpoint to test : 0x%x\n", endpoint);
@@ -240,137 +178,32 @@ streamer_thread_func (
 	printf ("\tQueue depth      : 0x%x\n", queuedepth);
 	printf ("\n");
 
-	// Allocate buffers and transfer structures
-	bool allocfail = false;
-
-	databuffers = (unsigned char **)calloc (queuedepth, sizeof (unsigned char *));
-	transfers   = (struct libusb_transfer **)calloc (queuedepth, sizeof (struct libusb_transfer *));
-
-	if ((databuffers != nullptr) && (transfers != nullptr)) {
-
-		for (unsigned int i = 0; i < queuedepth; i++) {
-
-			databuffers[i] = (unsigned char *)malloc (reqsize * pktsize);
-			transfers[i]   = libusb_alloc_transfer (
-					(eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0);
-
-			if ((databuffers[i] == nullptr) || (transfers[i] == nullptr)) {
-				allocfail = true;
-				break;
-			}
-		}
-
-	} else {
-
-		allocfail = true;
-
-	}
-
-	// Check if all memory allocations have succeeded
-	if (allocfail) {
-		printf ("Failed to allocate buffers and transfer structures\n");
-		free_transfer_buffers (databuffers, transfers);
-		pthread_exit (nullptr);
-	}
-
-	// Take the transfer start timestamp
-	gettimeofday (&start_ts, nullptr);
+	// Take the transfer start timestamp and the counters of the endpoint, which also count
+	// the earlier tests on it.
+	cyusb_stats_endpoint (current_device_index, endpoint, &base_stats);
+	last_stats = base_stats;
+	last_ns    = now_ns ();
 
 	// Launch all the transfers till queue depth is complete
-	for (unsigned int i = 0; i < queuedepth; i++) {
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				libusb_fill_bulk_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, nullptr, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				libusb_fill_interrupt_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, nullptr, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_fill_iso_transfer (transfers[i], dev_handle, endpoint, databuffers[i],
-						reqsize * pktsize, reqsize, xfer_callback, nullptr, 5000);
-				libusb_set_iso_packet_lengths (transfers[i], pktsize);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			default:
-				break;
-		}
+	rStatus = cyusb_stream_start (stream);
+	if (rStatus <= 0) {
+		printf ("Failed to queue transfers\n");
+		cyusb_stream_close (stream);
+		stream = nullptr;
+		return -EIO;
 	}
 
-	printf ("Queued %d requests\n", rqts_in_flight);
-
-	struct timeval t1, t2, tout;
-	gettimeofday (&t1, nullptr);
-
-	// Use a 1 second timeout for the libusb_handle_events_timeout call
-	tout.tv_sec  = 1;
-	tout.tv_usec = 0;
-
-	// Keep handling events until transfer stop is requested.
-	do {
-		libusb_handle_events_timeout (nullptr, &tout);
-
-		// Refresh the performance statistics about once in 0.5 seconds.
-		gettimeofday (&t2, nullptr);
-		if (t2.tv_sec > t1.tv_sec) {
-			streamer_update_results ();
-			t1 = t2;
-		}
+	printf ("Queued %d requests\n", rStatus);
 
-	} while (!stop_transfers);
-
-	printf ("Stopping streamer app\n");
-	while (rqts_in_flight != 0) {
-		printf ("%d requests are pending\n", rqts_in_flight);
-		libusb_handle_events_timeout (nullptr, &tout);
-		sleep (1);
+	// Refresh the performance statistics about once a second until transfer stop is requested.
+	if (strm_timer == nullptr) {
+		strm_timer = new QTimer (mainwin);
+		QObject::connect (strm_timer, &QTimer::timeout, streamer_update_results);
 	}
-
-	free_transfer_buffers (databuffers, transfers);
-	app_running = false;
-
-	printf ("Streamer test completed\n\n");
-	pthread_exit (nullptr);
-}
-
-// Function: streamer_start_xfer
-// Function to start the streamer operation. This creates a new thread which runs the
-// data transfers.
-int
-streamer_start_xfer (
-		void)
-{
-	if (app_running)
-		return -EBUSY;
-
-	// Default initialization for variables
-	success_count  = 0;
-	failure_count  = 0;
-	transfer_index = 0;
-	transfer_size  = 0;
-	transfer_perf  = 0;
-	rqts_in_flight = 0;
-	stop_transfers = false;
+	strm_timer->start (1000);
 
 	// Mark application running
 	app_running    = true;
-	if (pthread_create (&strm_thread, nullptr, streamer_thread_func, (void *)h) != 0) {
-		app_running = false;
-		return -ENOMEM;
-	}
-
 	return 0;
 }
 
@@ -32,6 +32,7 @@ private slots:
 	void on_listWidget_itemClicked(QListWidgetItem *item);
 
 	void sigusr1_handler();
+	void isoc_done();
 
 	void on_pb1_selfile_clicked();
 	void on_pb1_start_clicked();
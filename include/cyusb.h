@@ -15,23 +15,29 @@
  *                                                                                *
  \********************************************************************************/
 
+#include <stdio.h>
+#include <sys/uio.h>
 #include <libusb-1.0/libusb.h>
 
-/* This is the maximum number of 'devices of interest' we are willing to store as default. */
-/* These are the maximum number of devices we will communicate with simultaneously */
+/* This is the number of 'devices of interest' the device table has room for initially. */
+/* The table grows on demand, so this is not a limit on the number of devices. */
 #define MAXDEVICES        10
 
-/* This is the maximum number of VID/PID pairs that this library will consider. This limits
-   the number of valid VID/PID entries in the configuration file.
+/* This is the number of VID/PID entries the device database has room for initially. The
+   database grows on demand, so any number of entries in the configuration file is accepted.
  */
 #define MAX_ID_PAIRS    100
 
-/* This is the maximum length for the description string for a device in the configuration
-   file. If the actual string in the file is longer, only the first MAX_STR_LEN characters
-   will be considered.
+/* This was the maximum length for the description string for a device in the configuration
+   file. It is kept for existing applications; descriptions are now limited by CYUSB_DESC_LEN.
  */
 #define MAX_STR_LEN     30
 
+/* This is the maximum length of the description string for a device in the configuration
+   file, including the terminating NULL. Longer descriptions are truncated.
+ */
+#define CYUSB_DESC_LEN  128
+
 struct cydev {
     libusb_device *dev;          /* as above ... */
     libusb_device_handle *handle;       /* as above ... */
@@ -43,6 +49,167 @@ struct cydev {
     unsigned char filler;       /* Padding to make struct = 16 bytes */
 };
 
+/* Copy of the information of a device, see cyusb_getinfo(). */
+struct cyusb_devinfo {
+    unsigned short vid;         /* Vendor ID */
+    unsigned short pid;         /* Product ID */
+    unsigned char busnum;       /* The bus number of this device */
+    unsigned char devaddr;      /* The device address */
+    int speed;                  /* Link speed, as libusb_get_device_speed() */
+    char path[32];              /* Bus/port path, as cyusb_getpath() */
+    char serial[128];           /* Serial number, empty if the device has none */
+    char desc[CYUSB_DESC_LEN];  /* Description from the configuration file */
+};
+
+/* Endpoint information precomputed from the cached descriptors of a device. */
+struct cyusb_endpoint {
+    unsigned char  address;     /* bEndpointAddress */
+    unsigned char  type;        /* Transfer type, LIBUSB_TRANSFER_TYPE_xxx */
+    unsigned char  interface;   /* bInterfaceNumber of the interface holding the endpoint */
+    unsigned char  altsetting;  /* bAlternateSetting in which the endpoint is present */
+    unsigned short maxpacket;   /* Maximum packet size, bits 0-10 of wMaxPacketSize */
+    unsigned char  burst;       /* Packets per burst: bMaxBurst + 1 at SuperSpeed, else 1 */
+    unsigned char  mult;        /* Bursts (SS) or transactions (HS) per interval for iso/interrupt, else 1 */
+    unsigned int   pktsize;     /* Effective packet size: maxpacket * burst * mult */
+    unsigned char  interval;    /* bInterval */
+    short          next;        /* Same address in a later alternate setting, or -1 */
+    unsigned int   period;      /* Service interval in microseconds; for bulk and control, the (micro)frame */
+    unsigned int   periodbytes; /* Most bytes moved per period: wBytesPerInterval at SuperSpeed, else
+                                   pktsize for iso/interrupt; for bulk, the most a (micro)frame holds */
+    unsigned int   bandwidth;   /* Theoretical maximum in bytes per second, periodbytes per period */
+};
+
+/* Descriptors of a device, read once when the device is enumerated. */
+struct cyusb_descriptors {
+    struct libusb_device_descriptor device;         /* Device descriptor */
+    const struct libusb_config_descriptor *config;  /* Active configuration (the first one if unconfigured) */
+    int                    nendpoints;              /* Number of entries in endpoints[] */
+    struct cyusb_endpoint  *endpoints;              /* Endpoints of all interfaces and alternate settings */
+    short                  epmap[32];               /* endpoints[] index by address, see CYUSB_EP_SLOT(), or -1 */
+    int                    speed;                   /* Link speed, LIBUSB_SPEED_xxx */
+};
+
+/* Slot of an endpoint address in the epmap[] array: OUT endpoints first, then IN endpoints. */
+#define CYUSB_EP_SLOT(addr)     (((addr) & 0x0F) | (((addr) & 0x80) >> 3))
+
+/* Events reported to the hotplug change-notification callback. */
+#define CYUSB_DEVICE_ARRIVED    1   /* A device of interest was added to the cydev[] table. */
+#define CYUSB_DEVICE_LEFT       2   /* A device of interest is about to be removed from the table. */
+
+/* Change-notification callback type. index is the slot in the cydev[] array that changed,
+   event is one of CYUSB_DEVICE_ARRIVED or CYUSB_DEVICE_LEFT. */
+typedef void (*cyusb_hotplug_cb)(int index, int event, void *user);
+
+/* Completion callback type for cyusb_prepare(). status is 0 when the device at index is
+   ready, else a LIBUSB_ERROR; usec is the time since cyusb_prepare() was called. */
+typedef void (*cyusb_ready_cb)(int index, int status, unsigned long usec, void *user);
+
+/* An independent library session, see cyusb_open(cyusb_context **, const char *). */
+typedef struct cyusb_context cyusb_context;
+
+/* A queue of asynchronous transfers on one endpoint, see cyusb_stream_open(). */
+typedef struct cyusb_stream cyusb_stream;
+
+/* A finished transfer, as passed to the completion callback of a stream. */
+struct cyusb_xfer {
+    cyusb_stream   *stream;     /* Stream the transfer belongs to */
+    unsigned char  *buffer;     /* Data buffer of the transfer */
+    int            length;      /* Number of bytes requested */
+    int            actual;      /* Bytes transferred; for isochronous, summed over completed packets */
+    int            status;      /* LIBUSB_TRANSFER_COMPLETED, or the reason the transfer failed */
+    int            packets;     /* Number of isochronous packets, else 0 */
+    int            failed;      /* Isochronous packets that did not complete */
+    struct libusb_transfer *transfer;   /* Underlying libusb transfer, for per-packet details */
+    unsigned long long submitted;       /* CLOCK_MONOTONIC time of submission, in nanoseconds */
+    unsigned long long completed;       /* CLOCK_MONOTONIC time of completion, in nanoseconds */
+};
+
+/* Completion callback type for streams. Called on the library event thread for every transfer
+   that completes, fails or is cancelled. Return non-zero to submit the transfer again with the
+   same buffer and length, or 0 to give it back to the stream. */
+typedef int (*cyusb_xfer_cb)(const struct cyusb_xfer *xfer, void *user);
+
+/* What a ring mode stream does when its consumer falls behind, see cyusb_stream_open_ring(). */
+#define CYUSB_RING_BLOCK        0   /* Completed data is kept; transfers are held back until buffers are given back. */
+#define CYUSB_RING_DROP_OLDEST  1   /* Transfers keep running; the oldest data not yet taken is dropped. */
+
+/* Faults a stream recovers from by itself, see cyusb_stream_set_recovery(). */
+#define CYUSB_RECOVER_STALL     0x01    /* Clear the halt of a stalled endpoint */
+#define CYUSB_RECOVER_TIMEOUT   0x02    /* Clear the halt after a run of timed out or failed transfers */
+#define CYUSB_RECOVER_REATTACH  0x04    /* Move to the device that comes back at the same port */
+#define CYUSB_RECOVER_ALL       (CYUSB_RECOVER_STALL | CYUSB_RECOVER_TIMEOUT | CYUSB_RECOVER_REATTACH)
+
+/* Counters of a ring mode stream, see cyusb_stream_ring_stats(). */
+struct cyusb_ring_stats {
+    unsigned long long completed;   /* Transfers put in the ring by the event thread */
+    unsigned long long consumed;    /* Transfers taken by the consumer */
+    unsigned long long overruns;    /* Completions that left the queue short (block) or dropped data (drop-oldest) */
+    unsigned long long underruns;   /* Times the consumer found the ring empty */
+    unsigned int       waiting;     /* Transfers in the ring now */
+};
+
+/* Submission to completion times of the transfers of a stream in nanoseconds, see
+   cyusb_stream_latency(). Percentiles are accurate to 1/32 of their value. */
+struct cyusb_latency {
+    unsigned long long count;       /* Transfers measured; cancelled ones are left out */
+    unsigned long long min;         /* Shortest */
+    unsigned long long mean;        /* Average */
+    unsigned long long p50;         /* Median */
+    unsigned long long p99;         /* 99th percentile */
+    unsigned long long p999;        /* 99.9th percentile */
+    unsigned long long max;         /* Longest */
+};
+
+/* Number of transfer statuses counted, LIBUSB_TRANSFER_COMPLETED to LIBUSB_TRANSFER_OVERFLOW. */
+#define CYUSB_STATS_NSTATUS     (LIBUSB_TRANSFER_OVERFLOW + 1)
+
+/* Most endpoints counted per device, as in the epmap[] array. */
+#define CYUSB_STATS_ENDPOINTS   32
+
+/* Directory where each context publishes its counters for cyusbd, if it exists. */
+#define CYUSB_STATS_DIR         "/dev/shm/cyusb"
+
+/* Performance counters of one endpoint since its device was first seen, see
+   cyusb_stats_snapshot(). Endpoint 0 counts the transfers of cyusb_control_transfer(). */
+struct cyusb_ep_stats {
+    unsigned char      endpoint;            /* Endpoint address */
+    unsigned long long submitted;           /* Transfers submitted */
+    unsigned long long completed;           /* Transfers finished, whatever their status */
+    unsigned long long failed;              /* Transfers finished neither completed nor cancelled */
+    unsigned long long status[CYUSB_STATS_NSTATUS];    /* Transfers finished, by LIBUSB_TRANSFER_xxx status */
+    unsigned long long bytes;               /* Bytes transferred */
+    unsigned long long callbacks;           /* Stream callbacks run */
+    unsigned long long callback_ns;         /* Time spent in stream callbacks, in nanoseconds */
+    unsigned long long resubmit_failures;   /* Stream transfers that could not be submitted again */
+    unsigned long long control_count;       /* Control transfers */
+    unsigned long long control_ns;          /* Time spent in control transfers, in nanoseconds */
+    unsigned long long recoveries;          /* Stream recoveries from stalls, storms and disconnects */
+    unsigned long long recovery_ns;         /* Time from the faults to the transfers running again */
+    unsigned long long recovery_retries;    /* Recovery attempts that failed and were retried */
+};
+
+/* Performance counters of one device, see cyusb_stats_snapshot(). */
+struct cyusb_dev_stats {
+    char               path[32];            /* Bus/port path, which identifies the device */
+    unsigned short     vid;                 /* Vendor ID */
+    unsigned short     pid;                 /* Product ID */
+    int                index;               /* Index of the device, or -1 if it is not connected */
+    unsigned long long connects;            /* Times the device was added to the device table */
+    unsigned long long enum_ns;             /* Time taken to add it, in nanoseconds */
+    unsigned long long fw_loads;            /* Firmware downloads by cyusb_download_fx2/fx3() */
+    unsigned long long fw_failures;         /* Firmware downloads that failed */
+    unsigned long long fw_ns;               /* Time taken by all downloads, in nanoseconds */
+    int                nendpoints;          /* Number of endpoints used so far */
+    struct cyusb_ep_stats endpoints[CYUSB_STATS_ENDPOINTS];  /* Their counters, OUT endpoints first */
+};
+
+/* Performance counters of all devices of a context, see cyusb_stats_snapshot(). */
+struct cyusb_stats {
+    int                pid;                 /* Process the counters were taken in */
+    int                ndevices;            /* Number of devices seen so far */
+    struct cyusb_dev_stats *devices;        /* Their counters, the most recently seen first */
+};
+
 /* Function prototypes */
 
 /*******************************************************************************************
@@ -60,6 +227,9 @@ extern void cyusb_error(int err);
   Description  : This initializes the underlying libusb library, populates the cydev[]
                  array, and returns the number of devices of interest detected. A
                  'device of interest' is a device which appears in the /etc/cyusb.conf file.
+                 The devices are not opened here: each one is opened the first time its
+                 handle is asked for, so a device that cannot be opened (e.g. for lack of
+                 permissions) does not keep the others from being used.
   Parameters   : None
   Return Value : Returns an integer, equal to number of devices of interest detected.
  *******************************************************************************************/
@@ -78,16 +248,69 @@ extern int cyusb_open(void);
  *******************************************************************************************/
 extern int cyusb_open(unsigned short vid, unsigned short pid);
 
+/*******************************************************************************************
+  Prototype    : int cyusb_open_device(const char *device);
+  Description  : This function opens just one device of interest, given by its device node
+                 or by its serial number. A device node is opened directly, without the bus
+                 being scanned. A serial number is looked up in a cache of the device node
+                 last seen for it, kept in $XDG_CACHE_HOME/cyusb/devices (by default in
+                 ~/.cache). If there is no cache entry, or the device is no longer at that
+                 node, all devices of interest are enumerated as by cyusb_open(), and the
+                 cache is refreshed. Scripts that run a tool many times should pass the same
+                 serial number every time.
+  Parameters   :
+                 const char *device : Device node such as "/dev/bus/usb/002/005", or a
+                                      serial number.
+  Return Value : Returns the index of the device, for use with cyusb_gethandle() etc., or
+                 a negative error such as -ENODEV if it is not connected.
+ *******************************************************************************************/
+extern int cyusb_open_device(const char *device);
+
 /*******************************************************************************************
   Prototype    : libusb_device_handle * cyusb_gethandle(int index);
   Description  : This function returns a libusb_device_handle given an index from the cydev[] array.
+                 The device is opened on the first call, and the handle stays open until the
+                 device is removed or cyusb_close() is called.
   Parameters   :
                  int index : Equal to the index in the cydev[] array that gets populated
                              during the cyusb_open() call described above.
-  Return Value : Returns the pointer to a struct of type libusb_device_handle.
+  Return Value : Returns the pointer to a struct of type libusb_device_handle, or NULL if
+                 the slot is free or the device could not be opened.
+                 This and the other lookup functions (cyusb_getdevice(), cyusb_find_by_*() and
+                 so on) may be called from any thread. They do not wait for hotplug
+                 processing or other threads, except for the call that opens the device.
+                 The handle is closed when the device is removed; hold it with
+                 cyusb_acquire() to use it from another thread than the one handling hotplug
+                 events.
  *******************************************************************************************/
 extern libusb_device_handle * cyusb_gethandle(int index);
 
+/*******************************************************************************************
+  Prototype    : int cyusb_acquire(int index, libusb_device_handle **handle);
+  Description  : This function gets a counted use of the handle to a device, opening the
+                 device if it is not open yet. Every successful call must be matched by a
+                 call to cyusb_release(); the handle is closed when its last user releases
+                 it. A handle that is acquired stays valid if the device is removed, or the
+                 library is closed or re-opened, until it is released. Worker threads that
+                 use a handle should hold it this way.
+  Parameters   :
+                 int index                     : Index of the device, as used with
+                                                 cyusb_gethandle().
+                 libusb_device_handle **handle : Returns the device handle, or NULL on error.
+  Return Value : 0 on success, or LIBUSB_ERROR_NO_DEVICE for a free slot, or the libusb
+                 error code from opening the device (e.g. LIBUSB_ERROR_ACCESS).
+ *******************************************************************************************/
+extern int cyusb_acquire(int index, libusb_device_handle **handle);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_release(libusb_device_handle *handle);
+  Description  : This function gives up a use of a handle obtained from cyusb_acquire().
+  Parameters   :
+                 libusb_device_handle *handle : Handle returned by cyusb_acquire().
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_release(libusb_device_handle *handle);
+
 /*******************************************************************************************
   Prototype    : unsigned short cyusb_getvendor(libusb_device_handle *);
   Description  : This function returns a 16-bit value corresponding to the vendor ID given
@@ -106,6 +329,921 @@ extern unsigned short cyusb_getvendor(libusb_device_handle *);
  *******************************************************************************************/
 extern void cyusb_close(void);
 
+/*******************************************************************************************
+  Prototype    : int cyusb_getcount(void);
+  Description  : This function returns the number of slots in use in the cydev[] array. Slots
+                 freed by a device removal read back a NULL handle from cyusb_gethandle()
+                 until a newly attached device re-uses them.
+  Parameters   : none.
+  Return Value : Returns the number of valid indices for cyusb_gethandle().
+ *******************************************************************************************/
+extern int cyusb_getcount(void);
+
+/*******************************************************************************************
+  Prototype    : struct cydev * cyusb_getdevice(int index);
+  Description  : This function returns the information stored for a device of interest. The
+                 information, and the strings returned by cyusb_getpath(), cyusb_getserial()
+                 and cyusb_getdesc(), belong to the device table, and are freed when the
+                 device is removed, unless the device is held with cyusb_acquire(). Other
+                 threads than the one handling hotplug events should hold the device while
+                 they use them, or copy them with cyusb_getinfo().
+  Parameters   :
+                 int index : Index of the device, as used with cyusb_gethandle().
+  Return Value : Returns a pointer to the device information, or NULL for a free slot.
+ *******************************************************************************************/
+extern struct cydev * cyusb_getdevice(int index);
+
+/*******************************************************************************************
+  Prototype    : const char * cyusb_getpath(int index);
+  Description  : This function returns the bus/port path of a device, in the same form as
+                 its name under /sys/bus/usb/devices (e.g. "2-1.4"). Unlike the device
+                 address, the path stays the same when a device re-enumerates.
+  Parameters   :
+                 int index : Index of the device, as used with cyusb_gethandle().
+  Return Value : Returns the path string, or NULL for a free slot. It is valid as long as
+                 the pointer from cyusb_getdevice().
+ *******************************************************************************************/
+extern const char * cyusb_getpath(int index);
+
+/*******************************************************************************************
+  Prototype    : const char * cyusb_getserial(int index);
+  Description  : This function returns the serial number string of a device.
+  Parameters   :
+                 int index : Index of the device, as used with cyusb_gethandle().
+  Return Value : Returns the serial number, an empty string if the device has none, or
+                 NULL for a free slot. It is valid as long as the pointer from
+                 cyusb_getdevice().
+ *******************************************************************************************/
+extern const char * cyusb_getserial(int index);
+
+/*******************************************************************************************
+  Prototype    : const char * cyusb_getdesc(int index);
+  Description  : This function returns the description given for a device in the <VPD>
+                 section of the configuration file.
+  Parameters   :
+                 int index : Index of the device, as used with cyusb_gethandle().
+  Return Value : Returns the description, or NULL for a free slot. It is valid as long as
+                 the pointer from cyusb_getdevice(), unless reloads of the configuration
+                 file change the description twice; cyusb_getinfo() keeps a copy.
+ *******************************************************************************************/
+extern const char * cyusb_getdesc(int index);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_getinfo(int index, struct cyusb_devinfo *info);
+  Description  : This function copies the information of a device, with its path, serial
+                 number and description, so that it stays valid whatever happens to the
+                 device meanwhile.
+  Parameters   :
+                 int index                   : Index of the device, as used with
+                                               cyusb_gethandle().
+                 struct cyusb_devinfo *info  : Returns the information.
+  Return Value : 0 on success, or LIBUSB_ERROR_NO_DEVICE for a free slot.
+ *******************************************************************************************/
+extern int cyusb_getinfo(int index, struct cyusb_devinfo *info);
+
+/*******************************************************************************************
+  Prototype    : const struct cyusb_descriptors * cyusb_getdescriptors(int index);
+  Description  : This function returns the descriptors of a device. They are read once at
+                 enumeration, without opening the device, and are shared by all users. The
+                 cache is keyed by bus/port path and bcdDevice, so a device that comes back
+                 at the same port with the same firmware does not have its descriptors
+                 parsed again.
+  Parameters   :
+                 int index : Index of the device, as used with cyusb_gethandle().
+  Return Value : Returns the cached descriptors, valid until cyusb_close(), or NULL for a
+                 free slot or if the descriptors could not be read.
+ *******************************************************************************************/
+extern const struct cyusb_descriptors * cyusb_getdescriptors(int index);
+
+/*******************************************************************************************
+  Prototype    : const struct cyusb_endpoint * cyusb_getendpoint(int index, unsigned char address);
+  Description  : This function looks up an endpoint of a device in the cached endpoint
+                 table. Where the endpoint is present in several alternate settings, the
+                 first one in descriptor order is returned; the others are linked through
+                 the next field.
+                 The entry holds everything needed to size transfers on the endpoint: the
+                 effective packet size with burst and mult, the service interval and bytes
+                 per interval at the link speed of the device, and the theoretical
+                 bandwidth. It is computed once with the descriptors, so applications should
+                 use it rather than recompute these from the descriptors.
+  Parameters   :
+                 int index             : Index of the device, as used with cyusb_gethandle().
+                 unsigned char address : Endpoint address, including the direction bit.
+  Return Value : Returns the endpoint information, or NULL if there is no such endpoint.
+ *******************************************************************************************/
+extern const struct cyusb_endpoint * cyusb_getendpoint(int index, unsigned char address);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_find_by_path(const char *path);
+  Description  : This function looks up a device of interest by its bus/port path. The
+                 lookup takes constant time, independent of the number of devices.
+  Parameters   :
+                 const char *path : Bus/port path, as returned by cyusb_getpath().
+  Return Value : Returns the index of the device, or -1 if not found.
+ *******************************************************************************************/
+extern int cyusb_find_by_path(const char *path);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_find_by_vidpid(unsigned short vid, unsigned short pid);
+  Description  : This function looks up the first device of interest with the given Vendor
+                 ID and Product ID. Use cyusb_find_next_vidpid() to get any further devices
+                 with the same IDs.
+  Parameters   :
+                 unsigned short vid : Vendor ID
+                 unsigned short pid : Product ID
+  Return Value : Returns the index of the device, or -1 if not found.
+ *******************************************************************************************/
+extern int cyusb_find_by_vidpid(unsigned short vid, unsigned short pid);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_find_next_vidpid(int index);
+  Description  : This function continues a lookup started with cyusb_find_by_vidpid().
+  Parameters   :
+                 int index : Index returned by the previous lookup.
+  Return Value : Returns the index of the next device with the same IDs, or -1 if none.
+ *******************************************************************************************/
+extern int cyusb_find_next_vidpid(int index);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_find_by_serial(const char *serial);
+  Description  : This function looks up a device of interest by its serial number.
+  Parameters   :
+                 const char *serial : Serial number string.
+  Return Value : Returns the index of the device, or -1 if not found.
+ *******************************************************************************************/
+extern int cyusb_find_by_serial(const char *serial);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_hotplug_register(cyusb_hotplug_cb cb, void *user);
+  Description  : This function keeps the cydev[] array up to date with device arrivals and
+                 removals reported by libusb, instead of a complete cyusb_close()/cyusb_open()
+                 cycle. Only the affected slot is updated; handles to all other devices stay
+                 open. Events are handled on a thread owned by the library, and the callback
+                 is invoked on that thread. For a removal, the callback runs before the handle
+                 is closed. Must be called after cyusb_open().
+  Parameters   :
+                 cyusb_hotplug_cb cb : Change-notification callback, may be NULL.
+                 void *user          : User data passed to the callback.
+  Return Value : 0 on success, -ENOTSUP if the platform has no hotplug support,
+                 -EBUSY if already registered, or an appropriate LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_hotplug_register(cyusb_hotplug_cb cb, void *user);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_hotplug_deregister(void);
+  Description  : This function stops hotplug tracking and the library event thread. It is
+                 called implicitly by cyusb_close().
+  Parameters   : none.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_hotplug_deregister(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_watch_config(void);
+  Description  : This function makes the library reload the configuration file whenever it
+                 is edited, without re-enumerating the bus. Devices that are no longer of
+                 interest are removed, devices that have become of interest are added, and
+                 all other devices keep their index and their open handle. The changes are
+                 reported to the callback given to cyusb_hotplug_register(), if any, from a
+                 thread owned by the library. The configuration is loaded from a compiled
+                 image below ~/.cache/cyusb while the text file is unchanged.
+  Parameters   : none.
+  Return Value : 0 on success, -ENOENT if the library was opened without a configuration
+                 file, -EBUSY if already watching, or a negative errno.
+ *******************************************************************************************/
+extern int cyusb_watch_config(void);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_unwatch_config(void);
+  Description  : This function stops watching the configuration file. It is called
+                 implicitly by cyusb_close().
+  Parameters   : none.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_unwatch_config(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_prepare(int nthreads, int interface, cyusb_ready_cb cb, void *user);
+  Description  : This function opens all devices of interest, reads their serial numbers and
+                 optionally claims an interface on each, with up to nthreads devices being
+                 brought up at the same time. Each device can be used as soon as it is ready:
+                 cyusb_gethandle() returns its handle without waiting for the others. The
+                 callback is invoked once per device, from one of the pool threads, but never
+                 for two devices at the same time. The function returns when all devices
+                 are done.
+  Parameters   :
+                 int nthreads      : Maximum number of threads, or 0 for the default of 8.
+                                     The calling thread is one of them.
+                 int interface     : Interface to claim on every device, or -1 for none. A
+                                     kernel driver bound to it is detached first.
+                 cyusb_ready_cb cb : Completion callback, may be NULL.
+                 void *user        : User data passed to the callback.
+  Return Value : Returns the number of devices that are ready, or -EINVAL if
+                 cyusb_open() has not been called.
+ *******************************************************************************************/
+extern int cyusb_prepare(int nthreads, int interface, cyusb_ready_cb cb, void *user);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_start_events(void);
+  Description  : This function starts the library event thread, or takes another use of it
+                 if it is already running for the hotplug registry or a stream. Asynchronous
+                 transfers that the application submits to libusb on handles of the session
+                 then complete on that thread, as with include/cyusb_coro.h. Each call must be
+                 matched by a call to cyusb_stop_events().
+  Parameters   : none.
+  Return Value : 0 on success, or a negative errno.
+ *******************************************************************************************/
+extern int cyusb_start_events(void);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_stop_events(void);
+  Description  : This function gives up a use of the library event thread, which is stopped
+                 once it has no users left. Must not be called from a transfer callback.
+  Parameters   : none.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_stop_events(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_event_fd_open(void);
+  Description  : This function hands the libusb events of a session over to the event loop
+                 of the application, in place of the library event thread, which is stopped
+                 if it runs and not started again until cyusb_event_fd_close(). It returns a
+                 single fd, standing for all fds libusb uses, that becomes readable when
+                 there are events to handle. The application watches it with poll(), epoll,
+                 a QSocketNotifier (see include/cyusb_qt.h) or any other loop, and then calls
+                 cyusb_handle_events(). Stream, transfer and hotplug callbacks then run on the
+                 thread of that loop, and nothing wakes up while the devices are idle. Calling
+                 it again returns the same fd. Must not be called from a callback.
+  Parameters   : none.
+  Return Value : The event fd, or a negative errno.
+ *******************************************************************************************/
+extern int cyusb_event_fd_open(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_event_fd_close(void);
+  Description  : This function closes the event fd of a session and gives its events back to
+                 the library event thread. cyusb_close() does so as well. If the event thread
+                 is in use and cannot be started, the fd is left open and the application
+                 loop goes on handling the events.
+  Parameters   : none.
+  Return Value : 0 on success, or -ENOMEM if the event thread could not be started.
+ *******************************************************************************************/
+extern int cyusb_event_fd_close(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_handle_events(void);
+  Description  : This function handles the pending libusb events of a session without
+                 blocking, running the callbacks of completed transfers on the calling thread.
+                 It is called by the application loop when the event fd is readable, or when
+                 the time given by cyusb_event_timeout() has passed. Functions that wait for
+                 a stream, such as cyusb_stream_close(), handle the events themselves while
+                 they wait, so that they may be called from the thread of the loop.
+  Parameters   : none.
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_handle_events(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_event_timeout(void);
+  Description  : This function returns the time after which cyusb_handle_events() must be
+                 called even if the event fd has not become readable, for transfer timeouts
+                 on systems where libusb cannot signal them on an fd. On Linux there is none.
+  Parameters   : none.
+  Return Value : Time in milliseconds, or -1 for no limit.
+ *******************************************************************************************/
+extern int cyusb_event_timeout(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_epoll_add(int epfd, void *tag);
+  Description  : This function opens the event fd of a session, as cyusb_event_fd_open()
+                 does, and adds it to an epoll instance of the application for reading. When
+                 epoll_wait() returns an event with data.ptr equal to tag, the application
+                 calls cyusb_handle_events().
+  Parameters   :
+                 int epfd  : epoll instance of the application.
+                 void *tag : Value of data.ptr in the events of the session.
+  Return Value : 0 on success, or a negative errno.
+ *******************************************************************************************/
+extern int cyusb_epoll_add(int epfd, void *tag);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_epoll_del(int epfd);
+  Description  : This function removes the event fd of a session from an epoll instance and
+                 closes it, giving the events back to the library event thread. As with
+                 cyusb_event_fd_close(), the fd stays in the epoll instance, and the events
+                 with the application, if the event thread cannot be started.
+  Parameters   :
+                 int epfd : epoll instance given to cyusb_epoll_add().
+  Return Value : 0 on success, or -ENOMEM if the event thread could not be started.
+ *******************************************************************************************/
+extern int cyusb_epoll_del(int epfd);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_open(int index, unsigned char endpoint, unsigned int reqsize,
+                     unsigned int queuedepth, cyusb_xfer_cb cb, void *user,
+                     cyusb_stream **stream);
+  Description  : This function sets up asynchronous transfers on an endpoint of a device. The
+                 stream holds queuedepth transfers with buffers of reqsize packets each, and a
+                 use of the device handle as cyusb_acquire() does. Transfers are read or write
+                 according to the direction of the endpoint, and complete on an event thread
+                 owned by the library, which runs while any stream is open. The callbacks of
+                 all streams of one session are invoked on that thread, one at a time. The
+                 interface holding the endpoint must be claimed by the application.
+                 The buffers are mapped from the usbfs file of the device where the kernel
+                 supports it, which saves the kernel a copy of every transfer, and are
+                 page-aligned memory otherwise. Setting the environment variable
+                 CYUSB_NO_DEVMEM=1 always uses page-aligned memory.
+  Parameters   :
+                 int index               : Index of the device.
+                 unsigned char endpoint  : Endpoint address, as in cyusb_getendpoint().
+                 unsigned int reqsize    : Transfer size in packets. A packet is the effective
+                                           packet size of the endpoint, including burst and
+                                           mult; an isochronous transfer has reqsize packets.
+                 unsigned int queuedepth : Number of transfers.
+                 cyusb_xfer_cb cb        : Completion callback, may be NULL.
+                 void *user              : User data passed to the callback.
+                 cyusb_stream **stream   : Returns the stream, or NULL on error.
+  Return Value : 0 on success, LIBUSB_ERROR_NOT_FOUND if the device has no such endpoint, or
+                 an appropriate LIBUSB_ERROR or negative errno.
+ *******************************************************************************************/
+extern int cyusb_stream_open(int index, unsigned char endpoint, unsigned int reqsize,
+		unsigned int queuedepth, cyusb_xfer_cb cb, void *user, cyusb_stream **stream);
+
+/*******************************************************************************************
+  Prototype    : bool cyusb_stream_mapped(cyusb_stream *stream);
+  Description  : This function tells whether the buffers of a stream are mapped usbfs memory,
+                 which the host controller accesses without a copy by the kernel.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+  Return Value : true for usbfs memory, false for page-aligned memory.
+ *******************************************************************************************/
+extern bool cyusb_stream_mapped(cyusb_stream *stream);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_start(cyusb_stream *stream);
+  Description  : This function starts continuous streaming: every free transfer is
+                 submitted with its whole buffer, up to the queue depth. Each completed
+                 transfer is resubmitted for as long as the callback returns non-zero. An OUT
+                 stream sends its buffers as they are; the callback may refill them.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+  Return Value : Returns the number of transfers submitted, or an appropriate LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_stream_start(cyusb_stream *stream);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_submit(cyusb_stream *stream, const unsigned char *data,
+                     int length, int timeout);
+  Description  : This function submits one transfer. For an OUT endpoint, the data is copied
+                 into a free buffer of the stream, so the caller may reuse it at once. For an
+                 IN endpoint, data is ignored and the data read is passed to the callback. An
+                 isochronous transfer is rounded up to whole packets. When the queue depth is
+                 reached, the function waits for a transfer to be given back.
+  Parameters   :
+                 cyusb_stream *stream      : Stream returned by cyusb_stream_open().
+                 const unsigned char *data : Data to send, or NULL.
+                 int length                : Number of bytes, at most reqsize packets.
+                 int timeout               : Longest wait in milliseconds, 0 not to wait, or
+                                             -1 to wait forever. Never waits from a callback.
+  Return Value : 0 on success, -EAGAIN or -ETIMEDOUT if no transfer was free in time,
+                 -ECANCELED if the stream is stopped, or an appropriate LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_stream_submit(cyusb_stream *stream, const unsigned char *data, int length, int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_set_depth(cyusb_stream *stream, unsigned int depth);
+  Description  : This function changes the number of transfers a stream keeps in flight,
+                 between 1 and the queue depth it was opened with. A lower depth takes effect
+                 as transfers complete.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+                 unsigned int depth   : New queue depth.
+  Return Value : 0 on success, or -EINVAL.
+ *******************************************************************************************/
+extern int cyusb_stream_set_depth(cyusb_stream *stream, unsigned int depth);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_set_recovery(cyusb_stream *stream, unsigned int flags);
+  Description  : This function chooses the faults a stream recovers from by itself; all of
+                 them, CYUSB_RECOVER_ALL, when it is opened. On a stalled endpoint, or four
+                 timed out or failed transfers in a row, the stream stops submitting,
+                 cancels the transfers in flight, clears the halt of the endpoint and
+                 submits again the transfers the callback asked to requeue, and in ring
+                 mode all free ones. When the device is lost, it waits for a
+                 device to come back at the same bus/port path with the same endpoint, and
+                 moves its transfers there, claiming the interface of the endpoint on the
+                 new handle. Reattaching needs the hotplug registry of the session, see
+                 cyusb_hotplug_register(), for the device table to see the device return;
+                 without it a lost device ends the stream as before. An attempt that fails
+                 is retried after a wait that doubles from 1 ms to 1 s. The callback sees
+                 every failed and cancelled transfer as before, and cyusb_stream_submit()
+                 waits while the stream recovers. Recoveries and the time they took are counted in the
+                 performance counters of the endpoint, see cyusb_stats_snapshot().
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+                 unsigned int flags   : CYUSB_RECOVER_xxx flags, or 0 for none.
+  Return Value : 0 on success, or -EINVAL for an unknown flag.
+ *******************************************************************************************/
+extern int cyusb_stream_set_recovery(cyusb_stream *stream, unsigned int flags);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_pending(cyusb_stream *stream);
+  Description  : This function returns the number of transfers of a stream in flight.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+  Return Value : Number of transfers in flight.
+ *******************************************************************************************/
+extern int cyusb_stream_pending(cyusb_stream *stream);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_stream_stop(cyusb_stream *stream);
+  Description  : This function cancels all transfers of a stream and waits until the
+                 callback has seen each of them, with status LIBUSB_TRANSFER_CANCELLED unless
+                 it finished first. No transfer is submitted until cyusb_stream_start() is
+                 called again, and a recovery under way is given up. From a callback, the
+                 transfers are cancelled without waiting.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_stream_stop(cyusb_stream *stream);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_stream_close(cyusb_stream *stream);
+  Description  : This function stops a stream, frees it and releases its use of the device
+                 handle. Must not be called from a callback. The transfers and buffers of the
+                 stream are kept with the handle and reused by the next stream opened with
+                 the same sizes, so that starting and stopping a stream allocates nothing.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open(), or NULL.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_stream_close(cyusb_stream *stream);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_open_ring(int index, unsigned char endpoint,
+                     unsigned int reqsize, unsigned int queuedepth, unsigned int ringsize,
+                     int policy, cyusb_stream **stream);
+  Description  : This function sets up a stream on an IN endpoint whose completed transfers
+                 are handed to a consumer thread, instead of a callback, so that the data can
+                 be processed on another core without holding up the event thread. The event
+                 thread puts each completed transfer in a lock-free single-producer/single-
+                 consumer ring, and keeps queuedepth transfers in flight with ringsize more
+                 that hold data until the consumer takes it with cyusb_stream_get() and gives
+                 it back with cyusb_stream_put(). When the consumer falls behind, the policy
+                 decides: CYUSB_RING_BLOCK keeps all data and submits fewer transfers until
+                 buffers come back, so the device is throttled; CYUSB_RING_DROP_OLDEST keeps
+                 the transfers running and reuses the oldest transfer in the ring once more
+                 than ringsize are waiting. The stream is started, stopped and closed as any
+                 other, and cyusb_stream_submit() must not be used on it. Buffers held by the
+                 consumer are invalid after cyusb_stream_close().
+  Parameters   :
+                 int index               : Index of the device.
+                 unsigned char endpoint  : IN endpoint address, as in cyusb_getendpoint().
+                 unsigned int reqsize    : Transfer size in packets, as for cyusb_stream_open().
+                 unsigned int queuedepth : Number of transfers kept in flight.
+                 unsigned int ringsize   : Number of further transfers holding data for the
+                                           consumer, at least 1.
+                 int policy              : CYUSB_RING_BLOCK or CYUSB_RING_DROP_OLDEST.
+                 cyusb_stream **stream   : Returns the stream, or NULL on error.
+  Return Value : As for cyusb_stream_open(), and -EINVAL for an OUT endpoint.
+ *******************************************************************************************/
+extern int cyusb_stream_open_ring(int index, unsigned char endpoint, unsigned int reqsize,
+		unsigned int queuedepth, unsigned int ringsize, int policy, cyusb_stream **stream);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_get(cyusb_stream *stream, struct cyusb_xfer *xfer,
+                     int timeout);
+  Description  : This function takes the oldest completed transfer out of the ring of a
+                 stream, for a single consumer thread. The transfer belongs to the consumer
+                 until it is given back with cyusb_stream_put(). Failed and cancelled
+                 transfers are handed over as well, with their status.
+  Parameters   :
+                 cyusb_stream *stream   : Stream returned by cyusb_stream_open_ring().
+                 struct cyusb_xfer *xfer: Returns the transfer.
+                 int timeout            : Milliseconds to wait for a transfer when the ring
+                                          is empty, 0 not to wait, negative without limit.
+  Return Value : 0 on success, -EAGAIN or -ETIMEDOUT if no transfer completed in time,
+                 -ECANCELED if the ring is empty and the stream stopped, or -EINVAL if the
+                 stream is not in ring mode.
+ *******************************************************************************************/
+extern int cyusb_stream_get(cyusb_stream *stream, struct cyusb_xfer *xfer, int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_put(cyusb_stream *stream, const struct cyusb_xfer *xfer);
+  Description  : This function gives a transfer taken with cyusb_stream_get() back to its
+                 stream, which submits it again unless the stream is stopped.
+  Parameters   :
+                 cyusb_stream *stream         : Stream returned by cyusb_stream_open_ring().
+                 const struct cyusb_xfer *xfer: Transfer returned by cyusb_stream_get().
+  Return Value : 0 on success, or -EINVAL for a transfer of another stream.
+ *******************************************************************************************/
+extern int cyusb_stream_put(cyusb_stream *stream, const struct cyusb_xfer *xfer);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_ring_stats(cyusb_stream *stream, struct cyusb_ring_stats *stats);
+  Description  : This function gets the counters of a ring mode stream. Overruns count,
+                 under CYUSB_RING_BLOCK, completions after which fewer than queuedepth
+                 transfers could be kept in flight, and under CYUSB_RING_DROP_OLDEST,
+                 transfers whose data was dropped. Underruns count calls of cyusb_stream_get()
+                 that found the ring empty.
+  Parameters   :
+                 cyusb_stream *stream           : Stream returned by cyusb_stream_open_ring().
+                 struct cyusb_ring_stats *stats : Returns the counters.
+  Return Value : 0 on success, or -EINVAL if the stream is not in ring mode.
+ *******************************************************************************************/
+extern int cyusb_stream_ring_stats(cyusb_stream *stream, struct cyusb_ring_stats *stats);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_latency(cyusb_stream *stream, struct cyusb_latency *lat);
+  Description  : This function gets the latency of the transfers of a stream since it was
+                 opened: the time from each submission to the completion, as stamped with
+                 CLOCK_MONOTONIC in the submitted and completed fields of struct cyusb_xfer.
+                 It may be called from any thread while the stream runs. The tail, not the
+                 mean, tells how much buffering an endpoint needs to avoid overruns.
+  Parameters   :
+                 cyusb_stream *stream      : Stream returned by cyusb_stream_open().
+                 struct cyusb_latency *lat : Returns the count, mean and percentiles.
+  Return Value : 0 on success, or -EINVAL.
+ *******************************************************************************************/
+extern int cyusb_stream_latency(cyusb_stream *stream, struct cyusb_latency *lat);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stream_latency_dump(cyusb_stream *stream, FILE *f);
+  Description  : This function prints the latency histogram of a stream, one line per
+                 non-empty bucket with its largest value in microseconds, the share of
+                 transfers up to it and their count, followed by a summary line, in the
+                 manner of the HdrHistogram percentile distribution.
+  Parameters   :
+                 cyusb_stream *stream : Stream returned by cyusb_stream_open().
+                 FILE *f              : File to print to.
+  Return Value : 0 on success, or -EINVAL.
+ *******************************************************************************************/
+extern int cyusb_stream_latency_dump(cyusb_stream *stream, FILE *f);
+
+/*******************************************************************************************
+  Prototype    : unsigned char *cyusb_buffer_get(libusb_device_handle *h, int length);
+  Description  : This function gets a transfer buffer of at least length bytes for a device
+                 handle. Buffers given back with cyusb_buffer_put() are kept by the library and
+                 handed out again, so repeated transfers do not allocate memory. The buffer is
+                 usbfs memory where the kernel supports it, as for streams. Buffers are freed
+                 when the handle is closed, and must not be used after that.
+  Parameters   :
+                 libusb_device_handle *h : Handle from cyusb_gethandle() or cyusb_acquire().
+                 int length              : Number of bytes needed.
+  Return Value : The buffer, or NULL if out of memory.
+ *******************************************************************************************/
+extern unsigned char *cyusb_buffer_get(libusb_device_handle *h, int length);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_buffer_put(libusb_device_handle *h, unsigned char *buf);
+  Description  : This function gives back a buffer obtained from cyusb_buffer_get().
+  Parameters   :
+                 libusb_device_handle *h : Handle the buffer was obtained for.
+                 unsigned char *buf      : The buffer.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_buffer_put(libusb_device_handle *h, unsigned char *buf);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_bulk_writev(int index, unsigned char endpoint,
+                     const struct iovec *iov, int iovcnt, size_t *transferred,
+                     unsigned int timeout);
+  Description  : This function writes a list of buffers to a bulk or interrupt OUT endpoint
+                 as one stream of data. The data is split into chunks of whole packets of up
+                 to 64 KB, of which up to 8 are in flight at a time, so that the endpoint is
+                 kept busy for the whole call. A chunk that lies inside one buffer is sent
+                 from it in place; one that spans buffers is gathered into a library buffer.
+                 The function returns when all data is sent, or after the first failed chunk.
+                 It may be called while the library event thread runs, but not from a
+                 callback on that thread.
+  Parameters   :
+                 int index              : Index of the device.
+                 unsigned char endpoint : Endpoint address.
+                 const struct iovec *iov: Buffers to send, in order.
+                 int iovcnt             : Number of buffers.
+                 size_t *transferred    : Returns the number of bytes sent, may be NULL.
+                 unsigned int timeout   : Timeout of each chunk in milliseconds, 0 for none.
+  Return Value : 0 on success, -EDEADLK from a callback, LIBUSB_ERROR_NOT_FOUND if the device
+                 has no such bulk or interrupt endpoint, the LIBUSB_ERROR of the first
+                 failed chunk, as libusb_bulk_transfer() would return it, or that of
+                 libusb_handle_events_completed() if events cannot be handled.
+ *******************************************************************************************/
+extern int cyusb_bulk_writev(int index, unsigned char endpoint, const struct iovec *iov, int iovcnt,
+		size_t *transferred, unsigned int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_bulk_readv(int index, unsigned char endpoint,
+                     const struct iovec *iov, int iovcnt, size_t *transferred,
+                     unsigned int timeout);
+  Description  : This function reads from a bulk or interrupt IN endpoint into a list of
+                 buffers, with chunks in flight as cyusb_bulk_writev() does. A short packet
+                 ends the read: chunks queued after it are cancelled, and whatever they
+                 received is dropped, so the device should send exactly the amount asked
+                 for, or end it with a short packet only at the end.
+  Parameters   :
+                 int index              : Index of the device.
+                 unsigned char endpoint : Endpoint address.
+                 const struct iovec *iov: Buffers to fill, in order.
+                 int iovcnt             : Number of buffers.
+                 size_t *transferred    : Returns the number of bytes read, may be NULL.
+                 unsigned int timeout   : Timeout of each chunk in milliseconds, 0 for none.
+  Return Value : As for cyusb_bulk_writev().
+ *******************************************************************************************/
+extern int cyusb_bulk_readv(int index, unsigned char endpoint, const struct iovec *iov, int iovcnt,
+		size_t *transferred, unsigned int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_bulk_write(int index, unsigned char endpoint,
+                     const unsigned char *data, size_t length, size_t *transferred,
+                     unsigned int timeout);
+                 int cyusb_bulk_read(int index, unsigned char endpoint, unsigned char *data,
+                     size_t length, size_t *transferred, unsigned int timeout);
+  Description  : These functions work like cyusb_bulk_writev() and cyusb_bulk_readv() on a
+                 single buffer of any size.
+ *******************************************************************************************/
+extern int cyusb_bulk_write(int index, unsigned char endpoint, const unsigned char *data, size_t length,
+		size_t *transferred, unsigned int timeout);
+extern int cyusb_bulk_read(int index, unsigned char endpoint, unsigned char *data, size_t length,
+		size_t *transferred, unsigned int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_autotune(int index, unsigned char endpoint, unsigned int *reqsize,
+                     unsigned int *queuedepth);
+  Description  : This function searches for the request size and queue depth, as passed to
+                 cyusb_stream_open(), that give the highest throughput on an endpoint. Each
+                 candidate is streamed for a short time and measured; from the starting point
+                 the search moves to a faster setting with twice or half the request size or
+                 queue depth, and stops when no such neighbour is more than a few percent
+                 faster. Both values are powers of two up to 512 when started from powers of
+                 two. The result is stored in the cache directory, keyed by VID, PID,
+                 endpoint, host controller and link speed, and a later search on the same
+                 key starts from it. The interface holding the endpoint must be claimed by
+                 the application, and the device must keep the endpoint busy. The search
+                 takes about a third of a second per candidate.
+  Parameters   :
+                 int index                : Index of the device.
+                 unsigned char endpoint   : Endpoint address, as in cyusb_getendpoint().
+                 unsigned int *reqsize    : Starting request size in packets if nothing is
+                                            stored, 0 for the default; returns the best one.
+                 unsigned int *queuedepth : Starting queue depth if nothing is stored, 0 for
+                                            the default; returns the best one.
+  Return Value : Throughput at the best setting in KBps, LIBUSB_ERROR_NOT_FOUND if the device
+                 has no such streaming endpoint, LIBUSB_ERROR_TIMEOUT if no data came at the
+                 starting setting, or its error. Nothing is stored on failure.
+ *******************************************************************************************/
+extern int cyusb_autotune(int index, unsigned char endpoint, unsigned int *reqsize,
+		unsigned int *queuedepth);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_autotune_lookup(int index, unsigned char endpoint,
+                     unsigned int *reqsize, unsigned int *queuedepth);
+  Description  : This function gets the settings stored for an endpoint by cyusb_autotune(),
+                 without measuring anything.
+  Parameters   :
+                 int index                : Index of the device.
+                 unsigned char endpoint   : Endpoint address.
+                 unsigned int *reqsize    : Returns the stored request size in packets.
+                 unsigned int *queuedepth : Returns the stored queue depth.
+  Return Value : 0 on success, -ENOENT if nothing is stored for the endpoint on this host
+                 controller and link speed, or LIBUSB_ERROR_NO_DEVICE for a bad index.
+ *******************************************************************************************/
+extern int cyusb_autotune_lookup(int index, unsigned char endpoint, unsigned int *reqsize,
+		unsigned int *queuedepth);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_control_transfer(int index, unsigned char bmRequestType,
+                     unsigned char bRequest, unsigned short wValue, unsigned short wIndex,
+                     unsigned char *data, unsigned short wLength, unsigned int timeout);
+  Description  : This function performs a control transfer on the device with specified
+                 index, as libusb_control_transfer() does on its handle, and counts it and the
+                 time it took on endpoint 0 of the device, see cyusb_stats_snapshot().
+  Parameters   :
+                 int index                   : Index of the device.
+                 unsigned char bmRequestType : Request type, with the direction bit.
+                 unsigned char bRequest      : Request.
+                 unsigned short wValue       : Value field of the setup packet.
+                 unsigned short wIndex       : Index field of the setup packet.
+                 unsigned char *data         : Data to send or buffer to receive into.
+                 unsigned short wLength      : Length of the data.
+                 unsigned int timeout        : Timeout in milliseconds, 0 for none.
+  Return Value : The number of bytes transferred, or a LIBUSB_ERROR, as
+                 libusb_control_transfer() returns them.
+ *******************************************************************************************/
+extern int cyusb_control_transfer(int index, unsigned char bmRequestType, unsigned char bRequest,
+		unsigned short wValue, unsigned short wIndex, unsigned char *data, unsigned short wLength,
+		unsigned int timeout);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stats_snapshot(struct cyusb_stats **stats);
+  Description  : This function gets the performance counters of every device the session
+                 has seen, and of every endpoint used on it: the transfers of streams and
+                 of cyusb_bulk_readv() and cyusb_bulk_writev() submitted, and finished by
+                 status, bytes transferred, calls of and time in stream callbacks, stream
+                 transfers that could not be submitted again, and the control transfers of
+                 cyusb_control_transfer() with the time they took. Counters start when a
+                 device is first seen and are kept, by bus/port path, while it is
+                 disconnected. Counting takes no lock, and threads count on separate cache
+                 lines, so the counters are always on; this function may be called at any
+                 time from any thread, and rates come from the difference of two snapshots.
+                 Each device also counts the times it was added to the device table and
+                 the time that took, and the firmware downloads done on it.
+                 If the directory CYUSB_STATS_DIR exists, the counters are kept in a file
+                 there, which other processes read with cyusb_stats_load().
+  Parameters   :
+                 struct cyusb_stats **stats : Returns the counters, to be freed with
+                                              cyusb_stats_free().
+  Return Value : 0 on success, or -ENOMEM.
+ *******************************************************************************************/
+extern int cyusb_stats_snapshot(struct cyusb_stats **stats);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stats_load(const char *file, struct cyusb_stats **stats);
+  Description  : This function gets the performance counters that a session, of this or
+                 another process, keeps in a file of CYUSB_STATS_DIR, as
+                 cyusb_stats_snapshot() returns them in that session. The file is left
+                 behind when the session is closed or its process ends, with its final
+                 counters, and may then be removed by the caller.
+  Parameters   :
+                 const char *file           : Path of the file.
+                 struct cyusb_stats **stats : Returns the counters, to be freed with
+                                              cyusb_stats_free().
+  Return Value : 0 if the session is still open, 1 if it has ended, or a negative errno:
+                 -EINVAL for a file that does not hold counters.
+ *******************************************************************************************/
+extern int cyusb_stats_load(const char *file, struct cyusb_stats **stats);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_stats_free(struct cyusb_stats *stats);
+  Description  : This function frees counters returned by cyusb_stats_snapshot().
+  Parameters   :
+                 struct cyusb_stats *stats : The counters, may be NULL.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_stats_free(struct cyusb_stats *stats);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_stats_endpoint(int index, unsigned char endpoint,
+                     struct cyusb_ep_stats *stats);
+  Description  : This function gets the performance counters of one endpoint of the device
+                 with specified index, as cyusb_stats_snapshot() does for all of them.
+  Parameters   :
+                 int index                    : Index of the device.
+                 unsigned char endpoint       : Endpoint address, 0 for control transfers.
+                 struct cyusb_ep_stats *stats : Returns the counters, all 0 for an endpoint
+                                                not used yet.
+  Return Value : 0 on success, or LIBUSB_ERROR_NO_DEVICE for a bad index.
+ *******************************************************************************************/
+extern int cyusb_stats_endpoint(int index, unsigned char endpoint, struct cyusb_ep_stats *stats);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open(cyusb_context **ctx, const char *config);
+  Description  : This function creates an independent library session. The context owns its
+                 own libusb context, device table, device list and descriptor cache, so that
+                 one process can run several sessions, for example one per device group or
+                 per thread, without sharing any state. The functions without a context
+                 argument work on a default context, which runs on the default libusb
+                 context and is replaced by every call to cyusb_open().
+  Parameters   :
+                 cyusb_context **ctx : Returns the new context, or NULL on error.
+                 const char *config  : Configuration file listing the devices of interest,
+                                       or NULL for the same search as cyusb_open(void).
+  Return Value : Returns the number of devices of interest detected, or a negative error.
+ *******************************************************************************************/
+extern int cyusb_open(cyusb_context **ctx, const char *config);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open(cyusb_context **ctx, unsigned short vid, unsigned short pid);
+  Description  : This function creates an independent library session holding just the
+                 device with the given Vendor ID and Product ID.
+  Parameters   :
+                 cyusb_context **ctx : Returns the new context, or NULL on error.
+                 unsigned short vid  : Vendor ID
+                 unsigned short pid  : Product ID
+  Return Value : Returns 1 if the device was found, or a negative error.
+ *******************************************************************************************/
+extern int cyusb_open(cyusb_context **ctx, unsigned short vid, unsigned short pid);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open_device(cyusb_context **ctx, const char *config,
+                     const char *device);
+  Description  : This function creates an independent library session holding the device
+                 with the given device node or serial number, as cyusb_open_device(device).
+  Parameters   :
+                 cyusb_context **ctx : Returns the new context, or NULL on error.
+                 const char *config  : Configuration file, or NULL as for cyusb_open().
+                 const char *device  : Device node or serial number.
+  Return Value : Returns the index of the device, or a negative error.
+ *******************************************************************************************/
+extern int cyusb_open_device(cyusb_context **ctx, const char *config, const char *device);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open_shards(cyusb_context **shards, int nshards, const char *config);
+  Description  : This function creates nshards independent sessions that split the devices
+                 of interest between them, so that the completions of many devices are
+                 handled by several event threads instead of one. Each shard has its own
+                 libusb context, so there is no event lock shared between shards, and its
+                 event thread is pinned to a CPU of its own, taken in turn from the CPUs the
+                 process may run on. Each device goes to the shard chosen by a hash of its
+                 bus/port path, both at open and when it arrives later. Each shard is used
+                 and closed like a context from cyusb_open().
+  Parameters   :
+                 cyusb_context **shards : Array of nshards entries, returns the contexts.
+                 int nshards            : Number of shards.
+                 const char *config     : Configuration file, or NULL as for cyusb_open().
+  Return Value : Returns the number of devices of interest in all shards, or a negative
+                 error, in which case no shard is left open.
+ *******************************************************************************************/
+extern int cyusb_open_shards(cyusb_context **shards, int nshards, const char *config);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_set_event_cpu(cyusb_context *ctx, int cpu);
+  Description  : This function pins the event thread of a session to one CPU, or lets it
+                 run on any CPU again. It takes effect at once if the thread is running, and
+                 otherwise when it is next started.
+  Parameters   :
+                 cyusb_context *ctx : Context returned by cyusb_open() or cyusb_open_shards().
+                 int cpu            : CPU number, or -1 for any CPU.
+  Return Value : 0 on success, or a negative errno.
+ *******************************************************************************************/
+extern int cyusb_set_event_cpu(cyusb_context *ctx, int cpu);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_close(cyusb_context *ctx);
+  Description  : This function closes all handles of a context, releases its libusb context
+                 and frees it.
+  Parameters   :
+                 cyusb_context *ctx : Context returned by cyusb_open().
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_close(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : libusb_context * cyusb_getlibusb(cyusb_context *ctx);
+  Description  : This function returns the libusb context a session runs on. Asynchronous
+                 transfers on its device handles complete from libusb_handle_events() called
+                 on this context.
+  Parameters   :
+                 cyusb_context *ctx : Context returned by cyusb_open().
+  Return Value : Returns the libusb context.
+ *******************************************************************************************/
+extern libusb_context * cyusb_getlibusb(cyusb_context *ctx);
+
+/*******************************************************************************************
+  The following functions work like the functions of the same name described above, on the
+  given context instead of the default one. A NULL context behaves like an empty one.
+ *******************************************************************************************/
+extern libusb_device_handle * cyusb_gethandle(cyusb_context *ctx, int index);
+extern int cyusb_acquire(cyusb_context *ctx, int index, libusb_device_handle **handle);
+extern void cyusb_release(cyusb_context *ctx, libusb_device_handle *handle);
+extern int cyusb_getcount(cyusb_context *ctx);
+extern struct cydev * cyusb_getdevice(cyusb_context *ctx, int index);
+extern const char * cyusb_getpath(cyusb_context *ctx, int index);
+extern const char * cyusb_getserial(cyusb_context *ctx, int index);
+extern const char * cyusb_getdesc(cyusb_context *ctx, int index);
+extern int cyusb_getinfo(cyusb_context *ctx, int index, struct cyusb_devinfo *info);
+extern const struct cyusb_descriptors * cyusb_getdescriptors(cyusb_context *ctx, int index);
+extern const struct cyusb_endpoint * cyusb_getendpoint(cyusb_context *ctx, int index, unsigned char address);
+extern int cyusb_find_by_path(cyusb_context *ctx, const char *path);
+extern int cyusb_find_by_vidpid(cyusb_context *ctx, unsigned short vid, unsigned short pid);
+extern int cyusb_find_next_vidpid(cyusb_context *ctx, int index);
+extern int cyusb_find_by_serial(cyusb_context *ctx, const char *serial);
+extern int cyusb_hotplug_register(cyusb_context *ctx, cyusb_hotplug_cb cb, void *user);
+extern void cyusb_hotplug_deregister(cyusb_context *ctx);
+extern int cyusb_watch_config(cyusb_context *ctx);
+extern void cyusb_unwatch_config(cyusb_context *ctx);
+extern int cyusb_prepare(cyusb_context *ctx, int nthreads, int interface, cyusb_ready_cb cb, void *user);
+extern int cyusb_start_events(cyusb_context *ctx);
+extern void cyusb_stop_events(cyusb_context *ctx);
+extern int cyusb_event_fd_open(cyusb_context *ctx);
+extern int cyusb_event_fd_close(cyusb_context *ctx);
+extern int cyusb_handle_events(cyusb_context *ctx);
+extern int cyusb_event_timeout(cyusb_context *ctx);
+extern int cyusb_epoll_add(cyusb_context *ctx, int epfd, void *tag);
+extern int cyusb_epoll_del(cyusb_context *ctx, int epfd);
+extern int cyusb_stream_open(cyusb_context *ctx, int index, unsigned char endpoint, unsigned int reqsize,
+		unsigned int queuedepth, cyusb_xfer_cb cb, void *user, cyusb_stream **stream);
+extern int cyusb_stream_open_ring(cyusb_context *ctx, int index, unsigned char endpoint, unsigned int reqsize,
+		unsigned int queuedepth, unsigned int ringsize, int policy, cyusb_stream **stream);
+extern int cyusb_bulk_writev(cyusb_context *ctx, int index, unsigned char endpoint, const struct iovec *iov,
+		int iovcnt, size_t *transferred, unsigned int timeout);
+extern int cyusb_bulk_readv(cyusb_context *ctx, int index, unsigned char endpoint, const struct iovec *iov,
+		int iovcnt, size_t *transferred, unsigned int timeout);
+extern int cyusb_bulk_write(cyusb_context *ctx, int index, unsigned char endpoint, const unsigned char *data,
+		size_t length, size_t *transferred, unsigned int timeout);
+extern int cyusb_bulk_read(cyusb_context *ctx, int index, unsigned char endpoint, unsigned char *data,
+		size_t length, size_t *transferred, unsigned int timeout);
+extern int cyusb_autotune(cyusb_context *ctx, int index, unsigned char endpoint, unsigned int *reqsize,
+		unsigned int *queuedepth);
+extern int cyusb_autotune_lookup(cyusb_context *ctx, int index, unsigned char endpoint, unsigned int *reqsize,
+		unsigned int *queuedepth);
+extern int cyusb_control_transfer(cyusb_context *ctx, int index, unsigned char bmRequestType, unsigned char bRequest,
+		unsigned short wValue, unsigned short wIndex, unsigned char *data, unsigned short wLength,
+		unsigned int timeout);
+extern int cyusb_stats_snapshot(cyusb_context *ctx, struct cyusb_stats **stats);
+extern int cyusb_stats_endpoint(cyusb_context *ctx, int index, unsigned char endpoint, struct cyusb_ep_stats *stats);
+
 /****************************************************************************************
   Prototype    : void cyusb_download_fx2(libusb_device_handle *h, char *filename,
                      unsigned char vendor_command);
@@ -0,0 +1,406 @@
+#ifndef __CYUSB_CORO_H
+#define __CYUSB_CORO_H
+
+/*********************************************************************************\
+ * Coroutine interface of the cyusb suite for Linux, called cyusb_coro.h          *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * Transfers that can be awaited from C++20 coroutines, for example:              *
+ *                                                                                *
+ *     cyusb::task<int> load (cyusb::device &dev)                                 *
+ *     {                                                                          *
+ *         unsigned char id[8];                                                   *
+ *         cyusb::result r = co_await dev.control (0xC0, 0xB0, 0, 0, id, 8);      *
+ *         if (r.status == 0)                                                     *
+ *             r = co_await dev.bulk_write (0x01, data, len);                     *
+ *         co_return r.status;                                                    *
+ *     }                                                                          *
+ *                                                                                *
+ * A coroutine suspends on every transfer and is resumed by the library event    *
+ * thread when the transfer completes, so any number of transfers on any number   *
+ * of devices of a session are in flight without a thread each. Code between two  *
+ * transfers runs on the event thread and must not block. Needs -std=c++20.       *
+ \********************************************************************************/
+
+#if !defined(__cpp_impl_coroutine)
+#error "cyusb_coro.h needs a compiler with coroutine support, such as g++ -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyusb.h"
+
+namespace cyusb {
+
+/* Outcome of a transfer: status is 0, or the LIBUSB_ERROR the synchronous libusb call would
+   have returned; actual is the number of data bytes transferred. */
+struct result {
+	int	status;
+	int	actual;
+};
+
+template <typename T = void> class task;
+
+namespace detail {
+
+/* error_of:
+   Map the status of a finished transfer to the return value of the synchronous call.
+ */
+inline int
+error_of (
+		enum libusb_transfer_status status)
+{
+	switch ( status ) {
+		case LIBUSB_TRANSFER_COMPLETED:	return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT:	return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:	return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:	return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+		default:			return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Promise state shared by all tasks: the coroutine to resume when the task is done. */
+struct promise_base {
+	std::coroutine_handle<>	continuation = std::noop_coroutine();
+	std::exception_ptr	error;
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise().continuation;
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	T	value{};
+
+	task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+	T take() { if ( error ) std::rethrow_exception(error); return std::move(value); }
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object();
+	void return_void() {}
+	void take() { if ( error ) std::rethrow_exception(error); }
+};
+
+/* Coroutine that starts at once and frees itself when done, used to run a task from code
+   that is not a coroutine. */
+struct detached {
+	struct promise_type {
+		detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* Signalled by a task run from sync_wait(). */
+struct latch {
+	std::mutex		lock;
+	std::condition_variable	cond;
+	bool			done = false;
+
+	void set() { std::lock_guard<std::mutex> g(lock); done = true; cond.notify_all(); }
+	void wait() { std::unique_lock<std::mutex> g(lock); cond.wait(g, [this] { return done; }); }
+};
+
+} /* namespace detail */
+
+/*
+   class task
+   Return type of a coroutine that produces a T. A task starts when it is awaited, and
+   resumes its awaiter when it finishes.
+ */
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) : h(h) {}
+	task(task &&other) noexcept : h(std::exchange(other.h, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() { if ( h ) h.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		h.promise().continuation = awaiter;
+		return h;
+	}
+	T await_resume() { return h.promise().take(); }
+
+private:
+	std::coroutine_handle<promise_type>	h;
+};
+
+template <typename T>
+inline task<T>
+detail::promise<T>::get_return_object ()
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void>
+detail::promise<void>::get_return_object ()
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+namespace detail {
+
+template <typename T>
+detached
+run_and_set (
+		task<T> &t,
+		T &out,
+		latch &l)
+{
+	out = co_await t;
+	l.set();
+}
+
+inline detached
+run_and_set (
+		task<void> &t,
+		latch &l)
+{
+	co_await t;
+	l.set();
+}
+
+template <typename T>
+detached
+run_detached (
+		task<T> t)
+{
+	co_await t;
+}
+
+} /* namespace detail */
+
+/* sync_wait:
+   Run a task and block the calling thread until it has finished. Must not be called on the
+   event thread.
+ */
+template <typename T>
+T
+sync_wait (
+		task<T> t)
+{
+	detail::latch l;
+	T out{};
+
+	detail::run_and_set(t, out, l);
+	l.wait();
+	return out;
+}
+
+inline void
+sync_wait (
+		task<void> t)
+{
+	detail::latch l;
+
+	detail::run_and_set(t, l);
+	l.wait();
+}
+
+/* spawn:
+   Start a task without waiting for it. The task is freed when it finishes.
+ */
+template <typename T>
+void
+spawn (
+		task<T> t)
+{
+	detail::run_detached(std::move(t));
+}
+
+/*
+   class transfer_op
+   Awaitable for one libusb transfer, which it owns. The coroutine that awaits it is resumed
+   on the event thread when the transfer completes; the result of co_await is a result.
+ */
+class transfer_op {
+public:
+	transfer_op(struct libusb_transfer *t, unsigned char *in = nullptr) : t(t), in(in), r{0, 0}
+	{
+		if ( !t )
+			r.status = LIBUSB_ERROR_NO_MEM;
+	}
+	transfer_op(const transfer_op &) = delete;
+	transfer_op &operator=(const transfer_op &) = delete;
+	~transfer_op()
+	{
+		if ( !t )
+			return;
+		if ( t->type == LIBUSB_TRANSFER_TYPE_CONTROL )
+			free(t->buffer);
+		libusb_free_transfer(t);
+	}
+
+	bool await_ready() const noexcept { return t == nullptr; }
+
+	/* The transfer may complete, and the coroutine resume on the event thread, before
+	   libusb_submit_transfer() returns: nothing is touched after a successful submit. */
+	bool await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		int e;
+
+		h = awaiter;
+		t->callback  = done;
+		t->user_data = this;
+		e = libusb_submit_transfer(t);
+		if ( e == 0 )
+			return true;
+		r.status = e;
+		return false;
+	}
+
+	result await_resume() noexcept
+	{
+		if ( !t || (r.status != 0) )
+			return r;
+
+		r.status = detail::error_of(t->status);
+		r.actual = t->actual_length;
+		if ( in && (r.actual > 0) ) {
+			if ( r.actual > t->length - LIBUSB_CONTROL_SETUP_SIZE )
+				r.actual = t->length - LIBUSB_CONTROL_SETUP_SIZE;
+			memcpy(in, libusb_control_transfer_get_data(t), r.actual);
+		}
+		return r;
+	}
+
+private:
+	static void LIBUSB_CALL done(struct libusb_transfer *t)
+	{
+		((transfer_op *)t->user_data)->h.resume();
+	}
+
+	struct libusb_transfer	*t;
+	unsigned char		*in;			/* Where the data of a control read goes. */
+	result			r;
+	std::coroutine_handle<>	h;
+};
+
+/*
+   class device
+   A device of a session, opened for coroutine transfers. It holds a use of the device
+   handle and of the event thread for as long as it exists. A timeout of 0 means no timeout,
+   as in libusb.
+ */
+class device {
+public:
+	/* Open the device with specified index of a session, or of the default session. */
+	device(cyusb_context *ctx, int index) : ctx(ctx), legacy(false) { open(index); }
+	explicit device(int index) : ctx(nullptr), legacy(true) { open(index); }
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+	~device()
+	{
+		if ( !h )
+			return;
+		if ( legacy ) {
+			cyusb_stop_events();
+			cyusb_release(h);
+		}
+		else {
+			cyusb_stop_events(ctx);
+			cyusb_release(ctx, h);
+		}
+	}
+
+	/* 0 if the device is usable, else the error from opening it. */
+	int error() const { return err; }
+	libusb_device_handle *handle() const { return h; }
+
+	transfer_op bulk_read(unsigned char ep, unsigned char *buf, int len, unsigned int timeout = 0)
+	{
+		struct libusb_transfer *t = libusb_alloc_transfer(0);
+
+		if ( t )
+			libusb_fill_bulk_transfer(t, h, ep | LIBUSB_ENDPOINT_IN, buf, len, nullptr, nullptr, timeout);
+		return transfer_op(t);
+	}
+
+	transfer_op bulk_write(unsigned char ep, const unsigned char *buf, int len, unsigned int timeout = 0)
+	{
+		struct libusb_transfer *t = libusb_alloc_transfer(0);
+
+		if ( t )
+			libusb_fill_bulk_transfer(t, h, ep & ~LIBUSB_ENDPOINT_IN, (unsigned char *)buf, len,
+					nullptr, nullptr, timeout);
+		return transfer_op(t);
+	}
+
+	/* Control transfer with the arguments of libusb_control_transfer(). For a read, the data
+	   is copied into data when the transfer completes. */
+	transfer_op control(unsigned char bmRequestType, unsigned char bRequest, unsigned short wValue,
+			unsigned short wIndex, unsigned char *data, unsigned short wLength, unsigned int timeout = 0)
+	{
+		struct libusb_transfer *t = libusb_alloc_transfer(0);
+		unsigned char *buf = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+
+		if ( !t || !buf ) {
+			libusb_free_transfer(t);
+			free(buf);
+			return transfer_op(nullptr);
+		}
+
+		libusb_fill_control_setup(buf, bmRequestType, bRequest, wValue, wIndex, wLength);
+		if ( !(bmRequestType & LIBUSB_ENDPOINT_IN) && wLength )
+			memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+		libusb_fill_control_transfer(t, h, buf, nullptr, nullptr, timeout);
+		return transfer_op(t, (bmRequestType & LIBUSB_ENDPOINT_IN) ? data : nullptr);
+	}
+
+private:
+	void open(int index)
+	{
+		h   = nullptr;
+		err = legacy ? cyusb_acquire(index, &h) : cyusb_acquire(ctx, index, &h);
+		if ( err != 0 )
+			return;
+
+		err = legacy ? cyusb_start_events() : cyusb_start_events(ctx);
+		if ( err != 0 ) {
+			if ( legacy )
+				cyusb_release(h);
+			else
+				cyusb_release(ctx, h);
+			h = nullptr;
+		}
+	}
+
+	cyusb_context		*ctx;
+	bool			legacy;			/* Opened on the default session. */
+	libusb_device_handle	*h;
+	int			err;
+};
+
+} /* namespace cyusb */
+
+#endif /* __CYUSB_CORO_H */
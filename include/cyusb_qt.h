@@ -0,0 +1,102 @@
+#ifndef __CYUSB_QT_H
+#define __CYUSB_QT_H
+
+/*********************************************************************************\
+ * Qt event loop integration of the cyusb suite for Linux, called cyusb_qt.h      *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * Handles the libusb events of a session from the Qt event loop, for example:    *
+ *                                                                                *
+ *     cyusb_open ();                                                             *
+ *     new cyusb::EventNotifier (&app);                                           *
+ *     return app.exec ();                                                        *
+ *                                                                                *
+ * The library event thread is stopped while the notifier exists, and stream,     *
+ * transfer and hotplug callbacks run on the thread of the notifier, so they may  *
+ * update widgets directly. They must not block. The notifier must be deleted     *
+ * before the session is closed. Needs Qt 5 or later.                             *
+ \********************************************************************************/
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include "cyusb.h"
+
+namespace cyusb {
+
+class EventNotifier : public QObject {
+public:
+	/* Handle the events of the given session, or of the default one without a context. */
+	explicit EventNotifier(cyusb_context *ctx, QObject *parent = nullptr)
+		: QObject(parent), ctx(ctx), notifier(nullptr), timer(nullptr)
+	{
+		start(cyusb_event_fd_open(ctx));
+	}
+
+	explicit EventNotifier(QObject *parent = nullptr)
+		: QObject(parent), ctx(nullptr), notifier(nullptr), timer(nullptr)
+	{
+		start(cyusb_event_fd_open());
+	}
+
+	~EventNotifier()
+	{
+		if ( !notifier )
+			return;
+		delete notifier;
+		if ( ctx )
+			cyusb_event_fd_close(ctx);
+		else
+			cyusb_event_fd_close();
+	}
+
+	/* Whether the events are handled here; if not, the library event thread handles them. */
+	bool isValid() const
+	{
+		return notifier != nullptr;
+	}
+
+private:
+	cyusb_context	*ctx;			/* Session, nullptr for the default one. */
+	QSocketNotifier	*notifier;		/* Watches the event fd of the session. */
+	QTimer		*timer;			/* Fires at the next timeout libusb cannot signal. */
+
+	void start(int fd)
+	{
+		if ( fd < 0 )
+			return;
+
+		timer = new QTimer(this);
+		timer->setSingleShot(true);
+		connect(timer, &QTimer::timeout, this, &EventNotifier::handle);
+
+		notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+		connect(notifier, &QSocketNotifier::activated, this, &EventNotifier::handle);
+		arm();
+	}
+
+	void handle()
+	{
+		if ( ctx )
+			cyusb_handle_events(ctx);
+		else
+			cyusb_handle_events();
+		arm();
+	}
+
+	void arm()
+	{
+		int t = ctx ? cyusb_event_timeout(ctx) : cyusb_event_timeout();
+
+		if ( t >= 0 )
+			timer->start(t);
+		else
+			timer->stop();
+	}
+};
+
+} /* namespace cyusb */
+
+#endif /* __CYUSB_QT_H */
@@ -0,0 +1,513 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_bulkv.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Synchronous bulk reads and writes of large or scattered buffers, split	*
+ * into packet-aligned chunks of which several are kept in flight.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "cyusb_context.h"
+#include "cyusb_slab.h"
+
+/* Number of chunks of a vectored transfer kept in flight. */
+#define BULKV_DEPTH				(8)
+
+/* Largest chunk of a vectored transfer in bytes, rounded down to whole packets. */
+#define BULKV_CHUNK				(65536)
+
+/* Milliseconds to wait for the chunks between retries when events cannot be handled. */
+#define BULKV_RETRY_MS				(100)
+
+/* One chunk in flight. */
+struct bulkv_chunk {
+	size_t			offset;				/* Offset of the chunk in the whole transfer. */
+	size_t			length;				/* Bytes requested. */
+	unsigned long		seq;				/* Position of the chunk in submission order. */
+	bool			bounced;			/* Data goes through the slab buffer. */
+	bool			done;				/* Completed, waiting to be accounted in order. */
+	enum libusb_transfer_status status;
+	int			actual;
+};
+
+/* State of one vectored call, kept in the slab that holds its transfers. The lock is held
+   by the callback, and by the caller while it submits the first chunks, which the event
+   thread may already complete. */
+struct bulkv {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;				/* Signalled when completed is set. */
+	const struct iovec	*iov;				/* Caller's buffers. */
+	int			iovcnt;
+	bool			in;				/* Direction of the endpoint. */
+	unsigned char		endpoint;			/* Endpoint address. */
+	struct stats_device	*stats;				/* Performance counters of the device, or NULL. */
+	size_t			total;				/* Bytes in all buffers. */
+	size_t			chunk;				/* Bytes per chunk, whole packets. */
+	size_t			next;				/* Offset of the next chunk to submit. */
+	int			cur_iov;			/* Buffer holding offset next. */
+	size_t			cur_off;			/* Offset of next in that buffer. */
+	unsigned long		seq_next;			/* Sequence number of the next submission. */
+	unsigned long		seq_done;			/* Sequence number of the next to account. */
+	int			inflight;			/* Chunks submitted and not yet completed. */
+	size_t			transferred;			/* Bytes accounted, in order. */
+	int			error;				/* First error, as a LIBUSB_ERROR, or 0. */
+	bool			stopping;			/* A short or failed chunk ends the call. */
+	int			completed;			/* Set when nothing is left in flight. */
+	struct xfer_slab	*slab;
+	struct bulkv_chunk	chunks[BULKV_DEPTH];
+};
+
+/* error_of:
+   Map the status of a failed chunk to the error the synchronous libusb call returns.
+ */
+static int
+error_of (
+		enum libusb_transfer_status status)
+{
+	switch ( status ) {
+		case LIBUSB_TRANSFER_TIMED_OUT:	return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:	return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:	return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+		case LIBUSB_TRANSFER_CANCELLED:	return LIBUSB_ERROR_INTERRUPTED;
+		default:			return LIBUSB_ERROR_IO;
+	}
+}
+
+/* copy_iov:
+   Copy length bytes between a flat buffer and the caller's buffers, starting at offset of
+   the whole transfer; to the buffers if scatter is set, else from them.
+ */
+static void
+copy_iov (
+		const struct iovec *iov,
+		int iovcnt,
+		size_t offset,
+		unsigned char *flat,
+		size_t length,
+		bool scatter)
+{
+	size_t n;
+	int i;
+
+	for ( i = 0; (i < iovcnt) && (offset >= iov[i].iov_len); ++i )
+		offset -= iov[i].iov_len;
+
+	for ( ; (i < iovcnt) && (length > 0); ++i, offset = 0 ) {
+		n = iov[i].iov_len - offset;
+		if ( n > length )
+			n = length;
+		if ( scatter )
+			memcpy((unsigned char *)iov[i].iov_base + offset, flat, n);
+		else
+			memcpy(flat, (unsigned char *)iov[i].iov_base + offset, n);
+		flat   += n;
+		length -= n;
+	}
+}
+
+/* submit_chunk:
+   Submit the next chunk on a free slot. A chunk inside one of the caller's buffers is
+   transferred in place; one that spans buffers goes through the slab buffer of the slot.
+ */
+static int
+submit_chunk (
+		struct bulkv *v,
+		int slot)
+{
+	struct bulkv_chunk *c = &v->chunks[slot];
+	struct slab_item *item = &v->slab->items[slot];
+	struct stats_counters *sc;
+	unsigned char *data;
+	int r;
+
+	/* Skip empty buffers, so that an in-place chunk starts inside its buffer. */
+	while ( (v->cur_iov < v->iovcnt) && (v->cur_off == v->iov[v->cur_iov].iov_len) ) {
+		++v->cur_iov;
+		v->cur_off = 0;
+	}
+
+	c->offset = v->next;
+	c->length = v->total - v->next;
+	if ( c->length > v->chunk )
+		c->length = v->chunk;
+	c->seq  = v->seq_next;
+	c->done = false;
+
+	if ( v->iov[v->cur_iov].iov_len - v->cur_off >= c->length ) {
+		c->bounced = false;
+		data = (unsigned char *)v->iov[v->cur_iov].iov_base + v->cur_off;
+		v->cur_off += c->length;
+	}
+	else {
+		c->bounced = true;
+		data = item->buffer;
+		if ( !v->in )
+			copy_iov(v->iov, v->iovcnt, c->offset, data, c->length, false);
+
+		/* Move the cursor past the chunk. */
+		size_t left = c->length;
+		while ( left > 0 ) {
+			size_t n = v->iov[v->cur_iov].iov_len - v->cur_off;
+			if ( n > left ) {
+				v->cur_off += left;
+				break;
+			}
+			left -= n;
+			++v->cur_iov;
+			v->cur_off = 0;
+		}
+	}
+
+	item->transfer->buffer = data;
+	item->transfer->length = c->length;
+	r = libusb_submit_transfer(item->transfer);
+	if ( r != 0 )
+		return r;
+	if ( (sc = stats_shard(v->stats, v->endpoint)) != NULL )
+		stats_add(&sc->submitted, 1);
+
+	v->next += c->length;
+	++v->seq_next;
+	++v->inflight;
+	return 0;
+}
+
+/* bulkv_callback:
+   Called by libusb when a chunk completes. Chunks are accounted in submission order; a
+   short or failed chunk stops the call and cancels the chunks after it.
+ */
+static void LIBUSB_CALL
+bulkv_callback (
+		struct libusb_transfer *t)
+{
+	struct slab_item *item = (struct slab_item *)t->user_data;
+	struct bulkv *v = (struct bulkv *)item->owner;
+	struct bulkv_chunk *c;
+	int slot = item - v->slab->items;
+	int i, r;
+
+	pthread_mutex_lock(&v->lock);
+	c = &v->chunks[slot];
+	c->done   = true;
+	c->status = t->status;
+	c->actual = t->actual_length;
+	--v->inflight;
+	stats_completed(stats_shard(v->stats, v->endpoint), c->status, c->actual);
+
+	/* Account every chunk that is complete and next in order, and reuse its slot. */
+	for ( ;; ) {
+		for ( i = 0; i < BULKV_DEPTH; ++i ) {
+			if ( v->chunks[i].done && (v->chunks[i].seq == v->seq_done) )
+				break;
+		}
+		if ( i == BULKV_DEPTH )
+			break;
+
+		c = &v->chunks[i];
+		c->done = false;
+		++v->seq_done;
+		if ( v->stopping )
+			continue;
+
+		if ( v->in && c->bounced && (c->actual > 0) )
+			copy_iov(v->iov, v->iovcnt, c->offset, v->slab->items[i].buffer, c->actual, true);
+		v->transferred += c->actual;
+
+		if ( (c->status != LIBUSB_TRANSFER_COMPLETED) || ((size_t)c->actual < c->length) ) {
+			if ( c->status != LIBUSB_TRANSFER_COMPLETED )
+				v->error = error_of(c->status);
+			v->stopping = true;
+			for ( r = 0; r < BULKV_DEPTH; ++r ) {
+				if ( (r != i) && (v->chunks[r].seq > c->seq) && (v->chunks[r].seq < v->seq_next) )
+					libusb_cancel_transfer(v->slab->items[r].transfer);
+			}
+			continue;
+		}
+
+		if ( v->next < v->total ) {
+			r = submit_chunk(v, i);
+			if ( r != 0 ) {
+				v->error    = r;
+				v->stopping = true;
+			}
+		}
+	}
+
+	if ( v->inflight == 0 ) {
+		__atomic_store_n(&v->completed, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+}
+
+/* bulkv:
+   Transfer the caller's buffers on a bulk or interrupt endpoint, as one synchronous call
+   with up to BULKV_DEPTH chunks in flight.
+ */
+static int
+bulkv (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		const struct iovec *iov,
+		int iovcnt,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	const struct cyusb_endpoint *ep;
+	pthread_condattr_t attr;
+	libusb_device_handle *h;
+	struct xfer_slab *slab;
+	struct bulkv *v;
+	unsigned int depth;
+	size_t total = 0, chunk;
+	struct timespec ts;
+	int i, r;
+
+	if ( transferred )
+		*transferred = 0;
+	if ( !ctx || (iovcnt < 0) || (!iov && iovcnt) )
+		return -EINVAL;
+
+	/* Completions are delivered by the event thread, which must not wait for them. */
+	if ( event_thread_current(ctx) )
+		return -EDEADLK;
+
+	for ( i = 0; i < iovcnt; ++i )
+		total += iov[i].iov_len;
+	if ( total == 0 )
+		return 0;
+
+	r = cyusb_acquire(ctx, index, &h);
+	if ( r != 0 )
+		return r;
+
+	ep = cyusb_getendpoint(ctx, index, endpoint);
+	if ( !ep || ((ep->type != LIBUSB_TRANSFER_TYPE_BULK) && (ep->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)) ) {
+		cyusb_release(ctx, h);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	chunk = (BULKV_CHUNK / ep->pktsize) * ep->pktsize;
+	if ( chunk == 0 )
+		chunk = ep->pktsize;
+	depth = (total + chunk - 1) / chunk;
+	if ( depth > BULKV_DEPTH )
+		depth = BULKV_DEPTH;
+
+	/* Always BULKV_DEPTH slots, so that calls of any size share one cached slab. */
+	slab = slab_take(h, 0, chunk, BULKV_DEPTH, sizeof(struct bulkv));
+	if ( !slab ) {
+		cyusb_release(ctx, h);
+		return -ENOMEM;
+	}
+
+	v = (struct bulkv *)slab->priv;
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&v->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	v->iov      = iov;
+	v->iovcnt   = iovcnt;
+	v->in       = (endpoint & LIBUSB_ENDPOINT_IN) != 0;
+	v->endpoint = endpoint;
+	v->stats    = stats_device_of(ctx, index);
+	v->total    = total;
+	v->chunk    = chunk;
+	v->slab     = slab;
+	for ( i = 0; i < BULKV_DEPTH; ++i ) {
+		slab->items[i].owner = v;
+		if ( ep->type == LIBUSB_TRANSFER_TYPE_INTERRUPT )
+			libusb_fill_interrupt_transfer(slab->items[i].transfer, h, endpoint, NULL, 0,
+					bulkv_callback, &slab->items[i], timeout);
+		else
+			libusb_fill_bulk_transfer(slab->items[i].transfer, h, endpoint, NULL, 0,
+					bulkv_callback, &slab->items[i], timeout);
+	}
+
+	pthread_mutex_lock(&v->lock);
+	for ( i = 0, r = 0; (i < (int)depth) && (r == 0); ++i )
+		r = submit_chunk(v, i);
+	if ( r != 0 ) {
+		v->error    = r;
+		v->stopping = true;
+		for ( i = 0; i < BULKV_DEPTH; ++i )
+			libusb_cancel_transfer(slab->items[i].transfer);
+	}
+	if ( v->inflight == 0 )
+		v->completed = 1;
+	pthread_mutex_unlock(&v->lock);
+
+	/* Events are handled here unless the event thread does; libusb lets one thread handle
+	   them and the others wait until their transfers are done. The chunks may point into the
+	   caller's buffers, so the call never returns while any is in flight: if events cannot
+	   be handled, the chunks are cancelled and the call waits for them, retrying the events
+	   in case no other thread handles them. */
+	while ( !__atomic_load_n(&v->completed, __ATOMIC_ACQUIRE) ) {
+		r = libusb_handle_events_completed(ctx->usb, &v->completed);
+		if ( (r < 0) && (r != LIBUSB_ERROR_INTERRUPTED) ) {
+			pthread_mutex_lock(&v->lock);
+			if ( !v->stopping ) {
+				v->error    = r;
+				v->stopping = true;
+				for ( i = 0; i < BULKV_DEPTH; ++i )
+					libusb_cancel_transfer(slab->items[i].transfer);
+			}
+			if ( !v->completed ) {
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				ts.tv_nsec += BULKV_RETRY_MS * 1000000L;
+				if ( ts.tv_nsec >= 1000000000L ) {
+					ts.tv_sec  += 1;
+					ts.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&v->cond, &v->lock, &ts);
+			}
+			pthread_mutex_unlock(&v->lock);
+		}
+	}
+
+	/* Wait for the callback that completed the call to let go of the lock. */
+	pthread_mutex_lock(&v->lock);
+	if ( transferred )
+		*transferred = v->transferred;
+	r = v->error;
+	pthread_mutex_unlock(&v->lock);
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->lock);
+
+	slab_give(slab);
+	cyusb_release(ctx, h);
+	return r;
+}
+
+/* cyusb_bulk_writev:
+   Write the caller's buffers to an OUT endpoint, keeping several chunks in flight.
+ */
+int
+cyusb_bulk_writev (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		const struct iovec *iov,
+		int iovcnt,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return bulkv(ctx, index, endpoint & ~LIBUSB_ENDPOINT_IN, iov, iovcnt, transferred, timeout);
+}
+
+int
+cyusb_bulk_writev (
+		int index,
+		unsigned char endpoint,
+		const struct iovec *iov,
+		int iovcnt,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return cyusb_bulk_writev(default_context(), index, endpoint, iov, iovcnt, transferred, timeout);
+}
+
+/* cyusb_bulk_readv:
+   Read from an IN endpoint into the caller's buffers, keeping several chunks in flight.
+ */
+int
+cyusb_bulk_readv (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		const struct iovec *iov,
+		int iovcnt,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return bulkv(ctx, index, endpoint | LIBUSB_ENDPOINT_IN, iov, iovcnt, transferred, timeout);
+}
+
+int
+cyusb_bulk_readv (
+		int index,
+		unsigned char endpoint,
+		const struct iovec *iov,
+		int iovcnt,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return cyusb_bulk_readv(default_context(), index, endpoint, iov, iovcnt, transferred, timeout);
+}
+
+/* cyusb_bulk_write:
+   Write one buffer to an OUT endpoint, keeping several chunks in flight.
+ */
+int
+cyusb_bulk_write (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		const unsigned char *data,
+		size_t length,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len  = length;
+	return cyusb_bulk_writev(ctx, index, endpoint, &iov, 1, transferred, timeout);
+}
+
+int
+cyusb_bulk_write (
+		int index,
+		unsigned char endpoint,
+		const unsigned char *data,
+		size_t length,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return cyusb_bulk_write(default_context(), index, endpoint, data, length, transferred, timeout);
+}
+
+/* cyusb_bulk_read:
+   Read from an IN endpoint into one buffer, keeping several chunks in flight.
+ */
+int
+cyusb_bulk_read (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned char *data,
+		size_t length,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len  = length;
+	return cyusb_bulk_readv(ctx, index, endpoint, &iov, 1, transferred, timeout);
+}
+
+int
+cyusb_bulk_read (
+		int index,
+		unsigned char endpoint,
+		unsigned char *data,
+		size_t length,
+		size_t *transferred,
+		unsigned int timeout)
+{
+	return cyusb_bulk_read(default_context(), index, endpoint, data, length, transferred, timeout);
+}
+
+/*[]*/
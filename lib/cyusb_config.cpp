@@ -0,0 +1,244 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_config.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Binary cache of parsed configuration files.					*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "cyusb_config.h"
+#include "cyusb_devtab.h"
+
+/* Identifies a configuration image, and its layout version. */
+#define CONFCACHE_MAGIC				(0x46435943)	/* "CYCF" */
+#define CONFCACHE_VERSION			(1)
+
+/* Header of a configuration image. It is followed by the entries, then the descriptions. */
+struct confcache_header {
+	unsigned int		magic;				/* CONFCACHE_MAGIC. */
+	unsigned int		version;			/* CONFCACHE_VERSION. */
+	unsigned long long	size;				/* Size of the text file. */
+	long long		mtime_sec;			/* Modification time of the text file. */
+	long long		mtime_nsec;
+	unsigned long long	ino;				/* Inode and device of the text file. */
+	unsigned long long	dev;
+	unsigned int		nvpd;				/* Number of entries. */
+	unsigned int		strsize;			/* Size of the description area. */
+	char			logfile[CONFCACHE_PATH_LEN];	/* LogFile setting. */
+	char			pidfile[CONFCACHE_PATH_LEN];	/* PIDFile setting. */
+};
+
+/* One entry of the <VPD> section. */
+struct confcache_vpd {
+	unsigned short		vid;
+	unsigned short		pid_lo;
+	unsigned short		pid_hi;
+	unsigned short		reserved;
+	unsigned int		desc;				/* Offset of the description. */
+};
+
+/* cache_dir:
+   Get the cache directory of the library, $XDG_CACHE_HOME/cyusb or ~/.cache/cyusb, creating
+   it if asked to. dir must hold PATH_MAX characters.
+ */
+int
+cache_dir (
+		char *dir,
+		bool create)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int n;
+
+	if ( base && base[0] )
+		n = snprintf(dir, PATH_MAX, "%s", base);
+	else if ( home )
+		n = snprintf(dir, PATH_MAX, "%s/.cache", home);
+	else
+		return -ENOENT;
+
+	if ( n + sizeof("/cyusb/") + 32 > PATH_MAX )
+		return -ENAMETOOLONG;
+
+	if ( create )
+		mkdir(dir, 0755);
+	strcat(dir, "/cyusb");
+	if ( create )
+		mkdir(dir, 0755);
+	return 0;
+}
+
+/* image_path:
+   Get the path of the image of a configuration file. Images are named after a hash of the
+   absolute path of the text file.
+ */
+static int
+image_path (
+		const char *conf,
+		char *path,
+		bool create)
+{
+	char abspath[PATH_MAX];
+	int r;
+
+	r = cache_dir(path, create);
+	if ( r )
+		return r;
+
+	if ( !realpath(conf, abspath) )
+		return -ENOENT;
+	sprintf(path + strlen(path), "/conf-%08x.bin", devtab_hash_string(abspath));
+	return 0;
+}
+
+/* confcache_load:
+   Load the image of a configuration file into an empty matcher, if there is one that matches
+   the text file as described by st. Returns 0 on success, else a negative error and the
+   text file must be parsed.
+ */
+int
+confcache_load (
+		const char *conf,
+		const struct stat *st,
+		struct cyusb_matcher *m,
+		char *logfile,
+		char *pidfile)
+{
+	char path[PATH_MAX];
+	const struct confcache_header *h;
+	const struct confcache_vpd *v;
+	const char *strings;
+	struct stat ist;
+	void *image;
+	unsigned int i;
+	size_t len;
+	int fd;
+	int r = -EINVAL;
+
+	if ( image_path(conf, path, false) )
+		return -ENOENT;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 )
+		return -ENOENT;
+	if ( (fstat(fd, &ist) != 0) || ((size_t)ist.st_size < sizeof(struct confcache_header)) ) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	len   = ist.st_size;
+	image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( image == MAP_FAILED )
+		return -ENOMEM;
+
+	h       = (const struct confcache_header *)image;
+	v       = (const struct confcache_vpd *)(h + 1);
+	strings = (const char *)(v + h->nvpd);
+
+	if ( (h->magic != CONFCACHE_MAGIC) || (h->version != CONFCACHE_VERSION) ||
+			(h->size != (unsigned long long)st->st_size) ||
+			(h->mtime_sec != (long long)st->st_mtim.tv_sec) ||
+			(h->mtime_nsec != (long long)st->st_mtim.tv_nsec) ||
+			(h->ino != (unsigned long long)st->st_ino) || (h->dev != (unsigned long long)st->st_dev) )
+		goto out;
+
+	/* A damaged image is rejected rather than trusted. */
+	if ( (h->nvpd > (len - sizeof(*h)) / sizeof(*v)) ||
+			(len != sizeof(*h) + h->nvpd * sizeof(*v) + h->strsize) ||
+			(h->strsize == 0) || (strings[h->strsize - 1] != '\0') ||
+			!memchr(h->logfile, '\0', CONFCACHE_PATH_LEN) || !memchr(h->pidfile, '\0', CONFCACHE_PATH_LEN) )
+		goto out;
+
+	for ( i = 0; i < h->nvpd; ++i ) {
+		if ( (v[i].desc >= h->strsize) || (v[i].pid_lo > v[i].pid_hi) )
+			goto out;
+		if ( matcher_add(m, v[i].vid, v[i].pid_lo, v[i].pid_hi, strings + v[i].desc) ) {
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
+	strcpy(logfile, h->logfile);
+	strcpy(pidfile, h->pidfile);
+	r = 0;
+
+out:
+	munmap(image, len);
+	if ( r )
+		matcher_free(m);
+	return r;
+}
+
+/* confcache_store:
+   Save the image of a configuration file that was just parsed. st describes the text file as
+   it was before parsing. The image is replaced atomically, so that concurrent readers never
+   see a partial one.
+ */
+void
+confcache_store (
+		const char *conf,
+		const struct stat *st,
+		const struct cyusb_matcher *m,
+		const char *logfile,
+		const char *pidfile)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 16];
+	struct confcache_header h;
+	struct confcache_vpd v;
+	FILE *fp;
+	int i;
+	bool ok = true;
+
+	if ( image_path(conf, path, true) )
+		return;
+
+	memset(&h, 0, sizeof(h));
+	h.magic      = CONFCACHE_MAGIC;
+	h.version    = CONFCACHE_VERSION;
+	h.size       = st->st_size;
+	h.mtime_sec  = st->st_mtim.tv_sec;
+	h.mtime_nsec = st->st_mtim.tv_nsec;
+	h.ino        = st->st_ino;
+	h.dev        = st->st_dev;
+	h.nvpd       = m->nvpd;
+	h.strsize    = 1;				/* Offset 0 is the empty string. */
+	for ( i = 0; i < m->nvpd; ++i )
+		h.strsize += strlen(m->vpd[i].desc) + 1;
+	strncpy(h.logfile, logfile, CONFCACHE_PATH_LEN - 1);
+	strncpy(h.pidfile, pidfile, CONFCACHE_PATH_LEN - 1);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "w");
+	if ( !fp )
+		return;
+
+	ok = (fwrite(&h, sizeof(h), 1, fp) == 1);
+	memset(&v, 0, sizeof(v));
+	v.desc = 1;
+	for ( i = 0; ok && (i < m->nvpd); ++i ) {
+		v.vid    = m->vpd[i].vid;
+		v.pid_lo = m->vpd[i].pid_lo;
+		v.pid_hi = m->vpd[i].pid_hi;
+		ok = (fwrite(&v, sizeof(v), 1, fp) == 1);
+		v.desc += strlen(m->vpd[i].desc) + 1;
+	}
+	ok = ok && (fputc('\0', fp) != EOF);
+	for ( i = 0; ok && (i < m->nvpd); ++i )
+		ok = (fwrite(m->vpd[i].desc, strlen(m->vpd[i].desc) + 1, 1, fp) == 1);
+
+	if ( (fclose(fp) != 0) || !ok || rename(tmp, path) )
+		unlink(tmp);
+}
+
+/*[]*/
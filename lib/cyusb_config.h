@@ -0,0 +1,28 @@
+#ifndef __CYUSB_CONFIG_H
+#define __CYUSB_CONFIG_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_config.h                     *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A parsed configuration file is saved as a binary image below ~/.cache/cyusb,   *
+ * tagged with the size, modification time and inode of the text file. While     *
+ * these still match, the image is mapped and its entries are added to the        *
+ * matcher directly, so the text is not parsed again.                             *
+ \********************************************************************************/
+
+#include <sys/stat.h>
+
+#include "cyusb_match.h"
+
+/* Length of the LogFile and PIDFile paths, including the terminating NULL. */
+#define CONFCACHE_PATH_LEN			(256)
+
+extern int  cache_dir(char *dir, bool create);
+extern int  confcache_load(const char *conf, const struct stat *st, struct cyusb_matcher *m,
+		char *logfile, char *pidfile);
+extern void confcache_store(const char *conf, const struct stat *st, const struct cyusb_matcher *m,
+		const char *logfile, const char *pidfile);
+
+#endif /* __CYUSB_CONFIG_H */
@@ -0,0 +1,80 @@
+#ifndef __CYUSB_CONTEXT_H
+#define __CYUSB_CONTEXT_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_context.h                    *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A cyusb_context holds all state of one library session: its libusb context,    *
+ * device table, compiled device list, descriptor cache, hotplug registry,        *
+ * configuration watch and event thread.                                          *
+ * The functions without a context argument use a default context, which runs    *
+ * on the default libusb context so that existing applications keep working.      *
+ * A context stays allocated after cyusb_close() while handles are acquired.      *
+ * The event thread runs while the hotplug registry or any stream needs it.       *
+ * A context may be one of several shards that split the devices of interest      *
+ * between them, each with its own libusb context and event thread.               *
+ * Instead of the event thread, the event loop of the application may handle      *
+ * the libusb events of a context, through a single pollable event fd.            *
+ * The performance counters of every device the context has seen are kept here.   *
+ \********************************************************************************/
+
+#include <pthread.h>
+
+#include "../include/cyusb.h"
+#include "cyusb_devtab.h"
+#include "cyusb_match.h"
+#include "cyusb_desc.h"
+#include "cyusb_snap.h"
+#include "cyusb_stats.h"
+
+struct cyusb_context {
+	libusb_context		*usb;				/* libusb context, NULL for the default one. */
+	struct cydev_table	devtab;				/* Table of devices of interest that are connected. */
+	pthread_mutex_t		devlock;			/* Serialises updates to the device table. */
+	struct cydev_snapshot	*snap;				/* Published snapshot of the table, for lookups. */
+	struct cydev_entry	*retired;			/* Removed devices whose handle is still acquired. */
+	int			refs;				/* References: one for the owner, one per acquire. */
+	bool			closed;				/* Set by cyusb_close(); no new acquires. */
+	struct cyusb_context	*next_closing;			/* List of closed contexts with acquired handles. */
+	struct cyusb_matcher	matcher;			/* Compiled database of devices of interest. */
+	struct desc_cache	desccache;			/* Descriptors of all devices seen, by path. */
+	char			*config;			/* Configuration file in use, NULL for none. */
+	int			shard;				/* Shard of the devices of interest held here. */
+	int			nshards;			/* Number of shards, 0 for all devices. */
+	struct stats_registry	stats;				/* Performance counters of the devices seen. */
+
+	/* Hotplug registry state. */
+	libusb_hotplug_callback_handle	hotplug_handle;		/* Handle of the libusb hotplug registration. */
+	bool			hotplug_active;			/* Whether the hotplug registry is running. */
+	cyusb_hotplug_cb	hotplug_notify;			/* Application change-notification callback. */
+	void			*hotplug_user;			/* User data passed to the notification callback. */
+
+	/* Event thread state. */
+	pthread_mutex_t		eventlock;			/* Serialises starting and stopping the event thread. */
+	int			event_users;			/* Hotplug registry and open streams. */
+	pthread_t		event_thread;			/* Thread that handles libusb events of the context. */
+	volatile int		event_thread_stop;		/* Request to stop the event thread. */
+	int			event_cpu;			/* CPU the event thread is pinned to, or -1. */
+	bool			event_external;			/* Events are handled by the application loop. */
+	int			event_fd;			/* epoll instance over the libusb pollfds, or -1. */
+
+	/* Configuration watch state. */
+	int			watch_fd;			/* inotify instance on the configuration directory. */
+	int			watch_pipe[2];			/* Wakes up the watch thread to stop it. */
+	pthread_t		watch_thread;			/* Thread that reloads the configuration. */
+	bool			watch_active;			/* Whether the configuration is being watched. */
+};
+
+extern struct cyusb_context *default_context(void);
+extern int event_thread_get(struct cyusb_context *ctx);
+extern void event_thread_put(struct cyusb_context *ctx);
+extern bool event_thread_current(struct cyusb_context *ctx);
+extern int event_set_external(struct cyusb_context *ctx, bool external);
+extern void event_fd_release(struct cyusb_context *ctx);
+extern int event_handle(struct cyusb_context *ctx, struct timeval *tv);
+extern void event_wait(struct cyusb_context *ctx, pthread_mutex_t *lock, pthread_cond_t *cond);
+extern struct stats_device *stats_device_of(struct cyusb_context *ctx, int index);
+
+#endif /* __CYUSB_CONTEXT_H */
@@ -0,0 +1,329 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_desc.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Descriptor cache of the cyusb library. Descriptors are read and walked once	*
+ * per device, and endpoint lookups by address are a table hit.			*
+ \*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyusb_desc.h"
+
+/* Initial number of hash buckets. Grows by doubling. */
+#define DESC_INITIAL_BUCKETS			(16)
+
+/* Length of a frame below high speed, and of a microframe from high speed on, in microseconds. */
+#define DESC_FRAME_US				(1000)
+#define DESC_MICROFRAME_US			(125)
+
+/* Most full-size bulk packets in a full speed frame and in a high speed microframe. */
+#define DESC_FS_BULK_PACKETS			(19)
+#define DESC_HS_BULK_PACKETS			(13)
+
+/* Bytes a SuperSpeed (5 Gbps, 8b/10b) and a SuperSpeedPlus (10 Gbps, 128b/132b) lane carries
+   in a microframe. */
+#define DESC_SS_MICROFRAME_BYTES		(62500)
+#define DESC_SSP_MICROFRAME_BYTES		(151515)
+
+/* fill_endpoint:
+   Compute the endpoint information for one endpoint descriptor.
+ */
+static void
+fill_endpoint (
+		struct cyusb_endpoint *ep,
+		const struct libusb_interface_descriptor *ifd,
+		const struct libusb_endpoint_descriptor *epd,
+		int speed)
+{
+	struct libusb_ss_endpoint_companion_descriptor *compd = NULL;
+	unsigned int frame = (speed >= LIBUSB_SPEED_HIGH) ? DESC_MICROFRAME_US : DESC_FRAME_US;
+	unsigned int periodbytes = 0;
+
+	ep->address    = epd->bEndpointAddress;
+	ep->type       = epd->bmAttributes & 0x03;
+	ep->interface  = ifd->bInterfaceNumber;
+	ep->altsetting = ifd->bAlternateSetting;
+	ep->maxpacket  = epd->wMaxPacketSize & 0x7FF;
+	ep->interval   = epd->bInterval;
+	ep->burst      = 1;
+	ep->mult       = 1;
+	ep->next       = -1;
+
+	if ( libusb_get_ss_endpoint_companion_descriptor(NULL, epd, &compd) == 0 ) {
+		/* SuperSpeed: bursts of packets, and for isochronous endpoints several bursts
+		   per service interval. */
+		ep->burst = compd->bMaxBurst + 1;
+		if ( ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+			ep->mult = (compd->bmAttributes & 0x03) + 1;
+		periodbytes = compd->wBytesPerInterval;
+		libusb_free_ss_endpoint_companion_descriptor(compd);
+	}
+	else if ( (ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ||
+			(ep->type == LIBUSB_TRANSFER_TYPE_INTERRUPT) ) {
+		/* High-bandwidth high speed endpoints: additional transactions per microframe. */
+		ep->mult = ((epd->wMaxPacketSize >> 11) & 0x03) + 1;
+	}
+
+	ep->pktsize = (unsigned int)ep->maxpacket * ep->burst * ep->mult;
+
+	switch ( ep->type ) {
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+			/* Full and low speed interrupt endpoints give the interval in frames, all
+			   others as an exponent of 2. */
+			if ( (ep->type == LIBUSB_TRANSFER_TYPE_INTERRUPT) && (speed < LIBUSB_SPEED_HIGH) )
+				ep->period = frame * (ep->interval ? ep->interval : 1);
+			else
+				ep->period = frame << ((ep->interval >= 1) && (ep->interval <= 16) ?
+						(ep->interval - 1) : 0);
+			if ( (periodbytes == 0) || (periodbytes > ep->pktsize) )
+				periodbytes = ep->pktsize;
+			break;
+
+		default:
+			/* Bulk and control: the most the bus carries in a (micro)frame. */
+			ep->period = frame;
+			if ( speed > LIBUSB_SPEED_SUPER )
+				periodbytes = DESC_SSP_MICROFRAME_BYTES;
+			else if ( speed == LIBUSB_SPEED_SUPER )
+				periodbytes = DESC_SS_MICROFRAME_BYTES;
+			else if ( speed == LIBUSB_SPEED_HIGH )
+				periodbytes = DESC_HS_BULK_PACKETS * ep->maxpacket;
+			else if ( speed == LIBUSB_SPEED_FULL )
+				periodbytes = DESC_FS_BULK_PACKETS * ep->maxpacket;
+			break;
+	}
+
+	ep->periodbytes = periodbytes;
+	ep->bandwidth   = (unsigned int)(((unsigned long long)periodbytes * 1000000) / ep->period);
+}
+
+/* build_endpoints:
+   Walk all interfaces and alternate settings of the configuration once, and build the
+   endpoint table and the index by address.
+ */
+static int
+build_endpoints (
+		struct cyusb_descriptors *d)
+{
+	const struct libusb_config_descriptor *cfg = d->config;
+	short tail[32];
+	int i, j, k, n = 0;
+
+	for ( i = 0; i < 32; ++i ) {
+		d->epmap[i] = -1;
+		tail[i]     = -1;
+	}
+
+	for ( i = 0; i < cfg->bNumInterfaces; ++i ) {
+		for ( j = 0; j < cfg->interface[i].num_altsetting; ++j )
+			n += cfg->interface[i].altsetting[j].bNumEndpoints;
+	}
+	if ( n == 0 )
+		return 0;
+
+	d->endpoints = (struct cyusb_endpoint *)calloc(n, sizeof(struct cyusb_endpoint));
+	if ( !d->endpoints )
+		return -1;
+
+	for ( i = 0; i < cfg->bNumInterfaces; ++i ) {
+		for ( j = 0; j < cfg->interface[i].num_altsetting; ++j ) {
+			const struct libusb_interface_descriptor *ifd = &cfg->interface[i].altsetting[j];
+
+			for ( k = 0; k < ifd->bNumEndpoints; ++k ) {
+				struct cyusb_endpoint *ep = &d->endpoints[d->nendpoints];
+				int slot;
+
+				fill_endpoint(ep, ifd, &ifd->endpoint[k], d->speed);
+				slot = CYUSB_EP_SLOT(ep->address);
+				if ( tail[slot] < 0 )
+					d->epmap[slot] = d->nendpoints;
+				else
+					d->endpoints[tail[slot]].next = d->nendpoints;
+				tail[slot] = d->nendpoints;
+				++d->nendpoints;
+			}
+		}
+	}
+	return 0;
+}
+
+/* free_node:
+   Free a cached set of descriptors.
+ */
+static void
+free_node (
+		struct desc_node *node)
+{
+	if ( node->d.config )
+		libusb_free_config_descriptor((struct libusb_config_descriptor *)node->d.config);
+	free(node->d.endpoints);
+	free(node);
+}
+
+/* read_node:
+   Read the descriptors of a device into a new node.
+ */
+static struct desc_node *
+read_node (
+		libusb_device *dev,
+		const struct libusb_device_descriptor *dd,
+		const char *path)
+{
+	struct libusb_config_descriptor *cfg = NULL;
+	struct desc_node *node;
+
+	node = (struct desc_node *)calloc(1, sizeof(struct desc_node));
+	if ( !node )
+		return NULL;
+
+	node->d.device = *dd;
+	node->d.speed  = libusb_get_device_speed(dev);
+	strcpy(node->path, path);
+
+	/* Neither call needs the device to be opened. An unconfigured device has no active
+	   configuration, so its first one is used. */
+	if ( libusb_get_active_config_descriptor(dev, &cfg) != 0 ) {
+		if ( libusb_get_config_descriptor(dev, 0, &cfg) != 0 ) {
+			free(node);
+			return NULL;
+		}
+	}
+	node->d.config = cfg;
+
+	if ( build_endpoints(&node->d) ) {
+		free_node(node);
+		return NULL;
+	}
+	return node;
+}
+
+/* grow:
+   Double the number of hash buckets.
+ */
+static int
+grow (
+		struct desc_cache *c)
+{
+	unsigned int nbuckets = c->nbuckets ? (c->nbuckets * 2) : DESC_INITIAL_BUCKETS;
+	struct desc_node **buckets;
+	struct desc_node *node, *next;
+	unsigned int i, b;
+
+	buckets = (struct desc_node **)calloc(nbuckets, sizeof(struct desc_node *));
+	if ( !buckets )
+		return -1;
+
+	for ( i = 0; i < c->nbuckets; ++i ) {
+		for ( node = c->buckets[i]; node; node = next ) {
+			next = node->next;
+			b = devtab_hash_string(node->path) & (nbuckets - 1);
+			node->next = buckets[b];
+			buckets[b] = node;
+		}
+	}
+
+	free(c->buckets);
+	c->buckets  = buckets;
+	c->nbuckets = nbuckets;
+	return 0;
+}
+
+/* desc_cache_init:
+   Initialize an empty descriptor cache.
+ */
+void
+desc_cache_init (
+		struct desc_cache *c)
+{
+	memset(c, 0, sizeof(struct desc_cache));
+}
+
+/* desc_cache_clear:
+   Free all cached descriptors and the cache storage.
+ */
+void
+desc_cache_clear (
+		struct desc_cache *c)
+{
+	struct desc_node *node, *next;
+	unsigned int i;
+
+	for ( i = 0; i < c->nbuckets; ++i ) {
+		for ( node = c->buckets[i]; node; node = next ) {
+			next = node->next;
+			free_node(node);
+		}
+	}
+	free(c->buckets);
+	desc_cache_init(c);
+}
+
+/* desc_cache_get:
+   Get the descriptors of a device, reading them only if the cache has none for this path and
+   firmware. The VID/PID are compared as well, since a firmware download may change them
+   without changing bcdDevice, and so is the link speed, on which the endpoint bandwidth
+   depends. Returns NULL if the descriptors cannot be read.
+ */
+const struct cyusb_descriptors *
+desc_cache_get (
+		struct desc_cache *c,
+		libusb_device *dev,
+		const char *path)
+{
+	struct libusb_device_descriptor dd;
+	struct desc_node *node;
+	unsigned int h, b;
+
+	if ( libusb_get_device_descriptor(dev, &dd) != 0 )
+		return NULL;
+
+	h = devtab_hash_string(path);
+	if ( c->nbuckets ) {
+		for ( node = c->buckets[h & (c->nbuckets - 1)]; node; node = node->next ) {
+			if ( (node->d.device.bcdDevice == dd.bcdDevice) &&
+					(node->d.device.idVendor == dd.idVendor) &&
+					(node->d.device.idProduct == dd.idProduct) &&
+					(node->d.speed == libusb_get_device_speed(dev)) &&
+					!strcmp(node->path, path) )
+				return &node->d;
+		}
+	}
+
+	if ( c->count + 1 > c->nbuckets ) {
+		if ( grow(c) )
+			return NULL;
+	}
+
+	node = read_node(dev, &dd, path);
+	if ( !node )
+		return NULL;
+
+	b = h & (c->nbuckets - 1);
+	node->next = c->buckets[b];
+	c->buckets[b] = node;
+	++c->count;
+	return &node->d;
+}
+
+/* desc_find_endpoint:
+   Look up an endpoint by address in a set of cached descriptors.
+ */
+const struct cyusb_endpoint *
+desc_find_endpoint (
+		const struct cyusb_descriptors *d,
+		unsigned char address)
+{
+	short i;
+
+	if ( (d == NULL) || (address & 0x70) )
+		return NULL;
+
+	i = d->epmap[CYUSB_EP_SLOT(address)];
+	return (i >= 0) ? &d->endpoints[i] : NULL;
+}
+
+/*[]*/
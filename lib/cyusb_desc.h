@@ -0,0 +1,43 @@
+#ifndef __CYUSB_DESC_H
+#define __CYUSB_DESC_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_desc.h                       *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * The descriptor cache holds the device and configuration descriptors of every   *
+ * device seen, together with an endpoint table indexed by endpoint address. It   *
+ * is keyed by bus/port path and bcdDevice, so that a device re-attached at the   *
+ * same port with the same firmware re-uses the parsed descriptors.                *
+ \********************************************************************************/
+
+#include "../include/cyusb.h"
+#include "cyusb_devtab.h"
+
+/* One cached set of descriptors. */
+struct desc_node {
+	struct cyusb_descriptors	d;			/* Descriptors handed out to users. */
+	char			path[CYUSB_PATH_LEN];		/* Bus/port path of the device. */
+	struct desc_node	*next;				/* Hash chain. */
+};
+
+/*
+   struct desc_cache
+   Hash of cached descriptors by bus/port path. Nodes are only freed by desc_cache_clear(),
+   so pointers handed out stay valid until the library is closed.
+ */
+struct desc_cache {
+	struct desc_node	**buckets;			/* Hash buckets, NULL-terminated chains. */
+	unsigned int		nbuckets;			/* Number of buckets, a power of two. */
+	unsigned int		count;				/* Number of cached nodes. */
+};
+
+extern void desc_cache_init(struct desc_cache *c);
+extern void desc_cache_clear(struct desc_cache *c);
+extern const struct cyusb_descriptors *desc_cache_get(struct desc_cache *c, libusb_device *dev,
+		const char *path);
+extern const struct cyusb_endpoint *desc_find_endpoint(const struct cyusb_descriptors *d,
+		unsigned char address);
+
+#endif /* __CYUSB_DESC_H */
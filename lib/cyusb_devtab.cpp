@@ -0,0 +1,391 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_devtab.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Growable device table of the cyusb library, with hash indexes by bus/port	*
+ * path, by VID/PID and by serial number.					*
+ \*******************************************************************************/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyusb_devtab.h"
+
+/* Initial number of slots and hash buckets. Both grow by doubling. */
+#define DEVTAB_INITIAL_SIZE			(MAXDEVICES)
+#define DEVTAB_INITIAL_BUCKETS			(16)
+
+/* devtab_hash_string:
+   FNV-1a hash of a NULL-terminated string.
+ */
+unsigned int
+devtab_hash_string (
+		const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while ( *s ) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* devtab_hash_vidpid:
+   Multiplicative hash of a VID/PID pair.
+ */
+unsigned int
+devtab_hash_vidpid (
+		unsigned short vid,
+		unsigned short pid)
+{
+	return ((((unsigned int)vid << 16) | pid) * 2654435761u) >> 7;
+}
+
+/* link_entry:
+   Add an entry to the hash indexes.
+ */
+static void
+link_entry (
+		struct cydev_table *tab,
+		struct cydev_entry *e)
+{
+	unsigned int mask = tab->nbuckets - 1;
+	unsigned int b;
+
+	b = devtab_hash_string(e->path) & mask;
+	e->next_path = tab->by_path[b];
+	tab->by_path[b] = e;
+
+	b = devtab_hash_vidpid(e->cd.vid, e->cd.pid) & mask;
+	e->next_vidpid = tab->by_vidpid[b];
+	tab->by_vidpid[b] = e;
+
+	e->next_serial = NULL;
+	if ( e->serial[0] ) {
+		b = devtab_hash_string(e->serial) & mask;
+		e->next_serial = tab->by_serial[b];
+		tab->by_serial[b] = e;
+	}
+}
+
+/* unlink_from:
+   Remove an entry from one hash chain. The chain link is selected by its offset.
+ */
+static void
+unlink_from (
+		struct cydev_entry **bucket,
+		struct cydev_entry *e,
+		size_t link)
+{
+	struct cydev_entry **pp = bucket;
+
+	while ( *pp ) {
+		struct cydev_entry **next = (struct cydev_entry **)((char *)*pp + link);
+		if ( *pp == e ) {
+			*pp = *next;
+			return;
+		}
+		pp = next;
+	}
+}
+
+/* unlink_entry:
+   Remove an entry from the hash indexes.
+ */
+static void
+unlink_entry (
+		struct cydev_table *tab,
+		struct cydev_entry *e)
+{
+	unsigned int mask = tab->nbuckets - 1;
+
+	unlink_from(&tab->by_path[devtab_hash_string(e->path) & mask], e,
+			offsetof(struct cydev_entry, next_path));
+	unlink_from(&tab->by_vidpid[devtab_hash_vidpid(e->cd.vid, e->cd.pid) & mask], e,
+			offsetof(struct cydev_entry, next_vidpid));
+	if ( e->serial[0] )
+		unlink_from(&tab->by_serial[devtab_hash_string(e->serial) & mask], e,
+				offsetof(struct cydev_entry, next_serial));
+}
+
+/* rehash:
+   Grow the hash indexes to the given number of buckets and re-insert all live entries.
+ */
+static int
+rehash (
+		struct cydev_table *tab,
+		unsigned int nbuckets)
+{
+	struct cydev_entry **p, **v, **s;
+	int i;
+
+	p = (struct cydev_entry **)calloc(nbuckets, sizeof(struct cydev_entry *));
+	v = (struct cydev_entry **)calloc(nbuckets, sizeof(struct cydev_entry *));
+	s = (struct cydev_entry **)calloc(nbuckets, sizeof(struct cydev_entry *));
+	if ( !p || !v || !s ) {
+		free(p);
+		free(v);
+		free(s);
+		return -1;
+	}
+
+	free(tab->by_path);
+	free(tab->by_vidpid);
+	free(tab->by_serial);
+	tab->by_path   = p;
+	tab->by_vidpid = v;
+	tab->by_serial = s;
+	tab->nbuckets  = nbuckets;
+
+	for ( i = 0; i < tab->nslots; ++i ) {
+		if ( tab->slots[i] )
+			link_entry(tab, tab->slots[i]);
+	}
+	return 0;
+}
+
+/* devtab_init:
+   Initialize an empty device table.
+ */
+void
+devtab_init (
+		struct cydev_table *tab)
+{
+	memset(tab, 0, sizeof(struct cydev_table));
+}
+
+/* devtab_clear:
+   Remove all entries, passing each one to the release callback, and free the table storage.
+ */
+void
+devtab_clear (
+		struct cydev_table *tab,
+		devtab_release_fn release)
+{
+	int i;
+
+	for ( i = 0; i < tab->nslots; ++i ) {
+		if ( tab->slots[i] && release )
+			release(tab->slots[i]);
+	}
+
+	free(tab->slots);
+	free(tab->freelist);
+	free(tab->by_path);
+	free(tab->by_vidpid);
+	free(tab->by_serial);
+	devtab_init(tab);
+}
+
+/* devtab_insert:
+   Add an entry to the table, re-using a free slot if there is one. Returns the slot index,
+   or -1 if memory could not be allocated.
+ */
+int
+devtab_insert (
+		struct cydev_table *tab,
+		struct cydev_entry *entry)
+{
+	int index;
+
+	if ( tab->nbuckets == 0 ) {
+		if ( rehash(tab, DEVTAB_INITIAL_BUCKETS) )
+			return -1;
+	}
+	else if ( (unsigned int)(tab->count + 1) > tab->nbuckets ) {
+		if ( rehash(tab, tab->nbuckets * 2) )
+			return -1;
+	}
+
+	if ( tab->nfree > 0 ) {
+		index = tab->freelist[--tab->nfree];
+	}
+	else {
+		if ( tab->nslots == tab->capacity ) {
+			int newcap = tab->capacity ? (tab->capacity * 2) : DEVTAB_INITIAL_SIZE;
+			struct cydev_entry **slots;
+			int *freelist;
+
+			slots = (struct cydev_entry **)realloc(tab->slots, newcap * sizeof(struct cydev_entry *));
+			if ( !slots )
+				return -1;
+			tab->slots = slots;
+
+			freelist = (int *)realloc(tab->freelist, newcap * sizeof(int));
+			if ( !freelist )
+				return -1;
+			tab->freelist = freelist;
+
+			tab->capacity = newcap;
+		}
+		index = tab->nslots++;
+	}
+
+	entry->index = index;
+	tab->slots[index] = entry;
+	link_entry(tab, entry);
+	++tab->count;
+	return index;
+}
+
+/* devtab_remove:
+   Take the entry at the given slot out of the table and return it. The slot becomes free for
+   re-use; trailing free slots are trimmed so that nslots stays a tight bound.
+ */
+struct cydev_entry *
+devtab_remove (
+		struct cydev_table *tab,
+		int index)
+{
+	struct cydev_entry *e;
+
+	e = devtab_get(tab, index);
+	if ( !e )
+		return NULL;
+
+	unlink_entry(tab, e);
+	tab->slots[index] = NULL;
+	--tab->count;
+
+	if ( index == tab->nslots - 1 ) {
+		/* Trim trailing free slots, dropping them from the free stack as well. */
+		--tab->nslots;
+		while ( (tab->nslots > 0) && (tab->slots[tab->nslots - 1] == NULL) )
+			--tab->nslots;
+		if ( tab->nfree > 0 ) {
+			int i, j = 0;
+			for ( i = 0; i < tab->nfree; ++i ) {
+				if ( tab->freelist[i] < tab->nslots )
+					tab->freelist[j++] = tab->freelist[i];
+			}
+			tab->nfree = j;
+		}
+	}
+	else {
+		tab->freelist[tab->nfree++] = index;
+	}
+
+	return e;
+}
+
+/* devtab_get:
+   Get the entry at the given slot, or NULL if the slot is free or out of range.
+ */
+struct cydev_entry *
+devtab_get (
+		struct cydev_table *tab,
+		int index)
+{
+	if ( (index < 0) || (index >= tab->nslots) )
+		return NULL;
+	return tab->slots[index];
+}
+
+/* devtab_find_path:
+   Look up a device by its bus/port path.
+ */
+struct cydev_entry *
+devtab_find_path (
+		struct cydev_table *tab,
+		const char *path)
+{
+	struct cydev_entry *e;
+
+	if ( tab->nbuckets == 0 )
+		return NULL;
+
+	for ( e = tab->by_path[devtab_hash_string(path) & (tab->nbuckets - 1)]; e; e = e->next_path ) {
+		if ( !strcmp(e->path, path) )
+			return e;
+	}
+	return NULL;
+}
+
+/* devtab_find_vidpid:
+   Look up the first device with the given VID/PID. Further devices with the same IDs are
+   found with devtab_next_vidpid().
+ */
+struct cydev_entry *
+devtab_find_vidpid (
+		struct cydev_table *tab,
+		unsigned short vid,
+		unsigned short pid)
+{
+	struct cydev_entry *e;
+
+	if ( tab->nbuckets == 0 )
+		return NULL;
+
+	for ( e = tab->by_vidpid[devtab_hash_vidpid(vid, pid) & (tab->nbuckets - 1)]; e; e = e->next_vidpid ) {
+		if ( (e->cd.vid == vid) && (e->cd.pid == pid) )
+			return e;
+	}
+	return NULL;
+}
+
+/* devtab_next_vidpid:
+   Continue a VID/PID lookup started with devtab_find_vidpid().
+ */
+struct cydev_entry *
+devtab_next_vidpid (
+		struct cydev_entry *entry)
+{
+	struct cydev_entry *e;
+
+	for ( e = entry->next_vidpid; e; e = e->next_vidpid ) {
+		if ( (e->cd.vid == entry->cd.vid) && (e->cd.pid == entry->cd.pid) )
+			return e;
+	}
+	return NULL;
+}
+
+/* devtab_find_serial:
+   Look up a device by its serial number.
+ */
+struct cydev_entry *
+devtab_find_serial (
+		struct cydev_table *tab,
+		const char *serial)
+{
+	struct cydev_entry *e;
+
+	if ( (tab->nbuckets == 0) || (serial[0] == '\0') )
+		return NULL;
+
+	for ( e = tab->by_serial[devtab_hash_string(serial) & (tab->nbuckets - 1)]; e; e = e->next_serial ) {
+		if ( !strcmp(e->serial, serial) )
+			return e;
+	}
+	return NULL;
+}
+
+/* devtab_set_serial:
+   Record the serial number of an entry that is already in the table and has none yet, e.g.
+   once it has been read from the device, and update the serial number index. The string is
+   complete before the entry points to it, so lock-free readers see either no serial number
+   or the whole of it.
+ */
+void
+devtab_set_serial (
+		struct cydev_table *tab,
+		struct cydev_entry *entry,
+		const char *serial)
+{
+	unsigned int b;
+
+	if ( entry->serial[0] || (serial[0] == '\0') )
+		return;
+
+	strncpy(entry->serialbuf, serial, CYUSB_SERIAL_LEN);
+	entry->serialbuf[CYUSB_SERIAL_LEN - 1] = '\0';
+	__atomic_store_n(&entry->serial, (const char *)entry->serialbuf, __ATOMIC_RELEASE);
+
+	b = devtab_hash_string(entry->serial) & (tab->nbuckets - 1);
+	entry->next_serial = tab->by_serial[b];
+	tab->by_serial[b] = entry;
+}
+
+/*[]*/
@@ -0,0 +1,83 @@
+#ifndef __CYUSB_DEVTAB_H
+#define __CYUSB_DEVTAB_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_devtab.h                     *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * The device table holds the devices of interest known to the library. Slots are *
+ * addressed by the index used in cyusb_gethandle(), and the table grows on demand.*
+ * Entries are additionally hashed by bus/port path, by VID/PID and by serial      *
+ * number, so that all lookups take constant time independent of the table size.  *
+ \********************************************************************************/
+
+#include "../include/cyusb.h"
+
+/* Length of a bus/port path such as "2-1.4.3", including the terminating NULL. */
+#define CYUSB_PATH_LEN          32
+
+/* Maximum length of a serial number string, including the terminating NULL. */
+#define CYUSB_SERIAL_LEN        128
+
+struct stats_device;
+
+/*
+   struct cydev_entry
+   One slot of the device table. The public struct cydev comes first, so a pointer to the
+   entry can be handed out as a struct cydev pointer.
+ */
+struct cydev_entry {
+	struct cydev		cd;				/* Public device information. */
+	int			index;				/* Slot of this entry in the table. */
+	char			path[CYUSB_PATH_LEN];		/* Bus/port path, e.g. "2-1.4". */
+	char			serialbuf[CYUSB_SERIAL_LEN];	/* Serial number, once known. */
+	const char		*serial;			/* serialbuf once known, else "". Set once. */
+	char			descbuf[2][CYUSB_DESC_LEN];	/* Description from the configuration file, */
+	const char		*desc;				/* and the one before it; points to the current. */
+	const struct cyusb_descriptors *descs;			/* Cached descriptors, or NULL if unreadable. */
+	int			refs;				/* References: one for the table, one per acquire. */
+	int			users;				/* Users of the handle; it is closed when this drops to 0. */
+	int			pinned;				/* Whether cyusb_gethandle() holds a use of the handle. */
+	int			sysfd;				/* Device node the handle was opened from, or -1. */
+	struct stats_device	*stats;				/* Performance counters, NULL if out of memory. */
+	struct cydev_entry	*next_retired;			/* List of removed entries still acquired. */
+	struct cydev_entry	*next_path;			/* Hash chain of the path index. */
+	struct cydev_entry	*next_vidpid;			/* Hash chain of the VID/PID index. */
+	struct cydev_entry	*next_serial;			/* Hash chain of the serial number index. */
+};
+
+/*
+   struct cydev_table
+   Growable array of device slots plus the three hash indexes.
+ */
+struct cydev_table {
+	struct cydev_entry	**slots;			/* Slot array, NULL for a free slot. */
+	int			nslots;				/* Number of slots in use (high-water mark). */
+	int			capacity;			/* Allocated size of the slot array. */
+	int			*freelist;			/* Stack of free slots below nslots. */
+	int			nfree;				/* Number of entries on the free stack. */
+	int			count;				/* Number of live entries. */
+	struct cydev_entry	**by_path;			/* Buckets of the path index. */
+	struct cydev_entry	**by_vidpid;			/* Buckets of the VID/PID index. */
+	struct cydev_entry	**by_serial;			/* Buckets of the serial number index. */
+	unsigned int		nbuckets;			/* Number of buckets, a power of two. */
+};
+
+/* Release callback used by devtab_clear() to dispose of each entry. */
+typedef void (*devtab_release_fn)(struct cydev_entry *entry);
+
+extern unsigned int devtab_hash_string(const char *s);
+extern unsigned int devtab_hash_vidpid(unsigned short vid, unsigned short pid);
+extern void devtab_init(struct cydev_table *tab);
+extern void devtab_clear(struct cydev_table *tab, devtab_release_fn release);
+extern int  devtab_insert(struct cydev_table *tab, struct cydev_entry *entry);
+extern struct cydev_entry *devtab_remove(struct cydev_table *tab, int index);
+extern struct cydev_entry *devtab_get(struct cydev_table *tab, int index);
+extern struct cydev_entry *devtab_find_path(struct cydev_table *tab, const char *path);
+extern struct cydev_entry *devtab_find_vidpid(struct cydev_table *tab, unsigned short vid, unsigned short pid);
+extern struct cydev_entry *devtab_next_vidpid(struct cydev_entry *entry);
+extern struct cydev_entry *devtab_find_serial(struct cydev_table *tab, const char *serial);
+extern void devtab_set_serial(struct cydev_table *tab, struct cydev_entry *entry, const char *serial);
+
+#endif /* __CYUSB_DEVTAB_H */
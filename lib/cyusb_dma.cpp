@@ -0,0 +1,105 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_dma.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Transfer buffer pools in usbfs-mapped memory, with a page-aligned heap	*
+ * fallback.									*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cyusb_dma.h"
+
+/* map_allowed:
+   Whether mapped pools are enabled, see DMA_DISABLE_ENV.
+ */
+static bool
+map_allowed (
+		void)
+{
+	const char *env = getenv(DMA_DISABLE_ENV);
+
+	return !env || (strcmp(env, "0") == 0);
+}
+
+/* dma_pool_create:
+   Allocate count buffers of bufsize bytes for transfers on a device handle. The buffers are
+   zeroed. Returns 0 or -ENOMEM.
+ */
+int
+dma_pool_create (
+		libusb_device_handle *h,
+		size_t bufsize,
+		unsigned int count,
+		struct dma_pool *pool)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *mem;
+
+	memset(pool, 0, sizeof(struct dma_pool));
+	if ( (bufsize == 0) || (count == 0) )
+		return -EINVAL;
+
+	pool->stride = (bufsize + DMA_ALIGN - 1) & ~(size_t)(DMA_ALIGN - 1);
+	pool->size   = (pool->stride * count + page - 1) & ~(page - 1);
+	pool->count  = count;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	/* Fails when the kernel has no usbfs mmap, or the block is over its usbfs memory limit. */
+	if ( h && map_allowed() ) {
+		pool->base = libusb_dev_mem_alloc(h, pool->size);
+		if ( pool->base ) {
+			pool->mapped = true;
+			return 0;
+		}
+	}
+#endif
+
+	if ( posix_memalign(&mem, page, pool->size) != 0 ) {
+		memset(pool, 0, sizeof(struct dma_pool));
+		return -ENOMEM;
+	}
+	memset(mem, 0, pool->size);
+	pool->base = (unsigned char *)mem;
+	return 0;
+}
+
+/* dma_pool_buffer:
+   Get buffer i of a pool.
+ */
+unsigned char *
+dma_pool_buffer (
+		const struct dma_pool *pool,
+		unsigned int i)
+{
+	return pool->base + (size_t)i * pool->stride;
+}
+
+/* dma_pool_destroy:
+   Free the buffers of a pool. A mapped pool must be freed with the handle it was made for,
+   while that handle is open.
+ */
+void
+dma_pool_destroy (
+		libusb_device_handle *h,
+		struct dma_pool *pool)
+{
+	if ( !pool->base )
+		return;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if ( pool->mapped ) {
+		libusb_dev_mem_free(h, pool->base, pool->size);
+		memset(pool, 0, sizeof(struct dma_pool));
+		return;
+	}
+#endif
+
+	free(pool->base);
+	memset(pool, 0, sizeof(struct dma_pool));
+}
@@ -0,0 +1,39 @@
+#ifndef __CYUSB_DMA_H
+#define __CYUSB_DMA_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_dma.h                        *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A buffer pool is one block of memory cut into equal transfer buffers. The      *
+ * block is mapped from the usbfs file of the device handle when libusb and the   *
+ * kernel support it, so that the host controller reads and writes the buffers    *
+ * directly instead of the kernel copying every transfer; otherwise it is         *
+ * page-aligned heap memory. A mapped pool belongs to its handle and must be      *
+ * freed before the handle is closed.                                             *
+ \********************************************************************************/
+
+#include <stddef.h>
+
+#include "../include/cyusb.h"
+
+/* Buffers in a pool start on this boundary. */
+#define DMA_ALIGN				(64)
+
+/* Setting this environment variable to anything but "0" disables mapped pools. */
+#define DMA_DISABLE_ENV				"CYUSB_NO_DEVMEM"
+
+struct dma_pool {
+	unsigned char		*base;				/* Start of the block, page-aligned. */
+	size_t			size;				/* Size of the block in bytes. */
+	size_t			stride;				/* Distance between two buffers. */
+	unsigned int		count;				/* Number of buffers. */
+	bool			mapped;				/* Whether the block is usbfs memory. */
+};
+
+extern int dma_pool_create(libusb_device_handle *h, size_t bufsize, unsigned int count, struct dma_pool *pool);
+extern unsigned char *dma_pool_buffer(const struct dma_pool *pool, unsigned int i);
+extern void dma_pool_destroy(libusb_device_handle *h, struct dma_pool *pool);
+
+#endif /* __CYUSB_DMA_H */
@@ -0,0 +1,269 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_events.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Handling of the libusb events of a context from the event loop of the	*
+ * application instead of the library event thread. The libusb pollfds are	*
+ * kept in one epoll instance, whose fd the application loop watches.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+
+#include "cyusb_context.h"
+
+/* epoll_events:
+   Translate the poll events libusb asks for into epoll events.
+ */
+static unsigned int
+epoll_events (
+		short events)
+{
+	unsigned int e = 0;
+
+	if ( events & POLLIN )
+		e |= EPOLLIN;
+	if ( events & POLLOUT )
+		e |= EPOLLOUT;
+	return e;
+}
+
+/* pollfd_added:
+   Called by libusb, on any thread, when it starts using a file descriptor.
+ */
+static void LIBUSB_CALL
+pollfd_added (
+		int fd,
+		short events,
+		void *user)
+{
+	struct cyusb_context *ctx = (struct cyusb_context *)user;
+	struct epoll_event ev;
+
+	ev.events  = epoll_events(events);
+	ev.data.fd = fd;
+	if ( (epoll_ctl(ctx->event_fd, EPOLL_CTL_ADD, fd, &ev) != 0) && (errno == EEXIST) )
+		epoll_ctl(ctx->event_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* pollfd_removed:
+   Called by libusb, on any thread, when it stops using a file descriptor.
+ */
+static void LIBUSB_CALL
+pollfd_removed (
+		int fd,
+		void *user)
+{
+	struct cyusb_context *ctx = (struct cyusb_context *)user;
+
+	epoll_ctl(ctx->event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* cyusb_event_fd_open:
+   Hand the events of a context over to the application loop, and get the fd it watches.
+ */
+int
+cyusb_event_fd_open (
+		cyusb_context *ctx)
+{
+	const struct libusb_pollfd **fds;
+	int i;
+
+	if ( !ctx )
+		return -EINVAL;
+	if ( ctx->event_fd >= 0 )
+		return ctx->event_fd;
+
+	ctx->event_fd = epoll_create1(EPOLL_CLOEXEC);
+	if ( ctx->event_fd < 0 )
+		return -errno;
+
+	/* The notifiers go first, so that no fd added in between is missed. */
+	libusb_set_pollfd_notifiers(ctx->usb, pollfd_added, pollfd_removed, ctx);
+	fds = libusb_get_pollfds(ctx->usb);
+	if ( !fds ) {
+		libusb_set_pollfd_notifiers(ctx->usb, NULL, NULL, NULL);
+		close(ctx->event_fd);
+		ctx->event_fd = -1;
+		return -ENOTSUP;
+	}
+	for ( i = 0; fds[i]; ++i )
+		pollfd_added(fds[i]->fd, fds[i]->events, ctx);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+	libusb_free_pollfds(fds);
+#else
+	free(fds);
+#endif
+
+	event_set_external(ctx, true);
+	return ctx->event_fd;
+}
+
+int
+cyusb_event_fd_open (
+		void)
+{
+	return cyusb_event_fd_open(default_context());
+}
+
+/* event_fd_release:
+   Stop feeding the libusb pollfds of a context to its event fd, and close the fd.
+ */
+void
+event_fd_release (
+		struct cyusb_context *ctx)
+{
+	if ( ctx->event_fd < 0 )
+		return;
+
+	libusb_set_pollfd_notifiers(ctx->usb, NULL, NULL, NULL);
+	close(ctx->event_fd);
+	ctx->event_fd = -1;
+}
+
+/* cyusb_event_fd_close:
+   Give the events of a context back to the library event thread. If the thread cannot be
+   started, the events stay with the application loop and the event fd stays open.
+ */
+int
+cyusb_event_fd_close (
+		cyusb_context *ctx)
+{
+	int r;
+
+	if ( !ctx || (ctx->event_fd < 0) )
+		return 0;
+
+	r = event_set_external(ctx, false);
+	if ( r == 0 )
+		event_fd_release(ctx);
+	return r;
+}
+
+int
+cyusb_event_fd_close (
+		void)
+{
+	return cyusb_event_fd_close(default_context());
+}
+
+/* cyusb_handle_events:
+   Handle the pending events of a context without blocking. Completion and hotplug callbacks
+   run on the calling thread.
+ */
+int
+cyusb_handle_events (
+		cyusb_context *ctx)
+{
+	struct timeval tv;
+
+	if ( !ctx )
+		return -EINVAL;
+
+	tv.tv_sec  = 0;
+	tv.tv_usec = 0;
+	return event_handle(ctx, &tv);
+}
+
+int
+cyusb_handle_events (
+		void)
+{
+	return cyusb_handle_events(default_context());
+}
+
+/* cyusb_event_timeout:
+   Get the time until the events of a context must be handled even if the event fd has not
+   become readable, in milliseconds, or -1 for no such time.
+ */
+int
+cyusb_event_timeout (
+		cyusb_context *ctx)
+{
+	struct timeval tv;
+
+	/* On Linux, libusb arms a timerfd, and timeouts show up on the event fd. */
+	if ( !ctx || libusb_pollfds_handle_timeouts(ctx->usb) )
+		return -1;
+	if ( libusb_get_next_timeout(ctx->usb, &tv) != 1 )
+		return -1;
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+int
+cyusb_event_timeout (
+		void)
+{
+	return cyusb_event_timeout(default_context());
+}
+
+/* cyusb_epoll_add:
+   Add the event fd of a context to an epoll instance of the application.
+ */
+int
+cyusb_epoll_add (
+		cyusb_context *ctx,
+		int epfd,
+		void *tag)
+{
+	struct epoll_event ev;
+	int fd;
+
+	fd = cyusb_event_fd_open(ctx);
+	if ( fd < 0 )
+		return fd;
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = tag;
+	if ( epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0 ) {
+		fd = -errno;
+		cyusb_event_fd_close(ctx);
+		return fd;
+	}
+	return 0;
+}
+
+int
+cyusb_epoll_add (
+		int epfd,
+		void *tag)
+{
+	return cyusb_epoll_add(default_context(), epfd, tag);
+}
+
+/* cyusb_epoll_del:
+   Remove the event fd of a context from an epoll instance, and give the events back to the
+   library event thread.
+ */
+int
+cyusb_epoll_del (
+		cyusb_context *ctx,
+		int epfd)
+{
+	int r;
+
+	if ( !ctx || (ctx->event_fd < 0) )
+		return 0;
+
+	r = event_set_external(ctx, false);
+	if ( r == 0 ) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->event_fd, NULL);
+		event_fd_release(ctx);
+	}
+	return r;
+}
+
+int
+cyusb_epoll_del (
+		int epfd)
+{
+	return cyusb_epoll_del(default_context(), epfd);
+}
+
+/*[]*/
@@ -0,0 +1,168 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_hist.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Log-linear histograms of transfer latencies, with percentiles for the	*
+ * tail and a dump of the whole distribution.					*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cyusb_hist.h"
+
+/* bucket_of:
+   Get the bucket of a duration.
+ */
+static unsigned int
+bucket_of (
+		unsigned long long ns)
+{
+	unsigned int shift;
+
+	if ( ns < (1ULL << HIST_SUB_BITS) )
+		return ns;
+	if ( ns >= (1ULL << HIST_MAX_BITS) )
+		return HIST_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(ns) - (HIST_SUB_BITS - 1);
+	return HIST_HALF * shift + (ns >> shift);
+}
+
+/* bucket_high:
+   Get the largest duration that falls in a bucket.
+ */
+static unsigned long long
+bucket_high (
+		unsigned int b)
+{
+	unsigned int shift;
+	unsigned long long sub;
+
+	if ( b < (1U << HIST_SUB_BITS) )
+		return b;
+
+	shift = b / HIST_HALF - 1;
+	sub   = b % HIST_HALF + HIST_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+/* load:
+   Read a counter that the recording thread may be updating.
+ */
+static inline unsigned long long
+load (
+		const unsigned long long *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* hist_init:
+   Empty a histogram.
+ */
+void
+hist_init (
+		struct latency_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0ULL;
+}
+
+/* hist_record:
+   Count one duration. Only one thread may record at a time.
+ */
+void
+hist_record (
+		struct latency_hist *h,
+		unsigned long long ns)
+{
+	unsigned long long *b = &h->buckets[bucket_of(ns)];
+
+	__atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+	if ( ns < h->min )
+		__atomic_store_n(&h->min, ns, __ATOMIC_RELAXED);
+	if ( ns > h->max )
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/* hist_summary:
+   Get the count, mean and percentiles of a histogram. Percentiles are the largest duration
+   of their bucket, within the exact minimum and maximum.
+ */
+void
+hist_summary (
+		const struct latency_hist *h,
+		struct cyusb_latency *lat)
+{
+	static const double q[3] = { 0.5, 0.99, 0.999 };
+	unsigned long long *p[3] = { &lat->p50, &lat->p99, &lat->p999 };
+	unsigned long long total = 0, seen = 0, target, n;
+	unsigned int b, i = 0;
+
+	memset(lat, 0, sizeof(*lat));
+	for ( b = 0; b < HIST_BUCKETS; ++b )
+		total += load(&h->buckets[b]);
+	if ( total == 0 )
+		return;
+
+	lat->count = total;
+	lat->min   = load(&h->min);
+	lat->max   = load(&h->max);
+	lat->mean  = load(&h->sum) / total;
+
+	for ( b = 0; (b < HIST_BUCKETS) && (i < 3); ++b ) {
+		n = load(&h->buckets[b]);
+		if ( n == 0 )
+			continue;
+		seen += n;
+		while ( i < 3 ) {
+			target = (unsigned long long)(q[i] * total + 0.999999);
+			if ( target == 0 )
+				target = 1;
+			if ( seen < target )
+				break;
+			*p[i++] = bucket_high(b);
+		}
+	}
+	for ( i = 0; i < 3; ++i ) {
+		if ( *p[i] > lat->max )
+			*p[i] = lat->max;
+		if ( *p[i] < lat->min )
+			*p[i] = lat->min;
+	}
+}
+
+/* hist_dump:
+   Print every non-empty bucket of a histogram with the share of durations up to it, in the
+   manner of the HdrHistogram percentile distribution.
+ */
+void
+hist_dump (
+		const struct latency_hist *h,
+		FILE *f)
+{
+	struct cyusb_latency lat;
+	unsigned long long seen = 0, n, high;
+	unsigned int b;
+
+	hist_summary(h, &lat);
+	fprintf(f, "%14s %12s %12s\n", "Value(us)", "Percentile", "TotalCount");
+	for ( b = 0; (b < HIST_BUCKETS) && (lat.count != 0); ++b ) {
+		n = load(&h->buckets[b]);
+		if ( n == 0 )
+			continue;
+		seen += n;
+		high = bucket_high(b);
+		if ( high > lat.max )
+			high = lat.max;
+		fprintf(f, "%14.3f %12.6f %12llu\n", high / 1000.0, (double)seen / lat.count, seen);
+	}
+	fprintf(f, "#[Count = %llu, Min = %.3f, Mean = %.3f, p50 = %.3f, p99 = %.3f, p99.9 = %.3f, Max = %.3f us]\n",
+			lat.count, lat.count ? lat.min / 1000.0 : 0.0, lat.mean / 1000.0, lat.p50 / 1000.0,
+			lat.p99 / 1000.0, lat.p999 / 1000.0, lat.max / 1000.0);
+}
+
+/*[]*/
@@ -0,0 +1,57 @@
+#ifndef __CYUSB_HIST_H
+#define __CYUSB_HIST_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_hist.h                      *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A latency histogram counts durations in nanoseconds in log-linear buckets, as  *
+ * HdrHistogram does: exact below 2^HIST_SUB_BITS, then 2^(HIST_SUB_BITS-1)        *
+ * buckets per power of two, so any value is known to within 1/32 of itself.      *
+ * One thread records at a time, without atomics; others read the counters at     *
+ * any time, and may see a bucket one count ahead of the total.                   *
+ \********************************************************************************/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../include/cyusb.h"
+
+/* Values below 2^HIST_SUB_BITS have a bucket each; above, each power of two has half as many. */
+#define HIST_SUB_BITS				(6)
+#define HIST_HALF				(1 << (HIST_SUB_BITS - 1))
+
+/* Largest power of two recorded; longer durations, over 18 minutes, count as the largest. */
+#define HIST_MAX_BITS				(40)
+
+/* Number of buckets. */
+#define HIST_BUCKETS				((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+
+struct latency_hist {
+	unsigned long long	count;				/* Durations recorded. */
+	unsigned long long	sum;				/* Their sum, for the mean. */
+	unsigned long long	min;				/* Shortest, or ~0 before the first. */
+	unsigned long long	max;				/* Longest. */
+	unsigned long long	buckets[HIST_BUCKETS];		/* Durations per bucket. */
+};
+
+/* hist_now:
+   Get the CLOCK_MONOTONIC time in nanoseconds.
+ */
+static inline unsigned long long
+hist_now (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+extern void hist_init(struct latency_hist *h);
+extern void hist_record(struct latency_hist *h, unsigned long long ns);
+extern void hist_summary(const struct latency_hist *h, struct cyusb_latency *lat);
+extern void hist_dump(const struct latency_hist *h, FILE *f);
+
+#endif /* __CYUSB_HIST_H */
@@ -0,0 +1,374 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_match.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Compiled VID/PID matcher for the devices of interest listed in cyusb.conf.	*
+ * Lookups take constant time, whatever the number of configured IDs.		*
+ \*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyusb_match.h"
+
+/* Initial number of vendor and per-vendor PID buckets. Both grow by doubling. */
+#define MATCH_INITIAL_VIDS			(16)
+#define MATCH_INITIAL_PIDS			(8)
+
+#define BIT_TEST(map, n)	((map)[(n) >> 5] &  (1u << ((n) & 31)))
+#define BIT_SET(map, n)		((map)[(n) >> 5] |= (1u << ((n) & 31)))
+
+/* hash16:
+   Multiplicative hash of a 16-bit ID.
+ */
+static inline unsigned int
+hash16 (
+		unsigned short id)
+{
+	return ((unsigned int)id * 2654435761u) >> 13;
+}
+
+/* find_vid:
+   Get the bucket holding a vendor, or NULL if the vendor has no entries.
+ */
+static struct vpd_vid *
+find_vid (
+		const struct cyusb_matcher *m,
+		unsigned short vid)
+{
+	unsigned int mask = m->vidcap - 1;
+	unsigned int b;
+
+	for ( b = hash16(vid) & mask; m->vids[b].used; b = (b + 1) & mask ) {
+		if ( m->vids[b].vid == vid )
+			return &m->vids[b];
+	}
+	return NULL;
+}
+
+/* grow_vids:
+   Double the number of vendor buckets.
+ */
+static int
+grow_vids (
+		struct cyusb_matcher *m)
+{
+	unsigned int newcap = m->vidcap ? (m->vidcap * 2) : MATCH_INITIAL_VIDS;
+	struct vpd_vid *vids;
+	unsigned int i, b;
+
+	vids = (struct vpd_vid *)calloc(newcap, sizeof(struct vpd_vid));
+	if ( !vids )
+		return -1;
+
+	for ( i = 0; i < m->vidcap; ++i ) {
+		if ( !m->vids[i].used )
+			continue;
+		for ( b = hash16(m->vids[i].vid) & (newcap - 1); vids[b].used; b = (b + 1) & (newcap - 1) )
+			;
+		vids[b] = m->vids[i];
+	}
+
+	free(m->vids);
+	m->vids   = vids;
+	m->vidcap = newcap;
+	return 0;
+}
+
+/* get_vid:
+   Get the bucket of a vendor, adding the vendor if needed.
+ */
+static struct vpd_vid *
+get_vid (
+		struct cyusb_matcher *m,
+		unsigned short vid)
+{
+	struct vpd_vid *v;
+	unsigned int b;
+
+	if ( m->vidcap ) {
+		v = find_vid(m, vid);
+		if ( v )
+			return v;
+	}
+
+	/* Keep the load factor at or below one half. */
+	if ( (m->nvids + 1) * 2 > m->vidcap ) {
+		if ( grow_vids(m) )
+			return NULL;
+	}
+
+	for ( b = hash16(vid) & (m->vidcap - 1); m->vids[b].used; b = (b + 1) & (m->vidcap - 1) )
+		;
+	v = &m->vids[b];
+	v->used     = 1;
+	v->vid      = vid;
+	v->wildcard = -1;
+	++m->nvids;
+	BIT_SET(m->vidmap, vid);
+	return v;
+}
+
+/* find_pid:
+   Get the VPD entry of an exact PID of a vendor, or -1.
+ */
+static inline int
+find_pid (
+		const struct vpd_vid *v,
+		unsigned short pid)
+{
+	unsigned int mask = v->pidcap - 1;
+	unsigned int b;
+
+	if ( v->pidcap == 0 )
+		return -1;
+
+	for ( b = hash16(pid) & mask; v->pids[b].vpd >= 0; b = (b + 1) & mask ) {
+		if ( v->pids[b].pid == pid )
+			return v->pids[b].vpd;
+	}
+	return -1;
+}
+
+/* add_pid:
+   Add an exact PID to the PID hash of a vendor. The first entry for a PID wins, as with the
+   file order lookup this replaces.
+ */
+static int
+add_pid (
+		struct vpd_vid *v,
+		unsigned short pid,
+		int vpd)
+{
+	unsigned int i, b, mask;
+
+	if ( find_pid(v, pid) >= 0 )
+		return 0;
+
+	if ( (v->npids + 1) * 2 > v->pidcap ) {
+		unsigned int newcap = v->pidcap ? (v->pidcap * 2) : MATCH_INITIAL_PIDS;
+		struct vpd_pid *pids = (struct vpd_pid *)malloc(newcap * sizeof(struct vpd_pid));
+
+		if ( !pids )
+			return -1;
+		for ( i = 0; i < newcap; ++i )
+			pids[i].vpd = -1;
+		for ( i = 0; i < v->pidcap; ++i ) {
+			if ( v->pids[i].vpd < 0 )
+				continue;
+			for ( b = hash16(v->pids[i].pid) & (newcap - 1); pids[b].vpd >= 0; b = (b + 1) & (newcap - 1) )
+				;
+			pids[b] = v->pids[i];
+		}
+		free(v->pids);
+		v->pids   = pids;
+		v->pidcap = newcap;
+	}
+
+	mask = v->pidcap - 1;
+	for ( b = hash16(pid) & mask; v->pids[b].vpd >= 0; b = (b + 1) & mask )
+		;
+	v->pids[b].pid = pid;
+	v->pids[b].vpd = vpd;
+	++v->npids;
+	return 0;
+}
+
+/* add_range:
+   Add a PID range to a vendor.
+ */
+static int
+add_range (
+		struct vpd_vid *v,
+		unsigned short pid_lo,
+		unsigned short pid_hi,
+		int vpd)
+{
+	int *ranges;
+	unsigned int pid;
+
+	if ( !v->rangemap ) {
+		v->rangemap = (unsigned int *)calloc(65536 / 32, sizeof(unsigned int));
+		if ( !v->rangemap )
+			return -1;
+	}
+
+	ranges = (int *)realloc(v->ranges, (v->nranges + 1) * sizeof(int));
+	if ( !ranges )
+		return -1;
+	v->ranges = ranges;
+	v->ranges[v->nranges++] = vpd;
+
+	for ( pid = pid_lo; pid <= pid_hi; ++pid )
+		BIT_SET(v->rangemap, pid);
+	return 0;
+}
+
+/* matcher_init:
+   Initialize an empty matcher.
+ */
+void
+matcher_init (
+		struct cyusb_matcher *m)
+{
+	memset(m, 0, sizeof(struct cyusb_matcher));
+}
+
+/* matcher_free:
+   Free all storage of a matcher and leave it empty.
+ */
+void
+matcher_free (
+		struct cyusb_matcher *m)
+{
+	unsigned int i;
+
+	for ( i = 0; i < m->vidcap; ++i ) {
+		free(m->vids[i].rangemap);
+		free(m->vids[i].ranges);
+		free(m->vids[i].pids);
+	}
+	free(m->vids);
+	free(m->vpd);
+	matcher_init(m);
+}
+
+/* matcher_add:
+   Add an entry covering the PIDs pid_lo to pid_hi of a vendor. Returns 0 on success, or
+   -1 if memory could not be allocated.
+ */
+int
+matcher_add (
+		struct cyusb_matcher *m,
+		unsigned short vid,
+		unsigned short pid_lo,
+		unsigned short pid_hi,
+		const char *desc)
+{
+	struct vpd_vid *v;
+	struct VPD *e;
+	int index;
+
+	if ( m->nvpd == m->vpdcap ) {
+		int newcap = m->vpdcap ? (m->vpdcap * 2) : MAX_ID_PAIRS;
+		struct VPD *vpd = (struct VPD *)realloc(m->vpd, newcap * sizeof(struct VPD));
+
+		if ( !vpd )
+			return -1;
+		m->vpd    = vpd;
+		m->vpdcap = newcap;
+	}
+
+	index = m->nvpd;
+	e = &m->vpd[index];
+	e->vid    = vid;
+	e->pid_lo = pid_lo;
+	e->pid_hi = pid_hi;
+	strncpy(e->desc, desc, CYUSB_DESC_LEN);
+	e->desc[CYUSB_DESC_LEN - 1] = '\0';		/* Make sure of NULL-termination. */
+
+	v = get_vid(m, vid);
+	if ( !v )
+		return -1;
+
+	if ( (pid_lo == 0x0000) && (pid_hi == 0xFFFF) ) {
+		if ( v->wildcard < 0 )
+			v->wildcard = index;
+	}
+	else if ( pid_lo == pid_hi ) {
+		if ( add_pid(v, pid_lo, index) )
+			return -1;
+	}
+	else {
+		if ( add_range(v, pid_lo, pid_hi, index) )
+			return -1;
+	}
+
+	++m->nvpd;
+	return 0;
+}
+
+/* matcher_parse:
+   Add an entry given as text from the <VPD> section. The PID may be a hexadecimal ID, a
+   range of IDs such as 00F0-00FF, or * for any product of the vendor. Returns 0 on success,
+   -1 if out of memory, or -2 for a malformed entry.
+ */
+int
+matcher_parse (
+		struct cyusb_matcher *m,
+		char *vidstr,
+		char *pidstr,
+		const char *desc)
+{
+	unsigned long vid, pid_lo, pid_hi;
+	char *end;
+
+	vid = strtoul(vidstr, &end, 16);
+	if ( (end == vidstr) || (*end != '\0') || (vid > 0xFFFF) )
+		return -2;
+
+	if ( !strcmp(pidstr, "*") ) {
+		pid_lo = 0x0000;
+		pid_hi = 0xFFFF;
+	}
+	else {
+		pid_lo = strtoul(pidstr, &end, 16);
+		if ( end == pidstr )
+			return -2;
+		if ( *end == '-' ) {
+			char *hi = end + 1;
+			pid_hi = strtoul(hi, &end, 16);
+			if ( end == hi )
+				return -2;
+		}
+		else
+			pid_hi = pid_lo;
+		if ( (*end != '\0') || (pid_hi > 0xFFFF) || (pid_lo > pid_hi) )
+			return -2;
+	}
+
+	return matcher_add(m, vid, pid_lo, pid_hi, desc);
+}
+
+/* matcher_lookup:
+   Get the VPD entry matching a VID/PID pair, or NULL if it is not a device of interest.
+   An exact PID takes precedence over a range, and a range over a wildcard.
+ */
+const struct VPD *
+matcher_lookup (
+		const struct cyusb_matcher *m,
+		unsigned short vid,
+		unsigned short pid)
+{
+	const struct vpd_vid *v;
+	unsigned int i;
+	int index;
+
+	if ( !BIT_TEST(m->vidmap, vid) )
+		return NULL;
+
+	v = find_vid(m, vid);
+	if ( !v )
+		return NULL;
+
+	index = find_pid(v, pid);
+	if ( index >= 0 )
+		return &m->vpd[index];
+
+	if ( v->rangemap && BIT_TEST(v->rangemap, pid) ) {
+		/* Only the ranges of this vendor are checked, to find the description. */
+		for ( i = 0; i < v->nranges; ++i ) {
+			const struct VPD *e = &m->vpd[v->ranges[i]];
+			if ( (pid >= e->pid_lo) && (pid <= e->pid_hi) )
+				return e;
+		}
+	}
+
+	if ( v->wildcard >= 0 )
+		return &m->vpd[v->wildcard];
+
+	return NULL;
+}
+
+/*[]*/
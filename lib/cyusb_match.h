@@ -0,0 +1,70 @@
+#ifndef __CYUSB_MATCH_H
+#define __CYUSB_MATCH_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_match.h                      *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * The <VPD> section of cyusb.conf is compiled into a matcher that decides in      *
+ * constant time whether a VID/PID pair is a device of interest: a 65536-bit VID   *
+ * bitmap rejects unknown vendors, and a per-VID PID hash, range bitmap and        *
+ * wildcard flag resolve the product ID.                                           *
+ \********************************************************************************/
+
+#include "../include/cyusb.h"
+
+/*
+   struct VPD
+   Used to store information about the devices of interest listed in /etc/cyusb.conf. An
+   exact entry has pid_lo == pid_hi; a range or wildcard entry covers pid_lo to pid_hi.
+ */
+struct VPD {
+	unsigned short	vid;				/* USB Vendor ID. */
+	unsigned short	pid_lo;				/* First USB Product ID covered. */
+	unsigned short	pid_hi;				/* Last USB Product ID covered. */
+	char		desc[CYUSB_DESC_LEN];		/* Device description. */
+};
+
+/* One exact PID of a vendor, in the open-addressing PID hash of that vendor. */
+struct vpd_pid {
+	unsigned short	pid;				/* USB Product ID. */
+	int		vpd;				/* Index of the VPD entry, -1 for an empty bucket. */
+};
+
+/* All entries of one vendor, in the open-addressing VID hash. */
+struct vpd_vid {
+	int		used;				/* Whether this bucket holds a vendor. */
+	unsigned short	vid;				/* USB Vendor ID. */
+	int		wildcard;			/* VPD entry matching any PID, or -1. */
+	unsigned int	*rangemap;			/* 65536-bit map of PIDs covered by ranges, or NULL. */
+	int		*ranges;			/* VPD entries of the ranges, in file order. */
+	unsigned int	nranges;			/* Number of range entries. */
+	struct vpd_pid	*pids;				/* Hash of exact PIDs. */
+	unsigned int	npids;				/* Number of exact PIDs. */
+	unsigned int	pidcap;				/* Number of PID buckets, a power of two. */
+};
+
+/*
+   struct cyusb_matcher
+   Compiled form of the <VPD> section.
+ */
+struct cyusb_matcher {
+	unsigned int	vidmap[65536 / 32];		/* Bit set for every VID with at least one entry. */
+	struct vpd_vid	*vids;				/* Hash of vendors. */
+	unsigned int	nvids;				/* Number of vendors. */
+	unsigned int	vidcap;				/* Number of vendor buckets, a power of two. */
+	struct VPD	*vpd;				/* Entries in configuration file order. */
+	int		nvpd;				/* Number of entries. */
+	int		vpdcap;				/* Allocated size of the entry array. */
+};
+
+extern void matcher_init(struct cyusb_matcher *m);
+extern void matcher_free(struct cyusb_matcher *m);
+extern int  matcher_add(struct cyusb_matcher *m, unsigned short vid, unsigned short pid_lo,
+		unsigned short pid_hi, const char *desc);
+extern int  matcher_parse(struct cyusb_matcher *m, char *vidstr, char *pidstr, const char *desc);
+extern const struct VPD *matcher_lookup(const struct cyusb_matcher *m, unsigned short vid,
+		unsigned short pid);
+
+#endif /* __CYUSB_MATCH_H */
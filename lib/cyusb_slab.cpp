@@ -0,0 +1,338 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_slab.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Per-handle caches of transfer and buffer pairs, reused by streams and by	*
+ * cyusb_buffer_get().								*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cyusb_slab.h"
+
+/* Slabs of one handle: those handed out, and those given back for reuse. */
+struct slab_cache {
+	struct slab_cache	*next;
+	libusb_device_handle	*handle;
+	struct xfer_slab	*lent;				/* Taken and not given back yet. */
+	struct xfer_slab	*idle;				/* Given back, most recent first. */
+	int			nidle;
+};
+
+static struct slab_cache	*caches = NULL;			/* Caches of all handles with slabs. */
+static pthread_mutex_t		slablock = PTHREAD_MUTEX_INITIALIZER;	/* Guards all caches. */
+
+/* find_cache:
+   Get the cache of a handle, creating it if asked to. Called with slablock held.
+ */
+static struct slab_cache *
+find_cache (
+		libusb_device_handle *h,
+		bool create)
+{
+	struct slab_cache *c;
+
+	for ( c = caches; c; c = c->next ) {
+		if ( c->handle == h )
+			return c;
+	}
+	if ( !create )
+		return NULL;
+
+	c = (struct slab_cache *)calloc(1, sizeof(struct slab_cache));
+	if ( c ) {
+		c->handle = h;
+		c->next   = caches;
+		caches    = c;
+	}
+	return c;
+}
+
+/* unlink_slab:
+   Take a slab off a list. Called with slablock held.
+ */
+static void
+unlink_slab (
+		struct xfer_slab **list,
+		struct xfer_slab *slab)
+{
+	struct xfer_slab **pp;
+
+	for ( pp = list; *pp; pp = &(*pp)->next ) {
+		if ( *pp == slab ) {
+			*pp = slab->next;
+			return;
+		}
+	}
+}
+
+/* free_slab:
+   Free a slab, its transfers and its buffers. The handle must still be open.
+ */
+static void
+free_slab (
+		struct xfer_slab *slab)
+{
+	unsigned int i;
+
+	for ( i = 0; i < slab->count; ++i ) {
+		if ( slab->items[i].transfer )
+			libusb_free_transfer(slab->items[i].transfer);
+	}
+	dma_pool_destroy(slab->handle, &slab->pool);
+	free(slab);
+}
+
+/* new_slab:
+   Allocate a slab and everything it holds, in as few blocks as possible: the slab, its
+   items and the owner state share one.
+ */
+static struct xfer_slab *
+new_slab (
+		libusb_device_handle *h,
+		int npackets,
+		size_t bufsize,
+		unsigned int count,
+		size_t privsize)
+{
+	struct xfer_slab *slab;
+	size_t itemoff, privoff;
+	unsigned int i;
+
+	itemoff = (sizeof(struct xfer_slab) + 15) & ~(size_t)15;
+	privoff = (itemoff + count * sizeof(struct slab_item) + 15) & ~(size_t)15;
+	slab = (struct xfer_slab *)calloc(1, privoff + privsize);
+	if ( !slab )
+		return NULL;
+
+	slab->handle   = h;
+	slab->npackets = npackets;
+	slab->bufsize  = bufsize;
+	slab->privsize = privsize;
+	slab->items    = (struct slab_item *)((char *)slab + itemoff);
+	slab->priv     = privsize ? (char *)slab + privoff : NULL;
+
+	if ( dma_pool_create(h, bufsize, count, &slab->pool) != 0 ) {
+		free(slab);
+		return NULL;
+	}
+
+	/* count stays 0 until the items are complete, so that free_slab() sees only those. */
+	for ( i = 0; i < count; ++i ) {
+		struct slab_item *item = &slab->items[i];
+
+		item->buffer = dma_pool_buffer(&slab->pool, i);
+		if ( npackets >= 0 ) {
+			item->transfer = libusb_alloc_transfer(npackets);
+			if ( !item->transfer ) {
+				free_slab(slab);
+				return NULL;
+			}
+		}
+		slab->count = i + 1;
+	}
+	return slab;
+}
+
+/* slab_take:
+   Get a slab of count pairs of bufsize bytes for a handle, with transfers of npackets
+   isochronous packets, or no transfers if npackets is -1, and privsize bytes of zeroed owner
+   state. A cached slab of the same shape is reused. Returns NULL if memory runs out.
+ */
+struct xfer_slab *
+slab_take (
+		libusb_device_handle *h,
+		int npackets,
+		size_t bufsize,
+		unsigned int count,
+		size_t privsize)
+{
+	struct xfer_slab *slab;
+	struct slab_cache *c;
+
+	pthread_mutex_lock(&slablock);
+	c = find_cache(h, true);
+	if ( !c ) {
+		pthread_mutex_unlock(&slablock);
+		return NULL;
+	}
+
+	for ( slab = c->idle; slab; slab = slab->next ) {
+		if ( (slab->npackets == npackets) && (slab->bufsize == bufsize) && (slab->count == count) &&
+				(slab->privsize == privsize) )
+			break;
+	}
+	if ( slab ) {
+		unlink_slab(&c->idle, slab);
+		--c->nidle;
+	}
+	else {
+		/* Buffers may be mapped from the handle, which is slow; other handles need not wait. */
+		pthread_mutex_unlock(&slablock);
+		slab = new_slab(h, npackets, bufsize, count, privsize);
+		if ( !slab )
+			return NULL;
+		pthread_mutex_lock(&slablock);
+		c = find_cache(h, true);
+		if ( !c ) {
+			pthread_mutex_unlock(&slablock);
+			free_slab(slab);
+			return NULL;
+		}
+	}
+
+	slab->next = c->lent;
+	c->lent    = slab;
+	pthread_mutex_unlock(&slablock);
+
+	if ( slab->priv )
+		memset(slab->priv, 0, privsize);
+	return slab;
+}
+
+/* park_slab:
+   Move a lent slab of a cache to its idle list. Returns the slab that no longer fits in the
+   cache, to be freed by the caller, or NULL. Called with slablock held.
+ */
+static struct xfer_slab *
+park_slab (
+		struct slab_cache *c,
+		struct xfer_slab *slab)
+{
+	struct xfer_slab *old, **pp;
+
+	unlink_slab(&c->lent, slab);
+	slab->next = c->idle;
+	c->idle    = slab;
+	if ( ++c->nidle <= SLAB_CACHE_MAX )
+		return NULL;
+
+	for ( pp = &c->idle; (*pp)->next; pp = &(*pp)->next )
+		;
+	old = *pp;
+	*pp = NULL;
+	--c->nidle;
+	return old;
+}
+
+/* slab_give:
+   Give a slab back to the cache of its handle. No transfer of the slab may be in flight.
+ */
+void
+slab_give (
+		struct xfer_slab *slab)
+{
+	struct xfer_slab *old = NULL;
+	struct slab_cache *c;
+
+	pthread_mutex_lock(&slablock);
+	c = find_cache(slab->handle, false);
+	if ( c )
+		old = park_slab(c, slab);
+	pthread_mutex_unlock(&slablock);
+
+	if ( old )
+		free_slab(old);
+}
+
+/* slab_drop_handle:
+   Free all slabs of a handle that is about to be closed. Buffers still lent out become
+   invalid.
+ */
+void
+slab_drop_handle (
+		libusb_device_handle *h)
+{
+	struct slab_cache **pp, *c = NULL;
+	struct xfer_slab *slab;
+
+	pthread_mutex_lock(&slablock);
+	for ( pp = &caches; *pp; pp = &(*pp)->next ) {
+		if ( (*pp)->handle == h ) {
+			c   = *pp;
+			*pp = c->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&slablock);
+
+	if ( !c )
+		return;
+
+	while ( (slab = c->idle) != NULL ) {
+		c->idle = slab->next;
+		free_slab(slab);
+	}
+	while ( (slab = c->lent) != NULL ) {
+		c->lent = slab->next;
+		free_slab(slab);
+	}
+	free(c);
+}
+
+/* buffer_class:
+   Size of the buffers that serve a request of length bytes.
+ */
+static size_t
+buffer_class (
+		int length)
+{
+	size_t size = SLAB_MIN_BUFFER;
+
+	while ( size < (size_t)length )
+		size <<= 1;
+	return size;
+}
+
+/* cyusb_buffer_get:
+   Get a buffer of at least length bytes for transfers on a handle, from the cache of the
+   handle when one is free.
+ */
+unsigned char *
+cyusb_buffer_get (
+		libusb_device_handle *h,
+		int length)
+{
+	struct xfer_slab *slab;
+
+	if ( !h || (length <= 0) )
+		return NULL;
+
+	slab = slab_take(h, -1, buffer_class(length), 1, 0);
+	return slab ? slab->items[0].buffer : NULL;
+}
+
+/* cyusb_buffer_put:
+   Give back a buffer obtained from cyusb_buffer_get().
+ */
+void
+cyusb_buffer_put (
+		libusb_device_handle *h,
+		unsigned char *buf)
+{
+	struct xfer_slab *slab, *old = NULL;
+	struct slab_cache *c;
+
+	if ( !h || !buf )
+		return;
+
+	pthread_mutex_lock(&slablock);
+	c = find_cache(h, false);
+	for ( slab = c ? c->lent : NULL; slab; slab = slab->next ) {
+		if ( (slab->npackets < 0) && (slab->items[0].buffer == buf) )
+			break;
+	}
+	if ( slab )
+		old = park_slab(c, slab);
+	pthread_mutex_unlock(&slablock);
+
+	if ( old )
+		free_slab(old);
+	else if ( !slab )
+		printf("Library: Buffer %p was not obtained from cyusb_buffer_get()\n", buf);
+}
@@ -0,0 +1,56 @@
+#ifndef __CYUSB_SLAB_H
+#define __CYUSB_SLAB_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_slab.h                       *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A slab is a set of equal transfer and buffer pairs made for one device handle, *
+ * together with room for the state of its owner, such as a stream. Slabs that    *
+ * are given back stay cached on their handle and are handed out again to the    *
+ * next request of the same shape, so that repeated streams and buffer requests   *
+ * on a device allocate nothing. The cache of a handle is freed by the library   *
+ * just before it closes the handle.                                              *
+ \********************************************************************************/
+
+#include <stddef.h>
+
+#include "../include/cyusb.h"
+#include "cyusb_dma.h"
+
+/* Number of idle slabs cached per handle; the oldest is freed beyond this. */
+#define SLAB_CACHE_MAX				(8)
+
+/* Buffers of cyusb_buffer_get() are rounded up to a power of two, at least this size. */
+#define SLAB_MIN_BUFFER				(512)
+
+/* One transfer and its buffer. The fields after buffer belong to the owner of the slab. */
+struct slab_item {
+	struct libusb_transfer	*transfer;			/* Transfer, NULL for a slab of buffers only. */
+	unsigned char		*buffer;			/* Buffer of bufsize bytes. */
+	void			*owner;				/* Set by the owner, e.g. its stream. */
+	int			next_free;			/* Free list link of the owner, or -1. */
+	bool			busy;				/* Whether the transfer is in flight. */
+	unsigned long long	submitted;			/* CLOCK_MONOTONIC ns of the last submission. */
+	unsigned long long	completed;			/* CLOCK_MONOTONIC ns of the last completion. */
+};
+
+struct xfer_slab {
+	struct xfer_slab	*next;				/* Next slab in the cache of the handle. */
+	libusb_device_handle	*handle;			/* Handle the slab was made for. */
+	int			npackets;			/* Isochronous packets per transfer, -1 for no transfers. */
+	size_t			bufsize;			/* Bytes per buffer. */
+	unsigned int		count;				/* Number of pairs. */
+	size_t			privsize;			/* Bytes of owner state. */
+	void			*priv;				/* Owner state, zeroed when the slab is taken. */
+	struct slab_item	*items;				/* The pairs. */
+	struct dma_pool		pool;				/* Buffers of all pairs. */
+};
+
+extern struct xfer_slab *slab_take(libusb_device_handle *h, int npackets, size_t bufsize,
+		unsigned int count, size_t privsize);
+extern void slab_give(struct xfer_slab *slab);
+extern void slab_drop_handle(libusb_device_handle *h);
+
+#endif /* __CYUSB_SLAB_H */
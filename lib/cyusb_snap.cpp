@@ -0,0 +1,317 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_snap.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Read-mostly snapshots of the device table, and the grace period machinery	*
+ * that lets lookups run without taking a lock.					*
+ \*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "cyusb_snap.h"
+
+/* Number of per-thread reader slots. Threads beyond this fall back to a reader/writer lock. */
+#define SNAP_MAX_READERS			(256)
+
+/* Reader slot, one cache line each so that readers never share a line. */
+struct snap_reader {
+	unsigned long		epoch;				/* Grace period entered, 0 when not reading. */
+	int			used;				/* Whether a thread owns this slot. */
+} __attribute__ ((aligned (64)));
+
+static struct snap_reader	readers[SNAP_MAX_READERS];
+static unsigned long		gp_epoch = 1;			/* Current grace period. */
+static pthread_mutex_t		gp_lock = PTHREAD_MUTEX_INITIALIZER;	/* Serialises writers. */
+static pthread_rwlock_t		overflow_lock = PTHREAD_RWLOCK_INITIALIZER;	/* Readers without a slot. */
+static pthread_key_t		reader_key;			/* Frees the slot of an exiting thread. */
+static pthread_once_t		reader_once = PTHREAD_ONCE_INIT;
+
+static __thread struct snap_reader	*self = NULL;		/* Slot of this thread. */
+static __thread int			nesting = 0;		/* Depth of nested read-side sections. */
+static __thread bool			noslot = false;		/* No slot was free for this thread. */
+
+/* put_reader:
+   Give back the slot of a thread that exits.
+ */
+static void
+put_reader (
+		void *arg)
+{
+	struct snap_reader *r = (struct snap_reader *)arg;
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void
+make_reader_key (
+		void)
+{
+	pthread_key_create(&reader_key, put_reader);
+}
+
+/* get_reader:
+   Claim a reader slot for the calling thread.
+ */
+static void
+get_reader (
+		void)
+{
+	int i;
+
+	pthread_once(&reader_once, make_reader_key);
+	for ( i = 0; i < SNAP_MAX_READERS; ++i ) {
+		int expected = 0;
+
+		if ( __atomic_load_n(&readers[i].used, __ATOMIC_RELAXED) )
+			continue;
+		if ( __atomic_compare_exchange_n(&readers[i].used, &expected, 1, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+			self = &readers[i];
+			pthread_setspecific(reader_key, self);
+			return;
+		}
+	}
+	noslot = true;
+}
+
+/* snap_read_lock:
+   Enter a read-side critical section. Sections may nest. No lock is taken, unless more than
+   SNAP_MAX_READERS threads read at the same time.
+ */
+void
+snap_read_lock (
+		void)
+{
+	if ( nesting++ > 0 )
+		return;
+
+	if ( !self && !noslot )
+		get_reader();
+
+	if ( self ) {
+		__atomic_store_n(&self->epoch, __atomic_load_n(&gp_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	else
+		pthread_rwlock_rdlock(&overflow_lock);
+}
+
+/* snap_read_unlock:
+   Leave a read-side critical section.
+ */
+void
+snap_read_unlock (
+		void)
+{
+	if ( --nesting > 0 )
+		return;
+
+	if ( self )
+		__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+	else
+		pthread_rwlock_unlock(&overflow_lock);
+}
+
+/* snap_synchronize:
+   Wait until every reader that may still see data unpublished before this call has left its
+   critical section. Must not be called from inside a read-side critical section.
+ */
+void
+snap_synchronize (
+		void)
+{
+	unsigned long e, x;
+	int i;
+
+	pthread_mutex_lock(&gp_lock);
+	e = __atomic_add_fetch(&gp_epoch, 1, __ATOMIC_SEQ_CST);
+	for ( i = 0; i < SNAP_MAX_READERS; ++i ) {
+		if ( !__atomic_load_n(&readers[i].used, __ATOMIC_ACQUIRE) )
+			continue;
+		while ( ((x = __atomic_load_n(&readers[i].epoch, __ATOMIC_ACQUIRE)) != 0) && (x < e) )
+			sched_yield();
+	}
+	pthread_mutex_unlock(&gp_lock);
+
+	pthread_rwlock_wrlock(&overflow_lock);
+	pthread_rwlock_unlock(&overflow_lock);
+}
+
+/* snap_build:
+   Build a snapshot of the current contents of a device table. Called with the table lock
+   held. Returns NULL if memory could not be allocated.
+ */
+struct cydev_snapshot *
+snap_build (
+		struct cydev_table *tab)
+{
+	struct cydev_snapshot *snap;
+	unsigned int size = 8;
+	unsigned int b;
+	size_t len;
+	char *p;
+	int i;
+
+	while ( size < (unsigned int)tab->count * 2 )
+		size *= 2;
+
+	len = sizeof(struct cydev_snapshot) + tab->nslots * (sizeof(struct cydev_entry *) + sizeof(int)) +
+		3 * size * sizeof(struct cydev_entry *);
+	p = (char *)calloc(1, len);
+	if ( !p )
+		return NULL;
+
+	snap = (struct cydev_snapshot *)p;
+	p += sizeof(struct cydev_snapshot);
+	snap->by_path     = (struct cydev_entry **)p;
+	p += size * sizeof(struct cydev_entry *);
+	snap->by_vidpid   = (struct cydev_entry **)p;
+	p += size * sizeof(struct cydev_entry *);
+	snap->by_serial   = (struct cydev_entry **)p;
+	p += size * sizeof(struct cydev_entry *);
+	snap->slots       = (struct cydev_entry **)p;
+	p += tab->nslots * sizeof(struct cydev_entry *);
+	snap->next_vidpid = (int *)p;
+	snap->nslots      = tab->nslots;
+	snap->mask        = size - 1;
+
+	/* Walk the slots downwards, so that the VID/PID chains come out in slot order. */
+	for ( i = tab->nslots - 1; i >= 0; --i ) {
+		struct cydev_entry *e = tab->slots[i];
+
+		snap->slots[i]       = e;
+		snap->next_vidpid[i] = -1;
+		if ( !e )
+			continue;
+
+		for ( b = devtab_hash_string(e->path) & snap->mask; snap->by_path[b]; b = (b + 1) & snap->mask )
+			;
+		snap->by_path[b] = e;
+
+		for ( b = devtab_hash_vidpid(e->cd.vid, e->cd.pid) & snap->mask; snap->by_vidpid[b];
+				b = (b + 1) & snap->mask ) {
+			if ( (snap->by_vidpid[b]->cd.vid == e->cd.vid) && (snap->by_vidpid[b]->cd.pid == e->cd.pid) ) {
+				snap->next_vidpid[i] = snap->by_vidpid[b]->index;
+				break;
+			}
+		}
+		snap->by_vidpid[b] = e;
+
+		if ( e->serial[0] ) {
+			for ( b = devtab_hash_string(e->serial) & snap->mask; snap->by_serial[b];
+					b = (b + 1) & snap->mask )
+				;
+			snap->by_serial[b] = e;
+		}
+	}
+
+	return snap;
+}
+
+/* snap_free:
+   Free a snapshot that is no longer published, after a grace period.
+ */
+void
+snap_free (
+		struct cydev_snapshot *snap)
+{
+	free(snap);
+}
+
+/* snap_get:
+   Get the entry at the given slot of a snapshot, or NULL.
+ */
+struct cydev_entry *
+snap_get (
+		const struct cydev_snapshot *snap,
+		int index)
+{
+	if ( !snap || (index < 0) || (index >= snap->nslots) )
+		return NULL;
+	return snap->slots[index];
+}
+
+/* snap_find_path:
+   Look up an entry of a snapshot by bus/port path.
+ */
+struct cydev_entry *
+snap_find_path (
+		const struct cydev_snapshot *snap,
+		const char *path)
+{
+	struct cydev_entry *e;
+	unsigned int b;
+
+	if ( !snap )
+		return NULL;
+
+	for ( b = devtab_hash_string(path) & snap->mask; (e = snap->by_path[b]) != NULL; b = (b + 1) & snap->mask ) {
+		if ( !strcmp(e->path, path) )
+			return e;
+	}
+	return NULL;
+}
+
+/* snap_find_vidpid:
+   Look up the entry with the lowest slot index having the given VID/PID.
+ */
+struct cydev_entry *
+snap_find_vidpid (
+		const struct cydev_snapshot *snap,
+		unsigned short vid,
+		unsigned short pid)
+{
+	struct cydev_entry *e;
+	unsigned int b;
+
+	if ( !snap )
+		return NULL;
+
+	for ( b = devtab_hash_vidpid(vid, pid) & snap->mask; (e = snap->by_vidpid[b]) != NULL;
+			b = (b + 1) & snap->mask ) {
+		if ( (e->cd.vid == vid) && (e->cd.pid == pid) )
+			return e;
+	}
+	return NULL;
+}
+
+/* snap_next_vidpid:
+   Get the next entry with the same VID/PID as the entry at the given slot.
+ */
+struct cydev_entry *
+snap_next_vidpid (
+		const struct cydev_snapshot *snap,
+		int index)
+{
+	if ( !snap_get(snap, index) )
+		return NULL;
+	return snap_get(snap, snap->next_vidpid[index]);
+}
+
+/* snap_find_serial:
+   Look up an entry of a snapshot by serial number.
+ */
+struct cydev_entry *
+snap_find_serial (
+		const struct cydev_snapshot *snap,
+		const char *serial)
+{
+	struct cydev_entry *e;
+	unsigned int b;
+
+	if ( !snap || (serial[0] == '\0') )
+		return NULL;
+
+	for ( b = devtab_hash_string(serial) & snap->mask; (e = snap->by_serial[b]) != NULL; b = (b + 1) & snap->mask ) {
+		if ( !strcmp(__atomic_load_n(&e->serial, __ATOMIC_ACQUIRE), serial) )
+			return e;
+	}
+	return NULL;
+}
+
+/*[]*/
@@ -0,0 +1,50 @@
+#ifndef __CYUSB_SNAP_H
+#define __CYUSB_SNAP_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_snap.h                       *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * Lookups do not take the device table lock. Every change to the device table   *
+ * publishes an immutable snapshot of it, which readers use inside a read-side    *
+ * critical section. A writer that retires a snapshot, or an entry that has left  *
+ * the table, waits for a grace period: until every reader that was inside a      *
+ * critical section when it started has left it. Readers announce themselves in  *
+ * per-thread slots, so the read side only ever writes its own cache line.        *
+ \********************************************************************************/
+
+#include "cyusb_devtab.h"
+
+/*
+   struct cydev_snapshot
+   Immutable copy of the slot array, with open-addressing indexes by path, by VID/PID and by
+   serial number. All arrays live in the same allocation as the structure.
+ */
+struct cydev_snapshot {
+	int			nslots;				/* Number of slots, as in the table. */
+	struct cydev_entry	**slots;			/* Entry per slot, NULL for a free slot. */
+	int			*next_vidpid;			/* Next slot with the same VID/PID, or -1. */
+	unsigned int		mask;				/* Index size minus one, a power of two. */
+	struct cydev_entry	**by_path;			/* Path index. */
+	struct cydev_entry	**by_vidpid;			/* First entry per VID/PID. */
+	struct cydev_entry	**by_serial;			/* Serial number index. */
+};
+
+extern void snap_read_lock(void);
+extern void snap_read_unlock(void);
+extern void snap_synchronize(void);
+
+extern struct cydev_snapshot *snap_build(struct cydev_table *tab);
+extern void snap_free(struct cydev_snapshot *snap);
+extern struct cydev_entry *snap_get(const struct cydev_snapshot *snap, int index);
+extern struct cydev_entry *snap_find_path(const struct cydev_snapshot *snap, const char *path);
+extern struct cydev_entry *snap_find_vidpid(const struct cydev_snapshot *snap, unsigned short vid,
+		unsigned short pid);
+extern struct cydev_entry *snap_next_vidpid(const struct cydev_snapshot *snap, int index);
+extern struct cydev_entry *snap_find_serial(const struct cydev_snapshot *snap, const char *serial);
+
+/* Load the snapshot published at the given location; only valid inside snap_read_lock(). */
+#define SNAP_DEREF(p)		(__atomic_load_n(&(p), __ATOMIC_ACQUIRE))
+
+#endif /* __CYUSB_SNAP_H */
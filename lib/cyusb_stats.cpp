@@ -0,0 +1,541 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_stats.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Performance counters per device and endpoint, sharded by thread, in an	*
+ * arena that cyusbd can read from another process, and counted control		*
+ * transfers.									*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cyusb_context.h"
+#include "cyusb_stats.h"
+#include "cyusb_hist.h"
+
+static unsigned int shard_next = 0;			/* Shard dealt to the next thread. */
+static __thread int shard_self = -1;			/* Shard of this thread, or -1. */
+
+/* stats_shard_index:
+   Get the counter shard of the calling thread, dealing one out on first use.
+ */
+int
+stats_shard_index (
+		void)
+{
+	if ( shard_self < 0 )
+		shard_self = __atomic_fetch_add(&shard_next, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+	return shard_self;
+}
+
+/* arena_alloc:
+   Take size bytes of an arena, on cache lines of their own. Returns the offset, or 0 when the
+   arena is full.
+ */
+static unsigned int
+arena_alloc (
+		struct stats_arena *a,
+		unsigned int size)
+{
+	unsigned int used = __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+	unsigned int off;
+
+	size = (size + STATS_CACHE_LINE - 1) & ~(STATS_CACHE_LINE - 1);
+	do {
+		off = used;
+		if ( off + size > a->size )
+			return 0;
+	} while ( !__atomic_compare_exchange_n(&a->used, &used, off + size, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+	return off;
+}
+
+/* arena_file:
+   Create the file of an arena in CYUSB_STATS_DIR and lock it, or return -1 if the directory
+   is not there. Files are never reused, so that each belongs to one context.
+ */
+static int
+arena_file (
+		void)
+{
+	static unsigned int seq = 0;
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cyusb-%d-%u.stats", CYUSB_STATS_DIR, getpid(),
+			__atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if ( fd < 0 )
+		return -1;
+
+	/* The file is sparse; pages are only allocated as records are written. */
+	if ( (ftruncate(fd, STATS_ARENA_SIZE) != 0) || (flock(fd, LOCK_SH) != 0) ) {
+		unlink(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* stats_init:
+   Set up an empty registry, with its arena in a file for cyusbd if CYUSB_STATS_DIR exists. If
+   no memory can be mapped, nothing is counted.
+ */
+void
+stats_init (
+		struct stats_registry *reg)
+{
+	struct stats_arena *a;
+	void *p;
+
+	reg->fd = arena_file();
+	if ( reg->fd >= 0 )
+		p = mmap(NULL, STATS_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, reg->fd, 0);
+	else
+		p = mmap(NULL, STATS_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if ( p == MAP_FAILED ) {
+		if ( reg->fd >= 0 )
+			close(reg->fd);
+		reg->fd    = -1;
+		reg->arena = NULL;
+		return;
+	}
+
+	a = (struct stats_arena *)p;
+	a->version = STATS_VERSION;
+	a->size    = STATS_ARENA_SIZE;
+	a->used    = (sizeof(struct stats_arena) + STATS_CACHE_LINE - 1) & ~(STATS_CACHE_LINE - 1);
+	a->pid     = getpid();
+	__atomic_store_n(&a->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	reg->arena = a;
+}
+
+/* stats_clear:
+   Unmap the arena of a registry. No thread may count any more. The file of the arena, if any,
+   is unlocked and left for cyusbd.
+ */
+void
+stats_clear (
+		struct stats_registry *reg)
+{
+	if ( reg->arena )
+		munmap(reg->arena, STATS_ARENA_SIZE);
+	if ( reg->fd >= 0 )
+		close(reg->fd);
+	reg->arena = NULL;
+	reg->fd    = -1;
+}
+
+/* stats_device_find:
+   Get the record of the device with a bus/port path, or NULL if there is none. Takes no lock.
+ */
+struct stats_device *
+stats_device_find (
+		struct stats_registry *reg,
+		const char *path)
+{
+	struct stats_arena *a = reg->arena;
+	struct stats_device *dev;
+	unsigned int off;
+
+	if ( !a )
+		return NULL;
+	for ( off = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE); off; off = dev->next ) {
+		dev = (struct stats_device *)((char *)a + off);
+		if ( strcmp(dev->path, path) == 0 )
+			return dev;
+	}
+	return NULL;
+}
+
+/* stats_device_get:
+   Get the record of the device with a bus/port path, making it if the device is new. Called
+   with the device table lock held.
+ */
+struct stats_device *
+stats_device_get (
+		struct stats_registry *reg,
+		const char *path,
+		unsigned short vid,
+		unsigned short pid)
+{
+	struct stats_arena *a = reg->arena;
+	struct stats_device *dev;
+	unsigned int off;
+
+	dev = stats_device_find(reg, path);
+	if ( !dev && a ) {
+		off = arena_alloc(a, sizeof(struct stats_device));
+		if ( !off )
+			return NULL;
+		dev = (struct stats_device *)((char *)a + off);
+		strcpy(dev->path, path);
+		dev->self  = off;
+		dev->index = -1;
+		dev->next  = a->head;
+		__atomic_store_n(&a->head, off, __ATOMIC_RELEASE);
+	}
+
+	/* Another device may be plugged into the same port. */
+	if ( dev ) {
+		dev->vid = vid;
+		dev->pid = pid;
+	}
+	return dev;
+}
+
+/* stats_shard_slow:
+   Make the counters of an endpoint on its first use, and get the shard of the calling
+   thread. Threads racing to make them keep the first one published; the others leave their
+   space unused.
+ */
+struct stats_counters *
+stats_shard_slow (
+		struct stats_device *dev,
+		unsigned char endpoint)
+{
+	struct stats_arena *a = (struct stats_arena *)((char *)dev - dev->self);
+	unsigned int *slot = &dev->eps[CYUSB_EP_SLOT(endpoint)];
+	unsigned int off, old = 0;
+
+	off = arena_alloc(a, sizeof(struct stats_endpoint));
+	if ( !off )
+		return NULL;
+	off -= dev->self;
+
+	if ( !__atomic_compare_exchange_n(slot, &old, off, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+		off = old;
+	return &((struct stats_endpoint *)((char *)dev + off))->shards[stats_shard_index()];
+}
+
+/* sum_endpoint:
+   Add up the shards of the counters of an endpoint.
+ */
+static void
+sum_endpoint (
+		const struct stats_endpoint *ep,
+		unsigned char endpoint,
+		struct cyusb_ep_stats *st)
+{
+	const struct stats_counters *c;
+	int i, j;
+
+	memset(st, 0, sizeof(*st));
+	st->endpoint = endpoint;
+	if ( !ep )
+		return;
+
+	for ( i = 0; i < STATS_SHARDS; ++i ) {
+		c = &ep->shards[i];
+		st->submitted         += __atomic_load_n(&c->submitted, __ATOMIC_RELAXED);
+		st->bytes             += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		st->callbacks         += __atomic_load_n(&c->callbacks, __ATOMIC_RELAXED);
+		st->callback_ns       += __atomic_load_n(&c->callback_ns, __ATOMIC_RELAXED);
+		st->resubmit_failures += __atomic_load_n(&c->resubmit_failures, __ATOMIC_RELAXED);
+		st->control_count     += __atomic_load_n(&c->control_count, __ATOMIC_RELAXED);
+		st->control_ns        += __atomic_load_n(&c->control_ns, __ATOMIC_RELAXED);
+		st->recoveries        += __atomic_load_n(&c->recoveries, __ATOMIC_RELAXED);
+		st->recovery_ns       += __atomic_load_n(&c->recovery_ns, __ATOMIC_RELAXED);
+		st->recovery_retries  += __atomic_load_n(&c->recovery_retries, __ATOMIC_RELAXED);
+		for ( j = 0; j < CYUSB_STATS_NSTATUS; ++j )
+			st->status[j] += __atomic_load_n(&c->status[j], __ATOMIC_RELAXED);
+	}
+	for ( j = 0; j < CYUSB_STATS_NSTATUS; ++j ) {
+		st->completed += st->status[j];
+		if ( (j != LIBUSB_TRANSFER_COMPLETED) && (j != LIBUSB_TRANSFER_CANCELLED) )
+			st->failed += st->status[j];
+	}
+}
+
+/* slot_address:
+   Get the endpoint address of a slot of the counters of a device; the reverse of
+   CYUSB_EP_SLOT().
+ */
+static unsigned char
+slot_address (
+		int slot)
+{
+	return (slot & 0x0F) | ((slot & 0x10) << 3);
+}
+
+/* fits:
+   Check that a record of size bytes at an offset lies inside an arena of size bytes.
+ */
+static bool
+fits (
+		unsigned int off,
+		size_t size,
+		unsigned int total)
+{
+	return (off != 0) && (off % 8 == 0) && (off < total) && (size <= total - off);
+}
+
+/* sum_arena:
+   Add up the counters of every device in an arena, of this or another process. Offsets are
+   checked against the size of the arena, and each record must be older than the one before,
+   so that a damaged arena cannot lead outside it or into a loop.
+ */
+static int
+sum_arena (
+		const struct stats_arena *a,
+		unsigned int size,
+		struct cyusb_stats **stats)
+{
+	const struct stats_device *dev;
+	struct cyusb_dev_stats *ds;
+	struct cyusb_stats *st;
+	unsigned int head, off, prev, epoff;
+	int n = 0, i;
+
+	*stats = NULL;
+
+	/* Records made after head was read are left out; their counters are new anyway. */
+	head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+	for ( off = head, prev = size; off; off = dev->next ) {
+		if ( (off >= prev) || !fits(off, sizeof(struct stats_device), size) )
+			return -EINVAL;
+		dev  = (const struct stats_device *)((const char *)a + off);
+		prev = off;
+		++n;
+	}
+
+	st = (struct cyusb_stats *)calloc(1, sizeof(struct cyusb_stats));
+	if ( !st )
+		return -ENOMEM;
+	st->devices = (struct cyusb_dev_stats *)calloc(n ? n : 1, sizeof(struct cyusb_dev_stats));
+	if ( !st->devices ) {
+		free(st);
+		return -ENOMEM;
+	}
+	st->pid = a->pid;
+
+	/* Another process may write the records meanwhile, so the walk is checked again, and
+	   takes no more records than were counted. */
+	for ( off = head, prev = size; off && (st->ndevices < n); off = dev->next ) {
+		if ( (off >= prev) || !fits(off, sizeof(struct stats_device), size) )
+			break;
+		dev  = (const struct stats_device *)((const char *)a + off);
+		prev = off;
+		ds   = &st->devices[st->ndevices++];
+		memcpy(ds->path, dev->path, sizeof(ds->path));
+		ds->path[sizeof(ds->path) - 1] = '\0';
+		ds->vid         = dev->vid;
+		ds->pid         = dev->pid;
+		ds->index       = __atomic_load_n(&dev->index, __ATOMIC_RELAXED);
+		ds->connects    = __atomic_load_n(&dev->connects, __ATOMIC_RELAXED);
+		ds->enum_ns     = __atomic_load_n(&dev->enum_ns, __ATOMIC_RELAXED);
+		ds->fw_loads    = __atomic_load_n(&dev->fw_loads, __ATOMIC_RELAXED);
+		ds->fw_failures = __atomic_load_n(&dev->fw_failures, __ATOMIC_RELAXED);
+		ds->fw_ns       = __atomic_load_n(&dev->fw_ns, __ATOMIC_RELAXED);
+		for ( i = 0; i < CYUSB_STATS_ENDPOINTS; ++i ) {
+			epoff = __atomic_load_n(&dev->eps[i], __ATOMIC_ACQUIRE);
+			if ( !epoff || (epoff >= size - off) || !fits(off + epoff, sizeof(struct stats_endpoint), size) )
+				continue;
+			sum_endpoint((const struct stats_endpoint *)((const char *)a + off + epoff), slot_address(i),
+					&ds->endpoints[ds->nendpoints++]);
+		}
+	}
+
+	*stats = st;
+	return 0;
+}
+
+/* cyusb_stats_snapshot:
+   Add up the counters of every device of a context and every endpoint used on it.
+ */
+int
+cyusb_stats_snapshot (
+		cyusb_context *ctx,
+		struct cyusb_stats **stats)
+{
+	*stats = NULL;
+	if ( !ctx )
+		return -EINVAL;
+	if ( !ctx->stats.arena ) {
+		*stats = (struct cyusb_stats *)calloc(1, sizeof(struct cyusb_stats));
+		if ( !*stats )
+			return -ENOMEM;
+		(*stats)->pid = getpid();
+		return 0;
+	}
+	return sum_arena(ctx->stats.arena, STATS_ARENA_SIZE, stats);
+}
+
+int
+cyusb_stats_snapshot (
+		struct cyusb_stats **stats)
+{
+	return cyusb_stats_snapshot(default_context(), stats);
+}
+
+/* cyusb_stats_load:
+   Add up the counters in an arena file of CYUSB_STATS_DIR. Returns 0 if the context that
+   counts in it still runs, or 1 if it has been closed, in which case the file will not change
+   any more. Anyone may create files in that directory, and the owner of a mapped file could
+   truncate it under the reader, so the file is copied rather than mapped.
+ */
+int
+cyusb_stats_load (
+		const char *file,
+		struct cyusb_stats **stats)
+{
+	const struct stats_arena *a;
+	struct stat st;
+	size_t size = 0;
+	ssize_t n;
+	bool ended;
+	char *p;
+	int fd, r;
+
+	*stats = NULL;
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 )
+		return -errno;
+
+	/* The context holds a shared lock until it is closed, or its process ends. */
+	ended = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+	if ( (fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct stats_arena)) ||
+			(st.st_size > STATS_ARENA_SIZE) ) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	/* Records are laid out on cache lines, and read as such. */
+	if ( posix_memalign((void **)&p, STATS_CACHE_LINE, st.st_size) != 0 ) {
+		close(fd);
+		return -ENOMEM;
+	}
+	while ( size < (size_t)st.st_size ) {
+		n = pread(fd, p + size, st.st_size - size, size);
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+		if ( n <= 0 )
+			break;
+		size += n;
+	}
+	close(fd);
+
+	/* A file cut short meanwhile is read as far as it goes; sum_arena() checks every record
+	   against what was read. */
+	a = (const struct stats_arena *)p;
+	if ( (size < sizeof(struct stats_arena)) || (a->magic != STATS_MAGIC) || (a->version != STATS_VERSION) )
+		r = -EINVAL;
+	else
+		r = sum_arena(a, size, stats);
+	free(p);
+
+	if ( r < 0 )
+		return r;
+	return ended ? 1 : 0;
+}
+
+/* cyusb_stats_free:
+   Free counters returned by cyusb_stats_snapshot().
+ */
+void
+cyusb_stats_free (
+		struct cyusb_stats *stats)
+{
+	if ( !stats )
+		return;
+	free(stats->devices);
+	free(stats);
+}
+
+/* cyusb_stats_endpoint:
+   Add up the counters of one endpoint of the device with specified index.
+ */
+int
+cyusb_stats_endpoint (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		struct cyusb_ep_stats *stats)
+{
+	struct stats_device *dev = stats_device_of(ctx, index);
+	unsigned int off;
+
+	if ( !dev )
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	off = __atomic_load_n(&dev->eps[CYUSB_EP_SLOT(endpoint)], __ATOMIC_ACQUIRE);
+	sum_endpoint(off ? (const struct stats_endpoint *)((char *)dev + off) : NULL, endpoint, stats);
+	return 0;
+}
+
+int
+cyusb_stats_endpoint (
+		int index,
+		unsigned char endpoint,
+		struct cyusb_ep_stats *stats)
+{
+	return cyusb_stats_endpoint(default_context(), index, endpoint, stats);
+}
+
+/* cyusb_control_transfer:
+   Perform a control transfer on the device with specified index, and count it on endpoint 0.
+ */
+int
+cyusb_control_transfer (
+		cyusb_context *ctx,
+		int index,
+		unsigned char bmRequestType,
+		unsigned char bRequest,
+		unsigned short wValue,
+		unsigned short wIndex,
+		unsigned char *data,
+		unsigned short wLength,
+		unsigned int timeout)
+{
+	struct stats_counters *c;
+	libusb_device_handle *h;
+	unsigned long long start;
+	int r;
+
+	if ( !ctx )
+		return -EINVAL;
+
+	r = cyusb_acquire(ctx, index, &h);
+	if ( r != 0 )
+		return r;
+
+	c = stats_shard(stats_device_of(ctx, index), 0);
+	start = hist_now();
+	r = libusb_control_transfer(h, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+	if ( c ) {
+		stats_add(&c->submitted, 1);
+		stats_add(&c->control_count, 1);
+		stats_add(&c->control_ns, hist_now() - start);
+		stats_completed(c, stats_status(r), r);
+	}
+
+	cyusb_release(ctx, h);
+	return r;
+}
+
+int
+cyusb_control_transfer (
+		int index,
+		unsigned char bmRequestType,
+		unsigned char bRequest,
+		unsigned short wValue,
+		unsigned short wIndex,
+		unsigned char *data,
+		unsigned short wLength,
+		unsigned int timeout)
+{
+	return cyusb_control_transfer(default_context(), index, bmRequestType, bRequest, wValue, wIndex,
+			data, wLength, timeout);
+}
+
+/*[]*/
@@ -0,0 +1,166 @@
+#ifndef __CYUSB_STATS_H
+#define __CYUSB_STATS_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_stats.h                      *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * Performance counters of a context, per device and per endpoint. A device gets  *
+ * its record when it is first added to the device table, keyed by bus/port path, *
+ * so that the counts of a device survive its reconnection; records are only      *
+ * freed with the context. The counters of an endpoint are split into shards, one *
+ * cache line each, and every thread adds to the shard it was dealt, so that the  *
+ * event thread and application threads counting on the same endpoint do not      *
+ * bounce a line between them. Counting takes no lock; a snapshot adds up the     *
+ * shards, and may see the counters of one transfer partly updated.               *
+ *                                                                                *
+ * All records of a context live in one arena and refer to each other by offset,  *
+ * so that another process can read them. When CYUSB_STATS_DIR exists, the arena  *
+ * is a file there, which the context holds a shared lock on while it runs; the   *
+ * file is left behind for cyusbd, which reads it and removes it once unlocked.   *
+ * Otherwise the arena is private memory. Pages are only used as records grow.    *
+ \********************************************************************************/
+
+#include "../include/cyusb.h"
+#include "cyusb_devtab.h"
+
+/* Counter shards per endpoint; threads beyond this share them. */
+#define STATS_SHARDS				(8)
+
+/* Size of a cache line, which no two shards share. */
+#define STATS_CACHE_LINE			(64)
+
+/* Size of an arena; records that do not fit are not counted. */
+#define STATS_ARENA_SIZE			(4 << 20)
+
+/* Identifies an arena file, and the layout of its records. */
+#define STATS_MAGIC				(0x54535943)	/* "CYST" */
+#define STATS_VERSION				(2)
+
+/* Counters of one endpoint added to by the threads of one shard. */
+struct stats_counters {
+	unsigned long long	submitted;			/* Transfers submitted. */
+	unsigned long long	status[CYUSB_STATS_NSTATUS];	/* Completions, by libusb_transfer_status. */
+	unsigned long long	bytes;				/* Bytes transferred by all completions. */
+	unsigned long long	callbacks;			/* Application callbacks run. */
+	unsigned long long	callback_ns;			/* Time spent in them, in nanoseconds. */
+	unsigned long long	resubmit_failures;		/* Transfers that could not be submitted again. */
+	unsigned long long	control_count;			/* Synchronous control transfers. */
+	unsigned long long	control_ns;			/* Time spent in them, in nanoseconds. */
+	unsigned long long	recoveries;			/* Stream recoveries completed. */
+	unsigned long long	recovery_ns;			/* Time from their faults to resubmission, in nanoseconds. */
+	unsigned long long	recovery_retries;		/* Recovery attempts that failed. */
+} __attribute__ ((aligned (STATS_CACHE_LINE)));
+
+struct stats_endpoint {
+	struct stats_counters	shards[STATS_SHARDS];
+};
+
+/* Record of one device. The counters of the device itself change rarely, and are not
+   sharded. */
+struct stats_device {
+	unsigned int		self;				/* Arena offset of this record. */
+	unsigned int		next;				/* Arena offset of the next record, older, or 0. */
+	char			path[CYUSB_PATH_LEN];		/* Bus/port path of the device. */
+	unsigned short		vid;				/* Vendor ID when last added. */
+	unsigned short		pid;				/* Product ID when last added. */
+	int			index;				/* Slot in the device table, or -1 if removed. */
+	unsigned long long	connects;			/* Times the device was added to the table. */
+	unsigned long long	enum_ns;			/* Time all those additions took, in nanoseconds. */
+	unsigned long long	fw_loads;			/* Firmware downloads. */
+	unsigned long long	fw_failures;			/* Firmware downloads that failed. */
+	unsigned long long	fw_ns;				/* Time all downloads took, in nanoseconds. */
+	unsigned int		eps[CYUSB_STATS_ENDPOINTS];	/* Counters by CYUSB_EP_SLOT(), as offsets from this
+								   record, or 0 before their first use. */
+};
+
+/* Start of an arena. Records follow, each on its own cache lines. */
+struct stats_arena {
+	unsigned int		magic;				/* STATS_MAGIC. */
+	unsigned int		version;			/* STATS_VERSION. */
+	unsigned int		size;				/* Bytes in the arena. */
+	unsigned int		used;				/* Bytes taken by this header and the records. */
+	unsigned int		head;				/* Arena offset of the newest device record, or 0. */
+	int			pid;				/* Process the arena belongs to. */
+};
+
+/* Records of a context. Records are only added, by the holder of the device table lock,
+   and the head is published with a release store, so readers take no lock. */
+struct stats_registry {
+	struct stats_arena	*arena;				/* Arena of the records, NULL if none could be mapped. */
+	int			fd;				/* File of the arena, or -1 for private memory. */
+};
+
+extern void stats_init(struct stats_registry *reg);
+extern void stats_clear(struct stats_registry *reg);
+extern struct stats_device *stats_device_get(struct stats_registry *reg, const char *path,
+		unsigned short vid, unsigned short pid);
+extern struct stats_device *stats_device_find(struct stats_registry *reg, const char *path);
+extern struct stats_counters *stats_shard_slow(struct stats_device *dev, unsigned char endpoint);
+extern int stats_shard_index(void);
+
+/* stats_shard:
+   Get the counters of an endpoint of a device for the calling thread, or NULL if there is no
+   record or no room.
+ */
+static inline struct stats_counters *
+stats_shard (
+		struct stats_device *dev,
+		unsigned char endpoint)
+{
+	unsigned int off;
+
+	if ( !dev )
+		return NULL;
+	off = __atomic_load_n(&dev->eps[CYUSB_EP_SLOT(endpoint)], __ATOMIC_ACQUIRE);
+	if ( !off )
+		return stats_shard_slow(dev, endpoint);
+	return &((struct stats_endpoint *)((char *)dev + off))->shards[stats_shard_index()];
+}
+
+/* stats_add:
+   Add to a counter that other threads of the same shard may add to at the same time.
+ */
+static inline void
+stats_add (
+		unsigned long long *counter,
+		unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* stats_status:
+   Map the return code of a synchronous libusb call to the status of a transfer.
+ */
+static inline int
+stats_status (
+		int r)
+{
+	switch ( r ) {
+		case LIBUSB_ERROR_TIMEOUT:	return LIBUSB_TRANSFER_TIMED_OUT;
+		case LIBUSB_ERROR_PIPE:		return LIBUSB_TRANSFER_STALL;
+		case LIBUSB_ERROR_NO_DEVICE:	return LIBUSB_TRANSFER_NO_DEVICE;
+		case LIBUSB_ERROR_OVERFLOW:	return LIBUSB_TRANSFER_OVERFLOW;
+		default:			return (r >= 0) ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_ERROR;
+	}
+}
+
+/* stats_completed:
+   Count one completion of a transfer on an endpoint.
+ */
+static inline void
+stats_completed (
+		struct stats_counters *c,
+		int status,
+		int bytes)
+{
+	if ( !c )
+		return;
+	if ( (status >= 0) && (status < CYUSB_STATS_NSTATUS) )
+		stats_add(&c->status[status], 1);
+	if ( bytes > 0 )
+		stats_add(&c->bytes, bytes);
+}
+
+#endif /* __CYUSB_STATS_H */
@@ -0,0 +1,1434 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_stream.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Asynchronous transfer queues on device endpoints, completed by the event	*
+ * thread of the library, and their recovery from stalls, error storms and	*
+ * disconnects.									*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "cyusb_stream.h"
+#include "cyusb_context.h"
+
+/* free_slot:
+   Put a slot that is not in flight on the free list. Called with the stream lock held.
+ */
+static void
+free_slot (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	slot->busy      = false;
+	slot->next_free = s->free_head;
+	s->free_head    = slot - s->slots;
+	pthread_cond_broadcast(&s->cond);
+}
+
+/* push_free:
+   Put a slot that is no longer in flight back on the free list. Called with the stream lock
+   held.
+ */
+static void
+push_free (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	__atomic_sub_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+	free_slot(s, slot);
+}
+
+/* pop_free:
+   Take a slot off the free list, or NULL if there is none or the queue depth is reached.
+   Called with the stream lock held.
+ */
+static struct slab_item *
+pop_free (
+		struct cyusb_stream *s)
+{
+	struct slab_item *slot;
+
+	if ( (s->free_head < 0) || (s->inflight >= s->depth) )
+		return NULL;
+
+	slot = &s->slots[s->free_head];
+	s->free_head = slot->next_free;
+	slot->busy   = true;
+	__atomic_add_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+	return slot;
+}
+
+/* set_length:
+   Set the number of bytes the transfer of a slot moves. An isochronous transfer is cut to
+   whole packets.
+ */
+static void
+set_length (
+		struct cyusb_stream *s,
+		struct slab_item *slot,
+		int length)
+{
+	struct libusb_transfer *t = slot->transfer;
+
+	if ( s->npackets ) {
+		t->num_iso_packets = (length + s->ep.pktsize - 1) / s->ep.pktsize;
+		t->length = t->num_iso_packets * s->ep.pktsize;
+		libusb_set_iso_packet_lengths(t, s->ep.pktsize);
+	}
+	else
+		t->length = length;
+}
+
+/* submit_slot:
+   Stamp the transfer of a slot of a stream with the time, submit it and count it.
+ */
+static int
+submit_slot (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	struct stats_counters *c;
+	int r;
+
+	slot->submitted = hist_now();
+	r = libusb_submit_transfer(slot->transfer);
+	if ( (r == 0) && (c = stats_shard(s->stats, s->ep.address)) != NULL )
+		stats_add(&c->submitted, 1);
+	return r;
+}
+
+/* resubmit_failed:
+   Count a transfer of a stream that could not be submitted again after it completed.
+ */
+static void
+resubmit_failed (
+		struct cyusb_stream *s)
+{
+	struct stats_counters *c = stats_shard(s->stats, s->ep.address);
+
+	if ( c )
+		stats_add(&c->resubmit_failures, 1);
+}
+
+/* wake:
+   Wake the threads waiting on a ring mode stream after a change they may wait for. The stream
+   lock is only taken if there are any. Called without the stream lock.
+ */
+static void
+wake (
+		struct cyusb_stream *s)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ( __atomic_load_n(&s->ring->waiters, __ATOMIC_RELAXED) == 0 )
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* wait_begin:
+   Count a thread about to wait on a ring mode stream, before it checks what it waits for, so
+   that wake() cannot miss it. Called with the stream lock held.
+ */
+static void
+wait_begin (
+		struct cyusb_stream *s)
+{
+	if ( s->ring ) {
+		__atomic_add_fetch(&s->ring->waiters, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+/* wait_end:
+   Stop counting a thread that waited on a ring mode stream. Called with the stream lock held.
+ */
+static void
+wait_end (
+		struct cyusb_stream *s)
+{
+	if ( s->ring )
+		__atomic_sub_fetch(&s->ring->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* give_back:
+   Push a slot of a ring mode stream that is not in flight on the stack of slots to submit
+   again. Any thread may push; only the holder of the pump takes them off, all at once, so
+   a slot that comes back to the top meanwhile does no harm.
+ */
+static void
+give_back (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	struct stream_ring *ring = s->ring;
+	int top = __atomic_load_n(&ring->returned, __ATOMIC_RELAXED);
+
+	do
+		slot->next_free = top;
+	while ( !__atomic_compare_exchange_n(&ring->returned, &top, (int)(slot - s->slots), true,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED) );
+}
+
+/* pump_wanted:
+   Whether a ring mode stream has slots to submit and room for them.
+ */
+static bool
+pump_wanted (
+		struct cyusb_stream *s)
+{
+	struct stream_ring *ring = s->ring;
+
+	if ( __atomic_load_n(&s->stopping, __ATOMIC_SEQ_CST) || __atomic_load_n(&s->fault, __ATOMIC_SEQ_CST) )
+		return false;
+	if ( __atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) >= __atomic_load_n(&s->depth, __ATOMIC_RELAXED) )
+		return false;
+	return (__atomic_load_n(&ring->spare, __ATOMIC_RELAXED) >= 0) ||
+		(__atomic_load_n(&ring->returned, __ATOMIC_SEQ_CST) >= 0);
+}
+
+/* pump_fill:
+   Submit slots of a ring mode stream with their whole buffer until the queue depth is
+   reached; first those left over from the last time, then those given back since. A slot
+   that cannot be submitted is left over. Called by the holder of the pump. Returns the
+   number submitted, or the error of the first submission.
+ */
+static int
+pump_fill (
+		struct cyusb_stream *s)
+{
+	struct stream_ring *ring = s->ring;
+	struct slab_item *slot;
+	int n = 0, e, r;
+
+	while ( !__atomic_load_n(&s->stopping, __ATOMIC_SEQ_CST) && !__atomic_load_n(&s->fault, __ATOMIC_SEQ_CST) &&
+			(__atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) < __atomic_load_n(&s->depth, __ATOMIC_RELAXED)) ) {
+		e = ring->spare;
+		if ( (e < 0) && (e = __atomic_exchange_n(&ring->returned, -1, __ATOMIC_ACQUIRE)) < 0 )
+			break;
+		slot = &s->slots[e];
+		__atomic_store_n(&ring->spare, slot->next_free, __ATOMIC_RELAXED);
+
+		set_length(s, slot, s->bufsize);
+		__atomic_store_n(&slot->busy, true, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+		r = submit_slot(s, slot);
+		if ( r != 0 ) {
+			__atomic_store_n(&slot->busy, false, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+			resubmit_failed(s);
+			slot->next_free = ring->spare;
+			__atomic_store_n(&ring->spare, e, __ATOMIC_RELAXED);
+			return (n > 0) ? n : r;
+		}
+		++n;
+	}
+	return n;
+}
+
+/* pump:
+   Submit the slots given back to a ring mode stream, if the caller gets the pump. A thread
+   that finds it taken leaves the work to the holder, which looks again once it lets go. The
+   stream lock is not taken, so the caller calls wake() afterwards where a failed submission
+   may have left a waiter's condition true. Returns as pump_fill().
+ */
+static int
+pump (
+		struct cyusb_stream *s)
+{
+	struct stream_ring *ring = s->ring;
+	int n = 0, r;
+
+	while ( pump_wanted(s) ) {
+		if ( __atomic_exchange_n(&ring->pumping, true, __ATOMIC_SEQ_CST) )
+			break;
+		r = pump_fill(s);
+		__atomic_store_n(&ring->pumping, false, __ATOMIC_SEQ_CST);
+		if ( r <= 0 )
+			return (n > 0) ? n : r;
+		n += r;
+	}
+	return n;
+}
+
+/* cancel_all:
+   Cancel the transfers of a stream in flight. The caller has stopped submissions, by the stop
+   or the fault flag. In ring mode the pump is held meanwhile, so that nothing submitted before
+   the flag was seen escapes the cancellation; the holder of the pump never waits for the
+   stream lock, so the caller may hold it.
+ */
+static void
+cancel_all (
+		struct cyusb_stream *s)
+{
+	struct stream_ring *ring = s->ring;
+	unsigned int i;
+
+	while ( ring && __atomic_exchange_n(&ring->pumping, true, __ATOMIC_SEQ_CST) )
+		sched_yield();
+	for ( i = 0; i < s->nslots; ++i ) {
+		if ( __atomic_load_n(&s->slots[i].busy, __ATOMIC_RELAXED) )
+			libusb_cancel_transfer(s->slots[i].transfer);
+	}
+	if ( ring )
+		__atomic_store_n(&ring->pumping, false, __ATOMIC_SEQ_CST);
+}
+
+/* actual_of:
+   Get the number of bytes a completed transfer of a stream moved, over its completed packets
+   for an isochronous one.
+ */
+static int
+actual_of (
+		struct cyusb_stream *s,
+		struct libusb_transfer *t)
+{
+	int i, actual = 0;
+
+	if ( !s->npackets )
+		return t->actual_length;
+	for ( i = 0; i < t->num_iso_packets; ++i ) {
+		if ( t->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED )
+			actual += t->iso_packet_desc[i].actual_length;
+	}
+	return actual;
+}
+
+/* fill_xfer:
+   Describe a completed transfer of a stream to the application.
+ */
+static void
+fill_xfer (
+		struct cyusb_stream *s,
+		struct libusb_transfer *t,
+		struct cyusb_xfer *x)
+{
+	struct slab_item *slot = (struct slab_item *)t->user_data;
+	int i;
+
+	x->stream    = s;
+	x->submitted = slot->submitted;
+	x->completed = slot->completed;
+	x->buffer   = t->buffer;
+	x->length   = t->length;
+	x->status   = t->status;
+	x->packets  = 0;
+	x->failed   = 0;
+	x->transfer = t;
+	if ( s->npackets ) {
+		x->actual  = 0;
+		x->packets = t->num_iso_packets;
+		for ( i = 0; i < t->num_iso_packets; ++i ) {
+			if ( t->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED )
+				x->actual += t->iso_packet_desc[i].actual_length;
+			else
+				++x->failed;
+		}
+	}
+	else
+		x->actual = t->actual_length;
+}
+
+/* hold_slot:
+   Keep a completed slot that the callback asked to requeue while the stream recovers, to be
+   submitted again afterwards. Called with the stream lock held.
+ */
+static void
+hold_slot (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	__atomic_sub_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+	slot->busy      = false;
+	slot->next_free = s->held_head;
+	s->held_head    = slot - s->slots;
+	pthread_cond_broadcast(&s->cond);
+}
+
+/* free_held:
+   Put the held slots of a stream on its free list. Called with the stream lock held.
+ */
+static void
+free_held (
+		struct cyusb_stream *s)
+{
+	struct slab_item *slot;
+
+	while ( s->held_head >= 0 ) {
+		slot = &s->slots[s->held_head];
+		s->held_head = slot->next_free;
+		free_slot(s, slot);
+	}
+}
+
+/* resubmit_held:
+   Submit the held slots of a stream again. A slot that cannot be submitted stays held.
+   Called with the stream lock held.
+ */
+static int
+resubmit_held (
+		struct cyusb_stream *s)
+{
+	struct slab_item *slot;
+	int r;
+
+	while ( s->held_head >= 0 ) {
+		slot = &s->slots[s->held_head];
+		if ( s->npackets )
+			libusb_set_iso_packet_lengths(slot->transfer, s->ep.pktsize);
+		r = submit_slot(s, slot);
+		if ( r != 0 )
+			return r;
+		s->held_head = slot->next_free;
+		slot->busy   = true;
+		__atomic_add_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+/* drain:
+   Cancel the transfers of a stream in flight and wait until all have completed. Called with
+   the stream lock held, on the recovery thread.
+ */
+static void
+drain (
+		struct cyusb_stream *s)
+{
+	cancel_all(s);
+	wait_begin(s);
+	while ( (__atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) > 0) && !s->recover_quit )
+		event_wait(s->ctx, &s->lock, &s->cond);
+	wait_end(s);
+}
+
+/* wait_backoff:
+   Wait out the backoff of a recovering stream, and double it for the next attempt. Returns
+   false if the stream was stopped meanwhile. Called with the stream lock held.
+ */
+static bool
+wait_backoff (
+		struct cyusb_stream *s)
+{
+	struct timespec ts;
+
+	if ( s->backoff ) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec  += s->backoff / 1000;
+		ts.tv_nsec += (s->backoff % 1000) * 1000000L;
+		if ( ts.tv_nsec >= 1000000000L ) {
+			ts.tv_sec  += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while ( !s->stopping && !s->recover_quit &&
+				(pthread_cond_timedwait(&s->recover_cond, &s->lock, &ts) != ETIMEDOUT) )
+			;
+	}
+
+	if ( s->backoff == 0 )
+		__atomic_store_n(&s->backoff, STREAM_BACKOFF_MIN, __ATOMIC_RELAXED);
+	else if ( s->backoff * 2 > STREAM_BACKOFF_MAX )
+		__atomic_store_n(&s->backoff, STREAM_BACKOFF_MAX, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&s->backoff, s->backoff * 2, __ATOMIC_RELAXED);
+	return !s->stopping && !s->recover_quit;
+}
+
+/* reattach:
+   Move the transfers of a stream whose device was lost to the device now at the same
+   bus/port path, if it has the same endpoint, claiming the interface of the endpoint there.
+   The handle of the lost device is released, unless the slab of the stream belongs to it.
+   Only the hotplug registry sees the device come back, so without it this fails with
+   LIBUSB_ERROR_NOT_SUPPORTED. Called with the stream lock held, which is dropped meanwhile.
+ */
+static int
+reattach (
+		struct cyusb_stream *s)
+{
+	const struct cyusb_endpoint *ep;
+	libusb_device_handle *h, *old = s->handle;
+	int claimed = s->claimed;
+	unsigned int i;
+	int index, r;
+
+	if ( !__atomic_load_n(&s->ctx->hotplug_active, __ATOMIC_ACQUIRE) )
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	pthread_mutex_unlock(&s->lock);
+	index = cyusb_find_by_path(s->ctx, s->path);
+	r = (index >= 0) ? cyusb_acquire(s->ctx, index, &h) : LIBUSB_ERROR_NO_DEVICE;
+
+	/* The device table may not have seen the device leave yet. */
+	if ( (r == 0) && (h == old) ) {
+		cyusb_release(s->ctx, h);
+		r = LIBUSB_ERROR_NO_DEVICE;
+	}
+	if ( r == 0 ) {
+		ep = cyusb_getendpoint(s->ctx, index, s->ep.address);
+		if ( !ep || (ep->type != s->ep.type) || (ep->pktsize != s->ep.pktsize) )
+			r = LIBUSB_ERROR_NOT_FOUND;
+		else {
+			r = libusb_claim_interface(h, ep->interface);
+			if ( (r == 0) && (ep->altsetting != 0) ) {
+				r = libusb_set_interface_alt_setting(h, ep->interface, ep->altsetting);
+				if ( r != 0 )
+					libusb_release_interface(h, ep->interface);
+			}
+		}
+		if ( r != 0 )
+			cyusb_release(s->ctx, h);
+	}
+	pthread_mutex_lock(&s->lock);
+	if ( r != 0 )
+		return r;
+
+	/* Nothing is in flight; the buffers stay those of the slab. */
+	for ( i = 0; i < s->nslots; ++i )
+		s->slots[i].transfer->dev_handle = h;
+	s->handle  = h;
+	s->claimed = ep->interface;
+	s->stats   = stats_device_of(s->ctx, index);
+
+	if ( old != s->slab->handle ) {
+		pthread_mutex_unlock(&s->lock);
+		if ( claimed >= 0 )
+			libusb_release_interface(old, claimed);
+		cyusb_release(s->ctx, old);
+		pthread_mutex_lock(&s->lock);
+	}
+	return 0;
+}
+
+/* give_up:
+   End the recovery of a stream that was stopped. The held transfers wait on the free list for
+   the next start. Called with the stream lock held, on the recovery thread.
+ */
+static void
+give_up (
+		struct cyusb_stream *s)
+{
+	free_held(s);
+	__atomic_store_n(&s->fault, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&s->cond);
+}
+
+/* recover:
+   Recover a stream from its fault: drain it, clear the halt of the endpoint or reattach to
+   the device, and submit the held transfers again, retrying with backoff until this works or
+   the stream is stopped. Called with the stream lock held, on the recovery thread.
+ */
+static void
+recover (
+		struct cyusb_stream *s)
+{
+	struct stats_counters *c;
+	libusb_device_handle *h;
+	int r;
+
+	for ( ;; ) {
+		drain(s);
+		if ( !wait_backoff(s) ) {
+			give_up(s);
+			return;
+		}
+
+		if ( s->fault == LIBUSB_TRANSFER_NO_DEVICE )
+			r = reattach(s);
+		else {
+			h = s->handle;
+			pthread_mutex_unlock(&s->lock);
+			r = libusb_clear_halt(h, s->ep.address);
+			pthread_mutex_lock(&s->lock);
+		}
+
+		/* The stream may have been stopped while the lock was dropped; what stop counted
+		   out must stay out. */
+		if ( s->stopping || s->recover_quit ) {
+			give_up(s);
+			return;
+		}
+		if ( r == 0 )
+			r = resubmit_held(s);
+		if ( r == 0 )
+			break;
+		if ( r == LIBUSB_ERROR_NOT_SUPPORTED ) {
+			give_up(s);
+			return;
+		}
+
+		if ( (r == LIBUSB_ERROR_NO_DEVICE) && (s->recovery & CYUSB_RECOVER_REATTACH) )
+			__atomic_store_n(&s->fault, LIBUSB_TRANSFER_NO_DEVICE, __ATOMIC_SEQ_CST);
+		if ( (c = stats_shard(s->stats, s->ep.address)) != NULL )
+			stats_add(&c->recovery_retries, 1);
+	}
+
+	if ( (c = stats_shard(s->stats, s->ep.address)) != NULL ) {
+		stats_add(&c->recoveries, 1);
+		stats_add(&c->recovery_ns, hist_now() - s->fault_at);
+	}
+	__atomic_store_n(&s->storm, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->fault, 0, __ATOMIC_SEQ_CST);
+	if ( s->ring )
+		pump(s);
+	pthread_cond_broadcast(&s->cond);
+}
+
+/* recover_thread_func:
+   Recovers a stream from each fault handed over by note_fault(), until the stream is closed.
+ */
+static void *
+recover_thread_func (
+		void *arg)
+{
+	struct cyusb_stream *s = (struct cyusb_stream *)arg;
+
+	pthread_mutex_lock(&s->lock);
+	while ( !s->recover_quit ) {
+		if ( s->fault )
+			recover(s);
+		else
+			pthread_cond_wait(&s->recover_cond, &s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* note_fault:
+   Check the status of a completed transfer of a stream for a fault to recover from, and hand
+   a new one to the recovery thread, starting it on first use. Returns whether the stream is
+   recovering, in which case nothing may be submitted until it is done. Called with the
+   stream lock held.
+ */
+static bool
+note_fault (
+		struct cyusb_stream *s,
+		int status)
+{
+	int fault = 0;
+
+	switch ( status ) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			__atomic_store_n(&s->storm, 0, __ATOMIC_RELAXED);
+			if ( !s->fault )
+				__atomic_store_n(&s->backoff, 0, __ATOMIC_RELAXED);
+			break;
+
+		case LIBUSB_TRANSFER_STALL:
+			if ( s->recovery & CYUSB_RECOVER_STALL )
+				fault = status;
+			break;
+
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			if ( (s->recovery & CYUSB_RECOVER_REATTACH) &&
+					__atomic_load_n(&s->ctx->hotplug_active, __ATOMIC_ACQUIRE) )
+				fault = status;
+			break;
+
+		case LIBUSB_TRANSFER_TIMED_OUT:
+		case LIBUSB_TRANSFER_ERROR:
+			__atomic_store_n(&s->storm, s->storm + 1, __ATOMIC_RELAXED);
+			if ( (s->storm >= STREAM_STORM) && (s->recovery & CYUSB_RECOVER_TIMEOUT) )
+				fault = LIBUSB_TRANSFER_TIMED_OUT;
+			break;
+	}
+
+	if ( s->fault ) {
+		/* A lost device is what the recovery has to deal with, whatever came first. */
+		if ( fault == LIBUSB_TRANSFER_NO_DEVICE )
+			__atomic_store_n(&s->fault, fault, __ATOMIC_SEQ_CST);
+		return true;
+	}
+	if ( !fault || s->stopping )
+		return false;
+
+	if ( !s->recover_started ) {
+		if ( pthread_create(&s->recover_thread, NULL, recover_thread_func, s) != 0 )
+			return false;
+		s->recover_started = true;
+	}
+	s->fault_at = hist_now();
+	__atomic_store_n(&s->fault, fault, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&s->recover_cond);
+	return true;
+}
+
+/* ring_push:
+   Put a completed slot in the ring of a stream. Only the event thread calls this. With the
+   drop-oldest policy, a ring holding more than its limit gives up its oldest slot, which is
+   returned so that it can be submitted again; else NULL is returned.
+ */
+static struct slab_item *
+ring_push (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	struct stream_ring *r = s->ring;
+	unsigned int tail = r->tail;
+	unsigned int head;
+	int e;
+
+	/* The ring has an entry for every slot, so it never overflows. */
+	r->entries[tail & r->mask] = slot - s->slots;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&r->completed, 1, __ATOMIC_RELAXED);
+
+	if ( r->policy != CYUSB_RING_DROP_OLDEST )
+		return NULL;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	while ( tail + 1 - head > r->limit ) {
+		e = r->entries[head & r->mask];
+		if ( __atomic_compare_exchange_n(&r->head, &head, head + 1, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+			__atomic_add_fetch(&r->overruns, 1, __ATOMIC_RELAXED);
+			return &s->slots[e];
+		}
+	}
+	return NULL;
+}
+
+/* ring_pop:
+   Take the oldest slot out of the ring of a stream, or return -1 if it is empty. Only the
+   consumer calls this; under the block policy it alone moves the head.
+ */
+static int
+ring_pop (
+		struct stream_ring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	int e;
+
+	if ( r->policy == CYUSB_RING_BLOCK ) {
+		if ( head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) )
+			return -1;
+		e = r->entries[head & r->mask];
+		__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+		return e;
+	}
+
+	do {
+		if ( head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) )
+			return -1;
+		e = r->entries[head & r->mask];
+	} while ( !__atomic_compare_exchange_n(&r->head, &head, head + 1, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) );
+	return e;
+}
+
+/* ring_complete:
+   Hand a completed transfer of a ring mode stream to the consumer, and keep the queue depth
+   with the slots given back. Only a fault, or the first completion after a storm or a
+   recovery, takes the stream lock. Under the block policy, a completion that leaves the queue
+   short because the consumer holds every other slot counts as an overrun. The stream may be
+   freed once the count of completions being handled drops, so it is not touched after.
+ */
+static void
+ring_complete (
+		struct cyusb_stream *s,
+		struct slab_item *slot)
+{
+	struct stream_ring *ring = s->ring;
+	int status = slot->transfer->status;
+	struct slab_item *victim;
+	bool fault = false;
+
+	__atomic_add_fetch(&ring->completing, 1, __ATOMIC_SEQ_CST);
+
+	/* The slot is the consumer's once it is in the ring. */
+	__atomic_store_n(&slot->busy, false, __ATOMIC_RELAXED);
+	victim = ring_push(s, slot);
+	if ( victim )
+		give_back(s, victim);
+	__atomic_sub_fetch(&s->inflight, 1, __ATOMIC_SEQ_CST);
+
+	if ( (status != LIBUSB_TRANSFER_COMPLETED) || __atomic_load_n(&s->storm, __ATOMIC_RELAXED) ||
+			__atomic_load_n(&s->backoff, __ATOMIC_RELAXED) || __atomic_load_n(&s->fault, __ATOMIC_SEQ_CST) ) {
+		pthread_mutex_lock(&s->lock);
+		fault = note_fault(s, status);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if ( !fault && (status != LIBUSB_TRANSFER_NO_DEVICE) ) {
+		pump(s);
+		if ( !__atomic_load_n(&s->stopping, __ATOMIC_SEQ_CST) && (ring->policy == CYUSB_RING_BLOCK) &&
+				(__atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) < __atomic_load_n(&s->depth, __ATOMIC_RELAXED)) )
+			__atomic_add_fetch(&ring->overruns, 1, __ATOMIC_RELAXED);
+	}
+	wake(s);
+
+	__atomic_sub_fetch(&ring->completing, 1, __ATOMIC_RELEASE);
+}
+
+/* stream_callback:
+   Called by libusb on the event thread when a transfer of a stream completes. The transfer
+   is handed to the application, then resubmitted or given back to the stream.
+ */
+static void LIBUSB_CALL
+stream_callback (
+		struct libusb_transfer *t)
+{
+	struct slab_item *slot = (struct slab_item *)t->user_data;
+	struct cyusb_stream *s = (struct cyusb_stream *)slot->owner;
+	struct stats_counters *c = stats_shard(s->stats, s->ep.address);
+	struct cyusb_xfer x;
+	int requeue = 0;
+
+	/* Cancelled transfers say nothing about the device, and are left out. */
+	slot->completed = hist_now();
+	if ( t->status != LIBUSB_TRANSFER_CANCELLED )
+		hist_record(s->latency, slot->completed - slot->submitted);
+	stats_completed(c, t->status, actual_of(s, t));
+
+	if ( s->ring ) {
+		ring_complete(s, slot);
+		return;
+	}
+
+	fill_xfer(s, t, &x);
+	if ( s->cb ) {
+		requeue = s->cb(&x, s->user);
+		if ( c ) {
+			stats_add(&c->callbacks, 1);
+			stats_add(&c->callback_ns, hist_now() - slot->completed);
+		}
+	}
+
+	/* The stream may be freed as soon as the last transfer is given back, so it is not
+	   touched after the lock is dropped. */
+	pthread_mutex_lock(&s->lock);
+	if ( note_fault(s, t->status) ) {
+		if ( requeue && !s->stopping )
+			hold_slot(s, slot);
+		else
+			push_free(s, slot);
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	if ( requeue && !s->stopping && (__atomic_load_n(&s->inflight, __ATOMIC_RELAXED) <= s->depth) &&
+			(t->status != LIBUSB_TRANSFER_NO_DEVICE) ) {
+		if ( s->npackets )
+			libusb_set_iso_packet_lengths(t, s->ep.pktsize);
+		if ( submit_slot(s, slot) == 0 ) {
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		resubmit_failed(s);
+	}
+	push_free(s, slot);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* free_stream:
+   Give the slab of a stream that has no transfer in flight back to its handle, and release
+   the handle, and the one of the device the stream was reattached to, if any, with the
+   interface claimed on it. The stream itself lives in the slab.
+ */
+static void
+free_stream (
+		struct cyusb_stream *s)
+{
+	struct cyusb_context *ctx = s->ctx;
+	libusb_device_handle *h = s->handle;
+	libusb_device_handle *orig = s->slab->handle;
+	int claimed = s->claimed;
+
+	pthread_cond_destroy(&s->recover_cond);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	slab_give(s->slab);
+	if ( claimed >= 0 )
+		libusb_release_interface(h, claimed);
+	cyusb_release(ctx, h);
+	if ( orig != h )
+		cyusb_release(ctx, orig);
+}
+
+/* stop_recovery:
+   End the recovery thread of a stopped stream, if it was started.
+ */
+static void
+stop_recovery (
+		struct cyusb_stream *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->recover_quit = true;
+	pthread_cond_signal(&s->recover_cond);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if ( s->recover_started )
+		pthread_join(s->recover_thread, NULL);
+}
+
+/* open_stream:
+   Set up queuedepth transfers of reqsize packets each on an endpoint of the device with
+   specified index, and start the event thread of the context. With a ring size, ringsize
+   more transfers are set up, and completions go to the ring instead of the callback.
+ */
+static int
+open_stream (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		unsigned int ringsize,
+		int policy,
+		cyusb_xfer_cb cb,
+		void *user,
+		cyusb_stream **stream)
+{
+	const struct cyusb_endpoint *ep;
+	struct cyusb_endpoint epinfo;
+	const char *path;
+	struct cyusb_stream *s;
+	struct stream_ring *ring = NULL;
+	struct xfer_slab *slab;
+	libusb_device_handle *h;
+	pthread_condattr_t attr;
+	unsigned int i, npackets, nslots, nentries = 0;
+	size_t privsize = sizeof(struct cyusb_stream) + sizeof(struct latency_hist);
+	int r;
+
+	*stream = NULL;
+	if ( !ctx || (reqsize == 0) || (queuedepth == 0) )
+		return -EINVAL;
+
+	nslots = queuedepth + ringsize;
+	if ( ringsize ) {
+		if ( (policy != CYUSB_RING_BLOCK) && (policy != CYUSB_RING_DROP_OLDEST) )
+			return -EINVAL;
+		for ( nentries = 1; nentries < nslots; nentries <<= 1 )
+			;
+		privsize += sizeof(struct stream_ring) + nentries * sizeof(int);
+	}
+
+	/* The acquired handle keeps the device, and its endpoint table, in place. */
+	r = cyusb_acquire(ctx, index, &h);
+	if ( r != 0 )
+		return r;
+
+	ep = cyusb_getendpoint(ctx, index, endpoint);
+	if ( !ep || (ep->type == LIBUSB_TRANSFER_TYPE_CONTROL) ) {
+		cyusb_release(ctx, h);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	if ( ringsize && !(ep->address & LIBUSB_ENDPOINT_IN) ) {
+		cyusb_release(ctx, h);
+		return -EINVAL;
+	}
+	epinfo   = *ep;
+	path     = cyusb_getpath(ctx, index);
+	npackets = (epinfo.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0;
+
+	/* A stream of the same shape closed earlier on this handle leaves its slab cached. */
+	slab = slab_take(h, npackets, (size_t)reqsize * epinfo.pktsize, nslots, privsize);
+	if ( !slab ) {
+		cyusb_release(ctx, h);
+		return -ENOMEM;
+	}
+
+	s = (struct cyusb_stream *)slab->priv;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_cond_init(&s->recover_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	s->ctx       = ctx;
+	s->handle    = h;
+	s->ep        = epinfo;
+	s->bufsize   = slab->bufsize;
+	s->npackets  = npackets;
+	s->cb        = cb;
+	s->user      = user;
+	s->slab      = slab;
+	s->slots     = slab->items;
+	s->nslots    = nslots;
+	s->depth     = queuedepth;
+	s->free_head = -1;
+	s->held_head = -1;
+	s->claimed   = -1;
+	s->recovery  = CYUSB_RECOVER_ALL;
+	s->stats     = stats_device_of(ctx, index);
+	if ( path )
+		snprintf(s->path, sizeof(s->path), "%s", path);
+	s->latency   = (struct latency_hist *)(s + 1);
+	hist_init(s->latency);
+
+	if ( ringsize ) {
+		ring = (struct stream_ring *)(s->latency + 1);
+		ring->mask    = nentries - 1;
+		ring->limit   = ringsize;
+		ring->policy  = policy;
+		ring->entries = (int *)(ring + 1);
+		s->ring = ring;
+	}
+
+	for ( i = nslots; i-- > 0; ) {
+		struct slab_item *slot = &s->slots[i];
+
+		slot->owner     = s;
+		slot->busy      = false;
+		slot->next_free = s->free_head;
+		s->free_head    = i;
+
+		switch ( s->ep.type ) {
+			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+				libusb_fill_iso_transfer(slot->transfer, h, endpoint, slot->buffer, s->bufsize,
+						s->npackets, stream_callback, slot, STREAM_TIMEOUT);
+				libusb_set_iso_packet_lengths(slot->transfer, s->ep.pktsize);
+				break;
+
+			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+				libusb_fill_interrupt_transfer(slot->transfer, h, endpoint, slot->buffer, s->bufsize,
+						stream_callback, slot, STREAM_TIMEOUT);
+				break;
+
+			default:
+				libusb_fill_bulk_transfer(slot->transfer, h, endpoint, slot->buffer, s->bufsize,
+						stream_callback, slot, STREAM_TIMEOUT);
+				break;
+		}
+	}
+
+	/* In ring mode, the slots wait to be pumped instead of on the free list. */
+	if ( ring ) {
+		ring->returned = -1;
+		ring->spare    = s->free_head;
+		s->free_head   = -1;
+	}
+
+	r = event_thread_get(ctx);
+	if ( r != 0 ) {
+		free_stream(s);
+		return r;
+	}
+
+	*stream = s;
+	return 0;
+}
+
+/* cyusb_stream_open:
+   Set up queuedepth transfers of reqsize packets each on an endpoint of the device with
+   specified index, completed to a callback.
+ */
+int
+cyusb_stream_open (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		cyusb_xfer_cb cb,
+		void *user,
+		cyusb_stream **stream)
+{
+	return open_stream(ctx, index, endpoint, reqsize, queuedepth, 0, 0, cb, user, stream);
+}
+
+int
+cyusb_stream_open (
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		cyusb_xfer_cb cb,
+		void *user,
+		cyusb_stream **stream)
+{
+	return cyusb_stream_open(default_context(), index, endpoint, reqsize, queuedepth, cb, user, stream);
+}
+
+/* cyusb_stream_open_ring:
+   Set up a stream on an IN endpoint whose completed transfers are taken by a consumer thread
+   with cyusb_stream_get(), with ringsize transfers beyond the queue depth to hold them.
+ */
+int
+cyusb_stream_open_ring (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		unsigned int ringsize,
+		int policy,
+		cyusb_stream **stream)
+{
+	*stream = NULL;
+	if ( ringsize == 0 )
+		return -EINVAL;
+	return open_stream(ctx, index, endpoint, reqsize, queuedepth, ringsize, policy, NULL, NULL, stream);
+}
+
+int
+cyusb_stream_open_ring (
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		unsigned int ringsize,
+		int policy,
+		cyusb_stream **stream)
+{
+	return cyusb_stream_open_ring(default_context(), index, endpoint, reqsize, queuedepth, ringsize,
+			policy, stream);
+}
+
+/* cyusb_stream_mapped:
+   Whether the buffers of a stream are usbfs memory, which the kernel does not copy.
+ */
+bool
+cyusb_stream_mapped (
+		cyusb_stream *s)
+{
+	return s->slab->pool.mapped;
+}
+
+/* cyusb_stream_start:
+   Submit every free transfer of a stream, up to the queue depth, with its whole buffer.
+   Returns the number of transfers submitted, or an error if none could be.
+ */
+int
+cyusb_stream_start (
+		cyusb_stream *s)
+{
+	struct slab_item *slot;
+	int n = 0;
+	int r = 0;
+
+	pthread_mutex_lock(&s->lock);
+	__atomic_store_n(&s->stopping, false, __ATOMIC_SEQ_CST);
+	if ( s->ring ) {
+		pthread_mutex_unlock(&s->lock);
+		r = pump(s);
+		wake(s);
+		return r;
+	}
+
+	/* A recovery under way submits the transfers when it is done. */
+	while ( !s->fault && (slot = pop_free(s)) != NULL ) {
+		set_length(s, slot, s->bufsize);
+		r = submit_slot(s, slot);
+		if ( r != 0 ) {
+			push_free(s, slot);
+			break;
+		}
+		++n;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return (n > 0) ? n : r;
+}
+
+/* cyusb_stream_submit:
+   Submit one transfer of length bytes on a stream. For an OUT endpoint, data is copied into
+   the buffer of the transfer first. When the queue depth is reached, waits up to timeout
+   milliseconds for a transfer to be given back.
+ */
+int
+cyusb_stream_submit (
+		cyusb_stream *s,
+		const unsigned char *data,
+		int length,
+		int timeout)
+{
+	struct slab_item *slot = NULL;
+	struct timespec ts;
+	int r = 0;
+
+	if ( s->ring || (length <= 0) || ((unsigned int)length > s->bufsize) )
+		return -EINVAL;
+
+	/* Completions are delivered by the event thread, so it must never wait for one. */
+	if ( event_thread_current(s->ctx) )
+		timeout = 0;
+
+	if ( timeout > 0 ) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec  += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000L;
+		if ( ts.tv_nsec >= 1000000000L ) {
+			ts.tv_sec  += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while ( !s->stopping && (s->fault || (slot = pop_free(s)) == NULL) ) {
+		if ( timeout == 0 )
+			r = -EAGAIN;
+		else if ( timeout < 0 )
+			event_wait(s->ctx, &s->lock, &s->cond);
+		else if ( pthread_cond_timedwait(&s->cond, &s->lock, &ts) == ETIMEDOUT )
+			r = -ETIMEDOUT;
+		if ( r != 0 )
+			break;
+	}
+	if ( (r == 0) && s->stopping )
+		r = -ECANCELED;
+	if ( r != 0 ) {
+		pthread_mutex_unlock(&s->lock);
+		return r;
+	}
+
+	if ( data && !(s->ep.address & LIBUSB_ENDPOINT_IN) )
+		memcpy(slot->transfer->buffer, data, length);
+	set_length(s, slot, length);
+	r = submit_slot(s, slot);
+	if ( r != 0 )
+		push_free(s, slot);
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+/* cyusb_stream_get:
+   Take the oldest completed transfer out of the ring of a stream. When the ring is empty,
+   waits up to timeout milliseconds for one, or without limit for a negative timeout.
+ */
+int
+cyusb_stream_get (
+		cyusb_stream *s,
+		struct cyusb_xfer *x,
+		int timeout)
+{
+	struct stream_ring *r = s->ring;
+	struct timespec ts;
+	int e, rc = 0;
+
+	if ( !r )
+		return -EINVAL;
+
+	e = ring_pop(r);
+	if ( e < 0 ) {
+		__atomic_add_fetch(&r->underruns, 1, __ATOMIC_RELAXED);
+
+		/* Counted as a waiter before the ring is checked again, the consumer is woken by
+		   the completion that fills it. */
+		if ( event_thread_current(s->ctx) )
+			timeout = 0;
+		if ( timeout > 0 ) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec  += timeout / 1000;
+			ts.tv_nsec += (timeout % 1000) * 1000000L;
+			if ( ts.tv_nsec >= 1000000000L ) {
+				ts.tv_sec  += 1;
+				ts.tv_nsec -= 1000000000L;
+			}
+		}
+
+		pthread_mutex_lock(&s->lock);
+		wait_begin(s);
+		while ( (e = ring_pop(r)) < 0 ) {
+			if ( s->stopping )
+				rc = -ECANCELED;
+			else if ( timeout == 0 )
+				rc = -EAGAIN;
+			else if ( timeout < 0 )
+				event_wait(s->ctx, &s->lock, &s->cond);
+			else if ( pthread_cond_timedwait(&s->cond, &s->lock, &ts) == ETIMEDOUT )
+				rc = -ETIMEDOUT;
+			if ( rc != 0 )
+				break;
+		}
+		wait_end(s);
+		pthread_mutex_unlock(&s->lock);
+		if ( e < 0 )
+			return rc;
+	}
+
+	__atomic_add_fetch(&r->consumed, 1, __ATOMIC_RELAXED);
+	fill_xfer(s, s->slots[e].transfer, x);
+	return 0;
+}
+
+/* cyusb_stream_put:
+   Give a transfer taken with cyusb_stream_get() back to its stream, which submits it again
+   unless the stream is stopped. The next completion submits it; only when nothing is in
+   flight to complete does the consumer submit it itself.
+ */
+int
+cyusb_stream_put (
+		cyusb_stream *s,
+		const struct cyusb_xfer *x)
+{
+	struct slab_item *slot;
+
+	if ( !s->ring || (x->stream != s) )
+		return -EINVAL;
+	slot = (struct slab_item *)x->transfer->user_data;
+
+	give_back(s, slot);
+	if ( __atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) == 0 ) {
+		pump(s);
+		wake(s);
+	}
+	return 0;
+}
+
+/* cyusb_stream_ring_stats:
+   Get the counters of the ring of a stream.
+ */
+int
+cyusb_stream_ring_stats (
+		cyusb_stream *s,
+		struct cyusb_ring_stats *stats)
+{
+	struct stream_ring *r = s->ring;
+	unsigned int head;
+
+	if ( !r )
+		return -EINVAL;
+
+	stats->completed = __atomic_load_n(&r->completed, __ATOMIC_RELAXED);
+	stats->consumed  = __atomic_load_n(&r->consumed, __ATOMIC_RELAXED);
+	stats->overruns  = __atomic_load_n(&r->overruns, __ATOMIC_RELAXED);
+	stats->underruns = __atomic_load_n(&r->underruns, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	stats->waiting   = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+	return 0;
+}
+
+/* cyusb_stream_latency:
+   Get the count, mean and percentiles of the submission to completion times of the transfers
+   of a stream so far.
+ */
+int
+cyusb_stream_latency (
+		cyusb_stream *s,
+		struct cyusb_latency *lat)
+{
+	if ( !s || !lat )
+		return -EINVAL;
+
+	hist_summary(s->latency, lat);
+	return 0;
+}
+
+/* cyusb_stream_latency_dump:
+   Print the latency histogram of a stream.
+ */
+int
+cyusb_stream_latency_dump (
+		cyusb_stream *s,
+		FILE *f)
+{
+	if ( !s || !f )
+		return -EINVAL;
+
+	hist_dump(s->latency, f);
+	return 0;
+}
+
+/* cyusb_stream_set_depth:
+   Change the number of transfers a stream keeps in flight. A lower depth takes effect as
+   transfers complete; a higher one when transfers are next submitted.
+ */
+int
+cyusb_stream_set_depth (
+		cyusb_stream *s,
+		unsigned int depth)
+{
+	if ( (depth == 0) || (depth > s->nslots) )
+		return -EINVAL;
+
+	pthread_mutex_lock(&s->lock);
+	__atomic_store_n(&s->depth, depth, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/* cyusb_stream_set_recovery:
+   Choose the faults a stream recovers from by itself. A recovery under way is finished.
+ */
+int
+cyusb_stream_set_recovery (
+		cyusb_stream *s,
+		unsigned int flags)
+{
+	if ( flags & ~CYUSB_RECOVER_ALL )
+		return -EINVAL;
+
+	pthread_mutex_lock(&s->lock);
+	s->recovery = flags;
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/* cyusb_stream_pending:
+   Get the number of transfers of a stream that are in flight.
+ */
+int
+cyusb_stream_pending (
+		cyusb_stream *s)
+{
+	int n;
+
+	pthread_mutex_lock(&s->lock);
+	n = __atomic_load_n(&s->inflight, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+/* cyusb_stream_stop:
+   Cancel all transfers of a stream in flight and wait until each has been handed to the
+   callback. A recovery under way is given up first. From the callback itself, the transfers
+   are only cancelled, and the recovery gives up without submitting anything.
+ */
+void
+cyusb_stream_stop (
+		cyusb_stream *s)
+{
+	bool wait = !event_thread_current(s->ctx);
+
+	pthread_mutex_lock(&s->lock);
+	__atomic_store_n(&s->stopping, true, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&s->recover_cond);
+	pthread_cond_broadcast(&s->cond);
+	while ( wait && s->fault )
+		event_wait(s->ctx, &s->lock, &s->cond);
+	cancel_all(s);
+	wait_begin(s);
+	while ( wait && (__atomic_load_n(&s->inflight, __ATOMIC_SEQ_CST) > 0) )
+		event_wait(s->ctx, &s->lock, &s->cond);
+	wait_end(s);
+	pthread_mutex_unlock(&s->lock);
+
+	/* The event thread may still be finishing the last completion, and wakes waiters with
+	   the stream lock, so this waits without it. */
+	while ( wait && s->ring && __atomic_load_n(&s->ring->completing, __ATOMIC_ACQUIRE) )
+		sched_yield();
+}
+
+/* cyusb_stream_close:
+   Stop a stream and free it. The handle is released, and the event thread is stopped if no
+   other user is left.
+ */
+void
+cyusb_stream_close (
+		cyusb_stream *s)
+{
+	struct cyusb_context *ctx;
+
+	if ( !s )
+		return;
+
+	cyusb_stream_stop(s);
+	stop_recovery(s);
+	ctx = s->ctx;
+
+	/* The handle release may free a closed context, so the event thread goes first. */
+	event_thread_put(ctx);
+	free_stream(s);
+}
+
+/*[]*/
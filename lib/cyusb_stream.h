@@ -0,0 +1,127 @@
+#ifndef __CYUSB_STREAM_H
+#define __CYUSB_STREAM_H
+
+/*********************************************************************************\
+ * Internal header of the cyusb library, called cyusb_stream.h                     *
+ *                                                                                *
+ * License             :        LGPL Ver 2.1                                      *
+ *                                                                                *
+ * A stream is a fixed set of transfers on one endpoint of an acquired device     *
+ * handle. Transfers complete on the event thread of the context, which is       *
+ * started with the first stream and stopped with the last one. A transfer is    *
+ * either in flight or on the free list of its stream; the stream lock guards     *
+ * both, and is held across resubmission so that a stop request cannot miss a     *
+ * transfer that is being requeued. The stream, its transfers and its buffers     *
+ * live in one slab of the handle, which is cached for the next stream of the     *
+ * same shape when the stream is closed.                                          *
+ *                                                                                *
+ * A stream opened in ring mode hands its completed transfers to one consumer     *
+ * thread through a single-producer/single-consumer ring of slot numbers instead  *
+ * of a callback. The event thread produces with a release store of the tail,    *
+ * and the consumer takes with one of the head; only the drop-oldest policy also  *
+ * lets the producer take from the ring, so that the head is then advanced by     *
+ * compare-and-swap. The consumer gives slots back on an atomic stack instead of  *
+ * the free list, and the completion side submits them again: whichever thread   *
+ * holds the pump, taken by exchange and never waited for but to cancel, submits. *
+ * Neither side takes the stream lock, but to wake a thread waiting on the        *
+ * stream and to deal with a fault.                                               *
+ *                                                                                *
+ * Every transfer is stamped with CLOCK_MONOTONIC when it is submitted and when   *
+ * it completes, and the time between goes into a latency histogram of the        *
+ * stream, which the event thread records and any thread reads.                   *
+ * Submissions, completions and callbacks also go into the performance counters   *
+ * of the endpoint.                                                               *
+ *                                                                                *
+ * A stream recovers from a stalled endpoint, a run of timeouts or errors, and    *
+ * the loss of its device by itself. The completion that shows the fault starts  *
+ * the recovery thread of the stream, which cancels what is still in flight and  *
+ * waits for it, clears the halt, or waits for a device to come back at the same *
+ * bus/port path and moves the transfers to a handle on it, then submits again   *
+ * the transfers the callback asked to requeue meanwhile. Attempts that fail are *
+ * retried with exponential backoff, which is only reset by a completed transfer. *
+ \********************************************************************************/
+
+#include <pthread.h>
+
+#include "../include/cyusb.h"
+#include "cyusb_slab.h"
+#include "cyusb_hist.h"
+#include "cyusb_stats.h"
+
+/* Timeout of every stream transfer, in milliseconds. */
+#define STREAM_TIMEOUT				(5000)
+
+/* Failed or timed out transfers in a row that make a storm to recover from. */
+#define STREAM_STORM				(4)
+
+/* Shortest and longest wait before another attempt at recovery, in milliseconds. */
+#define STREAM_BACKOFF_MIN			(1)
+#define STREAM_BACKOFF_MAX			(1000)
+
+/* Size of a cache line, which the producer and consumer indexes of a ring do not share. */
+#define STREAM_CACHE_LINE			(64)
+
+/* Ring of completed transfers, followed by its entries in the slab. */
+struct stream_ring {
+	unsigned int		head;				/* Next entry for the consumer. */
+	unsigned long long	consumed;			/* Transfers taken by the consumer. */
+	unsigned long long	underruns;			/* Times the consumer found the ring empty. */
+	char			pad[STREAM_CACHE_LINE];		/* Keeps the consumer fields off the producer line. */
+	unsigned int		tail;				/* Next entry for the producer. */
+	unsigned long long	completed;			/* Transfers put in the ring. */
+	unsigned long long	overruns;			/* Transfers held back or dropped for a full ring. */
+	unsigned int		mask;				/* Number of entries less one, a power of two less one. */
+	unsigned int		limit;				/* Most transfers waiting for the consumer. */
+	int			policy;				/* CYUSB_RING_BLOCK or CYUSB_RING_DROP_OLDEST. */
+	int			*entries;			/* Slot numbers. */
+	char			pad2[STREAM_CACHE_LINE];	/* Keeps the shared fields off the producer line. */
+	int			returned;			/* Top of the stack of slots to submit again, or -1. */
+	int			spare;				/* Slots taken off that stack and not yet submitted, or -1;
+								   only the holder of the pump uses them. */
+	bool			pumping;			/* Whether a thread holds the pump, and may submit. */
+	unsigned int		waiters;			/* Threads waiting on the stream condition. */
+	unsigned int		completing;			/* Completions the event thread is handling. */
+};
+
+struct cyusb_stream {
+	struct cyusb_context	*ctx;				/* Context of the device. */
+	libusb_device_handle	*handle;			/* Acquired handle the transfers use, released at close. The
+								   handle of the slab stays acquired too after a reattach. */
+	char			path[CYUSB_PATH_LEN];		/* Bus/port path of the device, to reattach. */
+	int			claimed;			/* Interface claimed on the handle reattached to, or -1. */
+	struct cyusb_endpoint	ep;				/* Copy of the endpoint information. */
+	unsigned int		bufsize;			/* Bytes per transfer. */
+	unsigned int		npackets;			/* Isochronous packets per transfer, else 0. */
+	cyusb_xfer_cb		cb;				/* Completion callback. */
+	void			*user;				/* User data passed to the callback. */
+
+	pthread_mutex_t		lock;				/* Guards the fields below. In ring mode, the number in
+								   flight, the flags and the depth are also read, and the
+								   number in flight changed, atomically without it. */
+	pthread_cond_t		cond;				/* Signalled when a transfer is given back. */
+	unsigned int		nslots;				/* Number of transfers allocated. */
+	unsigned int		depth;				/* Maximum number of transfers in flight. */
+	unsigned int		inflight;			/* Number of transfers in flight. */
+	int			free_head;			/* First free slot, or -1. */
+	bool			stopping;			/* Set by cyusb_stream_stop(); no new submissions. */
+	struct xfer_slab	*slab;				/* Slab holding the stream. */
+	struct slab_item	*slots;				/* Transfers and buffers of the slab. */
+	struct stream_ring	*ring;				/* Ring of completed transfers in ring mode, else NULL. */
+	struct latency_hist	*latency;			/* Submission to completion times of the transfers. */
+	struct stats_device	*stats;				/* Performance counters of the device, or NULL. */
+
+	/* Recovery state, guarded by the stream lock. */
+	unsigned int		recovery;			/* CYUSB_RECOVER_xxx faults to recover from. */
+	int			fault;				/* LIBUSB_TRANSFER_STALL, _TIMED_OUT for a storm, or
+								   _NO_DEVICE while recovering, else 0. */
+	unsigned long long	fault_at;			/* CLOCK_MONOTONIC ns the fault was seen. */
+	unsigned int		storm;				/* Failed or timed out transfers since the last completed one. */
+	unsigned int		backoff;			/* Milliseconds to wait before the next attempt, or 0. */
+	int			held_head;			/* Slots to submit again after the recovery, or -1. */
+	pthread_cond_t		recover_cond;			/* Wakes the recovery thread. */
+	pthread_t		recover_thread;			/* Thread that recovers, started on the first fault. */
+	bool			recover_started;		/* Whether the recovery thread runs. */
+	bool			recover_quit;			/* Request to the recovery thread to end. */
+};
+
+#endif /* __CYUSB_STREAM_H */
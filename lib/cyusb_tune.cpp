@@ -0,0 +1,421 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_tune.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Modification Notes	:							*
+ * 										*
+ * Search for the request size and queue depth that give the highest stream	*
+ * throughput on an endpoint, and a store of the results per device,		*
+ * endpoint, host controller and link speed.					*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "cyusb_context.h"
+#include "cyusb_config.h"
+
+/* Largest request size and queue depth tried, as offered by the streamer. */
+#define TUNE_MAX_REQSIZE			(512)
+#define TUNE_MAX_DEPTH				(512)
+
+/* Largest amount of buffer memory a candidate may use. */
+#define TUNE_MAX_BYTES				(64 << 20)
+
+/* Time a candidate streams before, and while, its throughput is measured, in milliseconds. */
+#define TUNE_WARMUP				(50)
+#define TUNE_WINDOW				(250)
+
+/* A neighbour must be this many percent faster to be taken; less is a plateau. */
+#define TUNE_GAIN				(3)
+
+/* Most candidates measured in one search. */
+#define TUNE_MAX_POINTS				(40)
+
+/* Starting point when nothing is stored and the caller gives none. */
+#define TUNE_DEFAULT_REQSIZE			(16)
+#define TUNE_DEFAULT_DEPTH			(16)
+
+/* Length of a store key and of a store line. */
+#define TUNE_KEY_LEN				(128)
+#define TUNE_LINE_LEN				(256)
+
+/* Bytes seen by the callback of the candidate being measured. */
+struct tune_count {
+	unsigned long long	bytes;
+	unsigned long		good;
+	unsigned long		bad;
+};
+
+/* One measured candidate. */
+struct tune_point {
+	unsigned int		reqsize;
+	unsigned int		depth;
+	double			rate;				/* Bytes per second, or -1 if it failed. */
+};
+
+/* tune_callback:
+   Count the data of every completed transfer, and keep the transfer queued.
+ */
+static int
+tune_callback (
+		const struct cyusb_xfer *x,
+		void *user)
+{
+	struct tune_count *c = (struct tune_count *)user;
+
+	if ( x->status == LIBUSB_TRANSFER_COMPLETED ) {
+		__atomic_add_fetch(&c->bytes, x->actual, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&c->good, 1, __ATOMIC_RELAXED);
+	}
+	else if ( x->status != LIBUSB_TRANSFER_CANCELLED )
+		__atomic_add_fetch(&c->bad, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static double
+seconds (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* tune_sleep:
+   Let a candidate stream for a time. When the application loop handles the events of the
+   context, the caller may be the thread of that loop, so it handles them itself meanwhile.
+ */
+static void
+tune_sleep (
+		cyusb_context *ctx,
+		unsigned int ms)
+{
+	struct timeval tv;
+	double end, left;
+
+	if ( !__atomic_load_n(&ctx->event_external, __ATOMIC_ACQUIRE) ) {
+		usleep(ms * 1000);
+		return;
+	}
+
+	end = seconds() + ms / 1000.0;
+	while ( (left = end - seconds()) > 0 ) {
+		tv.tv_sec  = (long)left;
+		tv.tv_usec = (long)((left - tv.tv_sec) * 1e6);
+		event_handle(ctx, &tv);
+	}
+}
+
+/* measure:
+   Stream on an endpoint with one candidate and return its throughput in bytes per second.
+   Returns a negative error if the stream cannot run, if most of its transfers fail, or with
+   LIBUSB_ERROR_TIMEOUT if none completed with data in the window.
+ */
+static double
+measure (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int reqsize,
+		unsigned int depth)
+{
+	struct tune_count c;
+	cyusb_stream *s;
+	unsigned long long b0;
+	unsigned long g0, f0, good, bad;
+	double t0, t1;
+	int r;
+
+	memset(&c, 0, sizeof(c));
+	r = cyusb_stream_open(ctx, index, endpoint, reqsize, depth, tune_callback, &c, &s);
+	if ( r != 0 )
+		return r;
+
+	r = cyusb_stream_start(s);
+	if ( r <= 0 ) {
+		cyusb_stream_close(s);
+		return (r < 0) ? r : LIBUSB_ERROR_IO;
+	}
+
+	tune_sleep(ctx, TUNE_WARMUP);
+	b0 = __atomic_load_n(&c.bytes, __ATOMIC_RELAXED);
+	g0 = __atomic_load_n(&c.good, __ATOMIC_RELAXED);
+	f0 = __atomic_load_n(&c.bad, __ATOMIC_RELAXED);
+	t0 = seconds();
+	tune_sleep(ctx, TUNE_WINDOW);
+	t1 = seconds();
+	b0 = __atomic_load_n(&c.bytes, __ATOMIC_RELAXED) - b0;
+	good = __atomic_load_n(&c.good, __ATOMIC_RELAXED) - g0;
+	bad  = __atomic_load_n(&c.bad, __ATOMIC_RELAXED) - f0;
+	cyusb_stream_close(s);
+
+	if ( bad > good )
+		return LIBUSB_ERROR_IO;
+	if ( (good == 0) || (b0 == 0) )
+		return LIBUSB_ERROR_TIMEOUT;
+	return b0 / (t1 - t0);
+}
+
+/* tune_key:
+   Build the store key of an endpoint: VID, PID, endpoint, host controller and link speed.
+   The controller is named by the sysfs device of its root hub, e.g. the PCI address.
+ */
+static int
+tune_key (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		char *key)
+{
+	char link[PATH_MAX], target[PATH_MAX];
+	struct cyusb_devinfo info;
+	const char *ctrl;
+	char *p;
+
+	if ( cyusb_getinfo(ctx, index, &info) != 0 )
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	snprintf(link, sizeof(link), "/sys/bus/usb/devices/usb%d/..", info.busnum);
+	if ( realpath(link, target) ) {
+		p = strrchr(target, '/');
+		ctrl = p ? p + 1 : target;
+	}
+	else {
+		snprintf(target, sizeof(target), "bus%d", info.busnum);
+		ctrl = target;
+	}
+
+	snprintf(key, TUNE_KEY_LEN, "%04x:%04x ep%02x %.64s speed%d", info.vid, info.pid, endpoint, ctrl,
+			info.speed);
+	for ( p = key; *p; ++p ) {
+		if ( *p == '\t' || *p == '\n' )
+			*p = '_';
+	}
+	return 0;
+}
+
+/* store_path:
+   Get the path of the store of tuned settings.
+ */
+static int
+store_path (
+		char *path,
+		bool create)
+{
+	int r;
+
+	r = cache_dir(path, create);
+	if ( r )
+		return r;
+	strcat(path, "/tune");
+	return 0;
+}
+
+/* store_lookup:
+   Find the settings stored for a key. Lines are "key<TAB>reqsize queuedepth KBps".
+ */
+static int
+store_lookup (
+		const char *key,
+		unsigned int *reqsize,
+		unsigned int *depth)
+{
+	char path[PATH_MAX], line[TUNE_LINE_LEN];
+	size_t n = strlen(key);
+	unsigned int rs, qd;
+	FILE *fp;
+	int r = -ENOENT;
+
+	if ( store_path(path, false) )
+		return -ENOENT;
+	fp = fopen(path, "r");
+	if ( !fp )
+		return -ENOENT;
+
+	while ( fgets(line, sizeof(line), fp) ) {
+		if ( (strncmp(line, key, n) == 0) && (line[n] == '\t') &&
+				(sscanf(line + n + 1, "%u %u", &rs, &qd) == 2) && rs && qd ) {
+			*reqsize = rs;
+			*depth   = qd;
+			r = 0;
+		}
+	}
+	fclose(fp);
+	return r;
+}
+
+/* store_save:
+   Store the settings for a key, replacing any earlier ones. The store is replaced atomically,
+   as the configuration cache is.
+ */
+static void
+store_save (
+		const char *key,
+		unsigned int reqsize,
+		unsigned int depth,
+		double rate)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16], line[TUNE_LINE_LEN];
+	size_t n = strlen(key);
+	FILE *in, *out;
+	bool ok = true;
+
+	if ( store_path(path, true) )
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	out = fopen(tmp, "w");
+	if ( !out )
+		return;
+
+	in = fopen(path, "r");
+	if ( in ) {
+		while ( ok && fgets(line, sizeof(line), in) ) {
+			if ( (strncmp(line, key, n) == 0) && (line[n] == '\t') )
+				continue;
+			ok = (fputs(line, out) != EOF);
+		}
+		fclose(in);
+	}
+	ok = ok && (fprintf(out, "%s\t%u %u %.0f\n", key, reqsize, depth, rate / 1024) > 0);
+
+	if ( (fclose(out) != 0) || !ok || rename(tmp, path) )
+		unlink(tmp);
+}
+
+/* cyusb_autotune_lookup:
+   Get the request size and queue depth stored for an endpoint by an earlier cyusb_autotune().
+ */
+int
+cyusb_autotune_lookup (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int *reqsize,
+		unsigned int *queuedepth)
+{
+	char key[TUNE_KEY_LEN];
+	int r;
+
+	r = tune_key(ctx, index, endpoint, key);
+	if ( r )
+		return r;
+	return store_lookup(key, reqsize, queuedepth);
+}
+
+int
+cyusb_autotune_lookup (
+		int index,
+		unsigned char endpoint,
+		unsigned int *reqsize,
+		unsigned int *queuedepth)
+{
+	return cyusb_autotune_lookup(default_context(), index, endpoint, reqsize, queuedepth);
+}
+
+/* cyusb_autotune:
+   Search for the request size and queue depth with the highest throughput on an endpoint.
+   From the starting point, the neighbours at twice and half either setting are measured, and
+   the search moves to the first one that is more than TUNE_GAIN percent faster. It stops at
+   a point none of whose neighbours is, and stores that point. Returns the throughput there
+   in KBps.
+ */
+int
+cyusb_autotune (
+		cyusb_context *ctx,
+		int index,
+		unsigned char endpoint,
+		unsigned int *reqsize,
+		unsigned int *queuedepth)
+{
+	static const int moves[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+	struct tune_point pts[TUNE_MAX_POINTS];
+	const struct cyusb_endpoint *ep;
+	char key[TUNE_KEY_LEN];
+	unsigned int rs, qd, best_rs, best_qd;
+	double rate, best;
+	int npts = 0;
+	int i, j, r;
+	bool moved;
+
+	r = tune_key(ctx, index, endpoint, key);
+	if ( r )
+		return r;
+	ep = cyusb_getendpoint(ctx, index, endpoint);
+	if ( !ep || (ep->type == LIBUSB_TRANSFER_TYPE_CONTROL) )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* Start from the stored optimum, else from the caller's values, else the defaults. */
+	if ( store_lookup(key, &best_rs, &best_qd) != 0 ) {
+		best_rs = *reqsize ? *reqsize : TUNE_DEFAULT_REQSIZE;
+		best_qd = *queuedepth ? *queuedepth : TUNE_DEFAULT_DEPTH;
+	}
+	if ( best_rs > TUNE_MAX_REQSIZE )
+		best_rs = TUNE_MAX_REQSIZE;
+	if ( best_qd > TUNE_MAX_DEPTH )
+		best_qd = TUNE_MAX_DEPTH;
+
+	best = measure(ctx, index, endpoint, best_rs, best_qd);
+	if ( best < 0 )
+		return (int)best;
+	pts[npts].reqsize = best_rs;
+	pts[npts].depth   = best_qd;
+	pts[npts].rate    = best;
+	++npts;
+
+	do {
+		moved = false;
+		for ( i = 0; (i < 4) && !moved && (npts < TUNE_MAX_POINTS); ++i ) {
+			rs = (moves[i][0] > 0) ? best_rs * 2 : (moves[i][0] < 0) ? best_rs / 2 : best_rs;
+			qd = (moves[i][1] > 0) ? best_qd * 2 : (moves[i][1] < 0) ? best_qd / 2 : best_qd;
+			if ( (rs == 0) || (qd == 0) || (rs > TUNE_MAX_REQSIZE) || (qd > TUNE_MAX_DEPTH) ||
+					((unsigned long long)rs * qd * ep->pktsize > TUNE_MAX_BYTES) )
+				continue;
+
+			for ( j = 0; j < npts; ++j ) {
+				if ( (pts[j].reqsize == rs) && (pts[j].depth == qd) )
+					break;
+			}
+			if ( j < npts )
+				continue;
+
+			rate = measure(ctx, index, endpoint, rs, qd);
+			pts[npts].reqsize = rs;
+			pts[npts].depth   = qd;
+			pts[npts].rate    = rate;
+			++npts;
+
+			if ( rate > best * (100 + TUNE_GAIN) / 100 ) {
+				best    = rate;
+				best_rs = rs;
+				best_qd = qd;
+				moved   = true;
+			}
+		}
+	} while ( moved );
+
+	/* A point nothing was measured at is never stored. */
+	if ( best <= 0 )
+		return LIBUSB_ERROR_TIMEOUT;
+	store_save(key, best_rs, best_qd, best);
+	*reqsize    = best_rs;
+	*queuedepth = best_qd;
+	return (int)(best / 1024);
+}
+
+int
+cyusb_autotune (
+		int index,
+		unsigned char endpoint,
+		unsigned int *reqsize,
+		unsigned int *queuedepth)
+{
+	return cyusb_autotune(default_context(), index, endpoint, reqsize, queuedepth);
+}
+
+/*[]*/
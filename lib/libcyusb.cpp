@@ -16,12 +16,25 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <limits.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
+#include "cyusb_context.h"
+#include "cyusb_config.h"
+#include "cyusb_slab.h"
+#include "cyusb_hist.h"
 
 /* Maximum length of a string read from the Configuration file (/etc/cyusb.conf) for the library. */
-#define MAX_CFG_LINE_LENGTH                     (120)
+#define MAX_CFG_LINE_LENGTH                     (256)
 
 /* Maximum length for a filename. */
 #define MAX_FILEPATH_LENGTH			(256)
@@ -29,23 +42,15 @@
 /* Maximum size of EZ-USB FX3 firmware binary. Limited by amount of RAM available. */
 #define FX3_MAX_FW_SIZE				(524288)
 
-static struct cydev 	cydev[MAXDEVICES];		/* List of devices of interest that are connected. */
-static int          	nid;				/* Number of Interesting Devices. */
-static libusb_device	**list;				/* libusb device list used by the cyusb library. */
+/* File in the cache directory remembering the device node of each serial number. */
+#define DEVICE_CACHE_NAME			"devices"
 
-/*
-   struct VPD
-   Used to store information about the devices of interest listed in /etc/cyusb.conf
- */
-struct VPD {
-	unsigned short	vid;				/* USB Vendor ID. */
-	unsigned short	pid;				/* USB Product ID. */
-	char		desc[MAX_STR_LEN];		/* Device description. */
-};
+/* Default number of threads used by cyusb_prepare(). */
+#define PREPARE_THREADS				(8)
 
-static struct VPD	vpd[MAX_ID_PAIRS];		/* Known device database. */
-static int 		maxdevices;			/* Number of devices in the vpd database. */
-static unsigned int 	checksum = 0;			/* Checksum calculated on the Cypress firmware binary. */
+static cyusb_context	*defctx = NULL;			/* Context used by the functions without a context argument. */
+static cyusb_context	*closing = NULL;		/* Closed contexts that still have acquired handles. */
+static pthread_mutex_t	deflock = PTHREAD_MUTEX_INITIALIZER;	/* Serialises changes of defctx and closing. */
 
 /* The following variables are used by the cyusb_linux application. */
        char		pidfile[MAX_FILEPATH_LENGTH];	/* Full path to the PID file specified in /etc/cyusb.conf */
@@ -76,18 +81,20 @@ isempty (
 
 
 /* parse_configfile:
-   Parse the cyusb.conf file and get the list of USB devices of interest.
+   Parse the cyusb.conf file into an empty matcher, and get the LogFile and PIDFile settings.
+   Unknown keys and malformed entries are reported and skipped. Returns 0, or -ENOENT if the
+   file cannot be read.
  */
-static void
-parse_configfile( const char* cyusb_conf ) {
+static int
+parse_configfile( const char* cyusb_conf, struct cyusb_matcher *m, char *log, char *pid ) {
 	FILE *inp = nullptr;
 	char buf[MAX_CFG_LINE_LENGTH];
 	char *cp1, *cp2, *cp3;
-	int i;
+	int r;
 
 	inp = fopen( cyusb_conf, "r" );
 	if ( inp == nullptr ) // if not found...
-		return; // ...give up
+		return -ENOENT; // ...give up
 
 	memset(buf,'\0',MAX_CFG_LINE_LENGTH);
 	while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
@@ -98,268 +105,2581 @@ parse_configfile( const char* cyusb_conf ) {
 		if ( isempty(buf,strlen(buf)) )		/* Any blank line is also ignored		*/
 			continue;
 
-		cp1 = strtok(buf," =\t\n");
-		if ( !strcmp(cp1,"LogFile") ) {
-			cp2 = strtok(NULL," \t\n");
-			strcpy(logfile,cp2);
-		}
-		else if ( !strcmp(cp1,"PIDFile") ) {
-			cp2 = strtok(NULL," \t\n");
-			strcpy(pidfile,cp2);
-		}
-		else if ( !strcmp(cp1,"<VPD>") ) {
-			while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
-				if ( buf[0] == '#' ) 		/* Any line starting with a # is a comment 	*/
-					continue;
-				if ( buf[0] == '\n' )
-					continue;
-				if ( isempty(buf,strlen(buf)) )	/* Any blank line is also ignored		*/
-					continue;
-				if ( maxdevices == (MAX_ID_PAIRS - 1) )
-					continue;
-				cp1 = strtok(buf," \t\n");
-				if ( !strcmp(cp1,"</VPD>") )
-					break;
-				cp2 = strtok(NULL, " \t");
-				cp3 = strtok(NULL, "\n");
-                                while ( *cp3 == ' ' || *cp3 == '\t' ) // strip leading whitespace
-                                    ++cp3;
+		cp1 = strtok(buf," =\t\n");
+		if ( !strcmp(cp1,"LogFile") ) {
+			cp2 = strtok(NULL," \t\n");
+			if ( cp2 )
+				snprintf(log, MAX_FILEPATH_LENGTH, "%s", cp2);
+		}
+		else if ( !strcmp(cp1,"PIDFile") ) {
+			cp2 = strtok(NULL," \t\n");
+			if ( cp2 )
+				snprintf(pid, MAX_FILEPATH_LENGTH, "%s", cp2);
+		}
+		else if ( !strcmp(cp1,"<VPD>") ) {
+			while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
+				if ( buf[0] == '#' ) 		/* Any line starting with a # is a comment 	*/
+					continue;
+				if ( buf[0] == '\n' )
+					continue;
+				if ( isempty(buf,strlen(buf)) )	/* Any blank line is also ignored		*/
+					continue;
+				cp1 = strtok(buf," \t\n");
+				if ( !strcmp(cp1,"</VPD>") )
+					break;
+				cp2 = strtok(NULL, " \t\n");
+				cp3 = strtok(NULL, "\n");
+				if ( cp3 == NULL )
+					cp3 = (char *)"";
+                                while ( *cp3 == ' ' || *cp3 == '\t' ) // strip leading whitespace
+                                    ++cp3;
+
+				/* The PID may also be a range (00F0-00FF) or a wildcard (*). */
+				r = ( cp2 == NULL ) ? -2 : matcher_parse(m, cp1, cp2, cp3);
+				if ( r == -2 )
+					printf( "Ignoring malformed entry in config file %s: %s %s\n", cyusb_conf,
+							cp1, cp2 ? cp2 : "" );
+				else if ( r < 0 )
+					printf( "Library: Out of memory for device database\n" );
+			}
+		}
+		else
+			printf( "Ignoring unknown key in config file %s: %s\n", cyusb_conf, cp1 );
+	}
+
+	fclose(inp);
+	return 0;
+}
+
+/* load_configfile:
+   Get the devices of interest and the settings from a configuration file, through its binary
+   image if that is up to date, or else by parsing the file and saving a new image. st
+   describes the file.
+ */
+static int
+load_configfile (
+		const char *path,
+		const struct stat *st,
+		struct cyusb_matcher *m,
+		char *log,
+		char *pid)
+{
+	int r;
+
+	if ( confcache_load(path, st, m, log, pid) == 0 )
+		return 0;
+
+	r = parse_configfile(path, m, log, pid);
+	if ( r == 0 )
+		confcache_store(path, st, m, log, pid);
+	return r;
+}
+
+/* device_is_of_interest:
+   Check whether the current USB device is among the devices of interest. Returns the
+   matching entry of the device database, or NULL.
+ */
+static const struct VPD *
+device_is_of_interest (
+		struct cyusb_context *ctx,
+		libusb_device *d)
+{
+	struct libusb_device_descriptor desc;
+
+	libusb_get_device_descriptor(d, &desc);
+	return matcher_lookup(&ctx->matcher, desc.idVendor, desc.idProduct);
+}
+
+/* cyusb_getvendor:
+   Get the Vendor ID for the current USB device.
+ */
+unsigned short
+cyusb_getvendor (
+		libusb_device_handle *h)
+{
+	struct libusb_device_descriptor d;
+	libusb_device *tdev = libusb_get_device(h);
+	libusb_get_device_descriptor(tdev, &d);
+	return d.idVendor;
+}
+
+/* get_node_path:
+   Get the sysfs name of a USB device from its device node, through the /sys/dev/char link.
+ */
+static int
+get_node_path (
+		libusb_device *tdev,
+		char *path)
+{
+	char node[64];
+	char link[MAX_FILEPATH_LENGTH];
+	char target[MAX_FILEPATH_LENGTH];
+	const char *name;
+	struct stat st;
+	int n;
+
+	sprintf(node, "/dev/bus/usb/%03d/%03d", libusb_get_bus_number(tdev), libusb_get_device_address(tdev));
+	if ( stat(node, &st) != 0 )
+		return -ENOENT;
+
+	sprintf(link, "/sys/dev/char/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	n = readlink(link, target, sizeof(target) - 1);
+	if ( n <= 0 )
+		return -ENOENT;
+	target[n] = '\0';
+
+	name = strrchr(target, '/');
+	name = name ? name + 1 : target;
+	if ( strlen(name) >= CYUSB_PATH_LEN )
+		return -ENAMETOOLONG;
+	strcpy(path, name);
+	return 0;
+}
+
+/* get_device_path:
+   Build the bus/port path of a USB device, in the same form as its sysfs name (e.g. "2-1.4").
+ */
+static void
+get_device_path (
+		libusb_device *tdev,
+		char *path)
+{
+	unsigned char ports[7];
+	int nports;
+	int i, n;
+
+	nports = libusb_get_port_numbers(tdev, ports, sizeof(ports));
+	if ( nports <= 0 ) {
+		/* A device opened from its device node has no known parent; ask sysfs. */
+		if ( (libusb_get_device_address(tdev) > 1) && (get_node_path(tdev, path) == 0) )
+			return;
+		sprintf(path, "usb%d", libusb_get_bus_number(tdev));
+		return;
+	}
+
+	n = sprintf(path, "%d-%d", libusb_get_bus_number(tdev), ports[0]);
+	for ( i = 1; i < nports; ++i )
+		n += sprintf(path + n, ".%d", ports[i]);
+}
+
+/* read_serial:
+   Get the serial number of a device. It is taken from sysfs where possible, so that no device
+   handle is needed, and otherwise read from the device through the given handle, if any.
+ */
+static void
+read_serial (
+		struct cydev_entry *e,
+		libusb_device_handle *handle,
+		char *serial)
+{
+	char sysfs_path[64 + CYUSB_PATH_LEN];
+	struct libusb_device_descriptor desc;
+	int fd;
+	int n;
+
+	serial[0] = '\0';
+
+	sprintf(sysfs_path, "/sys/bus/usb/devices/%s/serial", e->path);
+	fd = open(sysfs_path, O_RDONLY);
+	if ( fd >= 0 ) {
+		n = read(fd, serial, CYUSB_SERIAL_LEN - 1);
+		close(fd);
+		if ( n > 0 ) {
+			while ( (n > 0) && ((serial[n - 1] == '\n') || (serial[n - 1] == ' ')) )
+				--n;
+			serial[n] = '\0';
+			return;
+		}
+	}
+
+	if ( !handle )
+		return;
+	libusb_get_device_descriptor(e->cd.dev, &desc);
+	if ( desc.iSerialNumber == 0 )
+		return;
+	n = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+			(unsigned char *)serial, CYUSB_SERIAL_LEN);
+	serial[(n > 0) ? n : 0] = '\0';
+}
+
+/* new_entry:
+   Allocate a device table entry describing a USB device. If a handle is already open on the
+   device, it is kept for cyusb_gethandle() until the device is removed.
+ */
+static struct cydev_entry *
+new_entry (
+		struct cyusb_context *ctx,
+		libusb_device *tdev,
+		libusb_device_handle *handle,
+		const struct VPD *vpd)
+{
+	struct libusb_device_descriptor desc;
+	struct cydev_entry *e;
+
+	e = (struct cydev_entry *)calloc(1, sizeof(struct cydev_entry));
+	if ( !e )
+		return NULL;
+
+	libusb_get_device_descriptor(tdev, &desc);
+	e->cd.dev     = libusb_ref_device(tdev);
+	e->cd.handle  = handle;
+	e->cd.vid     = desc.idVendor;
+	e->cd.pid     = desc.idProduct;
+	e->cd.is_open = (handle != NULL);
+	e->cd.busnum  = libusb_get_bus_number(tdev);
+	e->cd.devaddr = libusb_get_device_address(tdev);
+	e->refs       = 1;
+	e->users      = (handle != NULL);
+	e->pinned     = (handle != NULL);
+	e->sysfd      = -1;
+	get_device_path(tdev, e->path);
+	e->descs      = desc_cache_get(&ctx->desccache, tdev, e->path);
+	e->stats      = stats_device_get(&ctx->stats, e->path, desc.idVendor, desc.idProduct);
+	read_serial(e, handle, e->serialbuf);
+	e->serial     = e->serialbuf[0] ? e->serialbuf : "";
+	if ( vpd )
+		strcpy(e->descbuf[0], vpd->desc);
+	e->desc       = e->descbuf[0];
+	return e;
+}
+
+/* release_entry:
+   Close the handle held by a device table entry and free the entry.
+ */
+static void
+release_entry (
+		struct cydev_entry *e)
+{
+	if ( e->cd.handle ) {
+		slab_drop_handle(e->cd.handle);
+		libusb_close(e->cd.handle);
+	}
+	if ( e->sysfd >= 0 )
+		close(e->sysfd);
+	if ( e->cd.dev )
+		libusb_unref_device(e->cd.dev);
+	free(e);
+}
+
+/* publish:
+   Publish a snapshot of the device table for lookups, and free the previous one once no
+   reader can see it any more. Called with the device table lock held, after every change.
+   If memory runs out, an empty snapshot is published, so that readers never see an entry
+   that is about to be freed.
+ */
+static void
+publish (
+		struct cyusb_context *ctx)
+{
+	struct cydev_snapshot *snap, *old;
+
+	snap = ctx->closed ? NULL : snap_build(&ctx->devtab);
+	if ( !snap && !ctx->closed )
+		printf("Library: Out of memory for device table snapshot\n");
+
+	old = __atomic_exchange_n(&ctx->snap, snap, __ATOMIC_SEQ_CST);
+	if ( old ) {
+		snap_synchronize();
+		snap_free(old);
+	}
+}
+
+/* open_entry:
+   Open the handle of a device table entry, unless it is open already. The serial number is
+   read now if sysfs did not provide it at enumeration. Called with the device table lock held.
+ */
+static int
+open_entry (
+		struct cyusb_context *ctx,
+		struct cydev_entry *e)
+{
+	char serial[CYUSB_SERIAL_LEN];
+	int r;
+
+	if ( e->cd.handle )
+		return 0;
+
+	r = libusb_open(e->cd.dev, &e->cd.handle);
+	if ( r ) {
+		e->cd.handle = NULL;
+		return r;
+	}
+	e->cd.is_open = 1;
+
+	if ( (e->serial[0] == '\0') && (devtab_get(&ctx->devtab, e->index) == e) ) {
+		read_serial(e, e->cd.handle, serial);
+		if ( serial[0] ) {
+			devtab_set_serial(&ctx->devtab, e, serial);
+			publish(ctx);
+		}
+	}
+	return 0;
+}
+
+/* drop_user:
+   Give up one use of the handle of an entry, closing the handle with the last one.
+ */
+static void
+drop_user (
+		struct cydev_entry *e)
+{
+	if ( --e->users > 0 )
+		return;
+
+	if ( e->cd.handle ) {
+		slab_drop_handle(e->cd.handle);
+		libusb_close(e->cd.handle);
+	}
+	if ( e->sysfd >= 0 )
+		close(e->sysfd);
+	e->cd.handle  = NULL;
+	e->cd.is_open = 0;
+	e->sysfd      = -1;
+}
+
+/* drop_ref:
+   Drop one reference on an entry. The entry is freed with the last reference; until then a
+   removed entry stays on the retired list, where cyusb_release() can find it.
+ */
+static void
+drop_ref (
+		struct cyusb_context *ctx,
+		struct cydev_entry *e)
+{
+	struct cydev_entry **pp;
+
+	if ( --e->refs > 0 )
+		return;
+
+	for ( pp = &ctx->retired; *pp; pp = &(*pp)->next_retired ) {
+		if ( *pp == e ) {
+			*pp = e->next_retired;
+			break;
+		}
+	}
+	release_entry(e);
+}
+
+/* retire_entry:
+   Dispose of an entry that has been taken out of the table and is no longer in the published
+   snapshot. Its handle is closed now, unless the application still has it acquired. Called
+   with the device table lock held.
+ */
+static void
+retire_entry (
+		struct cyusb_context *ctx,
+		struct cydev_entry *e)
+{
+	if ( e->pinned ) {
+		e->pinned = 0;
+		drop_user(e);
+	}
+	if ( e->refs > 1 ) {
+		e->next_retired = ctx->retired;
+		ctx->retired = e;
+	}
+	drop_ref(ctx, e);
+}
+
+/* remove_device:
+   Take the device at the given slot out of the table. No lookup can return it once the new
+   snapshot is published, so only then is its handle closed. Called with the device table
+   lock held.
+ */
+static void
+remove_device (
+		struct cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e = devtab_remove(&ctx->devtab, index);
+
+	if ( !e )
+		return;
+
+	if ( e->stats )
+		__atomic_store_n(&e->stats->index, -1, __ATOMIC_RELAXED);
+	publish(ctx);
+	retire_entry(ctx, e);
+}
+
+/* add_device:
+   Add a device to the device table, together with the handle opened on it, if any. Returns
+   the slot index.
+ */
+static int
+add_device (
+		struct cyusb_context *ctx,
+		libusb_device *tdev,
+		libusb_device_handle *handle,
+		const struct VPD *vpd)
+{
+	unsigned long long start = hist_now();
+	struct cydev_entry *e;
+	int index;
+
+	e = new_entry(ctx, tdev, handle, vpd);
+	if ( e ) {
+		index = devtab_insert(&ctx->devtab, e);
+		if ( index >= 0 ) {
+			if ( e->stats ) {
+				__atomic_store_n(&e->stats->index, index, __ATOMIC_RELAXED);
+				stats_add(&e->stats->connects, 1);
+				stats_add(&e->stats->enum_ns, hist_now() - start);
+			}
+			return index;
+		}
+		free(e);
+	}
+
+	printf("Library: Out of memory for device table\n");
+	if ( handle )
+		libusb_close(handle);
+	return -ENOMEM;
+}
+
+/* in_shard:
+   Check whether a device of interest belongs to the shard of a context, by a hash of its
+   bus/port path. The same device lands in the same shard at enumeration and on hotplug.
+ */
+static bool
+in_shard (
+		struct cyusb_context *ctx,
+		libusb_device *tdev)
+{
+	char path[CYUSB_PATH_LEN];
+
+	if ( ctx->nshards <= 1 )
+		return true;
+
+	get_device_path(tdev, path);
+	return (int)(devtab_hash_string(path) % ctx->nshards) == ctx->shard;
+}
+
+/* renumerate:
+   Store information about all USB devices of interest. No device is opened here; handles are
+   opened on first use by cyusb_gethandle() or cyusb_acquire().
+ */
+static int
+renumerate (
+		struct cyusb_context *ctx)
+{
+	libusb_device **list = NULL;
+	const struct VPD *vpd;
+	int           numdev;
+	int           i;
+	int           r;
+
+	numdev = libusb_get_device_list(ctx->usb, &list);
+	if ( numdev < 0 ) {
+		printf("Library: Error in enumerating devices...\n");
+		return -ENODEV;
+	}
+
+	for ( i = 0; i < numdev; ++i ) {
+		libusb_device *tdev = list[i];
+		vpd = device_is_of_interest(ctx, tdev);
+		if ( vpd && in_shard(ctx, tdev) ) {
+			r = add_device(ctx, tdev, NULL, vpd);
+			if ( r < 0 ) {
+				libusb_free_device_list(list, 1);
+				return r;
+			}
+		}
+	}
+
+	/* The device table holds its own reference on each device of interest. */
+	libusb_free_device_list(list, 1);
+	publish(ctx);
+	return ctx->devtab.count;
+}
+
+/* find_cydev:
+   Get the device table slot that refers to a libusb device, or -1 if it is not in the table.
+ */
+static int
+find_cydev (
+		struct cyusb_context *ctx,
+		libusb_device *tdev)
+{
+	char path[CYUSB_PATH_LEN];
+	struct cydev_entry *e;
+
+	get_device_path(tdev, path);
+	e = devtab_find_path(&ctx->devtab, path);
+	if ( (e == NULL) || (e->cd.dev != tdev) )
+		return -1;
+	return e->index;
+}
+
+/* hotplug_callback:
+   Called by libusb on the event thread whenever a USB device arrives or leaves. Only the
+   affected slot of the device table is updated; handles to all other devices stay untouched.
+ */
+static int LIBUSB_CALL
+hotplug_callback (
+		libusb_context *,
+		libusb_device *tdev,
+		libusb_hotplug_event event,
+		void *user_data)
+{
+	struct cyusb_context *ctx = (struct cyusb_context *)user_data;
+	const struct VPD *vpd;
+	struct cydev_entry *e;
+	int index;
+
+	pthread_mutex_lock(&ctx->devlock);
+	if ( event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ) {
+		vpd = device_is_of_interest(ctx, tdev);
+		if ( (vpd == NULL) || !in_shard(ctx, tdev) || (find_cydev(ctx, tdev) >= 0) ) {
+			pthread_mutex_unlock(&ctx->devlock);
+			return 0;
+		}
+
+		index = add_device(ctx, tdev, NULL, vpd);
+		if ( index >= 0 )
+			publish(ctx);
+		pthread_mutex_unlock(&ctx->devlock);
+		if ( index < 0 )
+			return 0;
+
+		if ( ctx->hotplug_notify )
+			ctx->hotplug_notify(index, CYUSB_DEVICE_ARRIVED, ctx->hotplug_user);
+	}
+	else {
+		index = find_cydev(ctx, tdev);
+		if ( index < 0 ) {
+			pthread_mutex_unlock(&ctx->devlock);
+			return 0;
+		}
+		e = devtab_get(&ctx->devtab, index);
+		++e->refs;				/* Keeps the entry until it is reported. */
+		pthread_mutex_unlock(&ctx->devlock);
+
+		/* Let the application drop its use of the handle before it is closed. */
+		if ( ctx->hotplug_notify )
+			ctx->hotplug_notify(index, CYUSB_DEVICE_LEFT, ctx->hotplug_user);
+
+		/* A configuration reload may have removed the entry meanwhile, and reused its slot. */
+		pthread_mutex_lock(&ctx->devlock);
+		if ( devtab_get(&ctx->devtab, index) == e )
+			remove_device(ctx, index);
+		drop_ref(ctx, e);
+		pthread_mutex_unlock(&ctx->devlock);
+	}
+
+	return 0;
+}
+
+/* event_thread_func:
+   Handles libusb events of a context, so that hotplug notifications and the completions of
+   stream transfers get delivered. The timeout bounds the time taken to see a stop request
+   on versions of libusb that cannot interrupt the event handler.
+ */
+static void *
+event_thread_func (
+		void *arg)
+{
+	struct cyusb_context *ctx = (struct cyusb_context *)arg;
+	struct timeval tv;
+
+	while ( !ctx->event_thread_stop ) {
+		tv.tv_sec  = 1;
+		tv.tv_usec = 0;
+		libusb_handle_events_timeout_completed(ctx->usb, &tv, (int *)&ctx->event_thread_stop);
+	}
+	return NULL;
+}
+
+/* cpu_mask:
+   Get the set of CPUs an event thread may run on: the given one, or all for -1.
+ */
+static void
+cpu_mask (
+		int cpu,
+		cpu_set_t *set)
+{
+	long n = sysconf(_SC_NPROCESSORS_CONF);
+	long i;
+
+	CPU_ZERO(set);
+	if ( cpu >= 0 )
+		CPU_SET(cpu, set);
+	else {
+		for ( i = 0; (i < n) && (i < CPU_SETSIZE); ++i )
+			CPU_SET(i, set);
+	}
+}
+
+/* start_event_thread:
+   Start the event thread of a context, on the CPU the context is pinned to. Called with the
+   event lock held.
+ */
+static int
+start_event_thread (
+		struct cyusb_context *ctx)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int r = 0;
+
+	ctx->event_thread_stop = 0;
+	pthread_attr_init(&attr);
+	if ( ctx->event_cpu >= 0 ) {
+		cpu_mask(ctx->event_cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	if ( pthread_create(&ctx->event_thread, &attr, event_thread_func, ctx) != 0 )
+		r = -ENOMEM;
+	pthread_attr_destroy(&attr);
+
+	return r;
+}
+
+/* stop_event_thread:
+   Stop the event thread of a context and wait for it. Called with the event lock held.
+ */
+static void
+stop_event_thread (
+		struct cyusb_context *ctx)
+{
+	ctx->event_thread_stop = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	libusb_interrupt_event_handler(ctx->usb);
+#endif
+	pthread_join(ctx->event_thread, NULL);
+}
+
+/* event_thread_get:
+   Take a use of the event thread of a context, starting the thread on first use unless the
+   application loop handles the events.
+ */
+int
+event_thread_get (
+		struct cyusb_context *ctx)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&ctx->eventlock);
+	if ( (ctx->event_users == 0) && !ctx->event_external )
+		r = start_event_thread(ctx);
+	if ( r == 0 )
+		++ctx->event_users;
+	pthread_mutex_unlock(&ctx->eventlock);
+
+	return r;
+}
+
+/* event_thread_put:
+   Give up a use of the event thread of a context, and stop the thread after the last one.
+   Must not be called on the event thread.
+ */
+void
+event_thread_put (
+		struct cyusb_context *ctx)
+{
+	pthread_mutex_lock(&ctx->eventlock);
+	if ( (--ctx->event_users == 0) && !ctx->event_external )
+		stop_event_thread(ctx);
+	pthread_mutex_unlock(&ctx->eventlock);
+}
+
+/* Context whose events the calling thread is handling in event_handle(), if any. */
+static __thread struct cyusb_context *handling;
+
+/* event_thread_current:
+   Check whether the caller runs on the event thread of a context, or handles its events from
+   the application loop; that is, whether it is in a callback.
+ */
+bool
+event_thread_current (
+		struct cyusb_context *ctx)
+{
+	bool r;
+
+	if ( handling == ctx )
+		return true;
+
+	pthread_mutex_lock(&ctx->eventlock);
+	r = (ctx->event_users > 0) && !ctx->event_external && pthread_equal(ctx->event_thread, pthread_self());
+	pthread_mutex_unlock(&ctx->eventlock);
+
+	return r;
+}
+
+/* event_set_external:
+   Hand the events of a context over to the application loop, stopping the event thread if
+   it runs, or give them back to the event thread. If the thread is needed and cannot be
+   started, the events stay with the application loop.
+ */
+int
+event_set_external (
+		struct cyusb_context *ctx,
+		bool external)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&ctx->eventlock);
+	if ( external != ctx->event_external ) {
+		if ( ctx->event_users > 0 ) {
+			if ( external )
+				stop_event_thread(ctx);
+			else
+				r = start_event_thread(ctx);
+		}
+		if ( r == 0 )
+			__atomic_store_n(&ctx->event_external, external, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ctx->eventlock);
+
+	return r;
+}
+
+/* event_handle:
+   Handle the libusb events of a context for up to the given time, in place of the event
+   thread. Callbacks run on the calling thread.
+ */
+int
+event_handle (
+		struct cyusb_context *ctx,
+		struct timeval *tv)
+{
+	struct cyusb_context *prev = handling;
+	int r;
+
+	handling = ctx;
+	r = libusb_handle_events_timeout_completed(ctx->usb, tv, NULL);
+	handling = prev;
+
+	return r;
+}
+
+/* event_wait:
+   Wait on a condition signalled from a callback, with the lock held. When the application
+   loop handles the events, the waiter may be the thread of that loop, so it handles them
+   itself while it waits.
+ */
+void
+event_wait (
+		struct cyusb_context *ctx,
+		pthread_mutex_t *lock,
+		pthread_cond_t *cond)
+{
+	struct timeval tv;
+
+	if ( !__atomic_load_n(&ctx->event_external, __ATOMIC_ACQUIRE) ) {
+		pthread_cond_wait(cond, lock);
+		return;
+	}
+
+	tv.tv_sec  = 0;
+	tv.tv_usec = 100000;
+	pthread_mutex_unlock(lock);
+	event_handle(ctx, &tv);
+	pthread_mutex_lock(lock);
+}
+
+/* cyusb_set_event_cpu:
+   Pin the event thread of a context to a CPU, or let it run on all CPUs again with -1. Takes
+   effect at once if the thread runs, else when it is started.
+ */
+int
+cyusb_set_event_cpu (
+		cyusb_context *ctx,
+		int cpu)
+{
+	cpu_set_t set;
+	int r = 0;
+
+	if ( !ctx || (cpu < -1) || (cpu >= CPU_SETSIZE) )
+		return -EINVAL;
+
+	pthread_mutex_lock(&ctx->eventlock);
+	ctx->event_cpu = cpu;
+	if ( ctx->event_users > 0 ) {
+		cpu_mask(cpu, &set);
+		r = -pthread_setaffinity_np(ctx->event_thread, sizeof(set), &set);
+	}
+	pthread_mutex_unlock(&ctx->eventlock);
+	return r;
+}
+
+/* cyusb_start_events:
+   Take a use of the event thread of a context, for transfers that the application submits
+   to libusb itself on handles of the context.
+ */
+int
+cyusb_start_events (
+		cyusb_context *ctx)
+{
+	if ( !ctx )
+		return -EINVAL;
+	return event_thread_get(ctx);
+}
+
+int
+cyusb_start_events (
+		void)
+{
+	return cyusb_start_events(defctx);
+}
+
+/* cyusb_stop_events:
+   Give up a use of the event thread taken with cyusb_start_events().
+ */
+void
+cyusb_stop_events (
+		cyusb_context *ctx)
+{
+	if ( ctx )
+		event_thread_put(ctx);
+}
+
+void
+cyusb_stop_events (
+		void)
+{
+	cyusb_stop_events(defctx);
+}
+
+/* cyusb_hotplug_register:
+   Start tracking device arrival and removal through libusb hotplug events.
+ */
+int
+cyusb_hotplug_register (
+		cyusb_context *ctx,
+		cyusb_hotplug_cb cb,
+		void *user)
+{
+	int r;
+
+	if ( !ctx )
+		return -EINVAL;
+
+	if ( ctx->hotplug_active )
+		return -EBUSY;
+
+	if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) )
+		return -ENOTSUP;
+
+	ctx->hotplug_notify = cb;
+	ctx->hotplug_user   = user;
+
+	/* Devices already present are reported again and skipped, so that nothing attached
+	   between the initial enumeration and this registration is lost. */
+	r = libusb_hotplug_register_callback(ctx->usb,
+			(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, ctx, &ctx->hotplug_handle);
+	if ( r != LIBUSB_SUCCESS ) {
+		ctx->hotplug_notify = NULL;
+		ctx->hotplug_user   = NULL;
+		return r;
+	}
+
+	r = event_thread_get(ctx);
+	if ( r != 0 ) {
+		libusb_hotplug_deregister_callback(ctx->usb, ctx->hotplug_handle);
+		ctx->hotplug_notify = NULL;
+		ctx->hotplug_user   = NULL;
+		return r;
+	}
+
+	ctx->hotplug_active = true;
+	return 0;
+}
+
+int
+cyusb_hotplug_register (
+		cyusb_hotplug_cb cb,
+		void *user)
+{
+	return cyusb_hotplug_register(defctx, cb, user);
+}
+
+/* cyusb_hotplug_deregister:
+   Stop tracking device arrival and removal.
+ */
+void
+cyusb_hotplug_deregister (
+		cyusb_context *ctx)
+{
+	if ( !ctx || !ctx->hotplug_active )
+		return;
+
+	libusb_hotplug_deregister_callback(ctx->usb, ctx->hotplug_handle);
+	event_thread_put(ctx);
+
+	ctx->hotplug_active = false;
+	ctx->hotplug_notify = NULL;
+	ctx->hotplug_user   = NULL;
+}
+
+void
+cyusb_hotplug_deregister (
+		void)
+{
+	cyusb_hotplug_deregister(defctx);
+}
+
+/* reload_config:
+   Re-read the configuration file of a context and apply it to the device table. Devices that
+   are no longer of interest leave, devices that have become of interest arrive, and all
+   others keep their slot and their handle. Changes are reported to the hotplug callback.
+ */
+static int
+reload_config (
+		struct cyusb_context *ctx)
+{
+	struct cyusb_matcher m, old;
+	char log[MAX_FILEPATH_LENGTH] = "";
+	char pid[MAX_FILEPATH_LENGTH] = "";
+	libusb_device **list = NULL;
+	struct cydev_entry **gone = NULL;
+	int *arrived = NULL;
+	const struct VPD *vpd;
+	struct cydev_entry *e;
+	struct stat st;
+	int ngone = 0, narrived = 0, nrenamed = 0;
+	char *desc;
+	int numdev;
+	int i, r;
+
+	if ( stat(ctx->config, &st) != 0 )
+		return -errno;
+
+	matcher_init(&m);
+	r = load_configfile(ctx->config, &st, &m, log, pid);
+	if ( r ) {
+		matcher_free(&m);
+		return r;
+	}
+
+	numdev = libusb_get_device_list(ctx->usb, &list);
+	if ( numdev < 0 )
+		numdev = 0;
+
+	pthread_mutex_lock(&ctx->devlock);
+	gone    = (struct cydev_entry **)calloc(ctx->devtab.nslots + 1, sizeof(struct cydev_entry *));
+	arrived = (int *)calloc(numdev + 1, sizeof(int));
+	if ( !gone || !arrived ) {
+		pthread_mutex_unlock(&ctx->devlock);
+		free(gone);
+		free(arrived);
+		libusb_free_device_list(list, 1);
+		matcher_free(&m);
+		return -ENOMEM;
+	}
+
+	old = ctx->matcher;
+	ctx->matcher = m;
+	strcpy(logfile, log);
+	strcpy(pidfile, pid);
+
+	for ( i = 0; i < ctx->devtab.nslots; ++i ) {
+		e = devtab_get(&ctx->devtab, i);
+		if ( !e )
+			continue;
+		vpd = device_is_of_interest(ctx, e->cd.dev);
+		if ( !vpd ) {
+			++e->refs;			/* Keeps the entry until it is reported. */
+			gone[ngone++] = e;
+		}
+		else if ( strcmp(e->desc, vpd->desc) ) {
+			/* Lock-free readers may be copying the current description: the new one goes
+			   to the other buffer, which nobody reads since the last grace period. */
+			desc = (e->desc == e->descbuf[0]) ? e->descbuf[1] : e->descbuf[0];
+			strcpy(desc, vpd->desc);
+			__atomic_store_n(&e->desc, (const char *)desc, __ATOMIC_RELEASE);
+			++nrenamed;
+		}
+	}
+
+	for ( i = 0; i < numdev; ++i ) {
+		vpd = device_is_of_interest(ctx, list[i]);
+		if ( vpd && in_shard(ctx, list[i]) && (find_cydev(ctx, list[i]) < 0) ) {
+			r = add_device(ctx, list[i], NULL, vpd);
+			if ( r >= 0 )
+				arrived[narrived++] = r;
+		}
+	}
+	if ( narrived )
+		publish(ctx);
+	if ( nrenamed )
+		snap_synchronize();
+	pthread_mutex_unlock(&ctx->devlock);
+
+	libusb_free_device_list(list, 1);
+	matcher_free(&old);
+
+	/* As for hotplug, the application hears of a removal before the handle is closed. */
+	for ( i = 0; i < ngone; ++i ) {
+		e = gone[i];
+		if ( ctx->hotplug_notify )
+			ctx->hotplug_notify(e->index, CYUSB_DEVICE_LEFT, ctx->hotplug_user);
+
+		pthread_mutex_lock(&ctx->devlock);
+		if ( devtab_get(&ctx->devtab, e->index) == e )
+			remove_device(ctx, e->index);
+		drop_ref(ctx, e);
+		pthread_mutex_unlock(&ctx->devlock);
+	}
+	for ( i = 0; i < narrived; ++i ) {
+		if ( ctx->hotplug_notify )
+			ctx->hotplug_notify(arrived[i], CYUSB_DEVICE_ARRIVED, ctx->hotplug_user);
+	}
+
+	free(gone);
+	free(arrived);
+	return 0;
+}
+
+/* watch_thread_func:
+   Waits for the configuration file to be rewritten, and reloads it.
+ */
+static void *
+watch_thread_func (
+		void *arg)
+{
+	struct cyusb_context *ctx = (struct cyusb_context *)arg;
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	const struct inotify_event *ev;
+	const char *name;
+	struct pollfd fds[2];
+	bool changed;
+	int n;
+
+	name = strrchr(ctx->config, '/');
+	name = name ? name + 1 : ctx->config;
+
+	fds[0].fd     = ctx->watch_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd     = ctx->watch_pipe[0];
+	fds[1].events = POLLIN;
+
+	while ( 1 ) {
+		if ( poll(fds, 2, -1) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+		if ( fds[1].revents )
+			break;
+
+		n = read(ctx->watch_fd, buf, sizeof(buf));
+		if ( n <= 0 )
+			continue;
+
+		/* Editors either rewrite the file or replace it by renaming a new one over it. */
+		changed = false;
+		for ( char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len ) {
+			ev = (const struct inotify_event *)p;
+			if ( ev->len && !strcmp(ev->name, name) )
+				changed = true;
+		}
+
+		if ( changed && reload_config(ctx) )
+			printf("Library: Failed to reload config file %s\n", ctx->config);
+	}
+	return NULL;
+}
+
+/* cyusb_watch_config:
+   Start reloading the configuration file whenever it changes.
+ */
+int
+cyusb_watch_config (
+		cyusb_context *ctx)
+{
+	char dir[PATH_MAX];
+	char *p;
+
+	if ( !ctx )
+		return -EINVAL;
+	if ( !ctx->config )
+		return -ENOENT;
+	if ( ctx->watch_active )
+		return -EBUSY;
+
+	snprintf(dir, sizeof(dir), "%s", ctx->config);
+	p = strrchr(dir, '/');
+	if ( p == dir )
+		p[1] = '\0';
+	else if ( p )
+		*p = '\0';
+	else
+		strcpy(dir, ".");
+
+	ctx->watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if ( ctx->watch_fd < 0 )
+		return -errno;
+
+	if ( (inotify_add_watch(ctx->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) ||
+			(pipe(ctx->watch_pipe) != 0) ) {
+		int r = -errno;
+
+		close(ctx->watch_fd);
+		return r;
+	}
+
+	if ( pthread_create(&ctx->watch_thread, NULL, watch_thread_func, ctx) != 0 ) {
+		close(ctx->watch_pipe[0]);
+		close(ctx->watch_pipe[1]);
+		close(ctx->watch_fd);
+		return -ENOMEM;
+	}
+
+	ctx->watch_active = true;
+	return 0;
+}
+
+int
+cyusb_watch_config (
+		void)
+{
+	return cyusb_watch_config(defctx);
+}
+
+/* cyusb_unwatch_config:
+   Stop reloading the configuration file.
+ */
+void
+cyusb_unwatch_config (
+		cyusb_context *ctx)
+{
+	char c = 0;
+
+	if ( !ctx || !ctx->watch_active )
+		return;
+
+	/* The thread finishes a reload in progress before it sees the request. */
+	if ( write(ctx->watch_pipe[1], &c, 1) != 1 )
+		printf("Library: Failed to stop the config watch thread\n");
+	pthread_join(ctx->watch_thread, NULL);
+	close(ctx->watch_pipe[0]);
+	close(ctx->watch_pipe[1]);
+	close(ctx->watch_fd);
+	ctx->watch_active = false;
+}
+
+void
+cyusb_unwatch_config (
+		void)
+{
+	cyusb_unwatch_config(defctx);
+}
+
+/* create_context:
+   Allocate an empty context. If own_usb is set, the context gets a libusb context of its
+   own; otherwise it uses the default libusb context, as the library always did. Without
+   discover, libusb does not scan the bus, and devices can only be opened from their device
+   node. Versions of libusb before 1.0.27 always scan the bus.
+ */
+static struct cyusb_context *
+create_context (
+		bool own_usb,
+		bool discover)
+{
+	struct cyusb_context *ctx;
+	int r;
+
+	ctx = (struct cyusb_context *)calloc(1, sizeof(struct cyusb_context));
+	if ( !ctx )
+		return NULL;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x0100010A)
+	struct libusb_init_option opt;
+
+	opt.option     = LIBUSB_OPTION_NO_DEVICE_DISCOVERY;
+	opt.value.ival = 0;
+	r = libusb_init_context(own_usb ? &ctx->usb : NULL, &opt, discover ? 0 : 1);
+#else
+	r = libusb_init(own_usb ? &ctx->usb : NULL);
+#endif
+	if (r) {
+		printf("Error in initializing libusb library...\n");
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->refs = 1;
+	ctx->event_cpu = -1;
+	ctx->event_fd  = -1;
+	pthread_mutex_init(&ctx->devlock, NULL);
+	pthread_mutex_init(&ctx->eventlock, NULL);
+	devtab_init(&ctx->devtab);
+	matcher_init(&ctx->matcher);
+	desc_cache_init(&ctx->desccache);
+	stats_init(&ctx->stats);
+	return ctx;
+}
+
+/* find_configfile:
+   Get the configuration file to use. If config is NULL, the user configuration file is used,
+   or else the global one. user_config_path receives the path of the user configuration file,
+   and st the status of the file found. Returns NULL if no configuration file is found.
+ */
+static const char *
+find_configfile (
+		const char *config,
+		char *user_config_path,
+		struct stat *st)
+{
+	static const char global_config_path[] = "/etc/cyusb.conf";
+	const char *path = getenv( "HOME" );
+	int r = -1;
+
+	if ( config ) {
+	    r = stat( path = config, st );
+	}
+	else {
+	    if ( path ) {
+		snprintf( user_config_path, MAX_FILEPATH_LENGTH, "%s/%s", path, ".config/cyusb/cyusb.conf" );
+		path = user_config_path;
+		r = stat( path, st ); // try user config
+	    }
+	    if ( r < 0 ) // if not found...
+		r = stat( path = global_config_path, st ); // ...try global config
+	}
+	if ( r < 0 ) { // if also not found...
+	    printf( "Config file %s not found. Exiting\n", path );
+	    return NULL; // give up
+	}
+	return path;
+}
+
+/* open_context:
+   Create a context, read the configuration file and find all USB devices of interest, or
+   those of one shard out of nshards.
+ */
+static int
+open_context (
+		cyusb_context **pctx,
+		const char *config,
+		bool own_usb,
+		int shard,
+		int nshards)
+{
+	struct cyusb_context *ctx;
+	char user_config_path[ MAX_FILEPATH_LENGTH ] = "";
+	const char *path;
+	struct stat st;
+	int r;
+
+	*pctx = NULL;
+	path = find_configfile(config, user_config_path, &st);
+	if ( !path )
+		return -ENOENT;
+
+	ctx = create_context(own_usb, true);
+	if ( !ctx )
+		return -EACCES;
+	ctx->shard   = shard;
+	ctx->nshards = nshards;
+
+	/* Load the file, or its compiled image, and store information inside the context */
+	r = load_configfile(path, &st, &ctx->matcher, logfile, pidfile);
+	ctx->config = strdup(path);
+	if ( r < 0 ) {
+		printf( "Config file %s cannot be read\n", path );
+		cyusb_close(ctx);
+		return r;
+	}
+
+	/* Get list of USB devices of interest. */
+	r = renumerate(ctx);
+	if ( r < 0 ) {
+		cyusb_close(ctx);
+		return r;
+	}
+
+	*pctx = ctx;
+	return r;
+}
+
+/* open_context_vidpid:
+   Create a context holding just the USB device with specified vid/pid.
+ */
+static int
+open_context_vidpid (
+		cyusb_context **pctx,
+		unsigned short vid,
+		unsigned short pid,
+		bool own_usb)
+{
+	struct cyusb_context *ctx;
+	libusb_device *dev = NULL;
+	libusb_device_handle *h = NULL;
+	int r;
+
+	*pctx = NULL;
+	ctx = create_context(own_usb, true);
+	if ( !ctx )
+		return -EACCES;
+
+	h = libusb_open_device_with_vid_pid(ctx->usb, vid, pid);
+	if ( !h ) {
+		printf("Device not found\n");
+		cyusb_close(ctx);
+		return -ENODEV;
+	}
+
+	dev = libusb_get_device(h);
+	r = add_device(ctx, dev, h, device_is_of_interest(ctx, dev));
+	if ( r < 0 ) {
+		cyusb_close(ctx);
+		return r;
+	}
+
+	*pctx = ctx;
+	return 1;
+}
+
+/* get_cache_path:
+   Get the path of the device node cache, creating its directory if asked to.
+ */
+static int
+get_cache_path (
+		char *path,
+		bool create)
+{
+	int r = cache_dir(path, create);
+
+	if ( r == 0 )
+		strcat(path, "/" DEVICE_CACHE_NAME);
+	return r;
+}
+
+/* cache_lookup:
+   Find the device node last seen for a serial number in the device node cache.
+ */
+static int
+cache_lookup (
+		const char *serial,
+		char *node)
+{
+	char path[PATH_MAX];
+	char buf[MAX_CFG_LINE_LENGTH + CYUSB_SERIAL_LEN];
+	char key[CYUSB_SERIAL_LEN];
+	FILE *fp;
+	int r = -ENOENT;
+
+	if ( get_cache_path(path, false) )
+		return -ENOENT;
+
+	fp = fopen(path, "r");
+	if ( !fp )
+		return -ENOENT;
+
+	while ( fgets(buf, sizeof(buf), fp) ) {
+		if ( (buf[0] == '#') || (sscanf(buf, "%127s %255s", key, node) != 2) )
+			continue;
+		if ( !strcmp(key, serial) ) {
+			r = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return r;
+}
+
+/* cache_store:
+   Rewrite the device node cache with the devices of a context that have a serial number. The
+   file is replaced atomically, so that concurrent tools never see a partial one.
+ */
+static void
+cache_store (
+		struct cyusb_context *ctx)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 16];
+	struct cydev_entry *e;
+	FILE *fp;
+	int i;
+
+	if ( get_cache_path(path, true) )
+		return;
+
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "w");
+	if ( !fp )
+		return;
+
+	fprintf(fp, "# cyusb device node cache: <serial> <device node>\n");
+	for ( i = 0; i < ctx->devtab.nslots; ++i ) {
+		e = devtab_get(&ctx->devtab, i);
+		if ( e && e->serial[0] && !strchr(e->serial, ' ') )
+			fprintf(fp, "%s /dev/bus/usb/%03d/%03d\n", e->serial, e->cd.busnum, e->cd.devaddr);
+	}
+
+	if ( fclose(fp) || rename(tmp, path) )
+		unlink(tmp);
+}
+
+/* open_node:
+   Open a device from its device node and add it to a context, which need not have scanned the
+   bus. If serial is given, the device must have that serial number. Returns the slot index.
+ */
+static int
+open_node (
+		struct cyusb_context *ctx,
+		const char *node,
+		const char *serial)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000107)
+	libusb_device_handle *h = NULL;
+	const struct VPD *vpd;
+	libusb_device *dev;
+	int index;
+	int fd;
+	int r;
+
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if ( fd < 0 )
+		return -errno;
+
+	r = libusb_wrap_sys_device(ctx->usb, (intptr_t)fd, &h);
+	if ( r ) {
+		close(fd);
+		return r;
+	}
+
+	dev = libusb_get_device(h);
+	vpd = device_is_of_interest(ctx, dev);
+	if ( !vpd ) {
+		libusb_close(h);
+		close(fd);
+		return -ENODEV;
+	}
+
+	index = add_device(ctx, dev, h, vpd);
+	if ( index < 0 ) {
+		close(fd);
+		return index;
+	}
+	devtab_get(&ctx->devtab, index)->sysfd = fd;
+
+	/* The node may have been re-used by another device since the cache was written. */
+	if ( serial && strcmp(devtab_get(&ctx->devtab, index)->serial, serial) ) {
+		remove_device(ctx, index);
+		return -ENODEV;
+	}
+
+	publish(ctx);
+	return index;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* find_node:
+   Get the slot of the device with the given device node, or -1.
+ */
+static int
+find_node (
+		struct cyusb_context *ctx,
+		const char *node)
+{
+	struct cydev_entry *e;
+	int busnum, devaddr;
+	int i;
+
+	if ( sscanf(node, "/dev/bus/usb/%d/%d", &busnum, &devaddr) != 2 )
+		return -1;
+
+	for ( i = 0; i < ctx->devtab.nslots; ++i ) {
+		e = devtab_get(&ctx->devtab, i);
+		if ( e && (e->cd.busnum == busnum) && (e->cd.devaddr == devaddr) )
+			return i;
+	}
+	return -1;
+}
+
+/* open_context_device:
+   Create a context holding one device, given by its device node or serial number. The device
+   is opened straight from its node, without scanning the bus, if the node is given or if the
+   device node cache knows the serial number. Otherwise, or if the device has gone from that
+   node, all devices of interest are enumerated and the cache is refreshed. Returns the slot
+   index of the device.
+ */
+static int
+open_context_device (
+		cyusb_context **pctx,
+		const char *config,
+		const char *device,
+		bool own_usb)
+{
+	struct cyusb_context *ctx;
+	char user_config_path[ MAX_FILEPATH_LENGTH ] = "";
+	char cached[MAX_FILEPATH_LENGTH];
+	const char *serial = NULL;
+	const char *node = NULL;
+	const char *path;
+	struct stat st;
+	int index;
+	int r;
+
+	*pctx = NULL;
+	if ( !device )
+		return -EINVAL;
+
+	if ( !strncmp(device, "/dev/", 5) )
+		node = device;
+	else {
+		serial = device;
+		if ( cache_lookup(serial, cached) == 0 )
+			node = cached;
+	}
+
+	if ( node ) {
+		path = find_configfile(config, user_config_path, &st);
+		if ( !path )
+			return -ENOENT;
+
+		ctx = create_context(own_usb, false);
+		if ( !ctx )
+			return -EACCES;
+		ctx->config = strdup(path);
+
+		r = load_configfile(path, &st, &ctx->matcher, logfile, pidfile);
+		index = (r == 0) ? open_node(ctx, node, serial) : r;
+		if ( index >= 0 ) {
+			*pctx = ctx;
+			return index;
+		}
+		cyusb_close(ctx);
+	}
+
+	/* Slow path: scan the bus, and remember where the devices are for the next time. */
+	r = open_context(&ctx, config, own_usb, 0, 0);
+	if ( r < 0 )
+		return r;
+	cache_store(ctx);
+
+	index = serial ? cyusb_find_by_serial(ctx, serial) : find_node(ctx, node);
+	if ( index < 0 ) {
+		printf("Device %s not found\n", device);
+		cyusb_close(ctx);
+		return -ENODEV;
+	}
+
+	*pctx = ctx;
+	return index;
+}
+
+/* cyusb_open:
+   Finds all USB devices of interest, and returns their count.
+ */
+int cyusb_open( void ) {
+	cyusb_context *ctx;
+	int r;
+
+	if ( defctx )
+		cyusb_close();
+	r = open_context(&ctx, NULL, false, 0, 0);
+
+	pthread_mutex_lock(&deflock);
+	defctx = ctx;
+	pthread_mutex_unlock(&deflock);
+	return r;
+}
+
+/* cyusb_open:
+   Open a handle to the USB device with specified vid/pid.
+ */
+int cyusb_open (
+		unsigned short vid,
+		unsigned short pid)
+{
+	cyusb_context *ctx;
+	int r;
+
+	if ( defctx )
+		cyusb_close();
+	r = open_context_vidpid(&ctx, vid, pid, false);
+
+	pthread_mutex_lock(&deflock);
+	defctx = ctx;
+	pthread_mutex_unlock(&deflock);
+	return r;
+}
+
+/* cyusb_open_device:
+   Open just the USB device with the given device node or serial number, without scanning the
+   bus where possible. Returns the index of the device.
+ */
+int
+cyusb_open_device (
+		const char *device)
+{
+	cyusb_context *ctx;
+	int r;
+
+	if ( defctx )
+		cyusb_close();
+	r = open_context_device(&ctx, NULL, device, false);
+
+	pthread_mutex_lock(&deflock);
+	defctx = ctx;
+	pthread_mutex_unlock(&deflock);
+	return r;
+}
+
+int
+cyusb_open_device (
+		cyusb_context **ctx,
+		const char *config,
+		const char *device)
+{
+	return open_context_device(ctx, config, device, true);
+}
+
+/* cyusb_open:
+   Create an independent context, with its own libusb context, holding all USB devices of
+   interest listed in the given configuration file. Returns the number of devices.
+ */
+int
+cyusb_open (
+		cyusb_context **ctx,
+		const char *config)
+{
+	return open_context(ctx, config, true, 0, 0);
+}
+
+/* cyusb_open_shards:
+   Create nshards independent contexts that split the USB devices of interest between them,
+   each with its own libusb context and its event thread pinned to its own CPU. Returns the
+   total number of devices.
+ */
+int
+cyusb_open_shards (
+		cyusb_context **shards,
+		int nshards,
+		const char *config)
+{
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int ncpus = 0;
+	int total = 0;
+	int i, r;
+
+	if ( (nshards <= 0) || (nshards > CPU_SETSIZE) )
+		return -EINVAL;
+	for ( i = 0; i < nshards; ++i )
+		shards[i] = NULL;
+
+	/* Shards go to the CPUs the process may run on, in turn. */
+	if ( sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ) {
+		for ( i = 0; i < CPU_SETSIZE; ++i ) {
+			if ( CPU_ISSET(i, &allowed) )
+				cpus[ncpus++] = i;
+		}
+	}
+
+	for ( i = 0; i < nshards; ++i ) {
+		r = open_context(&shards[i], config, true, i, nshards);
+		if ( r < 0 ) {
+			while ( i-- > 0 ) {
+				cyusb_close(shards[i]);
+				shards[i] = NULL;
+			}
+			return r;
+		}
+		if ( ncpus > 0 )
+			shards[i]->event_cpu = cpus[i % ncpus];
+		total += r;
+	}
+	return total;
+}
+
+/* cyusb_open:
+   Create an independent context holding just the USB device with specified vid/pid.
+ */
+int
+cyusb_open (
+		cyusb_context **ctx,
+		unsigned short vid,
+		unsigned short pid)
+{
+	return open_context_vidpid(ctx, vid, pid, true);
+}
+
+/* default_context:
+   Get the context used by the functions without a context argument, or NULL.
+ */
+struct cyusb_context *
+default_context (
+		void)
+{
+	return defctx;
+}
+
+/* cyusb_getlibusb:
+   Get the libusb context a cyusb context runs on.
+ */
+libusb_context *
+cyusb_getlibusb (
+		cyusb_context *ctx)
+{
+	return ctx ? ctx->usb : NULL;
+}
+
+/* cyusb_error:
+   Print verbose information about the error returned by the cyusb API. These are essentially descriptions of
+   status values defined as part of the libusb library.
+ */
+void
+cyusb_error (
+		int err)
+{
+	switch (err)
+	{
+		case -1:
+			fprintf(stderr, "Input/output error\n");
+			break;
+		case -2:
+			fprintf(stderr, "Invalid parameter\n");
+			break;
+		case -3:
+			fprintf(stderr, "Access denied (insufficient permissions)\n");
+			break;
+		case -4:
+			fprintf(stderr, "No such device. Disconnected...?\n");
+			break;
+		case -5:
+			fprintf(stderr, "Entity not found\n");
+			break;
+		case -6:
+			fprintf(stderr, "Resource busy\n");
+			break;
+		case -7:
+			fprintf(stderr, "Operation timed out\n");
+			break;
+		case -8:
+			fprintf(stderr, "Overflow\n");
+			break;
+		case -9:
+			fprintf(stderr, "Pipe error\n");
+			break;
+		case -10:
+			fprintf(stderr, "System call interrupted, ( due to signal ? )\n");
+			break;
+		case -11:
+			fprintf(stderr, "Insufficient memory\n");
+			break;
+		case -12:
+			fprintf(stderr, "Operation not supported/implemented\n");
+			break;
+		default:
+			fprintf(stderr, "Unknown internal error\n");
+			break;
+	}
+}
+
+/* get_entry:
+   Get the entry at the given index from the snapshot published by a context, if any. Only
+   valid inside snap_read_lock(); no lock is taken.
+ */
+static struct cydev_entry *
+get_entry (
+		cyusb_context *ctx,
+		int index)
+{
+	return ctx ? snap_get(SNAP_DEREF(ctx->snap), index) : NULL;
+}
+
+/* stats_device_of:
+   Get the performance counters of the device at the given index, or NULL if there is no
+   such device. The counters stay allocated as long as the context.
+ */
+struct stats_device *
+stats_device_of (
+		struct cyusb_context *ctx,
+		int index)
+{
+	struct stats_device *dev = NULL;
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	if ( e )
+		dev = e->stats;
+	snap_read_unlock();
+
+	return dev;
+}
+
+/* destroy_context:
+   Free a context once it is closed and its last acquired handle has been released.
+ */
+static void
+destroy_context (
+		struct cyusb_context *ctx)
+{
+	desc_cache_clear(&ctx->desccache);
+	matcher_free(&ctx->matcher);
+	stats_clear(&ctx->stats);
+	pthread_mutex_destroy(&ctx->devlock);
+	pthread_mutex_destroy(&ctx->eventlock);
+
+	libusb_exit(ctx->usb);
+	free(ctx->config);
+	free(ctx);
+}
+
+/* unlink_closing:
+   Take a context off the list of closed contexts with acquired handles. Called with deflock
+   held.
+ */
+static void
+unlink_closing (
+		struct cyusb_context *ctx)
+{
+	struct cyusb_context **pp;
+
+	for ( pp = &closing; *pp; pp = &(*pp)->next_closing ) {
+		if ( *pp == ctx ) {
+			*pp = ctx->next_closing;
+			break;
+		}
+	}
+}
+
+/* cyusb_gethandle:
+   Get a handle to the USB device with specified index, opening the device on first use. Once
+   the device is open, this is a lookup in the published snapshot and takes no lock.
+ */
+libusb_device_handle *
+cyusb_gethandle (
+		cyusb_context *ctx,
+		int index)
+{
+	libusb_device_handle *handle = NULL;
+	struct cydev_entry *e;
+
+	if ( !ctx )
+		return NULL;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	if ( e && __atomic_load_n(&e->pinned, __ATOMIC_ACQUIRE) )
+		handle = e->cd.handle;
+	snap_read_unlock();
+	if ( handle || !e )
+		return handle;
+
+	pthread_mutex_lock(&ctx->devlock);
+	e = devtab_get(&ctx->devtab, index);
+	if ( e ) {
+		if ( !e->pinned && (open_entry(ctx, e) == 0) ) {
+			++e->users;
+			__atomic_store_n(&e->pinned, 1, __ATOMIC_RELEASE);
+		}
+		handle = e->cd.handle;
+	}
+	pthread_mutex_unlock(&ctx->devlock);
+
+	return handle;
+}
+
+libusb_device_handle *
+cyusb_gethandle (
+		int index)
+{
+	return cyusb_gethandle(defctx, index);
+}
+
+/* cyusb_acquire:
+   Get a counted use of the handle to the USB device with specified index, opening the device
+   if this is the first use. The use keeps the handle, and the context, alive across device
+   removal and cyusb_close().
+ */
+int
+cyusb_acquire (
+		cyusb_context *ctx,
+		int index,
+		libusb_device_handle **handle)
+{
+	struct cydev_entry *e;
+	int r;
+
+	*handle = NULL;
+	if ( !ctx )
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	pthread_mutex_lock(&ctx->devlock);
+	e = ctx->closed ? NULL : devtab_get(&ctx->devtab, index);
+	if ( !e ) {
+		pthread_mutex_unlock(&ctx->devlock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	r = open_entry(ctx, e);
+	if ( r == 0 ) {
+		++e->users;
+		++e->refs;
+		++ctx->refs;
+		*handle = e->cd.handle;
+	}
+	pthread_mutex_unlock(&ctx->devlock);
+
+	return r;
+}
+
+int
+cyusb_acquire (
+		int index,
+		libusb_device_handle **handle)
+{
+	return cyusb_acquire(defctx, index, handle);
+}
+
+/* release_handle:
+   Give up a use of an acquired handle of a context. Returns -1 if the handle was not acquired
+   from this context, 1 if this dropped the last reference on a closed context, else 0.
+ */
+static int
+release_handle (
+		struct cyusb_context *ctx,
+		libusb_device_handle *handle)
+{
+	char path[CYUSB_PATH_LEN];
+	struct cydev_entry *e;
+	int r = -1;
+
+	pthread_mutex_lock(&ctx->devlock);
+	get_device_path(libusb_get_device(handle), path);
+	e = devtab_find_path(&ctx->devtab, path);
+	if ( (e == NULL) || (e->cd.handle != handle) ) {
+		for ( e = ctx->retired; e; e = e->next_retired ) {
+			if ( e->cd.handle == handle )
+				break;
+		}
+	}
+
+	if ( e && (e->users > e->pinned) ) {
+		drop_user(e);
+		drop_ref(ctx, e);
+		r = (--ctx->refs == 0);
+	}
+	pthread_mutex_unlock(&ctx->devlock);
+
+	return r;
+}
+
+/* cyusb_release:
+   Give up a use of a handle obtained from cyusb_acquire(). The handle is closed once it has
+   no users left, and a closed context is freed with its last acquired handle.
+ */
+void
+cyusb_release (
+		cyusb_context *ctx,
+		libusb_device_handle *handle)
+{
+	if ( !ctx || !handle )
+		return;
+
+	if ( release_handle(ctx, handle) > 0 ) {
+		pthread_mutex_lock(&deflock);
+		unlink_closing(ctx);
+		pthread_mutex_unlock(&deflock);
+		destroy_context(ctx);
+	}
+}
+
+void
+cyusb_release (
+		libusb_device_handle *handle)
+{
+	struct cyusb_context *ctx;
+	int r = -1;
+
+	if ( !handle )
+		return;
+
+	/* The handle may have been acquired before cyusb_open() was called again. */
+	pthread_mutex_lock(&deflock);
+	ctx = defctx;
+	if ( ctx )
+		r = release_handle(ctx, handle);
+	for ( ctx = (r < 0) ? closing : ctx; (r < 0) && ctx; ctx = (r < 0) ? ctx->next_closing : ctx )
+		r = release_handle(ctx, handle);
+	if ( r > 0 )
+		unlink_closing(ctx);
+	pthread_mutex_unlock(&deflock);
+
+	if ( r > 0 )
+		destroy_context(ctx);
+}
+
+/* Shared state of one cyusb_prepare() call. */
+struct prepare_job {
+	struct cyusb_context	*ctx;
+	int			nslots;				/* Number of slots to prepare. */
+	int			next;				/* Next slot to be taken by a worker. */
+	int			interface;			/* Interface to claim, or -1. */
+	cyusb_ready_cb		cb;				/* Per-device completion callback. */
+	void			*user;				/* User data passed to the callback. */
+	pthread_mutex_t		cblock;				/* Serialises the callbacks. */
+	struct timespec		start;				/* Time cyusb_prepare() was called. */
+	int			nready;				/* Number of devices that are ready. */
+};
+
+/* prepare_device:
+   Open one device, read its serial number and claim the interface, if asked for. The slow
+   parts run without the device table lock, so that several devices come up at once. The
+   handle is pinned as for cyusb_gethandle(), so that later lookups find it open.
+ */
+static int
+prepare_device (
+		struct prepare_job *job,
+		int index)
+{
+	struct cyusb_context *ctx = job->ctx;
+	char serial[CYUSB_SERIAL_LEN] = "";
+	libusb_device_handle *h = NULL;
+	libusb_device_handle *handle = NULL;
+	struct cydev_entry *e;
+	bool opened, need_serial;
+	int r = 0;
+
+	pthread_mutex_lock(&ctx->devlock);
+	e = ctx->closed ? NULL : devtab_get(&ctx->devtab, index);
+	if ( !e ) {
+		pthread_mutex_unlock(&ctx->devlock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	++e->refs;
+	opened      = (e->cd.handle != NULL);
+	need_serial = (e->serial[0] == '\0');
+	pthread_mutex_unlock(&ctx->devlock);
+
+	if ( !opened ) {
+		r = libusb_open(e->cd.dev, &h);
+		if ( r == 0 && need_serial )
+			read_serial(e, h, serial);
+	}
+
+	pthread_mutex_lock(&ctx->devlock);
+	if ( (r == 0) && (devtab_get(&ctx->devtab, index) != e) )
+		r = LIBUSB_ERROR_NO_DEVICE;
+	if ( r == 0 ) {
+		/* Another thread may have opened the device in the meantime. */
+		if ( !e->cd.handle ) {
+			e->cd.handle  = h;
+			e->cd.is_open = 1;
+			h = NULL;
+		}
+		if ( !e->pinned ) {
+			++e->users;
+			__atomic_store_n(&e->pinned, 1, __ATOMIC_RELEASE);
+		}
+		++e->users;			/* Held while the interface is claimed. */
+		handle = e->cd.handle;
+
+		if ( serial[0] && (e->serial[0] == '\0') ) {
+			devtab_set_serial(&ctx->devtab, e, serial);
+			publish(ctx);
+		}
+	}
+	pthread_mutex_unlock(&ctx->devlock);
+
+	if ( h )
+		libusb_close(h);
+
+	if ( (r == 0) && (job->interface >= 0) ) {
+		if ( libusb_kernel_driver_active(handle, job->interface) == 1 )
+			libusb_detach_kernel_driver(handle, job->interface);
+		r = libusb_claim_interface(handle, job->interface);
+	}
+
+	pthread_mutex_lock(&ctx->devlock);
+	if ( handle )
+		drop_user(e);
+	drop_ref(ctx, e);
+	pthread_mutex_unlock(&ctx->devlock);
+
+	return r;
+}
+
+/* prepare_thread_func:
+   Worker of cyusb_prepare(). Takes slots until all are done, and reports each device as soon
+   as it is ready.
+ */
+static void *
+prepare_thread_func (
+		void *arg)
+{
+	struct prepare_job *job = (struct prepare_job *)arg;
+	struct timespec now;
+	unsigned long usec;
+	bool present;
+	int index;
+	int r;
+
+	while ( (index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nslots ) {
+		snap_read_lock();
+		present = (get_entry(job->ctx, index) != NULL);
+		snap_read_unlock();
+		if ( !present )
+			continue;
+
+		r = prepare_device(job, index);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec = (now.tv_sec - job->start.tv_sec) * 1000000 + (now.tv_nsec - job->start.tv_nsec) / 1000;
+
+		pthread_mutex_lock(&job->cblock);
+		if ( r == 0 )
+			++job->nready;
+		if ( job->cb )
+			job->cb(index, r, usec, job->user);
+		pthread_mutex_unlock(&job->cblock);
+	}
+	return NULL;
+}
+
+/* cyusb_prepare:
+   Open all devices of a context, and optionally claim an interface on each, on a bounded pool
+   of threads. Returns the number of devices that are ready.
+ */
+int
+cyusb_prepare (
+		cyusb_context *ctx,
+		int nthreads,
+		int interface,
+		cyusb_ready_cb cb,
+		void *user)
+{
+	struct prepare_job job;
+	pthread_t *threads;
+	int nstarted = 0;
+	int i;
+
+	if ( !ctx )
+		return -EINVAL;
+
+	memset(&job, 0, sizeof(job));
+	job.ctx       = ctx;
+	job.nslots    = cyusb_getcount(ctx);
+	job.interface = interface;
+	job.cb        = cb;
+	job.user      = user;
+	pthread_mutex_init(&job.cblock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &job.start);
+
+	if ( nthreads <= 0 )
+		nthreads = PREPARE_THREADS;
+	if ( nthreads > job.nslots )
+		nthreads = job.nslots;
+
+	/* The calling thread is one of the workers. */
+	threads = (nthreads > 1) ? (pthread_t *)calloc(nthreads - 1, sizeof(pthread_t)) : NULL;
+	if ( threads ) {
+		for ( nstarted = 0; nstarted < nthreads - 1; ++nstarted ) {
+			if ( pthread_create(&threads[nstarted], NULL, prepare_thread_func, &job) != 0 )
+				break;
+		}
+	}
+	prepare_thread_func(&job);
+	for ( i = 0; i < nstarted; ++i )
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&job.cblock);
+	return job.nready;
+}
+
+int
+cyusb_prepare (
+		int nthreads,
+		int interface,
+		cyusb_ready_cb cb,
+		void *user)
+{
+	return cyusb_prepare(defctx, nthreads, interface, cb, user);
+}
+
+/* cyusb_getcount:
+   Get the number of slots in use in the device table.
+ */
+int
+cyusb_getcount (
+		cyusb_context *ctx)
+{
+	struct cydev_snapshot *snap;
+	int count = 0;
+
+	if ( !ctx )
+		return 0;
+
+	snap_read_lock();
+	snap = SNAP_DEREF(ctx->snap);
+	if ( snap )
+		count = snap->nslots;
+	snap_read_unlock();
+
+	return count;
+}
+
+int
+cyusb_getcount (
+		void)
+{
+	return cyusb_getcount(defctx);
+}
+
+/* cyusb_getdevice:
+   Get the device information stored for the USB device with specified index.
+ */
+struct cydev *
+cyusb_getdevice (
+		cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	snap_read_unlock();
+
+	return (struct cydev *)e;
+}
+
+struct cydev *
+cyusb_getdevice (
+		int index)
+{
+	return cyusb_getdevice(defctx, index);
+}
+
+/* cyusb_getpath:
+   Get the bus/port path of the USB device with specified index.
+ */
+const char *
+cyusb_getpath (
+		cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	snap_read_unlock();
+
+	return e ? e->path : NULL;
+}
+
+const char *
+cyusb_getpath (
+		int index)
+{
+	return cyusb_getpath(defctx, index);
+}
+
+/* cyusb_getserial:
+   Get the serial number of the USB device with specified index.
+ */
+const char *
+cyusb_getserial (
+		cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	snap_read_unlock();
+
+	return e ? __atomic_load_n(&e->serial, __ATOMIC_ACQUIRE) : NULL;
+}
+
+const char *
+cyusb_getserial (
+		int index)
+{
+	return cyusb_getserial(defctx, index);
+}
+
+/* cyusb_getdesc:
+   Get the description from the configuration file of the USB device with specified index.
+ */
+const char *
+cyusb_getdesc (
+		cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e;
 
-				vpd[maxdevices].vid = strtol(cp1,NULL,16);
-				vpd[maxdevices].pid = strtol(cp2,NULL,16);
-				strncpy(vpd[maxdevices].desc,cp3,MAX_STR_LEN);
-				vpd[maxdevices].desc[MAX_STR_LEN - 1] = '\0';   /* Make sure of NULL-termination. */
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	snap_read_unlock();
 
-				++maxdevices;
-			}
-		}
-		else {
-			printf( "Error in config file %s: %s \n", cyusb_conf, buf );
-			exit(1);
-		}
+	return e ? __atomic_load_n(&e->desc, __ATOMIC_ACQUIRE) : NULL;
+}
+
+const char *
+cyusb_getdesc (
+		int index)
+{
+	return cyusb_getdesc(defctx, index);
+}
+
+/* cyusb_getinfo:
+   Copy the information of the USB device with specified index, which unlike the pointers of
+   the other lookups stays valid after the device is removed.
+ */
+int
+cyusb_getinfo (
+		cyusb_context *ctx,
+		int index,
+		struct cyusb_devinfo *info)
+{
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	if ( e ) {
+		info->vid     = e->cd.vid;
+		info->pid     = e->cd.pid;
+		info->busnum  = e->cd.busnum;
+		info->devaddr = e->cd.devaddr;
+		info->speed   = libusb_get_device_speed(e->cd.dev);
+		snprintf(info->path, sizeof(info->path), "%s", e->path);
+		snprintf(info->serial, sizeof(info->serial), "%s", __atomic_load_n(&e->serial, __ATOMIC_ACQUIRE));
+		snprintf(info->desc, sizeof(info->desc), "%s", __atomic_load_n(&e->desc, __ATOMIC_ACQUIRE));
 	}
+	snap_read_unlock();
 
-	fclose(inp);
+	return e ? 0 : LIBUSB_ERROR_NO_DEVICE;
 }
 
-/* device_is_of_interest:
-   Check whether the current USB device is among the devices of interest.
+int
+cyusb_getinfo (
+		int index,
+		struct cyusb_devinfo *info)
+{
+	return cyusb_getinfo(defctx, index, info);
+}
+
+/* cyusb_getdescriptors:
+   Get the cached descriptors of the USB device with specified index.
  */
-static int
-device_is_of_interest (
-		libusb_device *d)
+const struct cyusb_descriptors *
+cyusb_getdescriptors (
+		cyusb_context *ctx,
+		int index)
 {
-	int i;
-	struct libusb_device_descriptor desc;
-	int vid, pid;
+	const struct cyusb_descriptors *descs = NULL;
+	struct cydev_entry *e;
 
-	libusb_get_device_descriptor(d, &desc);
-	vid = desc.idVendor;
-	pid = desc.idProduct;
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	if ( e )
+		descs = e->descs;
+	snap_read_unlock();
 
-	for ( i = 0; i < maxdevices; ++i ) {
-		if ( (vpd[i].vid == vid) && (vpd[i].pid == pid) ) {
-			printf("Found device %04x %04x (%s)\n", vid, pid, vpd[i].desc);
-			return 1;
-		}
-	}
-	return 0;
+	return descs;
 }
 
-/* cyusb_getvendor:
-   Get the Vendor ID for the current USB device.
+const struct cyusb_descriptors *
+cyusb_getdescriptors (
+		int index)
+{
+	return cyusb_getdescriptors(defctx, index);
+}
+
+/* cyusb_getendpoint:
+   Look up an endpoint of the USB device with specified index in its cached endpoint table.
  */
-unsigned short
-cyusb_getvendor (
-		libusb_device_handle *h)
+const struct cyusb_endpoint *
+cyusb_getendpoint (
+		cyusb_context *ctx,
+		int index,
+		unsigned char address)
 {
-	struct libusb_device_descriptor d;
-	libusb_device *tdev = libusb_get_device(h);
-	libusb_get_device_descriptor(tdev, &d);
-	return d.idVendor;
+	const struct cyusb_endpoint *ep = NULL;
+	struct cydev_entry *e;
+
+	snap_read_lock();
+	e = get_entry(ctx, index);
+	if ( e )
+		ep = desc_find_endpoint(e->descs, address);
+	snap_read_unlock();
+
+	return ep;
 }
 
-/* renumerate:
-   Get handles to and store information about all USB devices of interest.
+const struct cyusb_endpoint *
+cyusb_getendpoint (
+		int index,
+		unsigned char address)
+{
+	return cyusb_getendpoint(defctx, index, address);
+}
+
+/* cyusb_find_by_path:
+   Get the index of the USB device at the specified bus/port path.
  */
-static int
-renumerate (
-		void)
+int
+cyusb_find_by_path (
+		cyusb_context *ctx,
+		const char *path)
 {
-	libusb_device *dev = NULL;
-	libusb_device_handle *handle = NULL;
-	struct libusb_device_descriptor desc;
-	int           numdev;
-	int           i;
-	int           r;
+	struct cydev_entry *e;
+	int index = -1;
 
-	numdev = libusb_get_device_list(NULL, &list);
-	if ( numdev < 0 ) {
-		printf("Library: Error in enumerating devices...\n");
-		return -ENODEV;
-	}
+	if ( !ctx )
+		return -1;
 
-	nid = 0;
-	for ( i = 0; i < numdev; ++i ) {
-		libusb_device *tdev = list[i];
-		if ( device_is_of_interest(tdev) ) {
-			cydev[nid].dev = tdev;
-			r = libusb_open(tdev, &cydev[nid].handle);
-			if ( r ) {
-				printf("Error in opening device %d\n", r);
-				return -EACCES;
-			}
-			else
-				handle = cydev[nid].handle;
+	snap_read_lock();
+	e = snap_find_path(SNAP_DEREF(ctx->snap), path);
+	if ( e )
+		index = e->index;
+	snap_read_unlock();
 
-			libusb_get_device_descriptor(tdev, &desc);
-			cydev[nid].vid     = desc.idVendor;
-			cydev[nid].pid     = desc.idProduct;
-			cydev[nid].is_open = 1;
-			cydev[nid].busnum  = libusb_get_bus_number(tdev);
-			cydev[nid].devaddr = libusb_get_device_address(tdev);
-			++nid;
-		}
-	}
+	return index;
+}
 
-	return nid;
+int
+cyusb_find_by_path (
+		const char *path)
+{
+	return cyusb_find_by_path(defctx, path);
 }
 
-/* cyusb_open:
-   Opens handles to all USB devices of interest, and returns their count.
+/* cyusb_find_by_vidpid:
+   Get the index of the first USB device with the specified vid/pid.
  */
-int cyusb_open( void ) {
-	int fd1 = -1;
-	int r;
-	char global_config_path[] = "/etc/cyusb.conf";
-	char user_config_path[ MAX_FILEPATH_LENGTH ] = "";
-	char *path = getenv( "HOME" );
-	if ( path ) {
-	    sprintf( user_config_path, "%s/%s", path, ".config/cyusb/cyusb.conf" );
-	    path = user_config_path;
-	    fd1 = open( path, O_RDONLY ); // try user config
-	}
-	if ( fd1 < 0 ) // if not found...
-	    fd1 = open( path = global_config_path, O_RDONLY ); // ...try global config
-	if ( fd1 < 0 ) { // if also not found...
-	    printf( "Config file %s not found. Exiting\n", path );
-	    return -ENOENT; // give up
-	}
-	else {
-		close(fd1);
-		parse_configfile( path );	/* Parse the file and store information inside exported data structures */
-	}
+int
+cyusb_find_by_vidpid (
+		cyusb_context *ctx,
+		unsigned short vid,
+		unsigned short pid)
+{
+	struct cydev_entry *e;
+	int index = -1;
 
-	r = libusb_init(NULL);
-	if (r) {
-		printf("Error in initializing libusb library...\n");
-		return -EACCES;
-	}
+	if ( !ctx )
+		return -1;
 
-	/* Get list of USB devices of interest. */
-	r = renumerate();
-	return r;
+	snap_read_lock();
+	e = snap_find_vidpid(SNAP_DEREF(ctx->snap), vid, pid);
+	if ( e )
+		index = e->index;
+	snap_read_unlock();
+
+	return index;
 }
 
-/* cyusb_open:
-   Open a handle to the USB device with specified vid/pid.
- */
-int cyusb_open (
+int
+cyusb_find_by_vidpid (
 		unsigned short vid,
 		unsigned short pid)
 {
-	int r;
-	libusb_device *dev = NULL;
-	libusb_device_handle *h = NULL;
-	struct libusb_device_descriptor desc;
+	return cyusb_find_by_vidpid(defctx, vid, pid);
+}
 
-	r = libusb_init(NULL);
-	if (r) {
-		printf("Error in initializing libusb library...\n");
-		return -EACCES;
-	}
+/* cyusb_find_next_vidpid:
+   Get the index of the next USB device with the same vid/pid as the device at index.
+ */
+int
+cyusb_find_next_vidpid (
+		cyusb_context *ctx,
+		int index)
+{
+	struct cydev_entry *e;
+	int next = -1;
 
-	h = libusb_open_device_with_vid_pid(NULL, vid, pid);
-	if ( !h ) {
-		printf("Device not found\n");
-		return -ENODEV;
-	}
+	if ( !ctx )
+		return -1;
 
-	dev = libusb_get_device(h);
-	cydev[0].dev     = dev;
-	cydev[0].handle  = h;
+	snap_read_lock();
+	e = snap_next_vidpid(SNAP_DEREF(ctx->snap), index);
+	if ( e )
+		next = e->index;
+	snap_read_unlock();
 
-	libusb_get_device_descriptor(dev, &desc);
-	cydev[0].vid     = desc.idVendor;
-	cydev[0].pid     = desc.idProduct;
-	cydev[0].is_open = 1;
-	cydev[0].busnum  = libusb_get_bus_number(dev);
-	cydev[0].devaddr = libusb_get_device_address(dev);
-	nid = 1;
+	return next;
+}
 
-	return 1;
+int
+cyusb_find_next_vidpid (
+		int index)
+{
+	return cyusb_find_next_vidpid(defctx, index);
 }
 
-/* cyusb_error:
-   Print verbose information about the error returned by the cyusb API. These are essentially descriptions of
-   status values defined as part of the libusb library.
+/* cyusb_find_by_serial:
+   Get the index of the USB device with the specified serial number.
  */
-void
-cyusb_error (
-		int err)
+int
+cyusb_find_by_serial (
+		cyusb_context *ctx,
+		const char *serial)
 {
-	switch (err)
-	{
-		case -1:
-			fprintf(stderr, "Input/output error\n");
-			break;
-		case -2:
-			fprintf(stderr, "Invalid parameter\n");
-			break;
-		case -3:
-			fprintf(stderr, "Access denied (insufficient permissions)\n");
-			break;
-		case -4:
-			fprintf(stderr, "No such device. Disconnected...?\n");
-			break;
-		case -5:
-			fprintf(stderr, "Entity not found\n");
-			break;
-		case -6:
-			fprintf(stderr, "Resource busy\n");
-			break;
-		case -7:
-			fprintf(stderr, "Operation timed out\n");
-			break;
-		case -8:
-			fprintf(stderr, "Overflow\n");
-			break;
-		case -9:
-			fprintf(stderr, "Pipe error\n");
-			break;
-		case -10:
-			fprintf(stderr, "System call interrupted, ( due to signal ? )\n");
-			break;
-		case -11:
-			fprintf(stderr, "Insufficient memory\n");
-			break;
-		case -12:
-			fprintf(stderr, "Operation not supported/implemented\n");
-			break;
-		default:
-			fprintf(stderr, "Unknown internal error\n");
-			break;
-	}
+	struct cydev_entry *e;
+	int index = -1;
+
+	if ( !ctx )
+		return -1;
+
+	snap_read_lock();
+	e = snap_find_serial(SNAP_DEREF(ctx->snap), serial);
+	if ( e )
+		index = e->index;
+	snap_read_unlock();
+
+	return index;
 }
 
-/* cyusb_gethandle:
-   Get a handle to the USB device with specified index.
+int
+cyusb_find_by_serial (
+		const char *serial)
+{
+	return cyusb_find_by_serial(defctx, serial);
+}
+
+/* cyusb_close:
+   Close all device handles of a context, de-initialize its libusb context and free it.
+   Handles that are still acquired stay open, and the context is only freed when the last
+   of them is released.
  */
-libusb_device_handle *
-cyusb_gethandle (
-		int index)
+void
+cyusb_close (
+		cyusb_context *ctx)
 {
-	return cydev[index].handle;
+	struct cydev_entry *e;
+	bool last;
+	int i;
+
+	if ( !ctx )
+		return;
+
+	cyusb_unwatch_config(ctx);
+	cyusb_hotplug_deregister(ctx);
+	if ( cyusb_event_fd_close(ctx) != 0 )
+		event_fd_release(ctx);		/* The fd goes with the context all the same. */
+
+	pthread_mutex_lock(&deflock);
+	pthread_mutex_lock(&ctx->devlock);
+	ctx->closed = true;
+	publish(ctx);
+	for ( i = 0; i < ctx->devtab.nslots; ++i ) {
+		e = devtab_remove(&ctx->devtab, i);
+		if ( e )
+			retire_entry(ctx, e);
+	}
+	devtab_clear(&ctx->devtab, NULL);
+
+	last = (--ctx->refs == 0);
+	if ( !last ) {
+		ctx->next_closing = closing;
+		closing = ctx;
+	}
+	pthread_mutex_unlock(&ctx->devlock);
+	pthread_mutex_unlock(&deflock);
+
+	if ( last )
+		destroy_context(ctx);
 }
 
 /* cyusb_close:
@@ -369,22 +2689,57 @@ void
 cyusb_close (
 		void)
 {
-	int i;
+	cyusb_context *ctx;
 
-	for ( i = 0; i < nid; ++i ) {
-		libusb_close(cydev[i].handle);
-	}
+	pthread_mutex_lock(&deflock);
+	ctx = defctx;
+	defctx = NULL;
+	pthread_mutex_unlock(&deflock);
 
-	libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
+	cyusb_close(ctx);
 }
 
 
-/* cyusb_download_fx2:
+
+/* count_download:
+   Count a firmware download on a device, with the time it took, in the counters of the
+   default session. The device need not be in the device table, as it usually is not before
+   its firmware runs.
+ */
+static void
+count_download (
+		libusb_device_handle *h,
+		int r,
+		unsigned long long ns)
+{
+	struct libusb_device_descriptor desc;
+	struct stats_device *dev = NULL;
+	libusb_device *tdev = libusb_get_device(h);
+	char path[CYUSB_PATH_LEN];
+
+	get_device_path(tdev, path);
+	libusb_get_device_descriptor(tdev, &desc);
+
+	pthread_mutex_lock(&deflock);
+	if ( defctx ) {
+		pthread_mutex_lock(&defctx->devlock);
+		dev = stats_device_get(&defctx->stats, path, desc.idVendor, desc.idProduct);
+		pthread_mutex_unlock(&defctx->devlock);
+	}
+	if ( dev ) {
+		stats_add(&dev->fw_loads, 1);
+		stats_add(&dev->fw_ns, ns);
+		if ( r != 0 )
+			stats_add(&dev->fw_failures, 1);
+	}
+	pthread_mutex_unlock(&deflock);
+}
+
+/* download_fx2:
    Download firmware to the Cypress FX2/FX2LP device using USB vendor commands.
  */
-int
-cyusb_download_fx2 (
+static int
+download_fx2 (
 		libusb_device_handle *h,
 		char *filename,
 		unsigned char vendor_command)
@@ -453,14 +2808,15 @@ cyusb_download_fx2 (
 
 /* control_transfer:
    Internal function that issues the vendor command that incrementally loads firmware segments to the
-   Cypress FX3 device RAM.
+   Cypress FX3 device RAM, and adds the segment to the firmware checksum.
  */
 static void
 control_transfer (
 		libusb_device_handle *h,
 	       	unsigned int address,
 	       	unsigned char *dbuf,
-	       	int len)
+	       	int len,
+		unsigned int *checksum)
 {
 	int j;
 	int r;
@@ -488,14 +2844,28 @@ control_transfer (
 
 	/* Update the firmware checksum as the download is being performed. */
 	for ( j = 0; j < len/4; ++j )
-		checksum += pint[j];
+		*checksum += pint[j];
+}
+
+int
+cyusb_download_fx2 (
+		libusb_device_handle *h,
+		char *filename,
+		unsigned char vendor_command)
+{
+	unsigned long long start = hist_now();
+	int r;
+
+	r = download_fx2(h, filename, vendor_command);
+	count_download(h, r, hist_now() - start);
+	return r;
 }
 
-/* cyusb_download_fx3:
+/* download_fx3:
    Download a firmware binary the Cypress FX3 device RAM.
  */
-int
-cyusb_download_fx3 (
+static int
+download_fx3 (
 		libusb_device_handle *h,
 	       	const char *filename)
 {
@@ -508,6 +2878,7 @@ cyusb_download_fx3 (
 	unsigned int address;
 	unsigned int *pint;
 	unsigned int program_entry;
+	unsigned int checksum;			/* Checksum calculated on the Cypress firmware binary. */
 	int r;
 
 	fd = open(filename, O_RDONLY);
@@ -545,7 +2916,7 @@ cyusb_download_fx3 (
 		address = *pint;
 		if ( dlen != 0 ) {
 			nbr = read(fd, buf, dlen*4);	/* Read data bytes	*/
-			control_transfer(h, address, buf, dlen*4);
+			control_transfer(h, address, buf, dlen*4, &checksum);
 		}
 		else {
 			program_entry = address;
@@ -570,5 +2941,18 @@ cyusb_download_fx3 (
 	return 0;
 }
 
+int
+cyusb_download_fx3 (
+		libusb_device_handle *h,
+	       	const char *filename)
+{
+	unsigned long long start = hist_now();
+	int r;
+
+	r = download_fx3(h, filename);
+	count_download(h, r, hist_now() - start);
+	return r;
+}
+
 /*[]*/
 
@@ -24,12 +24,13 @@
 
 /********** Cut and paste the following & modify as required  **********/
 static const char * program_name;
-static const char *const short_options = "hvf:e:";
+static const char *const short_options = "hvf:e:d:";
 static const struct option long_options[] = {
 		{ "help",	0,	NULL,	'h'	},
 		{ "version",	0,	NULL,	'v'	},
 		{ "file",       1,      NULL,   'f',    },
 		{ "extension",  1,      NULL,   'e',	},
+		{ "device",     1,      NULL,   'd',	},
 		{ NULL,		0,	NULL,	 0	}
 };
 
@@ -42,7 +43,8 @@ static void print_usage(FILE *stream, int exit_code)
 		"  -h  --help           Display this usage information.\n"
 		"  -v  --version        Print version.\n"
 		"  -f  --file           firmware file name (.hex) format\n"
-		"  -e  --extension	Vendor Specific Command extensions, eg A3 or A0 etc\n");
+		"  -e  --extension	Vendor Specific Command extensions, eg A3 or A0 etc\n"
+		"  -d  --device         device node (/dev/bus/usb/BBB/DDD) or serial number\n");
 
 	exit(exit_code);
 }
@@ -51,6 +53,7 @@ static void print_usage(FILE *stream, int exit_code)
 static int filename_provided;
 static char *filename;
 static unsigned char extension;
+static char *device;
 
 static void validate_inputs(void)
 {
@@ -109,6 +112,9 @@ int main(int argc, char **argv)
 			case 'e': /* -e or --extension  */
 				  extension = strtoul(optarg, NULL, 16);
 				  break;
+			case 'd': /* -d or --device  */
+				  device = optarg;
+				  break;
 			case '?': /* Invalid option */
 				  print_usage(stdout, 1);
 			default : /* Something else, unexpected */
@@ -118,20 +124,35 @@ int main(int argc, char **argv)
 
 	validate_inputs();
 
-	r = cyusb_open();
-	if ( r < 0 ) {
-	     printf("Error opening library\n");
-	     return -1;
+	if ( device ) {
+		r = cyusb_open_device(device);
+		if ( r < 0 ) {
+			printf("Error opening device %s\n", device);
+			return -1;
+		}
+		h = cyusb_gethandle(r);
 	}
-	else if ( r == 0 ) {
-		printf("No device found\n");
-		return 0;
+	else {
+		r = cyusb_open();
+		if ( r < 0 ) {
+		     printf("Error opening library\n");
+		     return -1;
+		}
+		else if ( r == 0 ) {
+			printf("No device found\n");
+			return 0;
+		}
+		else if ( r > 1 ) {
+			printf("Only 1 device supported in this example\n");
+			return 0;
+		}
+		h = cyusb_gethandle(0);
 	}
-	else if ( r > 1 ) {
-		printf("Only 1 device supported in this example\n");
-		return 0;
+	if ( h == NULL ) {
+		printf("Error opening device\n");
+		cyusb_close();
+		return -1;
 	}
-	h = cyusb_gethandle(0);
 	r = stat(filename, &statbuf);
 	printf("File size = %d\n",(int)statbuf.st_size);
 	r = cyusb_download_fx2(h, filename, extension);
@@ -67,7 +67,7 @@ int main(int argc, char **argv)
 {
 	int r;
 	struct libusb_device_descriptor desc;
-	libusb_device_handle  *h = NULL;
+	const struct cyusb_descriptors *descs = NULL;
 	char user_input = 'n';
 
 	program_name = argv[0];
@@ -129,12 +129,14 @@ int main(int argc, char **argv)
 		   return 0;
 	   }
 	}
-	h = cyusb_gethandle(0);
-	r = libusb_get_device_descriptor(libusb_get_device(h), &desc);
-	if ( r ) {
+	/* The descriptors are cached by the library, so the device need not be opened. */
+	descs = cyusb_getdescriptors(0);
+	if ( descs == NULL ) {
 	   printf("error getting device descriptor\n");
+	   cyusb_close();
 	   return -2;
 	}
+	desc = descs->device;
 	fprintf(fp,"bLength             = %d\n",       desc.bLength);
 	fprintf(fp,"bDescriptorType     = %d\n",       desc.bDescriptorType);
 	fprintf(fp,"bcdUSB              = 0x%04x\n",   desc.bcdUSB);
@@ -46,9 +46,9 @@ int main(int argc, char **argv)
 {
 	int r;
 	int config = 0;
-	struct libusb_config_descriptor *desc = NULL;
+	const struct libusb_config_descriptor *desc = NULL;
+	const struct cyusb_descriptors *descs = NULL;
 	libusb_device_handle		*dev_handle = NULL;	// Handle to the USB device
-	libusb_device		*dev = NULL;	// The USB device
 	char tbuf[64];
 
 	program_name = argv[0];
@@ -84,7 +84,6 @@ int main(int argc, char **argv)
 		printf ("%s: Failed to get CyUSB device handle\n", argv[0]);
 		return -EACCES;
 	}
-	dev = libusb_get_device(dev_handle);
 	r = libusb_get_configuration(dev_handle, &config); 
 	if ( r ) {
 		cyusb_error(r);
@@ -97,11 +96,13 @@ int main(int argc, char **argv)
 	else
 		printf("Device configured. Current configuration = %d\n", config);
 
-	r = libusb_get_active_config_descriptor(dev, &desc);
-	if ( r ) {
+	descs = cyusb_getdescriptors(0);
+	if ( descs == NULL ) {
 		printf("Error retrieving config descriptor\n");
-		return r;
+		cyusb_close();
+		return -EIO;
 	}
+	desc = descs->config;
 
 	sprintf(tbuf,"bLength             = %d\n",   desc->bLength);
 	printf("%s",tbuf);
@@ -120,7 +121,6 @@ int main(int argc, char **argv)
 	sprintf(tbuf,"Max Power           = %04d\n", desc->MaxPower);
 	printf("%s",tbuf);
 
-	libusb_free_config_descriptor (desc);
 	cyusb_close();
 
 	return 0;
@@ -83,6 +83,11 @@ int main(int argc, char **argv)
 		   printf("No device found\n");
 		   return 0;
 	}
+	if ( cyusb_gethandle(0) == NULL ) {
+		printf("Error opening device\n");
+		cyusb_close();
+		return -1;
+	}
 	r = libusb_kernel_driver_active(cyusb_gethandle(0), interface);
 	if ( r == 1 ) {
 	   printf("A kernel driver has already claimed this interface\n");
@@ -99,6 +99,11 @@ int main(int argc, char **argv)
 	printf("Enter interface number you wish to claim : ");
 	scanf("%d",&interface);
 
+	if ( cyusb_gethandle(0) == NULL ) {
+		printf("Error opening device\n");
+		cyusb_close();
+		return -1;
+	}
 	r = libusb_kernel_driver_active(cyusb_gethandle(0), interface);
 	if ( r == 1 ) {
 	   printf("A kernel driver has already claimed this interface\n");
@@ -80,17 +80,21 @@ static void *reader(void *arg1)
 
 }
 
+/* Input is read in blocks of this size; a block from a file or pipe is sent as one pipelined
+   write, so that the OUT endpoint does not sit idle between 64 byte packets. */
+#define WRITE_BLOCK	16384
+
 static void * writer(void *arg2)
 {
 	int r, nbr;
-	unsigned char buf[64];
-	int transferred = 0;
+	unsigned char buf[WRITE_BLOCK];
+	size_t transferred = 0;
 
-	memset(buf,'\0',64);
-	while ( nbr = read(0,buf,64) ) {
-		r = libusb_bulk_transfer(h1, 0x02, buf, nbr, &transferred, timeout * 1000);
+	memset(buf,'\0',WRITE_BLOCK);
+	while ( (nbr = read(0,buf,WRITE_BLOCK)) > 0 ) {
+		r = cyusb_bulk_write(0, 0x02, buf, nbr, &transferred, timeout * 1000);
 		if ( r == 0 ) {
-			memset(buf,'\0',64);
+			memset(buf,'\0',nbr);
 			continue;
 		}
 		else {
@@ -147,6 +151,11 @@ int main(int argc, char **argv)
 		return 0;
 	}
 	h1 = cyusb_gethandle(0);
+	if ( h1 == NULL ) {
+		printf("Error opening device\n");
+		cyusb_close();
+		return -1;
+	}
 	if ( cyusb_getvendor(h1) != 0x04b4 ) {
 	  	printf("Cypress chipset not detected\n");
 		cyusb_close();
@@ -3,7 +3,16 @@
  * Description		:	This is a CLI program which can be used to measure the		*
  *				data transfer rate for data (IN or OUT endpoint) transfers	*
  *				from a Cypress USB device. Endpoints of type Bulk, Interrupt 	*
- *				and Isochronous are supported.					*
+ *				and Isochronous are supported. Several endpoints on several	*
+ *				devices can be streamed at once, with the data rate reported	*
+ *				per endpoint, per bus and in total. The devices can be split	*
+ *				over several library contexts, each with its own event		*
+ *				thread pinned to a core, or the events of all contexts can	*
+ *				be handled in an epoll loop on the main thread. The latency	*
+ *				of every transfer goes into a histogram per endpoint, whose	*
+ *				percentiles are reported with the data rate. Transfer and	*
+ *				byte counts come from the performance counters of the		*
+ *				library.							*
  * Author		:	Karthik Sivaramakrishnan					*
  * License		:	LGPL Ver 2.1							*
  * Copyright		:	Cypress Semiconductors Inc.					*
@@ -16,140 +25,238 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
 
+// Most endpoints, devices and streams in one test.
+#define MAX_ENDPOINTS	16
+#define MAX_DEVICES	32
+#define MAX_STREAMS	64
+#define MAX_SHARDS	64
+
 // Variables storing the user provided application configuration.
-unsigned int endpoint   = 0;	// Endpoint to be tested
+unsigned int endpoints[MAX_ENDPOINTS];	// Endpoints to be tested
+unsigned int numendpoints = 0;		// Number of endpoints to be tested
+int          devices[MAX_DEVICES];	// Indexes of the devices to be tested
+int          numdevices   = 0;		// Number of devices, 0 for the first one only
+bool         alldevices   = false;	// Test every device found
 unsigned int reqsize    = 16;	// Request size in number of packets
 unsigned int queuedepth = 16;	// Number of requests to queue
 unsigned int duration   = 100;	// Duration of the test in seconds
-
-libusb_device_handle		*dev_handle = NULL;	// Handle to the USB device
-unsigned char		eptype;			// Type of endpoint (transfer type)
-unsigned int		pktsize;		// Maximum packet size for the endpoint
-
-unsigned int            success_count = 0;	// Number of successful transfers
-unsigned int            failure_count = 0;	// Number of failed transfers
-unsigned int 		transfer_size = 0;	// Size of data transfers performed so far
-unsigned int		transfer_index = 0;	// Write index into the transfer_size array
-volatile bool		stop_transfers = false;	// Request to stop data transfers
-volatile int		rqts_in_flight = 0;	// Number of transfers that are in progress
-
-struct timeval		start_ts;		// Data transfer start time stamp.
-struct timeval		end_ts;			// Data transfer stop time stamp.
+bool         autotune   = false;	// Search for the best request size and queue depth first
+bool         sized      = false;	// Request size or queue depth given on the command line
+int          numshards  = 0;		// Number of contexts to split the devices over, 0 for one unpinned
+bool         eventloop  = false;	// Handle the events in an epoll loop on the main thread
+int          epfd       = -1;		// epoll instance of that loop
+const char   *histfile  = NULL;		// File to dump the latency histograms to at exit, - for stdout
+
+cyusb_context	*shards[MAX_SHARDS];	// Contexts holding the devices
+int		shardbase[MAX_SHARDS + 1];	// Number of the first device of each context
+
+// State of one endpoint under test. The counters of the library are read by the main thread
+// once per second; they count from the first use of the endpoint, tuning included, so the
+// test counts from a baseline taken at its start.
+struct test_stream {
+	int				device;		// Number of the device, over all contexts
+	int				shard;		// Context holding the device
+	cyusb_context			*ctx;		// Same, as a pointer
+	int				index;		// Index of the device in its context
+	unsigned int			endpoint;	// Endpoint address
+	const struct cyusb_endpoint	*epinfo;	// Endpoint information cached by the library
+	unsigned int			reqsize;	// Request size in packets
+	unsigned int			queuedepth;	// Number of requests queued
+	cyusb_stream			*stream;	// Queue of transfers on the endpoint
+	struct cyusb_ep_stats		base;		// Counters of the endpoint at the start of the test
+	struct cyusb_ep_stats		last;		// Counters of the endpoint at the last report
+};
+
+struct test_stream	streams[MAX_STREAMS];	// Endpoints under test
+int			numstreams = 0;		// Number of endpoints under test
 
 // Function: xfer_callback
-// This is the call back function called by libusb upon completion of a queued data transfer.
-static void
+// This is the call back function called by the library event thread upon completion of a
+// queued data transfer. Returning non-zero re-submits the transfer. The library counts the
+// transfers and bytes of the endpoint itself; for isochronous endpoints it adds up the data
+// transferred in each micro-frame.
+static int
 xfer_callback (
-		struct libusb_transfer *transfer)
+		const struct cyusb_xfer *xfer,
+		void *user)
 {
-	unsigned int elapsed_time;
-	int size = 0;
-
-	// Reduce the number of requests in flight.
-	rqts_in_flight--;
-
-	// Check if the transfer has succeeded.
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-
-		failure_count++;
-
-	} else {
+	// Keep the request queued; the library stops re-submitting when the stream is stopped.
+	return 1;
+}
 
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+// Function: read_stats
+// Reads the counters of the endpoint of a stream since the start of the test.
+static void
+read_stats (
+		struct test_stream *ts,
+		struct cyusb_ep_stats *st)
+{
+	int i;
+
+	cyusb_stats_endpoint (ts->ctx, ts->index, ts->endpoint, st);
+	st->submitted         -= ts->base.submitted;
+	st->completed         -= ts->base.completed;
+	st->failed            -= ts->base.failed;
+	st->bytes             -= ts->base.bytes;
+	st->callbacks         -= ts->base.callbacks;
+	st->callback_ns       -= ts->base.callback_ns;
+	st->resubmit_failures -= ts->base.resubmit_failures;
+	st->recoveries        -= ts->base.recoveries;
+	st->recovery_ns       -= ts->base.recovery_ns;
+	st->recovery_retries  -= ts->base.recovery_retries;
+	for (i = 0; i < CYUSB_STATS_NSTATUS; i++)
+		st->status[i] -= ts->base.status[i];
+}
 
-			// Loop through all the packets and check the status of each packet transfer
-			for (int i = 0; i < reqsize; ++i) {
+// Function: cpu_seconds
+// Returns the user plus system CPU time used by the process so far, in seconds.
+static double
+cpu_seconds (
+		void)
+{
+	struct rusage ru;
 
-				// Calculate the actual size of data transferred in each micro-frame.
-				if (transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED) {
-					size += transfer->iso_packet_desc[i].actual_length;
-				}
-			}
+	getrusage (RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
 
-		} else {
-			size = reqsize * pktsize;
-		}
+// Function: elapsed_seconds
+// Returns the time between two time stamps in seconds.
+static double
+elapsed_seconds (
+		const struct timespec *from,
+		const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
 
-		success_count++;
+// Function: parse_list
+// Parses a comma separated list of numbers, in decimal or with a 0x prefix in hex.
+// Returns the number of entries, or -1 on a parse error or too many entries.
+static int
+parse_list (
+		const char *arg,
+		int *values,
+		int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*arg) {
+		if (n == max)
+			return -1;
+		values[n++] = (int)strtol (arg, &end, 0);
+		if ((end == arg) || ((*end != ',') && (*end != '\0')))
+			return -1;
+		arg = (*end == ',') ? end + 1 : end;
 	}
+	return n;
+}
 
-	// Update the actual transfer size for this request.
-	transfer_size += size;
-
-	// Print the transfer statistics when queuedepth transfers are completed.
-	transfer_index++;
-	if (transfer_index == queuedepth) {
-
-		gettimeofday (&end_ts, NULL);
-		elapsed_time = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000 +
-			(end_ts.tv_usec - start_ts.tv_usec));
-
-		printf ("Transfer Counts: %d pass %d fail\n", success_count, failure_count);
-		printf ("Data rate: %f KBps\n\n", (((double)transfer_size / 1024) / ((double)elapsed_time / 1000000)));
+// Function: wait_second
+// Waits for one second. With -E the transfers of all contexts complete meanwhile, in the epoll
+// loop run here, instead of on the library event threads.
+static void
+wait_second (
+		void)
+{
+	struct epoll_event ev[MAX_SHARDS];
+	struct timespec start, now;
+	int i, n, ms, t;
 
-		transfer_index = 0;
-		transfer_size  = 0;
-		start_ts = end_ts;
+	if (epfd < 0) {
+		sleep (1);
+		return;
 	}
 
-	// Prepare and re-submit the read request.
-	if (!stop_transfers) {
-
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_set_iso_packet_lengths (transfer, pktsize);
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (;;) {
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		ms = 1000 - (int)(elapsed_seconds (&start, &now) * 1000);
+		if (ms <= 0)
+			break;
+		for (i = 0; i < ((numshards > 0) ? numshards : 1); i++) {
+			t = cyusb_event_timeout (shards[i]);
+			if ((t >= 0) && (t < ms))
+				ms = t;
+		}
 
-			default:
-				break;
+		n = epoll_wait (epfd, ev, MAX_SHARDS, ms);
+		if (n == 0) {
+			for (i = 0; i < ((numshards > 0) ? numshards : 1); i++)
+				cyusb_handle_events (shards[i]);
 		}
+		for (i = 0; i < n; i++)
+			cyusb_handle_events ((cyusb_context *)ev[i].data.ptr);
 	}
 }
 
-// Function to free data buffers and transfer structures
+// Function: report
+// Prints the data rate of every endpoint since the last report, then per bus and in total.
 static void
-free_transfer_buffers (
-		unsigned char          **databuffers,
-		struct libusb_transfer **transfers)
+report (
+		double seconds)
 {
-	// Free up any allocated data buffers
-	if (databuffers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (databuffers[i] != NULL) {
-				free (databuffers[i]);
-			}
-			databuffers[i] = NULL;
+	unsigned char buses[MAX_STREAMS];
+	double busrate[MAX_STREAMS];
+	double shardxfers[MAX_SHARDS];
+	int nbuses = 0;
+	double rate, xfers, total = 0, totalxfers = 0;
+	struct cyusb_latency lat;
+	struct cyusb_ep_stats st;
+	int i, b;
+
+	for (i = 0; i < MAX_SHARDS; i++)
+		shardxfers[i] = 0;
+
+	for (i = 0; i < numstreams; i++) {
+		struct test_stream *ts = &streams[i];
+		unsigned char bus = cyusb_getdevice (ts->ctx, ts->index)->busnum;
+
+		read_stats (ts, &st);
+		rate = (st.bytes - ts->last.bytes) / 1024.0 / seconds;
+		total += rate;
+
+		// Completions, failed ones included, are the load on the event thread.
+		xfers = (st.completed - ts->last.completed) / seconds;
+		ts->last = st;
+		shardxfers[ts->shard] += xfers;
+		totalxfers += xfers;
+
+		for (b = 0; (b < nbuses) && (buses[b] != bus); b++)
+			;
+		if (b == nbuses) {
+			buses[nbuses]   = bus;
+			busrate[nbuses] = 0;
+			nbuses++;
 		}
-		free (databuffers);
-	}
+		busrate[b] += rate;
 
-	// Free up any allocated transfer structures
-	if (transfers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (transfers[i] != NULL) {
-				libusb_free_transfer (transfers[i]);
-			}
-			transfers[i] = NULL;
+		// Latency percentiles are over the whole test so far, in microseconds.
+		cyusb_stream_latency (ts->stream, &lat);
+		printf ("Device %2d EP 0x%02x: %6llu pass %6llu fail  %10.0f KBps  p50 %8.1f p99 %8.1f p99.9 %8.1f max %8.1f us\n",
+				ts->device, ts->endpoint, st.status[LIBUSB_TRANSFER_COMPLETED], st.failed, rate,
+				lat.p50 / 1000.0, lat.p99 / 1000.0, lat.p999 / 1000.0, lat.max / 1000.0);
+	}
+	if (numstreams > 1) {
+		for (b = 0; b < nbuses; b++)
+			printf ("Bus %3d           :                    %10.0f KBps\n", buses[b], busrate[b]);
+		if (numshards > 1) {
+			for (b = 0; b < numshards; b++)
+				printf ("Shard %2d          : %10.0f completions/s\n", b, shardxfers[b]);
 		}
-		free (transfers);
+		printf ("Total             : %10.0f completions/s  %10.0f KBps\n", totalxfers, total);
 	}
+	printf ("\n");
 }
 
 // Prints application usage information.
@@ -159,15 +266,131 @@ print_usage (
 {
 	printf ("%s: USB data transfer performance test\n", progname);
 	printf ("\n");
-	printf ("Usage: %s -e <epnum> -s <reqsize> -q <queuedepth> -d <duration>\n", progname);
+	printf ("Usage: %s -e <epnum>[,<epnum>...] [-D all|<index>[,<index>...]] [-S <shards>] [-E] -s <reqsize> -q <queuedepth> -d <duration> [-a] [-H <file>]\n",
+			progname);
 	printf ("\twhere\n");
-	printf ("\t\tepnum is the endpoint to be tested\n");
+	printf ("\t\tepnum is an endpoint to be tested; -e may be given several times\n");
+	printf ("\t\tindex is a device to be tested, or all for every device (default device 0)\n");
+	printf ("\t\tshards is the number of library contexts to split the devices over, each\n");
+	printf ("\t\t\twith its own event thread pinned to a core\n");
+	printf ("\t\t-E handles the events of all contexts in an epoll loop on the main thread\n");
 	printf ("\t\treqsize is the size of individual data transfer requests in packets or bursts\n");
 	printf ("\t\tqueuedepth is the number of requests to be queued at a time\n");
 	printf ("\t\tduration is the duration in seconds for which the test is to be run\n");
+	printf ("\t\t-a searches for the fastest request size and queue depth before the test\n");
+	printf ("\t\tfile receives the latency histogram of every endpoint at the end, - for stdout\n");
+	printf ("\n");
+	printf ("All endpoints of all devices selected are streamed at once, and the data rate is\n");
+	printf ("reported per endpoint, per bus and in total, to find host controller and hub limits.\n");
+	printf ("With -S, devices are numbered shard by shard, and the completions per second are\n");
+	printf ("reported per shard, to see how they scale with the number of event threads.\n");
+	printf ("With -E, no event thread runs during the test, and the main thread sleeps in\n");
+	printf ("epoll_wait() between completions.\n");
+	printf ("\n");
+	printf ("Every transfer is timed from submission to completion with CLOCK_MONOTONIC, and the\n");
+	printf ("p50, p99, p99.9 and maximum latency since the start are reported per endpoint.\n");
+	printf ("Transfers, bytes and the time spent in callbacks come from the performance counters\n");
+	printf ("of the library, and are broken down by status at the end.\n");
+	printf ("\n");
+	printf ("Without -s and -q, the test uses the settings found by an earlier -a run on this\n");
+	printf ("device, endpoint and host controller, if any. With -a, the search starts from them.\n");
+	printf ("\n");
+	printf ("Transfer buffers are mapped from usbfs where the kernel supports it. Set\n");
+	printf ("CYUSB_NO_DEVMEM=1 to use ordinary memory and compare the CPU time per GB.\n");
 	printf ("\n");
 }
 
+// Function: setup_stream
+// Claims the interface of an endpoint, chooses the transfer settings and opens a stream on it.
+static int
+setup_stream (
+		const char *progname,
+		struct test_stream *ts)
+{
+	libusb_device_handle *dev_handle = cyusb_gethandle (ts->ctx, ts->index);
+	const struct cyusb_endpoint *epinfo;
+	int rStatus;
+
+	// Look up the endpoint in the endpoint table cached by the library.
+	epinfo = cyusb_getendpoint (ts->ctx, ts->index, ts->endpoint);
+	if ((dev_handle == NULL) || (epinfo == NULL)) {
+		printf ("%s: Failed to find endpoint 0x%x on device %d\n", progname, ts->endpoint, ts->device);
+		return (-ENOENT);
+	}
+	printf ("%s: Found endpoint 0x%x of device %d in interface %d, setting %d\n",
+			progname, ts->endpoint, ts->device, epinfo->interface, epinfo->altsetting);
+	ts->epinfo = epinfo;
+
+	// Claim the interface and select the alternate setting holding the endpoint.
+	rStatus = libusb_claim_interface (dev_handle, epinfo->interface);
+	if (rStatus != 0) {
+		printf ("%s: Failed to claim interface %d of device %d\n", progname, epinfo->interface, ts->device);
+		return (-EACCES);
+	}
+	libusb_set_interface_alt_setting (dev_handle, epinfo->interface, epinfo->altsetting);
+
+	// Search for the fastest settings, or use the ones stored by an earlier search.
+	ts->reqsize    = reqsize;
+	ts->queuedepth = queuedepth;
+	if (autotune) {
+		printf ("%s: Tuning request size and queue depth\n", progname);
+		rStatus = cyusb_autotune (ts->ctx, ts->index, ts->endpoint, &ts->reqsize, &ts->queuedepth);
+		if (rStatus < 0) {
+			printf ("%s: Failed to tune endpoint 0x%x\n", progname, ts->endpoint);
+			return (-EIO);
+		}
+		printf ("%s: Best request size %d, queue depth %d at %d KBps\n", progname,
+				ts->reqsize, ts->queuedepth, rStatus);
+	} else if ((!sized) &&
+			(cyusb_autotune_lookup (ts->ctx, ts->index, ts->endpoint, &ts->reqsize, &ts->queuedepth) == 0)) {
+		printf ("%s: Using the stored request size and queue depth\n", progname);
+	}
+
+	// Print the test parameters. For a USB 3.0 connection the packet size is the product of
+	// the max packet size and the burst size, and for Isochronous endpoints it is multiplied
+	// by the mult value as well. The library computes it once.
+	printf ("\tRequest size     : 0x%x\n", ts->reqsize);
+	printf ("\tQueue depth      : 0x%x\n", ts->queuedepth);
+	printf ("\tEndpoint type    : 0x%x\n", epinfo->type);
+	printf ("\tMax packet size  : 0x%x\n", epinfo->pktsize);
+	printf ("\tBurst x mult     : %d x %d\n", epinfo->burst, epinfo->mult);
+	printf ("\tService interval : %d us, %d bytes\n", epinfo->period, epinfo->periodbytes);
+	printf ("\tBandwidth limit  : %.0f KBps\n", epinfo->bandwidth / 1024.0);
+
+	// Set up the transfers. The library allocates the buffers and transfer structures, and
+	// handles the transfer completions on its own event thread.
+	rStatus = cyusb_stream_open (ts->ctx, ts->index, ts->endpoint, ts->reqsize, ts->queuedepth, xfer_callback, ts,
+			&ts->stream);
+	if (rStatus != 0) {
+		printf ("%s: Failed to set up transfers on endpoint 0x%x\n", progname, ts->endpoint);
+		return (rStatus == LIBUSB_ERROR_NO_MEM) ? (-ENOMEM) : (-EACCES);
+	}
+
+	printf ("\tTransfer buffers : %s\n", cyusb_stream_mapped (ts->stream) ? "usbfs mapped" : "page aligned");
+	printf ("\n");
+	return 0;
+}
+
+// Function: close_streams
+// Closes every stream set up so far, and the library contexts.
+static void
+close_streams (
+		void)
+{
+	int i;
+
+	for (i = 0; i < numstreams; i++)
+		cyusb_stream_close (streams[i].stream);
+	for (i = 0; i < ((numshards > 0) ? numshards : 1); i++) {
+		if (epfd >= 0)
+			cyusb_epoll_del (shards[i], epfd);
+		cyusb_close (shards[i]);
+	}
+	if (epfd >= 0)
+		close (epfd);
+	epfd = -1;
+}
+
 int main (
 		int argc,
 		char **argv)
@@ -176,41 +399,74 @@ int main (
 	extern char *optarg;
 	char         c;
 
-	libusb_device		*dev = NULL;	// The USB device
-	libusb_device_descriptor deviceDesc;
-	libusb_config_descriptor *configDesc;
-	libusb_interface_descriptor *interfaceDesc;
-	libusb_endpoint_descriptor *endpointDesc;
-	libusb_ss_endpoint_companion_descriptor *companionDesc;
-
 	int  rStatus;
-	int  if_numsettings;
-	bool found_ep = false;
-
-	struct libusb_transfer **transfers = NULL;		// List of transfer structures.
-	unsigned char **databuffers = NULL;			// List of data buffers.
-
-	struct timeval t1, t2;					// Timestamps used for test duration control
+	int  values[MAX_ENDPOINTS];
+	int  ndev, i, j, n;
+	double cpu_start, cpu_used;				// CPU time at the start and during the test
+	struct timespec test_start, last_ts, now_ts;		// Monotonic time of the test and the last report
+	unsigned long long total_size = 0;			// Size of data transferred by all endpoints
+	double rate, limit = 0;					// Average data rate and the sum of the limits
+	bool mapped = true;					// Whether all streams use usbfs buffers
+	struct cyusb_latency lat;				// Latency of the transfers of one endpoint
+	struct cyusb_ep_stats st;				// Counters of one endpoint during the test
+	FILE *hf;						// File the histograms are dumped to
 
 	// Parse command line parameters
-	while ((c = getopt (argc, argv, "e:s:q:d:h")) != -1) {
+	while ((c = getopt (argc, argv, "e:D:S:Es:q:d:aH:h")) != -1) {
 		switch (c) {
 			case 'e':
-				// Get the endpoint number.
-				if (sscanf ((const char *)optarg, "%d", &endpoint) != 1) {
+				// Get the endpoint numbers.
+				n = parse_list (optarg, values, MAX_ENDPOINTS);
+				if ((n <= 0) || (numendpoints + n > MAX_ENDPOINTS)) {
 					printf ("%s: Failed to parse endpoint number\n", argv[0]);
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
 
-				// Check for validity of the endpoint
-				if (((endpoint & 0x70) != 0) || ((endpoint & 0x0F) == 0)) {
-					printf ("%s: Invalid endpoint 0x%x specified\n", argv[0], endpoint);
+				// Check for validity of the endpoints
+				for (i = 0; i < n; i++) {
+					if (((values[i] & ~0xFF) != 0) || ((values[i] & 0x70) != 0) || ((values[i] & 0x0F) == 0)) {
+						printf ("%s: Invalid endpoint 0x%x specified\n", argv[0], values[i]);
+						print_usage (argv[0]);
+						return (-EINVAL);
+					}
+					endpoints[numendpoints++] = values[i];
+				}
+				break;
+
+			case 'D':
+				// Get the device selection.
+				if (strcmp (optarg, "all") == 0) {
+					alldevices = true;
+				} else {
+					n = parse_list (optarg, devices, MAX_DEVICES);
+					if (n <= 0) {
+						printf ("%s: Failed to parse device list\n", argv[0]);
+						print_usage (argv[0]);
+						return (-EINVAL);
+					}
+					numdevices = n;
+				}
+				break;
+
+			case 'S':
+				// Get the number of contexts.
+				if ((sscanf ((const char *)optarg, "%d", &numshards) != 1) || (numshards <= 0) ||
+						(numshards > MAX_SHARDS)) {
+					printf ("%s: Failed to parse number of shards\n", argv[0]);
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
 				break;
 
+			case 'E':
+				eventloop = true;
+				break;
+
+			case 'H':
+				histfile = optarg;
+				break;
+
 			case 's':
 				// Get the request size value.
 				if (sscanf ((const char *)optarg, "%d", &reqsize) != 1) {
@@ -218,6 +474,7 @@ int main (
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
+				sized = true;
 				break;
 
 			case 'q':
@@ -227,6 +484,7 @@ int main (
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
+				sized = true;
 				break;
 
 			case 'd':
@@ -238,6 +496,11 @@ int main (
 				}
 				break;
 
+			case 'a':
+				// Tune the request size and queue depth before the test.
+				autotune = true;
+				break;
+
 			case 'h':
 				// Print the usage information and quit.
 				print_usage (argv[0]);
@@ -253,10 +516,20 @@ int main (
 		}
 	}
 
-	// Find the USB device and locate the endpoint to be tested.
+	if (numendpoints == 0) {
+		printf ("%s: No endpoint specified\n", argv[0]);
+		print_usage (argv[0]);
+		return (-EINVAL);
+	}
 
-	// Step 1: Initialize the cyusb library and check if any devices are detected.
-	rStatus = cyusb_open ();
+	// Find the USB devices and locate the endpoints to be tested.
+
+	// Step 1: Initialize the cyusb library and check if any devices are detected. Each shard
+	// is a context of its own, with a pinned event thread.
+	if (numshards > 0)
+		rStatus = cyusb_open_shards (shards, numshards, NULL);
+	else
+		rStatus = cyusb_open (&shards[0], NULL);
 	if (rStatus < 0) {
 		printf ("%s: Failed to initialize cyusb library\n", argv[0]);
 		return -EACCES;
@@ -264,214 +537,171 @@ int main (
 	else {
 		if (rStatus == 0) {
 			printf ("%s: No USB device found\n", argv[0]);
+			close_streams ();
 			return -ENODEV;
 		}
 	}
-
-	// Step 2: Get a handle to the first CyUSB device.
-	dev_handle = cyusb_gethandle (0);
-	if (dev_handle == NULL) {
-		printf ("%s: Failed to get CyUSB device handle\n", argv[0]);
-		return -EACCES;
+	ndev = rStatus;
+
+	// Number the devices shard by shard.
+	shardbase[0] = 0;
+	for (i = 0; i < ((numshards > 0) ? numshards : 1); i++)
+		shardbase[i + 1] = shardbase[i] + cyusb_getcount (shards[i]);
+
+	// Step 2: Select the devices.
+	if (alldevices) {
+		for (numdevices = 0; (numdevices < ndev) && (numdevices < MAX_DEVICES); numdevices++)
+			devices[numdevices] = numdevices;
+	} else if (numdevices == 0) {
+		devices[numdevices++] = 0;
 	}
-	dev = libusb_get_device(dev_handle);
 
-	// Step 3: Read the configuration descriptor.
-	rStatus = libusb_get_config_descriptor (dev, 0, &configDesc);
-	if (rStatus != 0) {
-		printf ("%s: Failed to get USB Configuration descriptor\n", argv[0]);
-		cyusb_close ();
-		return -EACCES;
-	}
-
-	// Step 4: Check each of the interfaces one by one and check if we can find the desired endpoint there.
-	for (int i = 0; i < configDesc->bNumInterfaces; i++) {
-
-		// Step 4.a: Claim the interface
-		rStatus = libusb_claim_interface (dev_handle, i);
-		if (rStatus != 0) {
-			printf ("%s: Failed to claim interface %d\n", argv[0], i);
-			libusb_free_config_descriptor (configDesc);
-			cyusb_close ();
+	// Step 3: Set up a stream on every endpoint of every device.
+	for (i = 0; i < numdevices; i++) {
+		for (n = 0; (n < numshards) && (devices[i] >= shardbase[n + 1]); n++)
+			;
+		if ((devices[i] < 0) || (devices[i] >= ndev) ||
+				(cyusb_gethandle (shards[n], devices[i] - shardbase[n]) == NULL)) {
+			printf ("%s: Failed to get CyUSB device handle of device %d\n", argv[0], devices[i]);
+			close_streams ();
 			return -EACCES;
 		}
-
-		// Step 4.b: Get each of the interface descriptors and check if the endpoint is present.
-		if_numsettings = configDesc->interface[i].num_altsetting;
-		for (int j = 0; j < if_numsettings; j++) {
-
-			interfaceDesc = (libusb_interface_descriptor *)&(configDesc->interface[i].altsetting[j]);
-
-			// Step 4.b.1: Check if the desired endpoint is present.
-			for (int k = 0; k < interfaceDesc->bNumEndpoints; k++) {
-
-				endpointDesc = (libusb_endpoint_descriptor *)&(interfaceDesc->endpoint[k]);
-				if (endpointDesc->bEndpointAddress == endpoint) {
-					printf ("%s: Found endpoint 0x%x in interface %d, setting %d\n",
-							argv[0], endpoint, i, j);
-
-					// If the alt setting is not 0, select it
-					libusb_set_interface_alt_setting (dev_handle, i, j);
-					found_ep = true;
-					break;
-				}
+		for (j = 0; j < (int)numendpoints; j++) {
+			if (numstreams == MAX_STREAMS) {
+				printf ("%s: Too many endpoints to test\n", argv[0]);
+				close_streams ();
+				return (-EINVAL);
 			}
-
-			if (found_ep)
-				break;
+			memset (&streams[numstreams], 0, sizeof (struct test_stream));
+			streams[numstreams].device   = devices[i];
+			streams[numstreams].shard    = n;
+			streams[numstreams].ctx      = shards[n];
+			streams[numstreams].index    = devices[i] - shardbase[n];
+			streams[numstreams].endpoint = endpoints[j];
+			rStatus = setup_stream (argv[0], &streams[numstreams]);
+			if (rStatus != 0) {
+				close_streams ();
+				return rStatus;
+			}
+			limit  += streams[numstreams].epinfo->bandwidth;
+			mapped &= cyusb_stream_mapped (streams[numstreams].stream);
+			numstreams++;
 		}
-
-		if (found_ep)
-			break;
-
-		// Step 4.c: Release the interface as the endpoint was not found.
-		libusb_release_interface (dev_handle, i);
-	}
-
-	if (!found_ep) {
-		printf ("%s: Failed to find endpoint 0x%x on device\n", argv[0], endpoint);
-		libusb_free_config_descriptor (configDesc);
-		cyusb_close ();
-		return (-ENOENT);
-	}
-
-	// Store the endpoint type and maximum packet size
-	eptype  = endpointDesc->bmAttributes;
-
-	libusb_get_device_descriptor (dev, &deviceDesc);
-	if (deviceDesc.bcdUSB >= 0x0300) {
-
-		// If this is a USB 3.0 connection, get the endpoint companion descriptor
-		// The packet size for the endpoint is calculated as the product of the max
-		// packet size and the burst size. For Isochronous endpoints, this value is
-		// multiplied by the mult value as well.
-
-		libusb_get_ss_endpoint_companion_descriptor (NULL, endpointDesc, &companionDesc);
-
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			pktsize = endpointDesc->wMaxPacketSize * (companionDesc->bMaxBurst + 1) *
-				(companionDesc->bmAttributes + 1);
-		else
-			pktsize = endpointDesc->wMaxPacketSize * (companionDesc->bMaxBurst + 1);
-
-		libusb_free_ss_endpoint_companion_descriptor (companionDesc);
-
-	} else {
-
-		// Not USB 3.0. For Isochronous endpoints, get the packet size as computed by
-		// the library. For other endpoints, use the max packet size as it is.
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			pktsize = libusb_get_max_iso_packet_size (dev, endpoint);
-		else
-			pktsize = endpointDesc->wMaxPacketSize;
-
 	}
 
-	// Print the test parameters.
-	printf ("%s: Starting test with the following parameters\n", argv[0]);
-	printf ("\tRequest size     : 0x%x\n", reqsize);
-	printf ("\tQueue depth      : 0x%x\n", queuedepth);
-	printf ("\tTest duration    : 0x%x\n", duration);
-	printf ("\tEndpoint to test : 0x%x\n", endpoint);
-	printf ("\n");
-	printf ("\tEndpoint type    : 0x%x\n", eptype);
-	printf ("\tMax packet size  : 0x%x\n", pktsize);
-
-	// Allocate buffers and transfer structures
-	bool allocfail = false;
-
-	databuffers = (unsigned char **)calloc (queuedepth, sizeof (unsigned char *));
-	transfers   = (struct libusb_transfer **)calloc (queuedepth, sizeof (struct libusb_transfer *));
-
-	if ((databuffers != NULL) && (transfers != NULL)) {
-
-		for (unsigned int i = 0; i < queuedepth; i++) {
-
-			databuffers[i] = (unsigned char *)malloc (reqsize * pktsize);
-			transfers[i]   = libusb_alloc_transfer (
-					(eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0);
-
-			if ((databuffers[i] == NULL) || (transfers[i] == NULL)) {
-				allocfail = true;
-				break;
+	// Step 4: Move the events of every context into the epoll loop of this thread.
+	if (eventloop) {
+		epfd = epoll_create1 (EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			printf ("%s: Failed to create the epoll loop\n", argv[0]);
+			close_streams ();
+			return (-ENOMEM);
+		}
+		for (i = 0; i < ((numshards > 0) ? numshards : 1); i++) {
+			rStatus = cyusb_epoll_add (shards[i], epfd, shards[i]);
+			if (rStatus != 0) {
+				printf ("%s: Failed to add the events of context %d to the epoll loop\n", argv[0], i);
+				close_streams ();
+				return rStatus;
 			}
 		}
-
-	} else {
-		allocfail = true;
 	}
 
-	// Check if all memory allocations have succeeded
-	if (allocfail) {
-		printf ("%s: Failed to allocate buffers and transfer structures\n", argv[0]);
-		free_transfer_buffers (databuffers, transfers);
-
-		libusb_free_config_descriptor (configDesc);
-		cyusb_close ();
-		return (-ENOMEM);
-	}
-
-	// Take the transfer start timestamp
-	gettimeofday (&start_ts, NULL);
-
-	// Launch all the transfers till queue depth is complete
-	for (unsigned int i = 0; i < queuedepth; i++) {
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				libusb_fill_bulk_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				libusb_fill_interrupt_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_fill_iso_transfer (transfers[i], dev_handle, endpoint, databuffers[i],
-						reqsize * pktsize, reqsize, xfer_callback, NULL, 5000);
-				libusb_set_iso_packet_lengths (transfers[i], pktsize);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			default:
-				break;
+	printf ("%s: Starting test of %d endpoint(s) on %d device(s) in %d context(s) for %d seconds%s\n\n",
+			argv[0], numstreams, numdevices, (numshards > 0) ? numshards : 1, duration,
+			eventloop ? ", events in the main thread" : "");
+
+	// Take the transfer start timestamp, CPU time and the counters of every endpoint.
+	clock_gettime (CLOCK_MONOTONIC, &test_start);
+	last_ts = test_start;
+	cpu_start = cpu_seconds ();
+	for (i = 0; i < numstreams; i++)
+		cyusb_stats_endpoint (streams[i].ctx, streams[i].index, streams[i].endpoint, &streams[i].base);
+
+	// Launch all the transfers till queue depth is complete, on all endpoints together.
+	for (i = 0; i < numstreams; i++) {
+		if (cyusb_stream_start (streams[i].stream) <= 0) {
+			printf ("%s: Failed to queue transfers on endpoint 0x%x of device %d\n", argv[0],
+					streams[i].endpoint, streams[i].device);
+			close_streams ();
+			return (-EIO);
 		}
 	}
 
-	gettimeofday (&t1, NULL);
-	do {
-		libusb_handle_events (NULL);
-		gettimeofday (&t2, NULL);
-	} while (t2.tv_sec < (t1.tv_sec + duration));
+	for (i = 0; i < (int)duration; i++) {
+		wait_second ();
+		clock_gettime (CLOCK_MONOTONIC, &now_ts);
+		report (elapsed_seconds (&last_ts, &now_ts));
+		last_ts = now_ts;
+	}
 
-	// Test duration elapsed. Set the stop_transfers flag and wait until all transfers are complete.
+	// Test duration elapsed. Cancel the transfers and wait until all of them are complete.
 	printf ("%s: Test duration is complete. Stopping transfers\n", argv[0]);
-	stop_transfers = true;
-	while (rqts_in_flight != 0) {
-		printf ("%d requests are pending\n", rqts_in_flight);
-		libusb_handle_events (NULL);
-		sleep (1);
+	for (i = 0; i < numstreams; i++) {
+		printf ("%d requests are pending on endpoint 0x%x of device %d\n",
+				cyusb_stream_pending (streams[i].stream), streams[i].endpoint, streams[i].device);
+		cyusb_stream_stop (streams[i].stream);
 	}
+	cpu_used = cpu_seconds () - cpu_start;
+	clock_gettime (CLOCK_MONOTONIC, &now_ts);
 
 	// All transfers are complete. We can now free up all structures.
 	printf ("%s: Transfers completed\n", argv[0]);
+	for (i = 0; i < numstreams; i++) {
+		read_stats (&streams[i], &st);
+		rate = st.bytes / elapsed_seconds (&test_start, &now_ts);
+		printf ("\tDevice %2d EP 0x%02x: %10.0f KBps average", streams[i].device, streams[i].endpoint,
+				rate / 1024);
+		if (streams[i].epinfo->bandwidth != 0)
+			printf (", %.1f%% of the bandwidth limit", 100.0 * rate / streams[i].epinfo->bandwidth);
+		printf ("\n");
+		cyusb_stream_latency (streams[i].stream, &lat);
+		printf ("\t                   latency p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n",
+				lat.p50 / 1000.0, lat.p99 / 1000.0, lat.p999 / 1000.0, lat.max / 1000.0);
+		printf ("\t                   %llu submitted, %llu completed, %llu timed out, %llu stalled, "
+				"%llu errors, %llu overflows, %llu not resubmitted\n",
+				st.submitted, st.status[LIBUSB_TRANSFER_COMPLETED], st.status[LIBUSB_TRANSFER_TIMED_OUT],
+				st.status[LIBUSB_TRANSFER_STALL], st.status[LIBUSB_TRANSFER_ERROR] +
+				st.status[LIBUSB_TRANSFER_NO_DEVICE], st.status[LIBUSB_TRANSFER_OVERFLOW],
+				st.resubmit_failures);
+		if (st.callbacks != 0)
+			printf ("\t                   callback time %.2f us average\n",
+					st.callback_ns / 1000.0 / st.callbacks);
+		if (st.recoveries != 0)
+			printf ("\t                   %llu recoveries, %.3f ms average, %llu retries\n",
+					st.recoveries, st.recovery_ns / 1e6 / st.recoveries, st.recovery_retries);
+		total_size += st.bytes;
+	}
+	rate = total_size / elapsed_seconds (&test_start, &now_ts);
+	printf ("\tData transferred : %.3f GB\n", total_size / 1e9);
+	printf ("\tAverage rate     : %.0f KBps", rate / 1024);
+	if (limit != 0)
+		printf (", %.1f%% of the bandwidth limit", 100.0 * rate / limit);
+	printf ("\n");
+	printf ("\tCPU time         : %.3f s\n", cpu_used);
+	if (total_size != 0)
+		printf ("\tCPU per GB       : %.3f s (%s buffers)\n", cpu_used / (total_size / 1e9),
+				mapped ? "usbfs mapped" : "page aligned");
+
+	// Dump the whole latency distribution of every endpoint, to look at the tail.
+	if (histfile) {
+		hf = (strcmp (histfile, "-") == 0) ? stdout : fopen (histfile, "w");
+		if (hf == NULL) {
+			printf ("%s: Failed to open %s\n", argv[0], histfile);
+		} else {
+			for (i = 0; i < numstreams; i++) {
+				fprintf (hf, "# Device %d EP 0x%02x\n", streams[i].device, streams[i].endpoint);
+				cyusb_stream_latency_dump (streams[i].stream, hf);
+			}
+			if (hf != stdout)
+				fclose (hf);
+		}
+	}
 
-	free_transfer_buffers (databuffers, transfers);
-	libusb_free_config_descriptor (configDesc);
-	cyusb_close();
+	close_streams ();
 
 	printf ("%s: Test completed\n", argv[0]);
 	return 0;
 }
 
 /*[]*/
-
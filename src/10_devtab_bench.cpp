@@ -0,0 +1,266 @@
+/************************************************************************************************
+ * Program Name		:	10_devtab_bench.cpp						*
+ * Description		:	This is a CLI program which measures the cost of building and	*
+ *				searching the libcyusb device table, and of matching devices	*
+ *				against the compiled cyusb.conf device list. A synthetic list	*
+ *				of devices is enumerated, so no USB hardware is needed.		*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "../lib/cyusb_devtab.h"
+#include "../lib/cyusb_match.h"
+
+unsigned int numdevices = 1024;		// Number of synthetic devices to enumerate
+unsigned int numlookups = 100000;	// Number of lookups to time for each index
+unsigned int numids     = 10;		// Number of VID/PID entries in the synthetic cyusb.conf
+
+// Function: now_ns
+// Returns a monotonic time stamp in nanoseconds.
+static double
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec * 1e9 + (double)ts.tv_nsec);
+}
+
+// Function: make_entry
+// Creates the synthetic device with the given number. Devices are spread across 8 buses and
+// two levels of hub ports, and every 16 devices share one VID/PID pair.
+static struct cydev_entry *
+make_entry (
+		unsigned int n)
+{
+	struct cydev_entry *e = (struct cydev_entry *)calloc (1, sizeof (struct cydev_entry));
+
+	if (e == NULL)
+		return NULL;
+
+	e->cd.vid    = 0x04b4;
+	e->cd.pid    = 0x00f0 + (n / 16);
+	e->cd.busnum = 1 + (n % 8);
+	sprintf (e->path, "%u-%u.%u.%u", 1 + (n % 8), 1 + ((n / 8) % 7), 1 + ((n / 56) % 7), 1 + (n / 392));
+	sprintf (e->serialbuf, "CY%08u", n);
+	e->serial = e->serialbuf;
+	return e;
+}
+
+static void
+free_entry (
+		struct cydev_entry *e)
+{
+	free (e);
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: libcyusb device table benchmark\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -n <numdevices> -l <numlookups> -i <numids>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tnumdevices is the number of synthetic devices to enumerate (default 1024)\n");
+	printf ("\t\tnumlookups is the number of lookups timed per index (default 100000)\n");
+	printf ("\t\tnumids is the number of VID/PID entries in the device list (default 10)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	struct cydev_table tab;
+	struct cyusb_matcher matcher;
+	struct cydev_entry **entries;
+	struct cydev_entry *e;
+	char   key[CYUSB_SERIAL_LEN];
+	double t1, t2;
+	unsigned int i, n, found;
+	int c;
+
+	while ((c = getopt (argc, argv, "n:l:i:h")) != -1) {
+		switch (c) {
+			case 'n':
+				if ((sscanf (optarg, "%u", &numdevices) != 1) || (numdevices == 0)) {
+					printf ("%s: Failed to parse number of devices\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'l':
+				if ((sscanf (optarg, "%u", &numlookups) != 1) || (numlookups == 0)) {
+					printf ("%s: Failed to parse number of lookups\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'i':
+				if ((sscanf (optarg, "%u", &numids) != 1) || (numids == 0)) {
+					printf ("%s: Failed to parse number of IDs\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	entries = (struct cydev_entry **)calloc (numdevices, sizeof (struct cydev_entry *));
+	if (entries == NULL)
+		return (-ENOMEM);
+	for (i = 0; i < numdevices; i++) {
+		entries[i] = make_entry (i);
+		if (entries[i] == NULL)
+			return (-ENOMEM);
+	}
+
+	printf ("%s: %u synthetic devices, %u lookups per index\n\n", argv[0], numdevices, numlookups);
+
+	// Step 1: Enumerate all devices into an empty table.
+	devtab_init (&tab);
+	t1 = now_ns ();
+	for (i = 0; i < numdevices; i++) {
+		if (devtab_insert (&tab, entries[i]) < 0) {
+			printf ("%s: Failed to insert device %u\n", argv[0], i);
+			return (-ENOMEM);
+		}
+	}
+	t2 = now_ns ();
+	printf ("\tEnumerate        : %10.1f ns/device (%u slots, %u buckets)\n",
+			(t2 - t1) / numdevices, tab.nslots, tab.nbuckets);
+
+	// Step 2: Look up devices by each of the indexes.
+	found = 0;
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (i * 7919) % numdevices;
+		if (devtab_find_path (&tab, entries[n]->path) == entries[n])
+			found++;
+	}
+	t2 = now_ns ();
+	printf ("\tLookup by path   : %10.1f ns (%u/%u found)\n", (t2 - t1) / numlookups, found, numlookups);
+
+	found = 0;
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (i * 7919) % numdevices;
+		for (e = devtab_find_vidpid (&tab, entries[n]->cd.vid, entries[n]->cd.pid); e != NULL;
+				e = devtab_next_vidpid (e)) {
+			if (e == entries[n]) {
+				found++;
+				break;
+			}
+		}
+	}
+	t2 = now_ns ();
+	printf ("\tLookup by VID/PID: %10.1f ns (%u/%u found)\n", (t2 - t1) / numlookups, found, numlookups);
+
+	found = 0;
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (i * 7919) % numdevices;
+		sprintf (key, "CY%08u", n);
+		if (devtab_find_serial (&tab, key) == entries[n])
+			found++;
+	}
+	t2 = now_ns ();
+	printf ("\tLookup by serial : %10.1f ns (%u/%u found, incl. key formatting)\n",
+			(t2 - t1) / numlookups, found, numlookups);
+
+	// For comparison: the linear scan over the slot array that an index-only table needs.
+	found = 0;
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (i * 7919) % numdevices;
+		for (int j = 0; j < tab.nslots; j++) {
+			if ((tab.slots[j] != NULL) && (strcmp (tab.slots[j]->path, entries[n]->path) == 0)) {
+				found++;
+				break;
+			}
+		}
+	}
+	t2 = now_ns ();
+	printf ("\tLinear scan      : %10.1f ns (%u/%u found)\n", (t2 - t1) / numlookups, found, numlookups);
+
+	// Step 3: Detach and re-attach devices, as done by the hotplug registry.
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (i * 7919) % numdevices;
+		e = devtab_remove (&tab, entries[n]->index);
+		if ((e == NULL) || (devtab_insert (&tab, e) < 0)) {
+			printf ("%s: Failed to re-attach device %u\n", argv[0], n);
+			return (-EINVAL);
+		}
+	}
+	t2 = now_ns ();
+	printf ("\tDetach + attach  : %10.1f ns (%u slots)\n", (t2 - t1) / numlookups, tab.nslots);
+
+	devtab_clear (&tab, free_entry);
+	free (entries);
+
+	// Step 4: Match device IDs against a device list with numids entries. Every tenth entry
+	// is a PID range and every hundredth a wildcard, spread over numids / 64 vendors.
+	matcher_init (&matcher);
+	t1 = now_ns ();
+	for (i = 0; i < numids; i++) {
+		unsigned short vid = 0x04b4 + (i / 64);
+		unsigned short pid = (i % 64) * 0x100;
+		int r;
+
+		if ((i % 100) == 99)
+			r = matcher_add (&matcher, vid + 0x1000, 0x0000, 0xFFFF, "wildcard");
+		else if ((i % 10) == 9)
+			r = matcher_add (&matcher, vid, pid, pid + 0xF, "range");
+		else
+			r = matcher_add (&matcher, vid, pid, pid, "exact");
+		if (r != 0) {
+			printf ("%s: Failed to compile ID %u\n", argv[0], i);
+			return (-ENOMEM);
+		}
+	}
+	t2 = now_ns ();
+	printf ("\tCompile %6u IDs: %10.1f ns/ID (%u vendors)\n", numids, (t2 - t1) / numids, matcher.nvids);
+
+	// Half of the probed IDs belong to configured vendors, the other half do not.
+	found = 0;
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		unsigned int n = (i * 7919) % numids;
+		unsigned short vid = ((i & 1) ? 0x04b4 : 0x8000) + (n / 64);
+		unsigned short pid = (n % 64) * 0x100 + (i % 3);
+
+		if (matcher_lookup (&matcher, vid, pid) != NULL)
+			found++;
+	}
+	t2 = now_ns ();
+	printf ("\tMatch device ID  : %10.1f ns (%u/%u matched)\n", (t2 - t1) / numlookups, found, numlookups);
+	matcher_free (&matcher);
+
+	printf ("\n%s: Benchmark completed\n", argv[0]);
+	return 0;
+}
+
+/*[]*/
@@ -0,0 +1,301 @@
+/************************************************************************************************
+ * Program Name		:	11_snapshot_bench.cpp						*
+ * Description		:	This is a CLI program which stresses concurrent lookups in the	*
+ *				libcyusb device table while a writer thread keeps detaching	*
+ *				and re-attaching devices, as the hotplug registry does. Lookups	*
+ *				through published snapshots are compared with lookups under	*
+ *				the device table lock. No USB hardware is needed.		*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "../lib/cyusb_devtab.h"
+#include "../lib/cyusb_snap.h"
+
+unsigned int numdevices = 256;		// Number of synthetic devices to enumerate
+unsigned int numlookups = 1000000;	// Number of lookups done by each reader thread
+unsigned int maxthreads = 8;		// Largest number of reader threads to test
+
+static struct cydev_table	tab;			// Device table updated by the writer
+static pthread_mutex_t		tablock = PTHREAD_MUTEX_INITIALIZER;
+static struct cydev_snapshot	*snap = NULL;		// Published snapshot of the table
+static struct cydev_entry	**entries;		// All synthetic devices
+static volatile bool		use_snapshots;		// Lookup mode of the current run
+static volatile bool		stop_writer;		// Request to stop the writer thread
+static unsigned int		updates;		// Table updates done by the writer
+
+// Per reader thread results.
+struct reader_info {
+	pthread_t	thread;
+	unsigned int	seed;
+	unsigned int	found;
+	double		elapsed;
+};
+
+// Function: now_ns
+// Returns a monotonic time stamp in nanoseconds.
+static double
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec * 1e9 + (double)ts.tv_nsec);
+}
+
+// Function: make_entry
+// Creates the synthetic device with the given number.
+static struct cydev_entry *
+make_entry (
+		unsigned int n)
+{
+	struct cydev_entry *e = (struct cydev_entry *)calloc (1, sizeof (struct cydev_entry));
+
+	if (e == NULL)
+		return NULL;
+
+	e->cd.vid    = 0x04b4;
+	e->cd.pid    = 0x00f0 + (n / 16);
+	e->cd.busnum = 1 + (n % 8);
+	sprintf (e->path, "%u-%u.%u.%u", 1 + (n % 8), 1 + ((n / 8) % 7), 1 + ((n / 56) % 7), 1 + (n / 392));
+	sprintf (e->serialbuf, "CY%08u", n);
+	e->serial = e->serialbuf;
+	return e;
+}
+
+// Function: publish
+// Replaces the published snapshot by one of the current table, and frees the old snapshot
+// after a grace period. Called with the table lock held.
+static int
+publish (
+		void)
+{
+	struct cydev_snapshot *s, *old;
+
+	s = snap_build (&tab);
+	if (s == NULL)
+		return (-ENOMEM);
+
+	old = __atomic_exchange_n (&snap, s, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		snap_synchronize ();
+		snap_free (old);
+	}
+	return 0;
+}
+
+// Function: writer_func
+// Detaches and re-attaches devices until asked to stop.
+static void *
+writer_func (
+		void *arg)
+{
+	unsigned int n = 0;
+
+	while (!stop_writer) {
+		struct cydev_entry *e = entries[n];
+
+		pthread_mutex_lock (&tablock);
+		devtab_remove (&tab, e->index);
+		publish ();
+		devtab_insert (&tab, e);
+		publish ();
+		pthread_mutex_unlock (&tablock);
+
+		updates++;
+		n = (n + 7919) % numdevices;
+	}
+	return NULL;
+}
+
+// Function: reader_func
+// Looks up devices by path and by VID/PID, either in the published snapshot or under the
+// table lock.
+static void *
+reader_func (
+		void *arg)
+{
+	struct reader_info *info = (struct reader_info *)arg;
+	struct cydev_entry *e;
+	unsigned int i, n;
+	double t1;
+
+	t1 = now_ns ();
+	for (i = 0; i < numlookups; i++) {
+		n = (info->seed + i * 7919) % numdevices;
+		if (use_snapshots) {
+			snap_read_lock ();
+			e = snap_find_path (SNAP_DEREF (snap), entries[n]->path);
+			if ((e == entries[n]) && (snap_find_vidpid (SNAP_DEREF (snap), e->cd.vid, e->cd.pid) != NULL))
+				info->found++;
+			snap_read_unlock ();
+		} else {
+			pthread_mutex_lock (&tablock);
+			e = devtab_find_path (&tab, entries[n]->path);
+			if ((e == entries[n]) && (devtab_find_vidpid (&tab, e->cd.vid, e->cd.pid) != NULL))
+				info->found++;
+			pthread_mutex_unlock (&tablock);
+		}
+	}
+	info->elapsed = now_ns () - t1;
+	return NULL;
+}
+
+// Function: run
+// Runs numthreads readers against a busy writer and prints the lookup throughput.
+static int
+run (
+		unsigned int numthreads,
+		bool snapshots)
+{
+	struct reader_info *readers;
+	pthread_t writer;
+	unsigned int i, found = 0;
+	double worst = 0, total;
+
+	readers = (struct reader_info *)calloc (numthreads, sizeof (struct reader_info));
+	if (readers == NULL)
+		return (-ENOMEM);
+
+	use_snapshots = snapshots;
+	stop_writer   = false;
+	updates       = 0;
+	if (pthread_create (&writer, NULL, writer_func, NULL) != 0) {
+		free (readers);
+		return (-ENOMEM);
+	}
+
+	for (i = 0; i < numthreads; i++) {
+		readers[i].seed = i * 131;
+		if (pthread_create (&readers[i].thread, NULL, reader_func, &readers[i]) != 0) {
+			printf ("Failed to create reader thread %u\n", i);
+			numthreads = i;
+			break;
+		}
+	}
+	for (i = 0; i < numthreads; i++) {
+		pthread_join (readers[i].thread, NULL);
+		found += readers[i].found;
+		if (readers[i].elapsed > worst)
+			worst = readers[i].elapsed;
+	}
+
+	stop_writer = true;
+	pthread_join (writer, NULL);
+
+	total = (double)numlookups * numthreads;
+	printf ("\t%-9s %3u threads: %8.2f M lookups/s total, %8.2f per thread, %6.1f ns/lookup, "
+			"%u updates, %.1f%% found\n", snapshots ? "snapshot" : "mutex", numthreads,
+			total * 1e3 / worst, (double)numlookups * 1e3 / worst, worst / numlookups,
+			updates, 100.0 * found / total);
+
+	free (readers);
+	return 0;
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: libcyusb concurrent lookup benchmark\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -n <numdevices> -l <numlookups> -t <maxthreads>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tnumdevices is the number of synthetic devices to enumerate (default 256)\n");
+	printf ("\t\tnumlookups is the number of lookups done by each reader thread (default 1000000)\n");
+	printf ("\t\tmaxthreads is the largest number of reader threads tested (default 8)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	unsigned int i, n;
+	int c;
+
+	while ((c = getopt (argc, argv, "n:l:t:h")) != -1) {
+		switch (c) {
+			case 'n':
+				if ((sscanf (optarg, "%u", &numdevices) != 1) || (numdevices == 0)) {
+					printf ("%s: Failed to parse number of devices\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'l':
+				if ((sscanf (optarg, "%u", &numlookups) != 1) || (numlookups == 0)) {
+					printf ("%s: Failed to parse number of lookups\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 't':
+				if ((sscanf (optarg, "%u", &maxthreads) != 1) || (maxthreads == 0)) {
+					printf ("%s: Failed to parse number of threads\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	entries = (struct cydev_entry **)calloc (numdevices, sizeof (struct cydev_entry *));
+	if (entries == NULL)
+		return (-ENOMEM);
+
+	devtab_init (&tab);
+	for (i = 0; i < numdevices; i++) {
+		entries[i] = make_entry (i);
+		if ((entries[i] == NULL) || (devtab_insert (&tab, entries[i]) < 0))
+			return (-ENOMEM);
+	}
+	if (publish () != 0)
+		return (-ENOMEM);
+
+	printf ("%s: %u synthetic devices, %u lookups per reader, one writer re-attaching devices\n\n",
+			argv[0], numdevices, numlookups);
+
+	// Double the number of readers up to maxthreads, in both lookup modes.
+	for (n = 1; ; n = (n * 2 > maxthreads) ? maxthreads : n * 2) {
+		if ((run (n, false) != 0) || (run (n, true) != 0)) {
+			printf ("%s: Failed to start threads\n", argv[0]);
+			return (-ENOMEM);
+		}
+		if (n == maxthreads)
+			break;
+	}
+
+	snap_free (snap);
+	devtab_clear (&tab, NULL);
+	for (i = 0; i < numdevices; i++)
+		free (entries[i]);
+	free (entries);
+
+	printf ("\n%s: Benchmark completed\n", argv[0]);
+	return 0;
+}
+
+/*[]*/
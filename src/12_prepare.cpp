@@ -0,0 +1,131 @@
+/************************************************************************************************
+ * Program Name		:	12_prepare.cpp							*
+ * Description		:	This is a CLI program which brings up all devices of interest	*
+ *				in parallel: each device is opened, its serial number read and	*
+ *				optionally an interface claimed. The time until each device is	*
+ *				ready, and until all of them are, is reported. Run with -t 1	*
+ *				for the time taken when the devices are set up one by one.	*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+int numthreads = 0;		// Number of threads to use, 0 for the library default
+int interface  = -1;		// Interface to claim on each device, -1 for none
+
+// Function: now_us
+// Returns a monotonic time stamp in microseconds.
+static unsigned long
+now_us (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+}
+
+// Function: ready_callback
+// Called by the library as each device becomes ready, or fails.
+static void
+ready_callback (
+		int index,
+		int status,
+		unsigned long usec,
+		void *user)
+{
+	struct cyusb_devinfo info;
+
+	// Called on the worker threads, so the device information is copied.
+	if (cyusb_getinfo (index, &info) != 0)
+		return;
+
+	printf ("\t%3d  %04x:%04x  %-12s  %-20s  %9.3f ms  %s\n", index, info.vid, info.pid,
+			info.path, info.serial[0] ? info.serial : "-",
+			usec / 1000.0, (status == 0) ? "ready" : libusb_error_name (status));
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: Parallel device bring-up\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -t <numthreads> -i <interface>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tnumthreads is the number of devices brought up at a time (default 8)\n");
+	printf ("\t\tinterface is the interface to claim on each device (default none)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	unsigned long t1, t2, t3;
+	int numdevs, numready;
+	int c;
+
+	while ((c = getopt (argc, argv, "t:i:h")) != -1) {
+		switch (c) {
+			case 't':
+				if ((sscanf (optarg, "%d", &numthreads) != 1) || (numthreads < 0)) {
+					printf ("%s: Failed to parse number of threads\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'i':
+				if ((sscanf (optarg, "%d", &interface) != 1) || (interface < 0)) {
+					printf ("%s: Failed to parse interface number\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	t1 = now_us ();
+	numdevs = cyusb_open ();
+	if (numdevs < 0) {
+		printf ("%s: Failed to enumerate devices\n", argv[0]);
+		return (-ENODEV);
+	}
+	t2 = now_us ();
+	printf ("%s: %d devices of interest found in %.3f ms\n\n", argv[0], numdevs, (t2 - t1) / 1000.0);
+	if (numdevs == 0) {
+		cyusb_close ();
+		return (-ENODEV);
+	}
+
+	printf ("\t%3s  %-9s  %-12s  %-20s  %12s  %s\n", "#", "VID:PID", "Path", "Serial", "Ready after", "Status");
+	numready = cyusb_prepare (numthreads, interface, ready_callback, NULL);
+	t3 = now_us ();
+
+	printf ("\n%s: %d of %d devices ready in %.3f ms (%.3f ms including enumeration)\n", argv[0],
+			numready, numdevs, (t3 - t2) / 1000.0, (t3 - t1) / 1000.0);
+
+	cyusb_close ();
+	return (numready == numdevs) ? 0 : (-EIO);
+}
+
+/*[]*/
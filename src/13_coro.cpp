@@ -0,0 +1,236 @@
+/************************************************************************************************
+ * Program Name		:	13_coro.cpp							*
+ * Description		:	This is a CLI program which reads from an IN endpoint of every	*
+ *				device of interest with many concurrent readers, written as	*
+ *				C++20 coroutines. Each device is first identified through a	*
+ *				chain of control transfers. All transfers of all devices	*
+ *				complete on the one event thread of the library, instead of	*
+ *				one blocking thread per reader. Build with -std=c++20.		*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "../include/cyusb_coro.h"
+
+unsigned int endpoint   = 0x81;		// Endpoint to read from
+unsigned int reqsize    = 16384;	// Size of each read in bytes
+unsigned int numreaders = 64;		// Number of reader coroutines per device
+unsigned int duration   = 10;		// Duration of the test in seconds
+
+static volatile bool	stop_readers = false;	// Request to stop the readers
+static int		live = 0;		// Number of readers still running
+
+// Per device results. Only the event thread updates them.
+struct dev_stats {
+	unsigned long long	bytes;
+	unsigned long		reads;
+	unsigned long		errors;
+};
+
+// Function: identify
+// Reads the device descriptor, then the serial number string it points to, from the device.
+static cyusb::task<int>
+identify (
+		cyusb::device &dev,
+		int index)
+{
+	unsigned char dd[18], str[255];
+	char serial[128];
+	cyusb::result r;
+	int i, n = 0;
+
+	// GET_DESCRIPTOR (DEVICE)
+	r = co_await dev.control (0x80, 0x06, 0x0100, 0, dd, sizeof (dd), 1000);
+	if (r.status != 0)
+		co_return r.status;
+
+	serial[0] = '\0';
+	if (dd[16] != 0) {
+		// GET_DESCRIPTOR (STRING), US English
+		r = co_await dev.control (0x80, 0x06, 0x0300 | dd[16], 0x0409, str, sizeof (str), 1000);
+		if (r.status != 0)
+			co_return r.status;
+
+		// Keep the low byte of each UTF-16 character.
+		for (i = 2; (i + 1 < r.actual) && (n < (int)sizeof (serial) - 1); i += 2)
+			serial[n++] = str[i];
+		serial[n] = '\0';
+	}
+
+	printf ("\t%3d  %04x:%04x  serial %s\n", index, dd[8] | (dd[9] << 8), dd[10] | (dd[11] << 8),
+			serial[0] ? serial : "-");
+	co_return 0;
+}
+
+// Function: reader
+// Reads from the endpoint until asked to stop.
+static cyusb::task<void>
+reader (
+		cyusb::device &dev,
+		struct dev_stats *st)
+{
+	unsigned char *buf = (unsigned char *)malloc (reqsize);
+	cyusb::result r;
+
+	while (buf && !stop_readers) {
+		r = co_await dev.bulk_read (endpoint, buf, reqsize, 1000);
+		if ((r.status != 0) && (r.status != LIBUSB_ERROR_TIMEOUT)) {
+			st->errors++;
+			break;
+		}
+		st->bytes += r.actual;
+		st->reads++;
+	}
+
+	free (buf);
+	__atomic_sub_fetch (&live, 1, __ATOMIC_RELEASE);
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: Coroutine transfers on all devices of interest\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -e <epnum> -s <reqsize> -n <numreaders> -d <duration>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tepnum is the IN endpoint to read from (default 0x81)\n");
+	printf ("\t\treqsize is the size of each read in bytes (default 16384)\n");
+	printf ("\t\tnumreaders is the number of concurrent readers per device (default 64)\n");
+	printf ("\t\tduration is the duration in seconds for which the test is to be run (default 10)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	cyusb::device **devs;
+	struct dev_stats *stats;
+	unsigned long long total = 0;
+	int numdevs, numready = 0;
+	int c, i;
+	unsigned int j;
+
+	while ((c = getopt (argc, argv, "e:s:n:d:h")) != -1) {
+		switch (c) {
+			case 'e':
+				if ((sscanf (optarg, "%i", &endpoint) != 1) || ((endpoint & 0x80) == 0)) {
+					printf ("%s: Invalid IN endpoint %s\n", argv[0], optarg);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 's':
+				if ((sscanf (optarg, "%u", &reqsize) != 1) || (reqsize == 0)) {
+					printf ("%s: Failed to parse request size\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'n':
+				if ((sscanf (optarg, "%u", &numreaders) != 1) || (numreaders == 0)) {
+					printf ("%s: Failed to parse number of readers\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'd':
+				if (sscanf (optarg, "%u", &duration) != 1) {
+					printf ("%s: Failed to parse test duration\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	numdevs = cyusb_open ();
+	if (numdevs <= 0) {
+		printf ("%s: No device of interest found\n", argv[0]);
+		return (-ENODEV);
+	}
+
+	devs  = (cyusb::device **)calloc (numdevs, sizeof (cyusb::device *));
+	stats = (struct dev_stats *)calloc (numdevs, sizeof (struct dev_stats));
+	if ((devs == NULL) || (stats == NULL)) {
+		cyusb_close ();
+		return (-ENOMEM);
+	}
+
+	// Open and identify every device. The control transfers of a device are chained in one
+	// coroutine; this thread only waits for the result.
+	printf ("%s: Identifying %d devices\n", argv[0], numdevs);
+	for (i = 0; i < numdevs; i++) {
+		devs[i] = new cyusb::device (i);
+		if (devs[i]->error () != 0) {
+			printf ("\t%3d  failed to open: %s\n", i, libusb_error_name (devs[i]->error ()));
+			continue;
+		}
+		if (cyusb::sync_wait (identify (*devs[i], i)) != 0) {
+			printf ("\t%3d  failed to identify\n", i);
+			continue;
+		}
+
+		// Claim the interface holding the endpoint, if the library knows it.
+		const struct cyusb_endpoint *ep = cyusb_getendpoint (i, endpoint);
+		if (ep != NULL)
+			libusb_claim_interface (devs[i]->handle (), ep->interface);
+		numready++;
+	}
+
+	// Start all readers. Each one suspends on its first read and is resumed by the event thread.
+	printf ("\n%s: Starting %u readers on endpoint 0x%x of %d devices for %u seconds\n",
+			argv[0], numreaders, endpoint, numready, duration);
+	for (i = 0; i < numdevs; i++) {
+		if (devs[i]->error () != 0)
+			continue;
+		for (j = 0; j < numreaders; j++) {
+			__atomic_add_fetch (&live, 1, __ATOMIC_RELAXED);
+			cyusb::spawn (reader (*devs[i], &stats[i]));
+		}
+	}
+
+	sleep (duration);
+	stop_readers = true;
+	while (__atomic_load_n (&live, __ATOMIC_ACQUIRE) > 0)
+		usleep (10000);
+
+	printf ("\n");
+	for (i = 0; i < numdevs; i++) {
+		if (devs[i]->error () == 0) {
+			printf ("\t%3d  %10lu reads  %8lu errors  %10.1f KBps\n", i, stats[i].reads, stats[i].errors,
+					(stats[i].bytes / 1024.0) / (duration ? duration : 1));
+			total += stats[i].bytes;
+		}
+		delete devs[i];
+	}
+	printf ("\n%s: %.1f KBps in total\n", argv[0], (total / 1024.0) / (duration ? duration : 1));
+
+	free (devs);
+	free (stats);
+	cyusb_close ();
+	return 0;
+}
+
+/*[]*/
@@ -0,0 +1,295 @@
+/************************************************************************************************
+ * Program Name		:	14_alloc_check.cpp						*
+ * Description		:	This is a CLI program which checks that the library does not	*
+ *				allocate heap memory in steady state: while a stream runs,	*
+ *				while a stream is closed and opened again, and while transfer	*
+ *				buffers are taken and given back. It counts every malloc()	*
+ *				of the process. libusb itself allocates on each submission,	*
+ *				so that cost is measured first on a bare libusb transfer and	*
+ *				allowed for. Exits with 0 if all checks pass, else 1.		*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+// The glibc allocator entry points, wrapped below to count every allocation of the process.
+extern "C" void *__libc_malloc (size_t size);
+extern "C" void *__libc_calloc (size_t n, size_t size);
+extern "C" void *__libc_realloc (void *ptr, size_t size);
+extern "C" void *__libc_memalign (size_t align, size_t size);
+
+static unsigned long allocs = 0;		// Number of allocations so far
+
+extern "C" void *
+malloc (
+		size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc (size);
+}
+
+extern "C" void *
+calloc (
+		size_t n,
+		size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc (n, size);
+}
+
+extern "C" void *
+realloc (
+		void *ptr,
+		size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc (ptr, size);
+}
+
+extern "C" int
+posix_memalign (
+		void **ptr,
+		size_t align,
+		size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	*ptr = __libc_memalign (align, size);
+	return (*ptr != NULL) ? 0 : ENOMEM;
+}
+
+unsigned int endpoint   = 0x81;		// Endpoint to stream from
+unsigned int reqsize    = 16;		// Request size in number of packets
+unsigned int queuedepth = 16;		// Number of requests to queue
+unsigned int cycles     = 100;		// Number of repetitions of each check
+
+static unsigned long	completions = 0;	// Transfers seen by the stream callback
+static volatile int	raw_left = 0;		// Submissions left in the libusb baseline
+static double		per_submit = 0;		// Allocations libusb makes per submission
+
+static int
+count_callback (
+		const struct cyusb_xfer *xfer,
+		void *user)
+{
+	__atomic_add_fetch (&completions, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void LIBUSB_CALL
+raw_callback (
+		struct libusb_transfer *t)
+{
+	if ((raw_left > 1) && (libusb_submit_transfer (t) == 0)) {
+		raw_left = raw_left - 1;
+		return;
+	}
+	raw_left = 0;
+}
+
+// Function: check
+// Compares the allocations of a check with what libusb needs for its submissions.
+static bool
+check (
+		const char *name,
+		unsigned long used,
+		unsigned long submits)
+{
+	unsigned long allowed = (unsigned long)ceil (per_submit * submits);
+	bool ok = (used <= allowed);
+
+	printf ("\t%-32s %8lu allocations, %8lu allowed  %s\n", name, used, allowed, ok ? "PASS" : "FAIL");
+	return ok;
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: Heap allocation check of the transfer paths\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -e <epnum> -s <reqsize> -q <queuedepth> -n <cycles>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tepnum is a bulk, interrupt or isochronous IN endpoint (default 0x81)\n");
+	printf ("\t\treqsize is the size of individual data transfer requests in packets (default 16)\n");
+	printf ("\t\tqueuedepth is the number of requests to be queued at a time (default 16)\n");
+	printf ("\t\tcycles is the number of repetitions of each check (default 100)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	const struct cyusb_endpoint *epinfo;
+	libusb_device_handle *h;
+	struct libusb_transfer *t;
+	cyusb_stream *stream = NULL;
+	unsigned char *buf;
+	unsigned long base, done;
+	unsigned int i;
+	bool ok = true;
+	int c, r;
+
+	while ((c = getopt (argc, argv, "e:s:q:n:h")) != -1) {
+		switch (c) {
+			case 'e':
+				if ((sscanf (optarg, "%i", &endpoint) != 1) || ((endpoint & 0x80) == 0)) {
+					printf ("%s: Invalid IN endpoint %s\n", argv[0], optarg);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 's':
+				if ((sscanf (optarg, "%u", &reqsize) != 1) || (reqsize == 0)) {
+					printf ("%s: Failed to parse request size\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'q':
+				if ((sscanf (optarg, "%u", &queuedepth) != 1) || (queuedepth == 0)) {
+					printf ("%s: Failed to parse queue depth\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'n':
+				if ((sscanf (optarg, "%u", &cycles) != 1) || (cycles == 0)) {
+					printf ("%s: Failed to parse number of cycles\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	if (cyusb_open () <= 0) {
+		printf ("%s: No device of interest found\n", argv[0]);
+		return (-ENODEV);
+	}
+
+	// The pinned handle stays open, and keeps the transfers and buffers cached by the library,
+	// for the whole run. The event thread is kept running between streams.
+	h = cyusb_gethandle (0);
+	epinfo = cyusb_getendpoint (0, endpoint);
+	if ((h == NULL) || (epinfo == NULL)) {
+		printf ("%s: Failed to find endpoint 0x%x on device 0\n", argv[0], endpoint);
+		cyusb_close ();
+		return (-ENOENT);
+	}
+	libusb_claim_interface (h, epinfo->interface);
+	libusb_set_interface_alt_setting (h, epinfo->interface, epinfo->altsetting);
+	if (cyusb_start_events () != 0) {
+		printf ("%s: Failed to start the event thread\n", argv[0]);
+		cyusb_close ();
+		return (-EIO);
+	}
+
+	// Baseline: a bare libusb transfer, resubmitted from its callback on the event thread.
+	buf = (unsigned char *)malloc (reqsize * epinfo->pktsize);
+	switch (epinfo->type) {
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+			t = libusb_alloc_transfer (reqsize);
+			libusb_fill_iso_transfer (t, h, endpoint, buf, reqsize * epinfo->pktsize, reqsize,
+					raw_callback, NULL, 1000);
+			libusb_set_iso_packet_lengths (t, epinfo->pktsize);
+			break;
+
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+			t = libusb_alloc_transfer (0);
+			libusb_fill_interrupt_transfer (t, h, endpoint, buf, reqsize * epinfo->pktsize,
+					raw_callback, NULL, 1000);
+			break;
+
+		default:
+			t = libusb_alloc_transfer (0);
+			libusb_fill_bulk_transfer (t, h, endpoint, buf, reqsize * epinfo->pktsize,
+					raw_callback, NULL, 1000);
+			break;
+	}
+	raw_left = cycles * queuedepth;
+	base = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+	if (libusb_submit_transfer (t) != 0)
+		raw_left = 0;
+	while (raw_left > 0)
+		usleep (1000);
+	per_submit = (double)(__atomic_load_n (&allocs, __ATOMIC_RELAXED) - base) / (cycles * queuedepth);
+	libusb_free_transfer (t);
+	free (buf);
+	printf ("%s: libusb makes %.2f allocations per submission\n\n", argv[0], per_submit);
+
+	// Check 1: steady state streaming. The first open fills the cache of the handle.
+	r = cyusb_stream_open (0, endpoint, reqsize, queuedepth, count_callback, NULL, &stream);
+	if ((r != 0) || (cyusb_stream_start (stream) <= 0)) {
+		printf ("%s: Failed to start a stream on endpoint 0x%x\n", argv[0], endpoint);
+		cyusb_stream_close (stream);
+		cyusb_stop_events ();
+		cyusb_close ();
+		return (-EIO);
+	}
+	while (__atomic_load_n (&completions, __ATOMIC_RELAXED) < queuedepth)
+		usleep (1000);
+
+	base = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+	done = __atomic_load_n (&completions, __ATOMIC_RELAXED);
+	while (__atomic_load_n (&completions, __ATOMIC_RELAXED) < done + cycles * queuedepth)
+		usleep (1000);
+	ok &= check ("Streaming", __atomic_load_n (&allocs, __ATOMIC_RELAXED) - base,
+			__atomic_load_n (&completions, __ATOMIC_RELAXED) - done + queuedepth);
+
+	// Check 2: closing the stream and opening it again reuses its transfers and buffers.
+	base = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+	done = __atomic_load_n (&completions, __ATOMIC_RELAXED);
+	for (i = 0; i < cycles; i++) {
+		cyusb_stream_close (stream);
+		if ((cyusb_stream_open (0, endpoint, reqsize, queuedepth, count_callback, NULL, &stream) != 0) ||
+				(cyusb_stream_start (stream) <= 0)) {
+			printf ("%s: Failed to restart the stream\n", argv[0]);
+			ok = false;
+			break;
+		}
+	}
+	cyusb_stream_stop (stream);
+	ok &= check ("Stream close and open", __atomic_load_n (&allocs, __ATOMIC_RELAXED) - base,
+			__atomic_load_n (&completions, __ATOMIC_RELAXED) - done + queuedepth);
+	cyusb_stream_close (stream);
+
+	// Check 3: transfer buffers of the sizes used by the GUI bulk tab.
+	for (i = 0; i < 3; i++)
+		cyusb_buffer_put (h, cyusb_buffer_get (h, 512 << (i * 3)));
+	base = __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+	for (i = 0; i < cycles; i++) {
+		buf = cyusb_buffer_get (h, 512 << ((i % 3) * 3));
+		cyusb_buffer_put (h, buf);
+	}
+	ok &= check ("Buffer get and put", __atomic_load_n (&allocs, __ATOMIC_RELAXED) - base, 0);
+
+	cyusb_stop_events ();
+	cyusb_close ();
+
+	printf ("\n%s: %s\n", argv[0], ok ? "All checks passed" : "Some checks failed");
+	return ok ? 0 : 1;
+}
+
+/*[]*/
@@ -0,0 +1,253 @@
+/************************************************************************************************
+ * Program Name		:	15_ring_consumer.cpp						*
+ * Description		:	This is a CLI program which streams from an IN endpoint in ring	*
+ *				mode: the library event thread only queues completed transfers	*
+ *				in a ring, and a consumer thread takes each one, processes its	*
+ *				data and gives it back. The processing cost per transfer can	*
+ *				be set to see how a slow consumer is handled by the block and	*
+ *				drop-oldest policies. Prints the data rate and ring counters	*
+ *				every second, with the failed transfers counted by the		*
+ *				library.							*
+ * License		:	LGPL Ver 2.1							*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+unsigned int endpoint   = 0x81;		// Endpoint to stream from
+unsigned int reqsize    = 16;		// Request size in number of packets
+unsigned int queuedepth = 16;		// Number of requests kept in flight
+unsigned int ringsize   = 16;		// Number of further requests holding data for the consumer
+unsigned int worktime   = 0;		// Processing time per transfer in microseconds
+unsigned int duration   = 10;		// Duration of the test in seconds
+int          policy     = CYUSB_RING_BLOCK;	// Policy for a consumer that falls behind
+
+static cyusb_stream		*stream = NULL;		// Ring mode stream on the endpoint
+static unsigned long long	bytes = 0;		// Data processed by the consumer
+static unsigned char		checksum = 0;		// Keeps the processing from being optimized out
+
+// Function: spin
+// Busy-waits for a number of microseconds, standing in for processing of the data.
+static void
+spin (
+		unsigned int usec)
+{
+	struct timespec t0, t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	do {
+		clock_gettime (CLOCK_MONOTONIC, &t);
+	} while ((t.tv_sec - t0.tv_sec) * 1000000L + (t.tv_nsec - t0.tv_nsec) / 1000 < (long)usec);
+}
+
+// Function: consumer
+// Takes completed transfers from the ring until the stream is stopped.
+static void *
+consumer (
+		void *arg)
+{
+	struct cyusb_xfer x;
+	unsigned char sum = 0;
+	int i;
+
+	while (cyusb_stream_get (stream, &x, -1) == 0) {
+		if (x.status == LIBUSB_TRANSFER_COMPLETED) {
+			for (i = 0; i < x.actual; i += 64)
+				sum += x.buffer[i];
+			spin (worktime);
+			__atomic_add_fetch (&bytes, x.actual, __ATOMIC_RELAXED);
+		}
+		cyusb_stream_put (stream, &x);
+	}
+
+	checksum = sum;
+	return NULL;
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: Ring mode streaming to a consumer thread\n", progname);
+	printf ("\n");
+	printf ("Usage: %s -e <epnum> -s <reqsize> -q <queuedepth> -r <ringsize> -p <policy> -w <usec> -d <duration>\n",
+			progname);
+	printf ("\twhere\n");
+	printf ("\t\tepnum is a bulk, interrupt or isochronous IN endpoint (default 0x81)\n");
+	printf ("\t\treqsize is the size of individual data transfer requests in packets (default 16)\n");
+	printf ("\t\tqueuedepth is the number of requests kept in flight (default 16)\n");
+	printf ("\t\tringsize is the number of further requests holding data for the consumer (default 16)\n");
+	printf ("\t\tpolicy is block or drop, for a consumer that falls behind (default block)\n");
+	printf ("\t\tusec is the processing time per request in microseconds (default 0)\n");
+	printf ("\t\tduration is the duration in seconds for which the test is to be run (default 10)\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	const struct cyusb_endpoint *epinfo;
+	struct cyusb_ring_stats st;
+	struct cyusb_latency lat;
+	struct cyusb_ep_stats base, es;
+	libusb_device_handle *h;
+	unsigned long long last = 0, now;
+	pthread_t thread;
+	unsigned int i;
+	int c, r;
+
+	while ((c = getopt (argc, argv, "e:s:q:r:p:w:d:h")) != -1) {
+		switch (c) {
+			case 'e':
+				if ((sscanf (optarg, "%i", &endpoint) != 1) || ((endpoint & 0x80) == 0)) {
+					printf ("%s: Invalid IN endpoint %s\n", argv[0], optarg);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 's':
+				if ((sscanf (optarg, "%u", &reqsize) != 1) || (reqsize == 0)) {
+					printf ("%s: Failed to parse request size\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'q':
+				if ((sscanf (optarg, "%u", &queuedepth) != 1) || (queuedepth == 0)) {
+					printf ("%s: Failed to parse queue depth\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'r':
+				if ((sscanf (optarg, "%u", &ringsize) != 1) || (ringsize == 0)) {
+					printf ("%s: Failed to parse ring size\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'p':
+				if (strcmp (optarg, "block") == 0)
+					policy = CYUSB_RING_BLOCK;
+				else if (strcmp (optarg, "drop") == 0)
+					policy = CYUSB_RING_DROP_OLDEST;
+				else {
+					printf ("%s: Unknown policy %s\n", argv[0], optarg);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'w':
+				if (sscanf (optarg, "%u", &worktime) != 1) {
+					printf ("%s: Failed to parse processing time\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'd':
+				if ((sscanf (optarg, "%u", &duration) != 1) || (duration == 0)) {
+					printf ("%s: Failed to parse test duration\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	if (cyusb_open () <= 0) {
+		printf ("%s: No device of interest found\n", argv[0]);
+		return (-ENODEV);
+	}
+
+	h = cyusb_gethandle (0);
+	epinfo = cyusb_getendpoint (0, endpoint);
+	if ((h == NULL) || (epinfo == NULL)) {
+		printf ("%s: Failed to find endpoint 0x%x on device 0\n", argv[0], endpoint);
+		cyusb_close ();
+		return (-ENOENT);
+	}
+	if (libusb_claim_interface (h, epinfo->interface) != 0) {
+		printf ("%s: Failed to claim interface %d\n", argv[0], epinfo->interface);
+		cyusb_close ();
+		return (-EACCES);
+	}
+	libusb_set_interface_alt_setting (h, epinfo->interface, epinfo->altsetting);
+
+	r = cyusb_stream_open_ring (0, endpoint, reqsize, queuedepth, ringsize, policy, &stream);
+	if (r != 0) {
+		printf ("%s: Failed to set up transfers on endpoint 0x%x\n", argv[0], endpoint);
+		cyusb_close ();
+		return (r == LIBUSB_ERROR_NO_MEM) ? (-ENOMEM) : (-EIO);
+	}
+
+	printf ("%s: Streaming from endpoint 0x%x, %d in flight, ring of %d, %s policy, %d us per request\n",
+			argv[0], endpoint, queuedepth, ringsize,
+			(policy == CYUSB_RING_BLOCK) ? "block" : "drop-oldest", worktime);
+
+	// The counters of the library count from the first use of the endpoint.
+	cyusb_stats_endpoint (0, endpoint, &base);
+	pthread_create (&thread, NULL, consumer, NULL);
+	if (cyusb_stream_start (stream) <= 0) {
+		printf ("%s: Failed to queue transfers\n", argv[0]);
+		cyusb_stream_stop (stream);
+		pthread_join (thread, NULL);
+		cyusb_stream_close (stream);
+		cyusb_close ();
+		return (-EIO);
+	}
+
+	for (i = 0; i < duration; i++) {
+		sleep (1);
+		now = __atomic_load_n (&bytes, __ATOMIC_RELAXED);
+		cyusb_stream_ring_stats (stream, &st);
+		cyusb_stats_endpoint (0, endpoint, &es);
+		printf ("Data rate: %10.0f KBps  waiting %3u  overruns %8llu  underruns %8llu  errors %llu\n",
+				(now - last) / 1024.0, st.waiting, st.overruns, st.underruns, es.failed - base.failed);
+		last = now;
+	}
+
+	// Stopping the stream wakes the consumer once the ring is drained.
+	cyusb_stream_stop (stream);
+	pthread_join (thread, NULL);
+	cyusb_stream_ring_stats (stream, &st);
+	printf ("%s: %llu transfers completed, %llu consumed, %llu overruns, %llu underruns\n",
+			argv[0], st.completed, st.consumed, st.overruns, st.underruns);
+	cyusb_stats_endpoint (0, endpoint, &es);
+	printf ("%s: %llu transfers failed, %llu could not be submitted again, %llu recoveries\n", argv[0],
+			es.failed - base.failed, es.resubmit_failures - base.resubmit_failures,
+			es.recoveries - base.recoveries);
+	cyusb_stream_latency (stream, &lat);
+	printf ("%s: latency p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n", argv[0],
+			lat.p50 / 1000.0, lat.p99 / 1000.0, lat.p999 / 1000.0, lat.max / 1000.0);
+
+	cyusb_stream_close (stream);
+	cyusb_close ();
+	return 0;
+}
+
+/*[]*/
@@ -25,7 +25,7 @@ static int logfd;
 static int pidfd;
 struct VPD {
 	unsigned short	vid;
-	unsigned short	pid;
+	char		pid[12];	/* ID, range (00F0-00FF) or wildcard (*) */
 	char		desc[30];
 };
 
@@ -91,7 +91,7 @@ int main(void)
 				cp2 = strtok(NULL, " \t");
 				cp3 = strtok(NULL, " \t\n");
 				vpd[maxdevices].vid = strtol(cp1,NULL,16);
-				vpd[maxdevices].pid = strtol(cp2,NULL,16);
+				strncpy(vpd[maxdevices].pid,cp2,11);
 				strcpy(vpd[maxdevices].desc,cp3);
 				++maxdevices;
 			}
@@ -104,7 +104,7 @@ int main(void)
 	printf("PIDFile=%s\n",pidfile);
 	printf("LogFile=%s\n",logfile);
 	for ( i = 0; i < maxdevices; ++i ) {
-		printf("VID = %04x, PID = %04x, DESC = %-30s\n",vpd[i].vid, vpd[i].pid, vpd[i].desc);
+		printf("VID = %04x, PID = %-9s, DESC = %-30s\n",vpd[i].vid, vpd[i].pid, vpd[i].desc);
 	}
 	fclose(inp);
 }
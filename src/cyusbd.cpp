@@ -10,8 +10,18 @@
  * Cypress devices ( as listed in /etc/cyusb.conf ) and waits for two kinds of signals		*
  * ( SIGUSR1 and SIGUSR2 ). SIGUSR1 signal is handled when a notification arrives from the	*
  * kernel whenever a usb device gets added/deleted in which case the device list is refreshed.	*
- * SIGUSR1 would be generated by a script from a persistent udev rule.				*
+ * SIGUSR1 would be generated by a script from a persistent udev rule. Where libusb supports	*
+ * hotplug, device changes are tracked incrementally by the library and SIGUSR1 is ignored.	*
  * SIGUSR2 signal is a request to free all resources and exit. 					*
+ * 												*
+ * Arrivals, removals and enumerations are written to the log file named in /etc/cyusb.conf.	*
+ * The daemon also exports metrics in the OpenMetrics text format, for a fleet monitoring	*
+ * system to scrape: device presence, enumeration time, firmware download time and failures,	*
+ * and per endpoint transfer, byte, error and recovery counters. They are added up from the	*
+ * counters every cyusb application publishes in CYUSB_STATS_DIR, including those of		*
+ * applications that have ended, and are served on a UNIX socket ( -s ), to plain or HTTP GET	*
+ * requests, and/or written to a file ( -m ) every few seconds, e.g. for the node_exporter	*
+ * textfile collector.										*
 \***********************************************************************************************/
 
 #include <stdio.h>
@@ -22,7 +32,13 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -30,10 +46,13 @@
 
 /********** Cut and paste the following & modify as required  **********/
 static const char * program_name;
-static const char *const short_options = "hv";
+static const char *const short_options = "hvs:m:i:";
 static const struct option long_options[] = {
 		{ "help",	0,	NULL,	'h'	},
 		{ "version",	0,	NULL,	'v'	},
+		{ "socket",	1,	NULL,	's'	},
+		{ "metrics",	1,	NULL,	'm'	},
+		{ "interval",	1,	NULL,	'i'	},
 		{ NULL,		0,	NULL,	 0	}
 };
 
@@ -44,7 +63,10 @@ static void print_usage(FILE *stream, int exit_code)
 	fprintf(stream, "Usage: %s options\n", program_name);
 	fprintf(stream, 
 		"  -h  --help           Display this usage information.\n"
-		"  -v  --version        Print version.\n");
+		"  -v  --version        Print version.\n"
+		"  -s  --socket <path>  Serve metrics on a UNIX socket at path.\n"
+		"  -m  --metrics <file> Write metrics to file.\n"
+		"  -i  --interval <sec> Seconds between writes of the metrics file, default 10.\n");
 
 	exit(exit_code);
 }
@@ -55,18 +77,48 @@ extern char logfile[256];
 extern int logfd;
 extern int pidfd;
 
-struct VPD {
-	unsigned short	vid;
-	unsigned short	pid;
-	char		desc[30];
+static char *socket_path = NULL;	/* UNIX socket to serve metrics on, or NULL.			*/
+static char *metrics_file = NULL;	/* File to write metrics to, or NULL.				*/
+static int interval = 10;		/* Seconds between writes of metrics_file.			*/
+
+static struct cyusb_dev_stats *retired = NULL;	/* Final counters of applications that have ended,	*/
+static int nretired = 0;			/* added up by device path.				*/
+
+static const char *const status_names[CYUSB_STATS_NSTATUS] = {
+	"completed", "error", "timed_out", "cancelled", "stall", "no_device", "overflow"
 };
 
-extern struct VPD vpd[100];
-extern int maxdevices;
-extern int numdev;
-extern libusb_device **list;
+static void log_event(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	time_t t;
+	int n;
+
+	if ( logfd <= 0 )
+		return;
+
+	t = time(NULL);
+	n = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S ", localtime(&t));
+	va_start(ap, fmt);
+	n += vsnprintf(buf + n, sizeof(buf) - n - 1, fmt, ap);
+	va_end(ap);
+	if ( n > (int)sizeof(buf) - 2 )
+		n = sizeof(buf) - 2;
+	buf[n++] = '\n';
+	write(logfd, buf, n);
+}
+
+static void log_devices(void)
+{
+	struct cyusb_devinfo info;
+	int i;
 
-extern struct cydev cydev[MAXDEVICES];
+	for ( i = 0; i < cyusb_getcount(); ++i ) {
+		if ( cyusb_getinfo(i, &info) == 0 )
+			log_event("Device of interest at %s, index %d", info.path, i);
+	}
+}
 
 static void handle_sigusr1(int signo)
 {
@@ -77,26 +129,482 @@ static void handle_sigusr1(int signo)
 	N = cyusb_open();
 	if ( N < 0 ) {
 	   printf("Error in opening library\n");
+	   log_event("Error in opening library");
 	   exit(-1);
 	}
 	else if ( N == 0 ) {
 		printf("No device of interest found\n");
+		log_event("Enumerated, no device of interest found");
 		 exit(0);
 	}
 	else printf("No of devices of interest found = %d\n",N);
+	log_event("Enumerated, %d devices of interest found", N);
+	log_devices();
+	cyusb_watch_config();
+}
+
+static void handle_hotplug(int index, int event, void *user)
+{
+	struct cyusb_devinfo info;
+
+	if ( event == CYUSB_DEVICE_ARRIVED ) {
+		printf("Device of interest added at index %d\n", index);
+		log_event("Device of interest added at %s, index %d",
+				(cyusb_getinfo(index, &info) == 0) ? info.path : "?", index);
+	}
+	else {
+		printf("Device of interest removed from index %d\n", index);
+		log_event("Device of interest removed from index %d", index);
+	}
 }
 
 static void handle_sigusr2(int signo)
 {
+	if ( socket_path )
+		unlink(socket_path);
 	unlink(pidfile);
 	close(logfd);
 	cyusb_close();
 	exit(0);
 }
 
-static void validate_inputs(void)
+// Add the counters of one endpoint to a total.
+static void add_endpoint(struct cyusb_ep_stats *to, const struct cyusb_ep_stats *from)
+{
+	int i;
+
+	to->endpoint           = from->endpoint;
+	to->submitted         += from->submitted;
+	to->completed         += from->completed;
+	to->failed            += from->failed;
+	to->bytes             += from->bytes;
+	to->callbacks         += from->callbacks;
+	to->callback_ns       += from->callback_ns;
+	to->resubmit_failures += from->resubmit_failures;
+	to->control_count     += from->control_count;
+	to->control_ns        += from->control_ns;
+	to->recoveries        += from->recoveries;
+	to->recovery_ns       += from->recovery_ns;
+	to->recovery_retries  += from->recovery_retries;
+	for ( i = 0; i < CYUSB_STATS_NSTATUS; ++i )
+		to->status[i] += from->status[i];
+}
+
+// Add the counters of all devices of one application to totals kept by device path. The
+// index of a total is left as it was; presence is only taken from the daemon itself.
+static int add_stats(struct cyusb_dev_stats **tab, int *n, const struct cyusb_stats *st)
+{
+	const struct cyusb_dev_stats *ds;
+	struct cyusb_dev_stats *d, *t;
+	int i, j, k;
+
+	for ( i = 0; i < st->ndevices; ++i ) {
+		ds = &st->devices[i];
+		for ( j = 0; (j < *n) && strcmp((*tab)[j].path, ds->path); ++j )
+			;
+		if ( j == *n ) {
+			t = (struct cyusb_dev_stats *)realloc(*tab, (*n + 1) * sizeof(**tab));
+			if ( !t )
+				return -ENOMEM;
+			*tab = t;
+			memset(&t[j], 0, sizeof(t[j]));
+			strcpy(t[j].path, ds->path);
+			t[j].index = -1;
+			++*n;
+		}
+		d = &(*tab)[j];
+		if ( ds->vid || ds->pid ) {
+			d->vid = ds->vid;
+			d->pid = ds->pid;
+		}
+		d->connects    += ds->connects;
+		d->enum_ns     += ds->enum_ns;
+		d->fw_loads    += ds->fw_loads;
+		d->fw_failures += ds->fw_failures;
+		d->fw_ns       += ds->fw_ns;
+		for ( k = 0; k < ds->nendpoints; ++k ) {
+			for ( j = 0; (j < d->nendpoints) && (d->endpoints[j].endpoint != ds->endpoints[k].endpoint); ++j )
+				;
+			if ( j == d->nendpoints ) {
+				if ( d->nendpoints == CYUSB_STATS_ENDPOINTS )
+					continue;
+				++d->nendpoints;
+			}
+			add_endpoint(&d->endpoints[j], &ds->endpoints[k]);
+		}
+	}
+	return 0;
+}
+
+// Add up the counters of every application, live or ended, with those of the daemon.
+// Files of ended applications are removed, and their counters kept in memory instead.
+static int gather(struct cyusb_dev_stats **tab, int *n, int *nprocs)
+{
+	struct cyusb_stats *st;
+	struct dirent *de;
+	char file[512];
+	bool self = false;
+	DIR *dir;
+	int i, j, r;
+
+	*tab = NULL;
+	*n = 0;
+	*nprocs = 0;
+	if ( nretired ) {
+		*tab = (struct cyusb_dev_stats *)malloc(nretired * sizeof(**tab));
+		if ( !*tab )
+			return -ENOMEM;
+		memcpy(*tab, retired, nretired * sizeof(**tab));
+		*n = nretired;
+	}
+
+	dir = opendir(CYUSB_STATS_DIR);
+	while ( dir && (de = readdir(dir)) != NULL ) {
+		if ( !strstr(de->d_name, ".stats") )
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", CYUSB_STATS_DIR, de->d_name);
+		r = cyusb_stats_load(file, &st);
+		if ( r < 0 )
+			continue;
+		if ( r == 0 ) {
+			++*nprocs;
+			if ( st->pid == getpid() )
+				self = true;
+		}
+		else if ( unlink(file) == 0 )
+			add_stats(&retired, &nretired, st);
+		add_stats(tab, n, st);
+		cyusb_stats_free(st);
+	}
+	if ( dir )
+		closedir(dir);
+
+	// Presence comes from the device table of the daemon, which sees every device of
+	// interest. Without a stats directory, its own counters are the only ones.
+	if ( cyusb_stats_snapshot(&st) != 0 )
+		return 0;
+	if ( !self ) {
+		add_stats(tab, n, st);
+		++*nprocs;
+	}
+	for ( i = 0; i < st->ndevices; ++i ) {
+		for ( j = 0; j < *n; ++j ) {
+			if ( strcmp((*tab)[j].path, st->devices[i].path) == 0 )
+				(*tab)[j].index = st->devices[i].index;
+		}
+	}
+	cyusb_stats_free(st);
+	return 0;
+}
+
+// Print a label value, escaped as OpenMetrics wants, from at most max characters of s.
+static void label_value(FILE *fp, const char *s, size_t max)
+{
+	size_t i;
+
+	for ( i = 0; (i < max) && s[i]; ++i ) {
+		if ( s[i] == '\n' )
+			fputs("\\n", fp);
+		else {
+			if ( (s[i] == '"') || (s[i] == '\\') )
+				fputc('\\', fp);
+			fputc(s[i], fp);
+		}
+	}
+}
+
+// Print the labels of a device.
+static void device_labels(FILE *fp, const struct cyusb_dev_stats *d)
+{
+	fputs("path=\"", fp);
+	label_value(fp, d->path, sizeof(d->path));
+	fprintf(fp, "\",vid=\"%04x\",pid=\"%04x\"", d->vid, d->pid);
+}
+
+// Print one sample of a device metric.
+static void device_sample(FILE *fp, const char *name, const struct cyusb_dev_stats *d, double value)
+{
+	fprintf(fp, "%s{", name);
+	device_labels(fp, d);
+	fprintf(fp, "} %.15g\n", value);
+}
+
+// Print one sample of an endpoint metric, with an extra label if any.
+static void endpoint_sample(FILE *fp, const char *name, const struct cyusb_dev_stats *d,
+		const struct cyusb_ep_stats *e, const char *extra, double value)
+{
+	fprintf(fp, "%s{", name);
+	device_labels(fp, d);
+	fprintf(fp, ",endpoint=\"0x%02x\"%s} %.15g\n", e->endpoint, extra ? extra : "", value);
+}
+
+// Render all metrics in the OpenMetrics text format. Returns a buffer to be freed, or NULL.
+static char *render(size_t *len)
+{
+	struct cyusb_dev_stats *tab, *d;
+	const struct cyusb_ep_stats *e;
+	char extra[32];
+	char *buf = NULL;
+	int n, nprocs;
+	int i, j, k;
+	FILE *fp;
+
+	if ( gather(&tab, &n, &nprocs) != 0 )
+		return NULL;
+	fp = open_memstream(&buf, len);
+	if ( !fp ) {
+		free(tab);
+		return NULL;
+	}
+
+	fprintf(fp, "# TYPE cyusb_processes gauge\n"
+		    "# HELP cyusb_processes Applications publishing counters.\n"
+		    "cyusb_processes %d\n", nprocs);
+
+	fprintf(fp, "# TYPE cyusb_device_present gauge\n"
+		    "# HELP cyusb_device_present Whether the device is connected.\n");
+	for ( i = 0; i < n; ++i )
+		device_sample(fp, "cyusb_device_present", &tab[i], tab[i].index >= 0);
+
+	fprintf(fp, "# TYPE cyusb_device_connects counter\n"
+		    "# HELP cyusb_device_connects Times the device was enumerated.\n");
+	for ( i = 0; i < n; ++i )
+		device_sample(fp, "cyusb_device_connects_total", &tab[i], tab[i].connects);
+
+	fprintf(fp, "# TYPE cyusb_device_enumeration_seconds summary\n"
+		    "# UNIT cyusb_device_enumeration_seconds seconds\n"
+		    "# HELP cyusb_device_enumeration_seconds Time taken to add the device to a device table.\n");
+	for ( i = 0; i < n; ++i ) {
+		device_sample(fp, "cyusb_device_enumeration_seconds_count", &tab[i], tab[i].connects);
+		device_sample(fp, "cyusb_device_enumeration_seconds_sum", &tab[i], tab[i].enum_ns / 1e9);
+	}
+
+	fprintf(fp, "# TYPE cyusb_firmware_load_seconds summary\n"
+		    "# UNIT cyusb_firmware_load_seconds seconds\n"
+		    "# HELP cyusb_firmware_load_seconds Time taken by firmware downloads.\n");
+	for ( i = 0; i < n; ++i ) {
+		device_sample(fp, "cyusb_firmware_load_seconds_count", &tab[i], tab[i].fw_loads);
+		device_sample(fp, "cyusb_firmware_load_seconds_sum", &tab[i], tab[i].fw_ns / 1e9);
+	}
+
+	fprintf(fp, "# TYPE cyusb_firmware_load_failures counter\n"
+		    "# HELP cyusb_firmware_load_failures Firmware downloads that failed.\n");
+	for ( i = 0; i < n; ++i )
+		device_sample(fp, "cyusb_firmware_load_failures_total", &tab[i], tab[i].fw_failures);
+
+	fprintf(fp, "# TYPE cyusb_endpoint_submitted counter\n"
+		    "# HELP cyusb_endpoint_submitted Transfers submitted.\n");
+	for ( i = 0; i < n; ++i )
+		for ( j = 0; j < tab[i].nendpoints; ++j )
+			endpoint_sample(fp, "cyusb_endpoint_submitted_total", &tab[i], &tab[i].endpoints[j], NULL,
+					tab[i].endpoints[j].submitted);
+
+	fprintf(fp, "# TYPE cyusb_endpoint_transfers counter\n"
+		    "# HELP cyusb_endpoint_transfers Transfers finished, by status.\n");
+	for ( i = 0; i < n; ++i ) {
+		for ( j = 0; j < tab[i].nendpoints; ++j ) {
+			for ( k = 0; k < CYUSB_STATS_NSTATUS; ++k ) {
+				snprintf(extra, sizeof(extra), ",status=\"%s\"", status_names[k]);
+				endpoint_sample(fp, "cyusb_endpoint_transfers_total", &tab[i], &tab[i].endpoints[j], extra,
+						tab[i].endpoints[j].status[k]);
+			}
+		}
+	}
+
+	fprintf(fp, "# TYPE cyusb_endpoint_bytes counter\n"
+		    "# UNIT cyusb_endpoint_bytes bytes\n"
+		    "# HELP cyusb_endpoint_bytes Bytes transferred.\n");
+	for ( i = 0; i < n; ++i )
+		for ( j = 0; j < tab[i].nendpoints; ++j )
+			endpoint_sample(fp, "cyusb_endpoint_bytes_total", &tab[i], &tab[i].endpoints[j], NULL,
+					tab[i].endpoints[j].bytes);
+
+	fprintf(fp, "# TYPE cyusb_endpoint_resubmit_failures counter\n"
+		    "# HELP cyusb_endpoint_resubmit_failures Stream transfers that could not be submitted again.\n");
+	for ( i = 0; i < n; ++i )
+		for ( j = 0; j < tab[i].nendpoints; ++j )
+			endpoint_sample(fp, "cyusb_endpoint_resubmit_failures_total", &tab[i], &tab[i].endpoints[j], NULL,
+					tab[i].endpoints[j].resubmit_failures);
+
+	fprintf(fp, "# TYPE cyusb_endpoint_callback_seconds summary\n"
+		    "# UNIT cyusb_endpoint_callback_seconds seconds\n"
+		    "# HELP cyusb_endpoint_callback_seconds Time spent in stream callbacks.\n");
+	for ( i = 0; i < n; ++i ) {
+		for ( j = 0; j < tab[i].nendpoints; ++j ) {
+			e = &tab[i].endpoints[j];
+			endpoint_sample(fp, "cyusb_endpoint_callback_seconds_count", &tab[i], e, NULL, e->callbacks);
+			endpoint_sample(fp, "cyusb_endpoint_callback_seconds_sum", &tab[i], e, NULL, e->callback_ns / 1e9);
+		}
+	}
+
+	fprintf(fp, "# TYPE cyusb_endpoint_recovery_seconds summary\n"
+		    "# UNIT cyusb_endpoint_recovery_seconds seconds\n"
+		    "# HELP cyusb_endpoint_recovery_seconds Time streams took to recover from stalls, storms and disconnects.\n");
+	for ( i = 0; i < n; ++i ) {
+		for ( j = 0; j < tab[i].nendpoints; ++j ) {
+			e = &tab[i].endpoints[j];
+			endpoint_sample(fp, "cyusb_endpoint_recovery_seconds_count", &tab[i], e, NULL, e->recoveries);
+			endpoint_sample(fp, "cyusb_endpoint_recovery_seconds_sum", &tab[i], e, NULL, e->recovery_ns / 1e9);
+		}
+	}
+
+	fprintf(fp, "# TYPE cyusb_endpoint_recovery_retries counter\n"
+		    "# HELP cyusb_endpoint_recovery_retries Recovery attempts that failed and were retried.\n");
+	for ( i = 0; i < n; ++i )
+		for ( j = 0; j < tab[i].nendpoints; ++j )
+			endpoint_sample(fp, "cyusb_endpoint_recovery_retries_total", &tab[i], &tab[i].endpoints[j], NULL,
+					tab[i].endpoints[j].recovery_retries);
+
+	fprintf(fp, "# TYPE cyusb_control_transfer_seconds summary\n"
+		    "# UNIT cyusb_control_transfer_seconds seconds\n"
+		    "# HELP cyusb_control_transfer_seconds Time taken by control transfers.\n");
+	for ( i = 0; i < n; ++i ) {
+		d = &tab[i];
+		for ( j = 0; j < d->nendpoints; ++j ) {
+			e = &d->endpoints[j];
+			if ( e->endpoint != 0 )
+				continue;
+			device_sample(fp, "cyusb_control_transfer_seconds_count", d, e->control_count);
+			device_sample(fp, "cyusb_control_transfer_seconds_sum", d, e->control_ns / 1e9);
+		}
+	}
+
+	fprintf(fp, "# EOF\n");
+	fclose(fp);
+	free(tab);
+	return buf;
+}
+
+// Write the metrics file, replacing it at once so that a reader never sees half of it.
+static void write_metrics(void)
 {
+	char tmp[512];
+	size_t len;
+	char *buf;
+	int fd;
+	int r;
+
+	buf = render(&len);
+	if ( !buf )
+		return;
 
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd >= 0 ) {
+		r = write(fd, buf, len);
+		close(fd);
+		if ( (r != (int)len) || (rename(tmp, metrics_file) != 0) ) {
+			log_event("Error writing metrics file %s", metrics_file);
+			unlink(tmp);
+		}
+	}
+	else log_event("Error opening metrics file %s", tmp);
+	free(buf);
+}
+
+// Send all of len bytes of buf to a non-blocking socket, waiting for room until the deadline
+// on the monotonic clock. Returns 0, or -1 if the client is gone or too slow.
+static int send_all(int fd, const char *buf, size_t len, const struct timespec *deadline)
+{
+	struct timespec now;
+	struct pollfd pfd;
+	ssize_t r;
+	long ms;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while ( len > 0 ) {
+		r = send(fd, buf, len, MSG_NOSIGNAL);
+		if ( r > 0 ) {
+			buf += r;
+			len -= r;
+			continue;
+		}
+		if ( (r < 0) && (errno == EINTR) )
+			continue;
+		if ( (r == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)) )
+			return -1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if ( (ms <= 0) || (poll(&pfd, 1, ms) <= 0) )
+			return -1;
+	}
+	return 0;
+}
+
+// Answer one client of the metrics socket. A client that sends an HTTP GET request gets an
+// HTTP response; any other gets the bare metrics, so that e.g. socat or nc can read them.
+static void serve_client(int listenfd)
+{
+	static const char header[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Connection: close\r\n\r\n";
+	struct timespec deadline;
+	struct pollfd pfd;
+	char req[256];
+	size_t len;
+	char *buf;
+	int fd;
+	int r = 0;
+
+	// The socket is non-blocking and the client gets a second in all, so that one that does
+	// not read cannot hold up the loop that gathers and writes the metrics.
+	fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if ( fd < 0 )
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += 1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ( poll(&pfd, 1, 100) > 0 )
+		r = read(fd, req, sizeof(req));
+
+	buf = render(&len);
+	if ( buf ) {
+		if ( (r >= 3) && !strncmp(req, "GET", 3) )
+			r = send_all(fd, header, sizeof(header) - 1, &deadline);
+		else
+			r = 0;
+		if ( r == 0 )
+			send_all(fd, buf, len, &deadline);
+		free(buf);
+	}
+	close(fd);
+}
+
+// Open the metrics socket. Returns the listening socket, or -1.
+static int open_socket(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if ( strlen(socket_path) >= sizeof(addr.sun_path) ) {
+		printf("Socket path too long %s\n", socket_path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ( fd < 0 )
+		return -1;
+	unlink(socket_path);
+	if ( (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 8) != 0) ) {
+		printf("Error opening socket %s\n", socket_path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void validate_inputs(void)
+{
+	if ( interval <= 0 ) {
+		printf("Interval must be positive\n");
+		print_usage(stdout, 1);
+	}
 }
 
 int main(int argc, char **argv)
@@ -104,8 +612,17 @@ int main(int argc, char **argv)
 	int N;
 	int pid;
 	char tbuf[50];
+	struct pollfd pfd;
+	time_t next_write = 0;
+	int listenfd = -1;
+	int timeout;
 	int r;
 
+	/* Let every cyusb application publish its counters, for the metrics. */
+	umask(0);
+	mkdir(CYUSB_STATS_DIR, 01777);
+	umask(022);
+
 	N = cyusb_open();
 	if ( N < 0 ) {
 	   printf("Error in opening library\n");
@@ -133,6 +650,15 @@ int main(int argc, char **argv)
 				  printf("cyusbd (Ver 1.0)\n");
 				  printf("Copyright (C) 2012 Cypress Semiconductors / ATR-LABS\n");
 				  exit(0);
+			case 's': /* -s or --socket */
+				  socket_path = optarg;
+				  break;
+			case 'm': /* -m or --metrics */
+				  metrics_file = optarg;
+				  break;
+			case 'i': /* -i or --interval */
+				  interval = atoi(optarg);
+				  break;
 			case '?': /* Invalid option */
 				  print_usage(stdout, 1);
 			default : /* Something else, unexpected */
@@ -141,6 +667,16 @@ int main(int argc, char **argv)
 		}
 	} 
 	validate_inputs();
+	log_event("Started, %d devices of interest found", N);
+	log_devices();
+
+	if ( socket_path ) {
+		listenfd = open_socket();
+		if ( listenfd < 0 ) {
+		   cyusb_close();
+		   return -4;
+		}
+	}
 
 	pid = getpid();
 	pidfd = open(pidfile, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR );
@@ -156,12 +692,32 @@ int main(int argc, char **argv)
 		close(pidfd);
 	}
 
-	signal(SIGUSR1,handle_sigusr1);  /* Signal to handle events received from the kernel			*/
+	/* Track device arrival/removal incrementally when libusb supports hotplug. The SIGUSR1 sent
+	   by cy_renumerate.sh is then redundant and ignored; otherwise fall back to re-enumeration. */
+	if ( cyusb_hotplug_register(handle_hotplug, NULL) == 0 )
+		signal(SIGUSR1,SIG_IGN);
+	else
+		signal(SIGUSR1,handle_sigusr1);  /* Signal to handle events received from the kernel		*/
+	cyusb_watch_config();		 /* Pick up edits of the config file without restarting		*/
 	signal(SIGUSR2,handle_sigusr2);  /* Signal to stop this daemon and exit gracefully			*/
 	signal(SIGINT, handle_sigusr2);  /* Ctrl_C will also stop this daemon and exit gracefully		*/
 
+	/* Wait for signals, and for scrapes on the metrics socket, writing the metrics file when
+	   it is due. Signals interrupt the wait; their handlers have done all that is needed. */
+	pfd.fd = listenfd;
+	pfd.events = POLLIN;
 	while (1) {
-		pause();
+		timeout = -1;
+		if ( metrics_file ) {
+			if ( time(NULL) >= next_write ) {
+				write_metrics();
+				next_write = time(NULL) + interval;
+			}
+			timeout = (next_write - time(NULL)) * 1000;
+		}
+		r = poll(&pfd, (listenfd >= 0) ? 1 : 0, timeout);
+		if ( (r > 0) && (pfd.revents & POLLIN) )
+			serve_client(listenfd);
 	}
 	return 0;
 }
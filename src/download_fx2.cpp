@@ -798,6 +798,11 @@ int main (
 	}
 
 	h = cyusb_gethandle(0);
+	if (h == NULL) {
+		fprintf (stderr, "Error: Failed to open device\n");
+		cyusb_close ();
+		return -EACCES;
+	}
 
 	switch (tgt) {
 		case FW_TARGET_RAM:
@@ -267,8 +267,10 @@ get_fx3_prog_handle (
 		r = cyusb_open ();
 		if (r > 0) {
 			for (i = 0; i < r; i++) {
+				if (cyusb_getdevice (i)->vid != FLASHPROG_VID)
+					continue;
 				handle = cyusb_gethandle (i);
-				if (cyusb_getvendor (handle) == FLASHPROG_VID) {
+				if (handle != NULL) {
 					r = check_fx3_flashprog (handle);
 					if (r == 0) {
 						printf ("Info: Got handle to FX3 flash programmer\n");
@@ -625,6 +627,11 @@ int main (
 	}
 
 	h = cyusb_gethandle (0);
+	if (h == NULL) {
+		fprintf (stderr, "Error: Failed to open device\n");
+		cyusb_close ();
+		return -EACCES;
+	}
 
 	switch (tgt) {
 		case FW_TARGET_RAM: